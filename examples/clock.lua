@@ -1,12 +1,5 @@
-function drawclock()
-    -- Get the current time in seconds
-    local time = os.time()
-
-    -- Calculate the hour, minute, and second
-    local hour   = (time / 3600) % 24
-    local minute = (time / 60) % 60
-    local second = time % 60
-
+function drawface()
+    layer(1)
     ht()
     clear()
     home()
@@ -38,6 +31,22 @@ function drawclock()
         pd()
         fd(10)
     end
+end
+
+function drawhands()
+    -- Get the current time in seconds
+    local time = os.time()
+
+    -- Calculate the hour, minute, and second
+    local hour   = (time / 3600) % 24
+    local minute = (time / 60) % 60
+    local second = time % 60
+
+    -- The hands are drawn on their own layer, over the face, so that
+    -- only the hands are redrawn.
+    layer(2)
+    clear()
+    setpencolor(black)
 
     -- Draw the hour hand
     home()
@@ -59,7 +68,15 @@ function drawclock()
     fd(215)
 end
 
+drawface()
+
+-- Redraw the hands when the time changes, one frame at a time.
+local lastTime = nil
 while true do
-    drawclock()
-    sleep(1)
-end
\ No newline at end of file
+    local time = os.time()
+    if time ~= lastTime then
+        lastTime = time
+        drawhands()
+    end
+    waitframe()
+end
@@ -461,6 +461,103 @@ function screencolor()
     return _ui.canvas.getbackgroundcolor()
 end
 
+function getpixel(x, y)
+    if x == nil and y == nil then
+        x, y = pos()
+    end
+    assert(type(x) == "number", "1st argument to getpixel() must be a number")
+    assert(type(y) == "number", "2nd argument to getpixel() must be a number")
+    return _ui.canvas.getpixel(x, y)
+end
+
+function floodfill(tolerance)
+    tolerance = tolerance or 0
+    assert(type(tolerance) == "number", "argument to floodfill() must be a number")
+    local t = turtles[currturtle]
+    _ui.canvas.floodfill(t.position.x, t.position.y,
+                         t.fillcolor.r, t.fillcolor.g, t.fillcolor.b, t.fillcolor.a,
+                         math.floor(tolerance))
+end
+
+function layer(n)
+    assert(type(n) == "number", "argument to layer() must be a number")
+    _ui.canvas.layer(math.floor(n))
+end
+
+function showlayer(n)
+    assert(type(n) == "number", "argument to showlayer() must be a number")
+    _ui.canvas.setlayervisible(math.floor(n), true)
+end
+
+function hidelayer(n)
+    assert(type(n) == "number", "argument to hidelayer() must be a number")
+    _ui.canvas.setlayervisible(math.floor(n), false)
+end
+
+function setlayeropacity(n, opacity)
+    assert(type(n) == "number", "1st argument to setlayeropacity() must be a number")
+    assert(type(opacity) == "number", "2nd argument to setlayeropacity() must be a number")
+    _ui.canvas.setlayeropacity(math.floor(n), opacity)
+end
+
+function drawtext(text, size, angle)
+    size = size or 16
+    angle = angle or 0
+    assert(type(size) == "number", "2nd argument to drawtext() must be a number")
+    assert(type(angle) == "number", "3rd argument to drawtext() must be a number")
+    local t = turtles[currturtle]
+    _ui.canvas.drawtext(t.position.x, t.position.y, tostring(text), math.floor(size),
+                        t.pencolor.r, t.pencolor.g, t.pencolor.b, t.pencolor.a,
+                        angle)
+end
+
+function loadimage(path)
+    assert(type(path) == "string", "argument to loadimage() must be a string")
+    return _ui.canvas.loadimage(path)
+end
+
+function drawimage(image, x, y, scale, angle)
+    if x == nil and y == nil then
+        x, y = pos()
+    end
+    scale = scale or 1
+    angle = angle or 0
+    assert(type(image) == "number", "1st argument to drawimage() must be an image from loadimage()")
+    assert(type(x) == "number", "2nd argument to drawimage() must be a number")
+    assert(type(y) == "number", "3rd argument to drawimage() must be a number")
+    assert(type(scale) == "number", "4th argument to drawimage() must be a number")
+    assert(type(angle) == "number", "5th argument to drawimage() must be a number")
+    _ui.canvas.drawimage(image, x, y, scale, angle)
+end
+
+function definestamp(name, fn)
+    assert(type(name) == "string", "1st argument to definestamp() must be a string")
+    assert(type(fn) == "function", "2nd argument to definestamp() must be a function")
+    local x, y = pos()
+    local heading = orientation()
+    -- The stamp is drawn around its origin, facing up.
+    _ui.canvas.definestamp(name, function()
+        home()
+        fn()
+    end)
+    setpos(x, y)
+    setorientation(heading)
+end
+
+function stamp(name, x, y, angle, scale)
+    if x == nil and y == nil then
+        x, y = pos()
+    end
+    angle = angle or orientation()
+    scale = scale or 1
+    assert(type(name) == "string", "1st argument to stamp() must be a string")
+    assert(type(x) == "number", "2nd argument to stamp() must be a number")
+    assert(type(y) == "number", "3rd argument to stamp() must be a number")
+    assert(type(angle) == "number", "4th argument to stamp() must be a number")
+    assert(type(scale) == "number", "5th argument to stamp() must be a number")
+    _ui.canvas.stamp(name, x, y, angle, scale)
+end
+
 function home()
     setpos(0,0)
     setorientation(0)
@@ -497,3 +594,67 @@ end
 function aaoff()
     _ui.canvas.setaa(false)
 end
+
+-- Sets how often the on-screen turtle follows the turtle's moves:
+-- every n moves, or only at each waitframe() (and when the script ends)
+-- if n is 0. Drawing is not affected.
+function tracer(n)
+    assert(type(n) == "number", "argument to tracer() must be a number")
+    _ui.canvas.tracer(math.floor(n))
+end
+
+-- speed(0) moves the turtle instantly, i.e. the on-screen turtle is only
+-- updated at each waitframe(). Any other speed shows every move.
+function speed(s)
+    assert(type(s) == "number", "argument to speed() must be a number")
+    if s == 0 then
+        tracer(0)
+    else
+        tracer(1)
+    end
+end
+
+-- Adds a program for the turtle called name, run by runturtles().
+--
+-- fn is called with no arguments. While it runs, the turtle commands
+-- (fd, rt, etc.) move the turtle called name. The programs of all the
+-- turtles take turns: each runs for up to 'budget' Lua instructions
+-- (or until it calls coroutine.yield()) before the next one continues.
+--
+-- params:
+--    name     - the turtle's name (created if it doesn't exist).
+--    fn       - the turtle's program.
+--    priority - optional; used by runturtles("priority").
+--    budget   - optional; the number of instructions per turn.
+function spawnturtle(name, fn, priority, budget)
+    assert(name ~= nil, "spawnturtle() needs a turtle name")
+    assert(type(fn) == "function", "argument 2 to spawnturtle() must be a function")
+
+    if turtles[name] == nil then
+        turtles[name] = Turtle.new()
+    end
+
+    return _ui.sched.spawn(fn, priority, budget, name)
+end
+
+-- Runs the programs added by spawnturtle() until they have all finished.
+--
+-- params:
+--    policy - optional; "roundrobin" (the default) gives every program a
+--             turn in order, "priority" only runs the programs with the
+--             highest priority until they finish.
+--    frames - optional; if true, a frame is shown after every round of
+--             turns (see waitframe()).
+function runturtles(policy, frames)
+    local previous = currturtle
+
+    _ui.sched.onswitch(function(name)
+        currturtle = name
+        turtles[name]:switchto()
+    end)
+
+    _ui.sched.run(policy, frames)
+    _ui.sched.onswitch(nil)
+
+    setturtle(previous)
+end
@@ -0,0 +1,811 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "compositing.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  include <immintrin.h>
+#  define TURTYL_X86_SIMD
+#  define TURTYL_TARGET(isa)
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define TURTYL_X86_SIMD
+#  define TURTYL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/**
+ * @brief Multiply each 8-bit channel of a pixel by an 8-bit factor.
+ *
+ * This is the usual "two channels at a time" trick: the red and blue
+ * channels are multiplied together, then the alpha and green channels.
+ * The result is rounded to the nearest value.
+ */
+static inline quint32 byteMul(quint32 pixel, quint32 factor)
+{
+    quint32 rb = (pixel & 0x00ff00ffu) * factor;
+    rb = (rb + ((rb >> 8) & 0x00ff00ffu) + 0x00800080u) >> 8;
+    rb &= 0x00ff00ffu;
+
+    quint32 ag = ((pixel >> 8) & 0x00ff00ffu) * factor;
+    ag = (ag + ((ag >> 8) & 0x00ff00ffu) + 0x00800080u);
+    ag &= 0xff00ff00u;
+
+    return ag | rb;
+}
+
+static inline uchar coverageToAlpha(float sum)
+{
+    const float coverage = std::min(1.0f, std::abs(sum));
+    return static_cast<uchar>(static_cast<int>(coverage * 255.0f + 0.5f));
+}
+
+static void accumulateCoverageGeneric(float* accumulator, uchar* coverage, int count)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < count; i++)
+    {
+        sum += accumulator[i];
+        accumulator[i] = 0.0f;
+        coverage[i] = coverageToAlpha(sum);
+    }
+}
+
+static void blendCoverageSpanGeneric(quint32* dst,
+                                     const uchar* coverage,
+                                     int count,
+                                     quint32 color)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const quint32 src = (coverage[i] == 0xffu) ? color : byteMul(color, coverage[i]);
+        const quint32 alpha = src >> 24;
+
+        if (alpha == 0xffu)
+        {
+            dst[i] = src;
+        }
+        else if (alpha != 0u)
+        {
+            dst[i] = src + byteMul(dst[i], 0xffu - alpha);
+        }
+    }
+}
+
+static void blendImageSpanGeneric(quint32* dst, const quint32* src, int count, int opacity)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const quint32 pixel = (opacity == 0xff) ? src[i] : byteMul(src[i], static_cast<quint32>(opacity));
+        const quint32 alpha = pixel >> 24;
+
+        if (alpha == 0xffu)
+        {
+            dst[i] = pixel;
+        }
+        else if (alpha != 0u)
+        {
+            dst[i] = pixel + byteMul(dst[i], 0xffu - alpha);
+        }
+    }
+}
+
+/**
+ * @brief Check whether each channel of a pixel is within @p tolerance of a color's.
+ */
+static inline bool pixelMatches(quint32 pixel, quint32 color, int tolerance)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        const int difference = static_cast<int>((pixel >> shift) & 0xffu)
+                               - static_cast<int>((color >> shift) & 0xffu);
+        if (std::abs(difference) > tolerance)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int matchingPixelsGeneric(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    int i = 0;
+    while ((i < count) && pixelMatches(pixels[i], color, tolerance))
+    {
+        i++;
+    }
+    return i;
+}
+
+static int matchingPixelsBackwardGeneric(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    int i = 0;
+    while ((i < count) && pixelMatches(pixels[count - 1 - i], color, tolerance))
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef TURTYL_X86_SIMD
+
+/**
+ * @brief SSE2 equivalent of byteMul() for 16-bit channels.
+ */
+TURTYL_TARGET("sse2")
+static inline __m128i byteMulSse2(__m128i channels, __m128i factors)
+{
+    const __m128i half = _mm_set1_epi16(0x80);
+
+    __m128i t = _mm_mullo_epi16(channels, factors);
+    t = _mm_add_epi16(t, _mm_srli_epi16(t, 8));
+    t = _mm_add_epi16(t, half);
+    return _mm_srli_epi16(t, 8);
+}
+
+TURTYL_TARGET("sse2")
+static void accumulateCoverageSse2(float* accumulator, uchar* coverage, int count)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 one      = _mm_set1_ps(1.0f);
+    const __m128 scale    = _mm_set1_ps(255.0f);
+    const __m128 half     = _mm_set1_ps(0.5f);
+
+    __m128 offset = _mm_setzero_ps();
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        // Prefix sum of the 4 values, plus the sum of everything before them.
+        __m128 x = _mm_loadu_ps(accumulator + i);
+        _mm_storeu_ps(accumulator + i, _mm_setzero_ps());
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+        x = _mm_add_ps(x, offset);
+        offset = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+
+        x = _mm_min_ps(_mm_andnot_ps(signMask, x), one);
+        __m128i alpha = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, scale), half));
+        alpha = _mm_packs_epi32(alpha, alpha);
+        alpha = _mm_packus_epi16(alpha, alpha);
+
+        const int packed = _mm_cvtsi128_si32(alpha);
+        std::memcpy(coverage + i, &packed, sizeof(packed));
+    }
+
+    float sum = _mm_cvtss_f32(offset);
+    for (; i < count; i++)
+    {
+        sum += accumulator[i];
+        accumulator[i] = 0.0f;
+        coverage[i] = coverageToAlpha(sum);
+    }
+}
+
+TURTYL_TARGET("sse2")
+static void blendCoverageSpanSse2(quint32* dst,
+                                  const uchar* coverage,
+                                  int count,
+                                  quint32 color)
+{
+    const __m128i zero     = _mm_setzero_si128();
+    const __m128i all      = _mm_set1_epi16(0xff);
+    const __m128i color16  = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(color)), zero);
+    const bool    opaque   = (color >> 24) == 0xffu;
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        quint32 mask;
+        std::memcpy(&mask, coverage + i, sizeof(mask));
+
+        if (mask == 0u)
+        {
+            continue;
+        }
+
+        __m128i* pixels = reinterpret_cast<__m128i*>(dst + i);
+
+        if (opaque && (mask == 0xffffffffu))
+        {
+            _mm_storeu_si128(pixels, _mm_set1_epi32(static_cast<int>(color)));
+            continue;
+        }
+
+        // Spread each pixel's coverage over its 4 channels.
+        __m128i m = _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(mask)), zero);
+        m = _mm_unpacklo_epi16(m, m);
+        const __m128i coverageLo = _mm_unpacklo_epi32(m, m);
+        const __m128i coverageHi = _mm_unpackhi_epi32(m, m);
+
+        const __m128i srcLo = byteMulSse2(color16, coverageLo);
+        const __m128i srcHi = byteMulSse2(color16, coverageHi);
+
+        // 255 - alpha of the source, for each channel.
+        __m128i inverseLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLo, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i inverseHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHi, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                _MM_SHUFFLE(3, 3, 3, 3));
+        inverseLo = _mm_sub_epi16(all, inverseLo);
+        inverseHi = _mm_sub_epi16(all, inverseHi);
+
+        const __m128i d   = _mm_loadu_si128(pixels);
+        const __m128i dLo = _mm_add_epi16(srcLo, byteMulSse2(_mm_unpacklo_epi8(d, zero), inverseLo));
+        const __m128i dHi = _mm_add_epi16(srcHi, byteMulSse2(_mm_unpackhi_epi8(d, zero), inverseHi));
+
+        _mm_storeu_si128(pixels, _mm_packus_epi16(dLo, dHi));
+    }
+
+    blendCoverageSpanGeneric(dst + i, coverage + i, count - i, color);
+}
+
+TURTYL_TARGET("sse2")
+static void blendImageSpanSse2(quint32* dst, const quint32* src, int count, int opacity)
+{
+    const __m128i zero      = _mm_setzero_si128();
+    const __m128i all       = _mm_set1_epi16(0xff);
+    const __m128i opacity16 = _mm_set1_epi16(static_cast<short>(opacity));
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+        // Layers are mostly transparent.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+        {
+            continue;
+        }
+
+        __m128i srcLo = _mm_unpacklo_epi8(s, zero);
+        __m128i srcHi = _mm_unpackhi_epi8(s, zero);
+
+        if (opacity != 0xff)
+        {
+            srcLo = byteMulSse2(srcLo, opacity16);
+            srcHi = byteMulSse2(srcHi, opacity16);
+        }
+
+        // 255 - alpha of the source, for each channel.
+        __m128i inverseLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLo, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i inverseHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHi, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                _MM_SHUFFLE(3, 3, 3, 3));
+        inverseLo = _mm_sub_epi16(all, inverseLo);
+        inverseHi = _mm_sub_epi16(all, inverseHi);
+
+        __m128i* pixels = reinterpret_cast<__m128i*>(dst + i);
+
+        const __m128i d   = _mm_loadu_si128(pixels);
+        const __m128i dLo = _mm_add_epi16(srcLo, byteMulSse2(_mm_unpacklo_epi8(d, zero), inverseLo));
+        const __m128i dHi = _mm_add_epi16(srcHi, byteMulSse2(_mm_unpackhi_epi8(d, zero), inverseHi));
+
+        _mm_storeu_si128(pixels, _mm_packus_epi16(dLo, dHi));
+    }
+
+    blendImageSpanGeneric(dst + i, src + i, count - i, opacity);
+}
+
+/**
+ * @brief Check 4 pixels against a color, a channel at a time.
+ *
+ * @return The movemask of the channels within the tolerance (0xffff when
+ *     all 4 pixels match).
+ */
+TURTYL_TARGET("sse2")
+static inline int matchMaskSse2(const quint32* pixels, __m128i color, __m128i tolerance)
+{
+    const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+
+    // |p - color| for unsigned bytes, then difference <= tolerance.
+    const __m128i difference = _mm_or_si128(_mm_subs_epu8(p, color), _mm_subs_epu8(color, p));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(difference, tolerance), tolerance));
+}
+
+TURTYL_TARGET("sse2")
+static int matchingPixelsSse2(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+    const __m128i t = _mm_set1_epi8(static_cast<char>(tolerance));
+
+    int i = 0;
+    while ((i + 4 <= count) && (0xffff == matchMaskSse2(pixels + i, c, t)))
+    {
+        i += 4;
+    }
+
+    return i + matchingPixelsGeneric(pixels + i, count - i, color, tolerance);
+}
+
+TURTYL_TARGET("sse2")
+static int matchingPixelsBackwardSse2(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+    const __m128i t = _mm_set1_epi8(static_cast<char>(tolerance));
+
+    int i = 0;
+    while ((i + 4 <= count) && (0xffff == matchMaskSse2(pixels + count - i - 4, c, t)))
+    {
+        i += 4;
+    }
+
+    return i + matchingPixelsBackwardGeneric(pixels, count - i, color, tolerance);
+}
+
+TURTYL_TARGET("avx2")
+static inline __m256i byteMulAvx2(__m256i channels, __m256i factors)
+{
+    const __m256i half = _mm256_set1_epi16(0x80);
+
+    __m256i t = _mm256_mullo_epi16(channels, factors);
+    t = _mm256_add_epi16(t, _mm256_srli_epi16(t, 8));
+    t = _mm256_add_epi16(t, half);
+    return _mm256_srli_epi16(t, 8);
+}
+
+TURTYL_TARGET("avx2")
+static void accumulateCoverageAvx2(float* accumulator, uchar* coverage, int count)
+{
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 one      = _mm256_set1_ps(1.0f);
+    const __m256 scale    = _mm256_set1_ps(255.0f);
+    const __m256 half     = _mm256_set1_ps(0.5f);
+    const __m256i last    = _mm256_set1_epi32(7);
+
+    __m256 offset = _mm256_setzero_ps();
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        // Prefix sum within each 128-bit lane, then carry the low lane's
+        // total into the high lane.
+        __m256 x = _mm256_loadu_ps(accumulator + i);
+        _mm256_storeu_ps(accumulator + i, _mm256_setzero_ps());
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+        const __m256 lowTotal = _mm256_permute_ps(x, _MM_SHUFFLE(3, 3, 3, 3));
+        x = _mm256_add_ps(x, _mm256_permute2f128_ps(lowTotal, lowTotal, 0x08));
+        x = _mm256_add_ps(x, offset);
+        offset = _mm256_permutevar8x32_ps(x, last);
+
+        x = _mm256_min_ps(_mm256_andnot_ps(signMask, x), one);
+        const __m256i alpha = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, scale), half));
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(alpha),
+                                         _mm256_extracti128_si256(alpha, 1));
+        packed = _mm_packus_epi16(packed, packed);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(coverage + i), packed);
+    }
+
+    float sum = _mm_cvtss_f32(_mm256_castps256_ps128(offset));
+    for (; i < count; i++)
+    {
+        sum += accumulator[i];
+        accumulator[i] = 0.0f;
+        coverage[i] = coverageToAlpha(sum);
+    }
+}
+
+TURTYL_TARGET("avx2")
+static void blendCoverageSpanAvx2(quint32* dst,
+                                  const uchar* coverage,
+                                  int count,
+                                  quint32 color)
+{
+    const __m256i zero    = _mm256_setzero_si256();
+    const __m256i all     = _mm256_set1_epi16(0xff);
+    const __m256i color16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(color)), zero);
+    const __m256i alphaShuffle = _mm256_set_epi8(15, 14, 15, 14, 15, 14, 15, 14,
+                                                 7, 6, 7, 6, 7, 6, 7, 6,
+                                                 15, 14, 15, 14, 15, 14, 15, 14,
+                                                 7, 6, 7, 6, 7, 6, 7, 6);
+    const bool opaque = (color >> 24) == 0xffu;
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        quint64 mask;
+        std::memcpy(&mask, coverage + i, sizeof(mask));
+
+        if (mask == 0u)
+        {
+            continue;
+        }
+
+        __m256i* pixels = reinterpret_cast<__m256i*>(dst + i);
+
+        if (opaque && (mask == ~Q_UINT64_C(0)))
+        {
+            _mm256_storeu_si256(pixels, _mm256_set1_epi32(static_cast<int>(color)));
+            continue;
+        }
+
+        // Unpacking works within 128-bit lanes, so the "low" registers hold
+        // pixels 0,1,4,5 and the "high" registers hold pixels 2,3,6,7.
+        __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(coverage + i)));
+        m = _mm256_or_si256(m, _mm256_slli_epi32(m, 16));
+        const __m256i coverageLo = _mm256_unpacklo_epi32(m, m);
+        const __m256i coverageHi = _mm256_unpackhi_epi32(m, m);
+
+        const __m256i srcLo = byteMulAvx2(color16, coverageLo);
+        const __m256i srcHi = byteMulAvx2(color16, coverageHi);
+
+        const __m256i inverseLo = _mm256_sub_epi16(all, _mm256_shuffle_epi8(srcLo, alphaShuffle));
+        const __m256i inverseHi = _mm256_sub_epi16(all, _mm256_shuffle_epi8(srcHi, alphaShuffle));
+
+        const __m256i d   = _mm256_loadu_si256(pixels);
+        const __m256i dLo = _mm256_add_epi16(srcLo, byteMulAvx2(_mm256_unpacklo_epi8(d, zero), inverseLo));
+        const __m256i dHi = _mm256_add_epi16(srcHi, byteMulAvx2(_mm256_unpackhi_epi8(d, zero), inverseHi));
+
+        _mm256_storeu_si256(pixels, _mm256_packus_epi16(dLo, dHi));
+    }
+
+    blendCoverageSpanGeneric(dst + i, coverage + i, count - i, color);
+}
+
+TURTYL_TARGET("avx2")
+static void blendImageSpanAvx2(quint32* dst, const quint32* src, int count, int opacity)
+{
+    const __m256i zero      = _mm256_setzero_si256();
+    const __m256i all       = _mm256_set1_epi16(0xff);
+    const __m256i opacity16 = _mm256_set1_epi16(static_cast<short>(opacity));
+    const __m256i alphaShuffle = _mm256_set_epi8(15, 14, 15, 14, 15, 14, 15, 14,
+                                                 7, 6, 7, 6, 7, 6, 7, 6,
+                                                 15, 14, 15, 14, 15, 14, 15, 14,
+                                                 7, 6, 7, 6, 7, 6, 7, 6);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+
+        // Layers are mostly transparent.
+        if (_mm256_testz_si256(s, s))
+        {
+            continue;
+        }
+
+        __m256i srcLo = _mm256_unpacklo_epi8(s, zero);
+        __m256i srcHi = _mm256_unpackhi_epi8(s, zero);
+
+        if (opacity != 0xff)
+        {
+            srcLo = byteMulAvx2(srcLo, opacity16);
+            srcHi = byteMulAvx2(srcHi, opacity16);
+        }
+
+        const __m256i inverseLo = _mm256_sub_epi16(all, _mm256_shuffle_epi8(srcLo, alphaShuffle));
+        const __m256i inverseHi = _mm256_sub_epi16(all, _mm256_shuffle_epi8(srcHi, alphaShuffle));
+
+        __m256i* pixels = reinterpret_cast<__m256i*>(dst + i);
+
+        const __m256i d   = _mm256_loadu_si256(pixels);
+        const __m256i dLo = _mm256_add_epi16(srcLo, byteMulAvx2(_mm256_unpacklo_epi8(d, zero), inverseLo));
+        const __m256i dHi = _mm256_add_epi16(srcHi, byteMulAvx2(_mm256_unpackhi_epi8(d, zero), inverseHi));
+
+        _mm256_storeu_si256(pixels, _mm256_packus_epi16(dLo, dHi));
+    }
+
+    blendImageSpanGeneric(dst + i, src + i, count - i, opacity);
+}
+
+/**
+ * @brief AVX2 version of matchMaskSse2(), for 8 pixels.
+ */
+TURTYL_TARGET("avx2")
+static inline int matchMaskAvx2(const quint32* pixels, __m256i color, __m256i tolerance)
+{
+    const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels));
+
+    const __m256i difference = _mm256_or_si256(_mm256_subs_epu8(p, color), _mm256_subs_epu8(color, p));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(difference, tolerance), tolerance));
+}
+
+TURTYL_TARGET("avx2")
+static int matchingPixelsAvx2(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(tolerance));
+
+    int i = 0;
+    while ((i + 8 <= count) && (-1 == matchMaskAvx2(pixels + i, c, t)))
+    {
+        i += 8;
+    }
+
+    return i + matchingPixelsGeneric(pixels + i, count - i, color, tolerance);
+}
+
+TURTYL_TARGET("avx2")
+static int matchingPixelsBackwardAvx2(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(tolerance));
+
+    int i = 0;
+    while ((i + 8 <= count) && (-1 == matchMaskAvx2(pixels + count - i - 8, c, t)))
+    {
+        i += 8;
+    }
+
+    return i + matchingPixelsBackwardGeneric(pixels, count - i, color, tolerance);
+}
+
+#endif // TURTYL_X86_SIMD
+
+/**
+ * @brief The kernels selected for the CPU.
+ */
+struct CompositingKernels
+{
+    const char* instructionSet;
+    void (*accumulateCoverage)(float*, uchar*, int);
+    void (*blendCoverageSpan)(quint32*, const uchar*, int, quint32);
+    void (*blendImageSpan)(quint32*, const quint32*, int, int);
+    int  (*matchingPixels)(const quint32*, int, quint32, int);
+    int  (*matchingPixelsBackward)(const quint32*, int, quint32, int);
+};
+
+static CompositingKernels selectKernels()
+{
+    bool sse2 = false;
+    bool avx2 = false;
+
+#if defined(TURTYL_X86_SIMD) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+
+    if ((maxLeaf >= 7) && osxsave && ((_xgetbv(0) & 0x6) == 0x6))
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#elif defined(TURTYL_X86_SIMD)
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    CompositingKernels kernels = {"generic",
+                                  &accumulateCoverageGeneric,
+                                  &blendCoverageSpanGeneric,
+                                  &blendImageSpanGeneric,
+                                  &matchingPixelsGeneric,
+                                  &matchingPixelsBackwardGeneric};
+
+#ifdef TURTYL_X86_SIMD
+    if (avx2)
+    {
+        kernels.instructionSet         = "AVX2";
+        kernels.accumulateCoverage     = &accumulateCoverageAvx2;
+        kernels.blendCoverageSpan      = &blendCoverageSpanAvx2;
+        kernels.blendImageSpan         = &blendImageSpanAvx2;
+        kernels.matchingPixels         = &matchingPixelsAvx2;
+        kernels.matchingPixelsBackward = &matchingPixelsBackwardAvx2;
+    }
+    else if (sse2)
+    {
+        kernels.instructionSet         = "SSE2";
+        kernels.accumulateCoverage     = &accumulateCoverageSse2;
+        kernels.blendCoverageSpan      = &blendCoverageSpanSse2;
+        kernels.blendImageSpan         = &blendImageSpanSse2;
+        kernels.matchingPixels         = &matchingPixelsSse2;
+        kernels.matchingPixelsBackward = &matchingPixelsBackwardSse2;
+    }
+#else
+    Q_UNUSED(sse2);
+    Q_UNUSED(avx2);
+#endif
+
+    return kernels;
+}
+
+static const CompositingKernels& kernels()
+{
+    static const CompositingKernels selected = selectKernels();
+    return selected;
+}
+
+/**
+ * @brief Get the name of the instruction set used by the SIMD kernels.
+ *
+ * @return "AVX2", "SSE2" or "generic".
+ */
+const char* Compositing::instructionSet()
+{
+    return kernels().instructionSet;
+}
+
+/**
+ * @brief Blend a solid color over a run of pixels.
+ *
+ * @param dst The first pixel to blend.
+ * @param count The number of pixels to blend.
+ * @param color The premultiplied color.
+ */
+void Compositing::blendSolidSpan(quint32* dst, int count, quint32 color)
+{
+    const quint32 alpha = color >> 24;
+
+    if (alpha == 0xffu)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            dst[i] = color;
+        }
+    }
+    else if (alpha != 0u)
+    {
+        const quint32 inverseAlpha = 0xffu - alpha;
+        for (int i = 0; i < count; i++)
+        {
+            dst[i] = color + byteMul(dst[i], inverseAlpha);
+        }
+    }
+}
+
+/**
+ * @brief Blend a repeating pattern over a run of pixels.
+ *
+ * @param dst The first pixel to blend.
+ * @param count The number of pixels to blend.
+ * @param patternRow The PATTERN_SIZE premultiplied pixels of the pattern
+ *     row to repeat.
+ * @param phase The index in @p patternRow of the pixel blended over @p dst[0].
+ */
+void Compositing::blendPatternSpan(quint32* dst,
+                                   int count,
+                                   const quint32* patternRow,
+                                   int phase)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const quint32 src   = patternRow[(phase + i) & (PATTERN_SIZE - 1)];
+        const quint32 alpha = src >> 24;
+
+        if (alpha == 0xffu)
+        {
+            dst[i] = src;
+        }
+        else if (alpha != 0u)
+        {
+            dst[i] = src + byteMul(dst[i], 0xffu - alpha);
+        }
+    }
+}
+
+/**
+ * @brief Convert accumulated signed areas into pixel coverage.
+ *
+ * The coverage of each pixel is the running sum of the accumulator up to
+ * and including that pixel, clamped to [0, 1] and scaled to [0, 255].
+ * The accumulator is cleared, ready for the next row.
+ *
+ * @param accumulator The signed area deltas, @p count values.
+ * @param coverage Receives the @p count coverage values.
+ * @param count The number of pixels.
+ */
+void Compositing::accumulateCoverage(float* accumulator, uchar* coverage, int count)
+{
+    kernels().accumulateCoverage(accumulator, coverage, count);
+}
+
+/**
+ * @brief Blend a solid color over a run of pixels, weighted by coverage.
+ *
+ * @param dst The first pixel to blend.
+ * @param coverage The coverage (0-255) of each pixel.
+ * @param count The number of pixels to blend.
+ * @param color The premultiplied color.
+ */
+void Compositing::blendCoverageSpan(quint32* dst,
+                                    const uchar* coverage,
+                                    int count,
+                                    quint32 color)
+{
+    kernels().blendCoverageSpan(dst, coverage, count, color);
+}
+
+/**
+ * @brief Blend a repeating pattern over a run of pixels, weighted by coverage.
+ *
+ * @param dst The first pixel to blend.
+ * @param coverage The coverage (0-255) of each pixel.
+ * @param count The number of pixels to blend.
+ * @param patternRow The PATTERN_SIZE premultiplied pixels of the pattern
+ *     row to repeat.
+ * @param phase The index in @p patternRow of the pixel blended over @p dst[0].
+ */
+void Compositing::blendPatternCoverageSpan(quint32* dst,
+                                           const uchar* coverage,
+                                           int count,
+                                           const quint32* patternRow,
+                                           int phase)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (coverage[i] == 0u)
+        {
+            continue;
+        }
+
+        const quint32 pattern = patternRow[(phase + i) & (PATTERN_SIZE - 1)];
+        const quint32 src     = (coverage[i] == 0xffu) ? pattern : byteMul(pattern, coverage[i]);
+        const quint32 alpha   = src >> 24;
+
+        if (alpha == 0xffu)
+        {
+            dst[i] = src;
+        }
+        else if (alpha != 0u)
+        {
+            dst[i] = src + byteMul(dst[i], 0xffu - alpha);
+        }
+    }
+}
+
+/**
+ * @brief Blend a run of pixels over another, with a constant opacity.
+ *
+ * This is used to composite the layers of the canvas.
+ *
+ * @param dst The first pixel to blend over.
+ * @param src The first premultiplied pixel to blend.
+ * @param count The number of pixels to blend.
+ * @param opacity The opacity (0-255) of the pixels blended.
+ */
+void Compositing::blendImageSpan(quint32* dst, const quint32* src, int count, int opacity)
+{
+    kernels().blendImageSpan(dst, src, count, opacity);
+}
+
+/**
+ * @brief Count the pixels at the start of a run which match a color.
+ *
+ * A pixel matches when none of its channels (including alpha) differs
+ * from the color's by more than @p tolerance.
+ *
+ * @param pixels The first pixel of the run.
+ * @param count The number of pixels in the run.
+ * @param color The premultiplied color to match.
+ * @param tolerance The largest difference allowed in each channel (0-255).
+ * @return The number of consecutive matching pixels from pixels[0].
+ */
+int Compositing::matchingPixels(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    return kernels().matchingPixels(pixels, count, color, tolerance);
+}
+
+/**
+ * @brief Count the pixels at the end of a run which match a color.
+ *
+ * This is matchingPixels() going backwards, from pixels[count - 1].
+ */
+int Compositing::matchingPixelsBackward(const quint32* pixels, int count, quint32 color, int tolerance)
+{
+    return kernels().matchingPixelsBackward(pixels, count, color, tolerance);
+}
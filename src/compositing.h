@@ -0,0 +1,75 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef COMPOSITING_H
+#define COMPOSITING_H
+
+#include <QtGlobal>
+
+/**
+ * @brief Pixel compositing kernels used by the Rasterizer and the layers
+ *     of the canvas.
+ *
+ * All kernels operate on premultiplied ARGB32 pixels
+ * (QImage::Format_ARGB32_Premultiplied) and use the "source over"
+ * composition mode, i.e. the same result as QPainter's default mode.
+ *
+ * The coverage, image blending and color matching kernels have SSE2 and AVX2
+ * implementations on x86 CPUs.
+ * The fastest implementation supported by the CPU is selected at run time,
+ * the portable implementation is used on other CPUs. The implementations
+ * blend identically; the coverage they compute may differ by one unit
+ * (out of 255) as the running sums are added up in a different order.
+ */
+class Compositing
+{
+public:
+    /// Width and height of the pattern tiles used by the pattern kernels.
+    static const int PATTERN_SIZE = 8;
+
+    static const char* instructionSet();
+
+    static void blendSolidSpan(quint32* dst, int count, quint32 color);
+
+    static void blendPatternSpan(quint32* dst,
+                                 int count,
+                                 const quint32* patternRow,
+                                 int phase);
+
+    static void accumulateCoverage(float* accumulator, uchar* coverage, int count);
+
+    static void blendCoverageSpan(quint32* dst,
+                                  const uchar* coverage,
+                                  int count,
+                                  quint32 color);
+
+    static void blendPatternCoverageSpan(quint32* dst,
+                                         const uchar* coverage,
+                                         int count,
+                                         const quint32* patternRow,
+                                         int phase);
+
+    static void blendImageSpan(quint32* dst, const quint32* src, int count, int opacity);
+
+    static int matchingPixels(const quint32* pixels, int count, quint32 color, int tolerance);
+
+    static int matchingPixelsBackward(const quint32* pixels, int count, quint32 color, int tolerance);
+};
+
+#endif // COMPOSITING_H
@@ -0,0 +1,182 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "displaylist.h"
+#include "perfcounters.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+/// Memory use is published every this many appended commands.
+static const int BYTES_UPDATE_INTERVAL = 256;
+
+/// query() is only worth using when its candidates are at most this
+/// fraction of the commands.
+static const quint64 QUERY_SELECTIVITY = 4;
+
+DisplayList::DisplayList() :
+    m_commands(),
+    m_bounds(),
+    m_index(),
+    m_baseTiles(),
+    m_keyframes()
+{
+
+}
+
+QRectF DisplayList::bounds(int index) const
+{
+    const Bounds& b = m_bounds.at(index);
+    return QRectF(QPointF(b.left, b.top), QPointF(b.right, b.bottom));
+}
+
+/**
+ * @brief Add a command to the end of the list.
+ *
+ * @param command The command.
+ * @param bounds The area covered by the command, relative to the center
+ *     of the canvas.
+ */
+void DisplayList::append(const DrawCommand& command, const QRectF& bounds)
+{
+    // Round outwards so that the stored bounds still cover the command.
+    Bounds b;
+    b.left   = std::nextafter(static_cast<float>(bounds.left()),   -HUGE_VALF);
+    b.top    = std::nextafter(static_cast<float>(bounds.top()),    -HUGE_VALF);
+    b.right  = std::nextafter(static_cast<float>(bounds.right()),  HUGE_VALF);
+    b.bottom = std::nextafter(static_cast<float>(bounds.bottom()), HUGE_VALF);
+
+    m_index.insert(m_commands.size(), bounds);
+    m_commands.append(command);
+    m_bounds.append(b);
+
+    if ((m_commands.size() % BYTES_UPDATE_INTERVAL) == 0)
+    {
+        updateBytes();
+    }
+}
+
+/**
+ * @brief Find the commands whose bounding box intersects a rectangle.
+ *
+ * @param rect The region, relative to the center of the canvas.
+ * @param commands Receives the indexes of the commands, in drawing order.
+ */
+void DisplayList::query(const QRectF& rect, QVector<int>& commands) const
+{
+    m_index.query(rect, commands);
+
+    int kept = 0;
+    for (int i = 0; i < commands.size(); i++)
+    {
+        if (bounds(commands[i]).intersects(rect))
+        {
+            commands[kept++] = commands[i];
+        }
+    }
+    commands.resize(kept);
+}
+
+/**
+ * @brief Check whether query() is worth using for a region.
+ *
+ * Each command is a candidate once for every cell of the index it covers,
+ * and query() gathers and sorts all the candidates. When they are not a
+ * small fraction of the commands, it is quicker to test the bounds() of
+ * every command in order, which also uses no memory.
+ *
+ * @param rect The region, relative to the center of the canvas.
+ */
+bool DisplayList::isSelective(const QRectF& rect) const
+{
+    return m_index.count(rect) * QUERY_SELECTIVITY <= static_cast<quint64>(m_commands.size());
+}
+
+/**
+ * @brief Save the drawing after the last command.
+ *
+ * @pre The number of commands is a multiple of KEYFRAME_INTERVAL, and
+ *     the previous keyframes were all added.
+ *
+ * @param tiles The canvas' tiles.
+ */
+void DisplayList::addKeyframe(const TileStore& tiles)
+{
+    assert(m_commands.size() == (m_keyframes.size() + 1) * KEYFRAME_INTERVAL);
+
+    m_keyframes.append(tiles);
+}
+
+/**
+ * @brief Get the latest saved drawing preceding a step of the drawing.
+ *
+ * @param step The number of commands drawn, from 0 to size().
+ * @param firstCommand Receives the number of commands drawn in the
+ *     returned tiles. The commands from there to @p step must be drawn
+ *     over them to obtain the drawing at @p step.
+ * @return The keyframe, or the base tiles.
+ */
+const TileStore& DisplayList::keyframeBefore(int step, int& firstCommand) const
+{
+    const int keyframe = std::min(step / KEYFRAME_INTERVAL, m_keyframes.size());
+
+    firstCommand = keyframe * KEYFRAME_INTERVAL;
+
+    return (keyframe > 0) ? m_keyframes.at(keyframe - 1) : m_baseTiles;
+}
+
+/**
+ * @brief Replace all the commands by the tiles of their drawing.
+ *
+ * @param baseTiles The canvas' tiles. The center of the tiles is the
+ *     center of the canvas.
+ */
+void DisplayList::rebase(const TileStore& baseTiles)
+{
+    m_commands.clear();
+    m_bounds.clear();
+    m_index.clear();
+    m_baseTiles = baseTiles;
+    m_keyframes.clear();
+    updateBytes();
+}
+
+/**
+ * @brief Remove all commands and the base tiles.
+ */
+void DisplayList::clear()
+{
+    rebase(TileStore());
+}
+
+/**
+ * @brief Publish the memory used by the list to PerfCounters::displayListBytes.
+ *
+ * This is done when the list is cleared or rebased and periodically as
+ * commands are appended.
+ */
+void DisplayList::updateBytes() const
+{
+    const quint64 bytes = static_cast<quint64>(m_commands.capacity()) * sizeof(DrawCommand)
+                          + static_cast<quint64>(m_bounds.capacity()) * sizeof(Bounds)
+                          + m_index.bytes()
+                          + m_baseTiles.bytes();
+
+    PerfCounters::instance().displayListBytes.set(bytes);
+}
@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef DISPLAYLIST_H
+#define DISPLAYLIST_H
+
+#include "drawcommand.h"
+#include "spatialindex.h"
+#include "tilestore.h"
+#include <QRectF>
+#include <QVector>
+
+/**
+ * @brief The primitives drawn on the canvas since it was last cleared.
+ *
+ * Each command is stored with its bounding box (including the pen),
+ * which is indexed by a SpatialIndex so that the commands touching a
+ * region can be found without visiting the whole list.
+ *
+ * The canvas may have to discard the commands while keeping the drawing,
+ * for example when the pen/brush table overflows. The drawing is then
+ * kept as the base tiles of the list, and the commands which follow are
+ * drawn over it. The base tiles share their pixels with the canvas until
+ * either is drawn on.
+ *
+ * Every KEYFRAME_INTERVAL commands, the canvas adds a keyframe: a copy of
+ * its tiles (which shares their pixels). Any intermediate state of the
+ * drawing can then be rebuilt by drawing at most KEYFRAME_INTERVAL
+ * commands over the preceding keyframe (see keyframeBefore()).
+ *
+ * Copies share their storage until either is modified, so the canvas
+ * can keep copies in its checkpoints cheaply. The memory used by the
+ * canvas' list is published to PerfCounters::displayListBytes.
+ *
+ * This class is not thread-safe.
+ */
+class DisplayList
+{
+public:
+    /// Number of commands between keyframes.
+    static const int KEYFRAME_INTERVAL = 4096;
+
+    DisplayList();
+
+    int size() const { return m_commands.size(); }
+    bool isEmpty() const { return m_commands.isEmpty(); }
+
+    const DrawCommand& at(int index) const { return m_commands.at(index); }
+    QRectF bounds(int index) const;
+
+    const TileStore& baseTiles() const { return m_baseTiles; }
+
+    void append(const DrawCommand& command, const QRectF& bounds);
+
+    void query(const QRectF& rect, QVector<int>& commands) const;
+    bool isSelective(const QRectF& rect) const;
+
+    void addKeyframe(const TileStore& tiles);
+    const TileStore& keyframeBefore(int step, int& firstCommand) const;
+
+    void rebase(const TileStore& baseTiles);
+
+    void clear();
+
+    void updateBytes() const;
+
+private:
+    /// Bounding boxes are stored in single precision to save memory.
+    struct Bounds
+    {
+        float left;
+        float top;
+        float right;
+        float bottom;
+    };
+
+    QVector<DrawCommand> m_commands;
+    QVector<Bounds>      m_bounds;
+    SpatialIndex         m_index;
+    TileStore            m_baseTiles;
+    QVector<TileStore>   m_keyframes; ///< Tiles after each KEYFRAME_INTERVAL commands.
+};
+
+#endif // DISPLAYLIST_H
@@ -0,0 +1,241 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef DRAWCOMMAND_H
+#define DRAWCOMMAND_H
+
+#include "penbrushtable.h"
+#include "rasterizer.h"
+#include <QLineF>
+
+/**
+ * @brief A primitive to be drawn on the canvas.
+ *
+ * The geometry is relative to the center of the canvas, with the Y axis
+ * pointing down (i.e. already flipped from the script's point of view).
+ * The pen and brush are referred to by their handle in the canvas'
+ * PenBrushTable.
+ *
+ * Commands are retained in the canvas' DisplayList, so they are kept
+ * small: the geometry of all types of primitive shares the same storage.
+ */
+class DrawCommand
+{
+public:
+    enum Type
+    {
+        Line,
+        Arc,
+        Fill, ///< A flood fill, with the style's brush color.
+        Stamp, ///< A stamp (see StampCache), drawn with its own styles.
+        Glyph, ///< A character of text (see GlyphAtlas), with the style's pen color.
+        Image  ///< An image loaded from a file (see ImageCache).
+    };
+
+    static DrawCommand line(const QLineF& line,
+                            PenBrushTable::Handle style,
+                            bool antialiased)
+    {
+        DrawCommand command(Line, style, false, antialiased);
+        command.m_geometry[0] = line.x1();
+        command.m_geometry[1] = line.y1();
+        command.m_geometry[2] = line.x2();
+        command.m_geometry[3] = line.y2();
+        return command;
+    }
+
+    static DrawCommand arc(const ArcShape& arc,
+                           PenBrushTable::Handle style,
+                           bool filled,
+                           bool antialiased)
+    {
+        DrawCommand command(Arc, style, filled, antialiased);
+        command.m_geometry[0] = arc.center.x();
+        command.m_geometry[1] = arc.center.y();
+        command.m_geometry[2] = arc.rotation;
+        command.m_geometry[3] = arc.spanAngle;
+        command.m_geometry[4] = arc.xradius;
+        command.m_geometry[5] = arc.yradius;
+        return command;
+    }
+
+    static DrawCommand fill(const QPointF& seed,
+                            PenBrushTable::Handle style,
+                            int tolerance)
+    {
+        DrawCommand command(Fill, style, true, false);
+        command.m_geometry[0] = seed.x();
+        command.m_geometry[1] = seed.y();
+        command.m_geometry[2] = tolerance;
+        return command;
+    }
+
+    static DrawCommand stamp(int stamp,
+                             const QPointF& position,
+                             qreal angle,
+                             qreal scale)
+    {
+        DrawCommand command(Stamp, 0, false, false);
+        command.m_geometry[0] = position.x();
+        command.m_geometry[1] = position.y();
+        command.m_geometry[2] = angle;
+        command.m_geometry[3] = scale;
+        command.m_geometry[4] = stamp;
+        return command;
+    }
+
+    static DrawCommand glyph(uint codePoint,
+                             const QPointF& position,
+                             int pixelSize,
+                             qreal angle,
+                             PenBrushTable::Handle style,
+                             bool antialiased)
+    {
+        DrawCommand command(Glyph, style, false, antialiased);
+        command.m_geometry[0] = position.x();
+        command.m_geometry[1] = position.y();
+        command.m_geometry[2] = angle;
+        command.m_geometry[3] = pixelSize;
+        command.m_geometry[4] = codePoint;
+        return command;
+    }
+
+    static DrawCommand image(int image,
+                             const QPointF& position,
+                             qreal scale,
+                             qreal angle,
+                             bool antialiased)
+    {
+        DrawCommand command(Image, 0, false, antialiased);
+        command.m_geometry[0] = position.x();
+        command.m_geometry[1] = position.y();
+        command.m_geometry[2] = angle;
+        command.m_geometry[3] = scale;
+        command.m_geometry[4] = image;
+        return command;
+    }
+
+    Type type() const { return static_cast<Type>(m_type); }
+    PenBrushTable::Handle style() const { return m_style; }
+    bool filled() const { return m_filled; }
+    bool antialiased() const { return m_antialiased; }
+
+    /// The line, for Line commands.
+    QLineF line() const
+    {
+        return QLineF(m_geometry[0], m_geometry[1], m_geometry[2], m_geometry[3]);
+    }
+
+    /// The arc, for Arc commands.
+    ArcShape arc() const
+    {
+        ArcShape shape;
+        shape.center    = QPointF(m_geometry[0], m_geometry[1]);
+        shape.rotation  = m_geometry[2];
+        shape.spanAngle = m_geometry[3];
+        shape.xradius   = m_geometry[4];
+        shape.yradius   = m_geometry[5];
+        return shape;
+    }
+
+    /// The pixel the fill starts from, for Fill commands.
+    QPointF seed() const
+    {
+        return QPointF(m_geometry[0], m_geometry[1]);
+    }
+
+    /// The largest difference in each channel of the filled pixels, for Fill commands.
+    int tolerance() const
+    {
+        return static_cast<int>(m_geometry[2]);
+    }
+
+    /// The stamp's identifier in the canvas' StampCache, for Stamp commands.
+    int stampId() const
+    {
+        return static_cast<int>(m_geometry[4]);
+    }
+
+    /// Where the stamp's origin is drawn, for Stamp commands, the pen
+    /// position on the baseline, for Glyph commands, or where the image's
+    /// center is drawn, for Image commands.
+    QPointF position() const
+    {
+        return QPointF(m_geometry[0], m_geometry[1]);
+    }
+
+    /// The clockwise rotation (degrees), for Stamp, Glyph and Image commands.
+    qreal angle() const
+    {
+        return m_geometry[2];
+    }
+
+    /// The scale, for Stamp and Image commands.
+    qreal scale() const
+    {
+        return m_geometry[3];
+    }
+
+    /// The image's identifier in the canvas' ImageCache, for Image commands.
+    int imageId() const
+    {
+        return static_cast<int>(m_geometry[4]);
+    }
+
+    /// The character's Unicode code point, for Glyph commands.
+    uint codePoint() const
+    {
+        return static_cast<uint>(m_geometry[4]);
+    }
+
+    /// The font's pixel size, for Glyph commands.
+    int pixelSize() const
+    {
+        return static_cast<int>(m_geometry[3]);
+    }
+
+    DrawCommand() :
+        m_type(Line),
+        m_filled(false),
+        m_antialiased(false),
+        m_style(0),
+        m_geometry()
+    {
+
+    }
+
+private:
+    DrawCommand(Type type, PenBrushTable::Handle style, bool filled, bool antialiased) :
+        m_type(static_cast<quint8>(type)),
+        m_filled(filled),
+        m_antialiased(antialiased),
+        m_style(style),
+        m_geometry()
+    {
+
+    }
+
+    quint8                m_type;
+    bool                  m_filled;      ///< For arcs, whether the pie is filled with the brush.
+    bool                  m_antialiased;
+    PenBrushTable::Handle m_style;
+    qreal                 m_geometry[6];
+};
+
+#endif // DRAWCOMMAND_H
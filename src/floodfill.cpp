@@ -0,0 +1,272 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "floodfill.h"
+#include "compositing.h"
+#include <QtAlgorithms>
+#include <algorithm>
+
+// The masks of filled pixels have a 64-bit word per row of a tile.
+static_assert(TileStore::TILE_SIZE <= 64, "a row of a tile must fit in a quint64");
+
+/// Read in place of the pixels of the tiles which are not allocated.
+static const quint32 TRANSPARENT_ROW[TileStore::TILE_SIZE] = {};
+
+/// A row of a tile's mask with no pixel filled.
+static const quint64 UNFILLED_ROW = 0u;
+
+/**
+ * @param tiles The tiles to fill.
+ * @param color The premultiplied fill color.
+ * @param tolerance The largest difference (0-255) between a channel of the
+ *     seed pixel and the same channel of the pixels filled.
+ */
+FloodFill::FloodFill(TileStore& tiles, quint32 color, int tolerance) :
+    m_tiles(tiles),
+    m_rect(tiles.rect()),
+    m_color(color),
+    m_tolerance(std::max(0, std::min(255, tolerance))),
+    m_target(0u),
+    m_filled(tiles.columns() * tiles.rows()),
+    m_seeds(),
+    m_bounds()
+{
+
+}
+
+/**
+ * @brief Fill the area around a pixel.
+ *
+ * @param seed The pixel, in canvas coordinates.
+ * @return The bounds of the pixels filled, which is empty when the seed
+ *     lies outside of the canvas.
+ */
+QRect FloodFill::fill(const QPoint& seed)
+{
+    if (!m_rect.contains(seed))
+    {
+        return QRect();
+    }
+
+    m_target = *pixels(seed.x(), seed.y());
+    m_seeds.append(seed);
+
+    while (!m_seeds.isEmpty())
+    {
+        const QPoint pixel = m_seeds.takeLast();
+
+        // The pixel may have been filled since it was added.
+        if (isFillable(pixel.x(), pixel.y()))
+        {
+            const int x0 = extendLeft(pixel.x(), pixel.y());
+            const int x1 = extendRight(pixel.x(), pixel.y());
+
+            fillSpan(pixel.y(), x0, x1);
+
+            if (pixel.y() > m_rect.top())
+            {
+                findSpans(pixel.y() - 1, x0, x1);
+            }
+            if (pixel.y() < m_rect.bottom())
+            {
+                findSpans(pixel.y() + 1, x0, x1);
+            }
+        }
+    }
+
+    return m_bounds;
+}
+
+/**
+ * @brief Get the pixels of a tile's row, from pixel (x,y) to the tile's right edge.
+ */
+const quint32* FloodFill::pixels(int x, int y) const
+{
+    const int column = m_tiles.columnAt(x);
+    const int row    = m_tiles.rowAt(y);
+    const QRect tileRect = m_tiles.tileRect(column, row);
+
+    if (!m_tiles.isOccupied(column, row))
+    {
+        return TRANSPARENT_ROW + (x - tileRect.left());
+    }
+
+    const QImage& image = m_tiles.tile(column, row).image;
+    return reinterpret_cast<const quint32*>(image.constScanLine(y - tileRect.top()))
+           + (x - tileRect.left());
+}
+
+/**
+ * @brief Get the mask of the filled pixels of the tile's row containing pixel (x,y).
+ *
+ * Bit n is set when the tile's pixel n of the row is filled.
+ */
+const quint64* FloodFill::filledRow(int x, int y) const
+{
+    const int column = m_tiles.columnAt(x);
+    const int row    = m_tiles.rowAt(y);
+    const QVector<quint64>& mask = m_filled.at((row * m_tiles.columns()) + column);
+
+    if (mask.isEmpty())
+    {
+        return &UNFILLED_ROW;
+    }
+
+    return mask.constData() + (y - m_tiles.tileRect(column, row).top());
+}
+
+/**
+ * @brief Check whether a pixel is to be filled, i.e. it matches and was not filled yet.
+ */
+bool FloodFill::isFillable(int x, int y) const
+{
+    const int bit = x - m_tiles.tileRect(m_tiles.columnAt(x), m_tiles.rowAt(y)).left();
+
+    return (0u == ((*filledRow(x, y) >> bit) & 1u))
+           && (1 == Compositing::matchingPixels(pixels(x, y), 1, m_target, m_tolerance));
+}
+
+/**
+ * @brief Find the leftmost pixel of the fillable run of pixels containing pixel (x,y).
+ *
+ * @pre Pixel (x,y) is fillable.
+ */
+int FloodFill::extendLeft(int x, int y) const
+{
+    while (x > m_rect.left())
+    {
+        // The pixels from the left of the tile (or canvas) to x - 1.
+        const int end   = x - 1;
+        const int bit   = end - m_tiles.tileRect(m_tiles.columnAt(end), m_tiles.rowAt(y)).left();
+        const int count = std::min(bit + 1, end - m_rect.left() + 1);
+
+        int run = Compositing::matchingPixelsBackward(pixels(end - count + 1, y),
+                                                      count,
+                                                      m_target,
+                                                      m_tolerance);
+
+        // Stop at the first filled pixel.
+        const quint64 filled = *filledRow(end, y) << (63 - bit);
+        if (0u != filled)
+        {
+            run = std::min(run, static_cast<int>(qCountLeadingZeroBits(filled)));
+        }
+
+        x -= run;
+
+        if (run < count)
+        {
+            break;
+        }
+    }
+
+    return x;
+}
+
+/**
+ * @brief Find the rightmost pixel of the fillable run of pixels containing pixel (x,y).
+ *
+ * @pre Pixel (x,y) is fillable.
+ */
+int FloodFill::extendRight(int x, int y) const
+{
+    while (x < m_rect.right())
+    {
+        // The pixels from x + 1 to the right of the tile (or canvas).
+        const int start = x + 1;
+        const int bit   = start - m_tiles.tileRect(m_tiles.columnAt(start), m_tiles.rowAt(y)).left();
+        const int count = std::min(TileStore::TILE_SIZE - bit, m_rect.right() - start + 1);
+
+        int run = Compositing::matchingPixels(pixels(start, y), count, m_target, m_tolerance);
+
+        const quint64 filled = *filledRow(start, y) >> bit;
+        if (0u != filled)
+        {
+            run = std::min(run, static_cast<int>(qCountTrailingZeroBits(filled)));
+        }
+
+        x += run;
+
+        if (run < count)
+        {
+            break;
+        }
+    }
+
+    return x;
+}
+
+/**
+ * @brief Fill the pixels x0..x1 (inclusive) of row y.
+ */
+void FloodFill::fillSpan(int y, int x0, int x1)
+{
+    m_bounds |= QRect(x0, y, x1 - x0 + 1, 1);
+
+    while (x0 <= x1)
+    {
+        const int column = m_tiles.columnAt(x0);
+        const int row    = m_tiles.rowAt(y);
+        const QPoint tileOrigin = m_tiles.tileRect(column, row).topLeft();
+
+        const int tileX0 = x0 - tileOrigin.x();
+        const int tileX1 = std::min(x1 - tileOrigin.x(), TileStore::TILE_SIZE - 1);
+        const int tileY  = y - tileOrigin.y();
+        const int count  = tileX1 - tileX0 + 1;
+
+        TileStore::Tile& tile = m_tiles.writableTile(column, row);
+        quint32* dst = reinterpret_cast<quint32*>(tile.image.scanLine(tileY)) + tileX0;
+        std::fill(dst, dst + count, m_color);
+
+        tile.used |= QRect(tileX0, tileY, count, 1);
+
+        QVector<quint64>& mask = m_filled[(row * m_tiles.columns()) + column];
+        if (mask.isEmpty())
+        {
+            mask.fill(0u, TileStore::TILE_SIZE);
+        }
+        const quint64 bits = (count == TileStore::TILE_SIZE) ? ~quint64(0) : ((quint64(1) << count) - 1u);
+        mask[tileY] |= bits << tileX0;
+
+        x0 += count;
+    }
+}
+
+/**
+ * @brief Add a seed for each fillable run of pixels overlapping x0..x1 on row y.
+ */
+void FloodFill::findSpans(int y, int x0, int x1)
+{
+    int x = x0;
+
+    while (x <= x1)
+    {
+        if (isFillable(x, y))
+        {
+            m_seeds.append(QPoint(x, y));
+
+            // The pixel following the run is not fillable.
+            x = extendRight(x, y) + 2;
+        }
+        else
+        {
+            x++;
+        }
+    }
+}
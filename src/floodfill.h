@@ -0,0 +1,75 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef FLOODFILL_H
+#define FLOODFILL_H
+
+#include "tilestore.h"
+#include <QPoint>
+#include <QRect>
+#include <QVector>
+
+/**
+ * @brief Scanline flood fill of the canvas' tiles.
+ *
+ * fill() gives a color to the area around a seed pixel: the pixels reached
+ * from the seed by moving up, down, left or right through pixels matching
+ * the seed's color. Pixels match when each of their channels (including
+ * alpha) is within the tolerance of the seed pixel's.
+ *
+ * The area is filled one span (a run of pixels on a row) at a time. A
+ * span is found by extending a pixel left and right with the color
+ * matching kernels (see Compositing::matchingPixels()), one tile at a
+ * time, then the rows above and below the span are searched for the
+ * spans to fill next.
+ *
+ * Tiles which were never drawn on are read as transparent pixels, and are
+ * only allocated if the fill reaches them. A mask of the pixels already
+ * filled is kept for each tile reached, so that pixels are filled once
+ * even when the fill color matches the seed's.
+ */
+class FloodFill
+{
+public:
+    FloodFill(TileStore& tiles, quint32 color, int tolerance);
+
+    QRect fill(const QPoint& seed);
+
+private:
+    const quint32* pixels(int x, int y) const;
+    const quint64* filledRow(int x, int y) const;
+
+    bool isFillable(int x, int y) const;
+    int extendLeft(int x, int y) const;
+    int extendRight(int x, int y) const;
+
+    void fillSpan(int y, int x0, int x1);
+    void findSpans(int y, int x0, int x1);
+
+    TileStore&                 m_tiles;
+    QRect                      m_rect;      ///< The canvas.
+    quint32                    m_color;     ///< The premultiplied fill color.
+    int                        m_tolerance;
+    quint32                    m_target;    ///< The seed pixel's color.
+    QVector<QVector<quint64> > m_filled;    ///< Per tile, a bit per filled pixel; empty until the tile is reached.
+    QVector<QPoint>            m_seeds;     ///< Pixels from which to fill more spans.
+    QRect                      m_bounds;    ///< The pixels filled so far.
+};
+
+#endif // FLOODFILL_H
@@ -0,0 +1,322 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "functionprofiler.h"
+#include <QList>
+#include <QTextStream>
+#include <algorithm>
+#include <cstring>
+
+/**
+ * @brief Quote a field for a CSV file, if necessary.
+ */
+static QString csvField(const QString& field)
+{
+    if (field.contains(',') || field.contains('"') || field.contains('\n'))
+    {
+        return '"' + QString(field).replace("\"", "\"\"") + '"';
+    }
+
+    return field;
+}
+
+/**
+ * @brief Get the depth of the innermost active function of a Lua thread.
+ *
+ * The depth is the number of active functions below it on the thread's
+ * call stack. As each lua_getstack() call walks the stack, @p guess is
+ * checked first, and the depth is only searched for if it is wrong.
+ */
+static int stackDepth(lua_State* state, int guess)
+{
+    lua_Debug ar;
+    if ((0 != lua_getstack(state, guess, &ar)) && (0 == lua_getstack(state, guess + 1, &ar)))
+    {
+        return guess;
+    }
+
+    int valid   = 0;
+    int invalid = 1;
+
+    while (0 != lua_getstack(state, invalid, &ar))
+    {
+        valid    = invalid;
+        invalid *= 2;
+    }
+
+    while (valid + 1 < invalid)
+    {
+        const int middle = (valid + invalid) / 2;
+        if (0 != lua_getstack(state, middle, &ar))
+        {
+            valid = middle;
+        }
+        else
+        {
+            invalid = middle;
+        }
+    }
+
+    return valid;
+}
+
+FunctionProfiler::FunctionProfiler() :
+    m_enabled(0),
+    m_clock(),
+    m_functions(),
+    m_stacks(),
+    m_currentState(nullptr),
+    m_currentStack(nullptr)
+{
+    m_clock.start();
+}
+
+FunctionProfiler::~FunctionProfiler()
+{
+    qDeleteAll(m_functions);
+}
+
+/**
+ * @brief Switch the profiler on or off.
+ *
+ * The change takes effect the next time the ScriptRunner's debug hook runs.
+ *
+ * @param on @c true to enable the profiler.
+ */
+void FunctionProfiler::setEnabled(bool on)
+{
+    m_enabled.storeRelease(on ? 1 : 0);
+}
+
+/**
+ * @brief Discard all collected statistics.
+ */
+void FunctionProfiler::reset()
+{
+    qDeleteAll(m_functions);
+    m_functions.clear();
+    m_stacks.clear();
+    m_currentState = nullptr;
+    m_currentStack = nullptr;
+}
+
+/**
+ * @brief Handle a call (or tail call) event.
+ *
+ * @param state The Lua thread running the function.
+ * @param ar The activation record passed to the hook.
+ * @param tailCall @c true if this is a tail call event.
+ */
+void FunctionProfiler::enterFunction(lua_State* state, lua_Debug* ar, bool tailCall)
+{
+    const qint64 now = m_clock.nsecsElapsed();
+
+    // The frames at the called function's depth or deeper were unwound by
+    // an error, except that a tail call keeps the frame of the function it
+    // replaces, which is closed with it by the return event.
+    QVector<Frame>& stack = stackOf(state);
+    const int depth = stackDepth(state, stack.isEmpty() ? 0 : stack.last().depth + (tailCall ? 0 : 1));
+    popFrames(stack, tailCall ? depth + 1 : depth, now);
+
+    FunctionStats* stats = lookupFunction(state, ar);
+    stats->calls++;
+
+    Frame frame;
+    frame.stats      = stats;
+    frame.startNsecs = now;
+    frame.childNsecs = 0;
+    frame.depth      = depth;
+    stack.append(frame);
+}
+
+/**
+ * @brief Handle a return event.
+ *
+ * @param state The Lua thread running the returning function.
+ */
+void FunctionProfiler::leaveFunction(lua_State* state)
+{
+    const qint64 now = m_clock.nsecsElapsed();
+
+    QVector<Frame>& stack = stackOf(state);
+    popFrames(stack, stackDepth(state, stack.isEmpty() ? 0 : stack.last().depth), now);
+
+    // The stack of a finished coroutine is not needed anymore.
+    if (stack.isEmpty())
+    {
+        m_stacks.remove(state);
+        m_currentState = nullptr;
+        m_currentStack = nullptr;
+    }
+}
+
+/**
+ * @brief Close all open frames.
+ *
+ * This should be called when the script finishes, to account for frames
+ * that were unwound without a return event.
+ */
+void FunctionProfiler::finish()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+
+    for (QVector<Frame>& stack : m_stacks)
+    {
+        popFrames(stack, 0, now);
+    }
+    m_stacks.clear();
+    m_currentState = nullptr;
+    m_currentStack = nullptr;
+}
+
+bool FunctionProfiler::isEmpty() const
+{
+    return m_functions.isEmpty();
+}
+
+/**
+ * @brief Produce a report of the collected statistics.
+ *
+ * The report is in CSV format (so it can be sorted by any column in a
+ * spreadsheet) and is sorted by decreasing instruction count.
+ */
+QString FunctionProfiler::report() const
+{
+    QList<const FunctionStats*> functions;
+    for (const FunctionStats* stats : m_functions)
+    {
+        functions.append(stats);
+    }
+
+    std::sort(functions.begin(), functions.end(),
+              [](const FunctionStats* a, const FunctionStats* b)
+              {
+                  if (a->instructions != b->instructions)
+                  {
+                      return a->instructions > b->instructions;
+                  }
+                  return a->totalNsecs > b->totalNsecs;
+              });
+
+    QString report;
+    QTextStream stream(&report);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(3);
+
+    stream << "function,source,line,calls,instructions,self_ms,total_ms\n";
+    for (const FunctionStats* stats : functions)
+    {
+        stream << csvField(stats->name) << ','
+               << csvField(stats->source) << ','
+               << stats->line << ','
+               << stats->calls << ','
+               << stats->instructions << ','
+               << (static_cast<double>(stats->selfNsecs) / 1e6) << ','
+               << (static_cast<double>(stats->totalNsecs) / 1e6) << '\n';
+    }
+    stream.flush();
+
+    return report;
+}
+
+/**
+ * @brief Find (or create) the statistics for the function being called.
+ */
+FunctionProfiler::FunctionStats* FunctionProfiler::lookupFunction(lua_State* state, lua_Debug* ar)
+{
+    // "f" pushes the function onto the stack, which identifies C functions.
+    (void)lua_getinfo(state, "Sf", ar);
+
+    FunctionKey key;
+    if (0 == strcmp(ar->what, "C"))
+    {
+        key = FunctionKey(lua_topointer(state, -1), -1);
+    }
+    else
+    {
+        key = FunctionKey(ar->source, ar->linedefined);
+    }
+    lua_pop(state, 1);
+
+    FunctionStats*& stats = m_functions[key];
+    if (nullptr == stats)
+    {
+        (void)lua_getinfo(state, "n", ar);
+
+        stats = new FunctionStats;
+        stats->line         = ar->linedefined;
+        stats->source       = ar->short_src;
+        stats->calls        = 0;
+        stats->instructions = 0;
+        stats->selfNsecs    = 0;
+        stats->totalNsecs   = 0;
+
+        if (0 == strcmp(ar->what, "main"))
+        {
+            stats->name = "main chunk";
+        }
+        else if (nullptr != ar->name)
+        {
+            stats->name = ar->name;
+        }
+        else
+        {
+            stats->name = "?";
+        }
+    }
+
+    return stats;
+}
+
+/**
+ * @brief Get the stack of open frames of a Lua thread.
+ *
+ * The stack is remembered, so that countInstruction() only looks it up
+ * when the thread changes.
+ */
+QVector<FunctionProfiler::Frame>& FunctionProfiler::stackOf(lua_State* state)
+{
+    if (state != m_currentState)
+    {
+        m_currentState = state;
+        m_currentStack = &m_stacks[state];
+    }
+
+    return *m_currentStack;
+}
+
+/**
+ * @brief Pop the frames at @p depth or deeper, accumulating their times.
+ */
+void FunctionProfiler::popFrames(QVector<Frame>& stack, int depth, qint64 now)
+{
+    while (!stack.isEmpty() && (stack.last().depth >= depth))
+    {
+        const Frame frame = stack.takeLast();
+        const qint64 total = now - frame.startNsecs;
+
+        frame.stats->totalNsecs += total;
+        frame.stats->selfNsecs  += total - frame.childNsecs;
+
+        if (!stack.isEmpty())
+        {
+            stack.last().childNsecs += total;
+        }
+    }
+}
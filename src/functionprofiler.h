@@ -0,0 +1,139 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef FUNCTIONPROFILER_H
+#define FUNCTIONPROFILER_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPair>
+#include <QString>
+#include <QVector>
+#include "lua.hpp"
+
+/**
+ * @brief Deterministic per-function profiler for Lua scripts.
+ *
+ * Complementing SamplingProfiler, this profiler uses the Lua call, return
+ * and count hooks to count exactly, per function:
+ *    - the number of calls,
+ *    - the number of VM instructions executed by the function itself,
+ *    - the wall time spent in the function itself (self time) and in the
+ *      function including its callees (total time).
+ *
+ * Functions are identified by their source and the line on which they are
+ * defined. C functions (including the native canvas functions such as
+ * @c _ui.canvas.drawline) are also profiled, so the time spent rasterizing
+ * is visible as the self time of the corresponding C function.
+ *
+ * The profiler is switched on and off at runtime via setEnabled(), which
+ * may be called from any thread. The ScriptRunner only installs the call,
+ * return and per-instruction hooks while the profiler is enabled, so it has
+ * no cost when it is disabled.
+ *
+ * All other methods must only be called by the thread running the Lua VM.
+ *
+ * Each Lua thread (such as the coroutines running the tasks of a
+ * TaskScheduler) has its own stack of frames, and each frame records the
+ * depth of its function in the thread's call stack.
+ *
+ * @note Functions which are unwound by an error (e.g. caught by @c pcall)
+ * do not produce return events. Their frames are closed by the next call
+ * or return event at their depth or above it, so their time runs until
+ * that event rather than until the error. Frames still open at the end of
+ * the profile are closed by finish(). The time a coroutine spends running
+ * is also counted in the self time of the function resuming it, and the
+ * time it spends suspended is counted in its open frames.
+ */
+class FunctionProfiler
+{
+public:
+    FunctionProfiler();
+    ~FunctionProfiler();
+
+    void setEnabled(bool on);
+
+    inline bool enabled() const
+    {
+        return 0 != m_enabled.loadAcquire();
+    }
+
+    void reset();
+
+    void enterFunction(lua_State* state, lua_Debug* ar, bool tailCall);
+    void leaveFunction(lua_State* state);
+
+    inline void countInstruction(lua_State* state)
+    {
+        QVector<Frame>& stack = (state == m_currentState) ? *m_currentStack : stackOf(state);
+        if (!stack.isEmpty())
+        {
+            stack.last().stats->instructions++;
+        }
+    }
+
+    void finish();
+
+    bool isEmpty() const;
+    QString report() const;
+
+private:
+    Q_DISABLE_COPY(FunctionProfiler)
+
+    struct FunctionStats
+    {
+        QString name;
+        QString source;
+        int line;
+        quint64 calls;
+        quint64 instructions;
+        qint64 selfNsecs;
+        qint64 totalNsecs;
+    };
+
+    struct Frame
+    {
+        FunctionStats* stats;
+        qint64 startNsecs;
+        qint64 childNsecs;
+        int depth;
+    };
+
+    // Lua functions are keyed by (source, linedefined) and C functions
+    // by (function pointer, -1).
+    typedef QPair<const void*, int> FunctionKey;
+
+    FunctionStats* lookupFunction(lua_State* state, lua_Debug* ar);
+    QVector<Frame>& stackOf(lua_State* state);
+    void popFrames(QVector<Frame>& stack, int depth, qint64 now);
+
+    QAtomicInt m_enabled;
+
+    QElapsedTimer m_clock;
+    QHash<FunctionKey, FunctionStats*> m_functions;
+    QHash<lua_State*, QVector<Frame> > m_stacks;
+
+    // The stack of the thread of the last event, so that countInstruction()
+    // doesn't look it up for every instruction.
+    lua_State* m_currentState;
+    QVector<Frame>* m_currentStack;
+};
+
+#endif // FUNCTIONPROFILER_H
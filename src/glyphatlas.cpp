@@ -0,0 +1,237 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "glyphatlas.h"
+#include "rasterizer.h"
+#include <QFontMetricsF>
+#include <QPainter>
+#include <QString>
+#include <QTransform>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+const qreal GlyphAtlas::ANGLE_STEP = 1.0;
+
+/// Number of rotations of a glyph (one turn in steps of ANGLE_STEP).
+static const int ANGLE_STEPS = 360;
+
+GlyphAtlas::GlyphAtlas() :
+    m_mutex(),
+    m_font(),
+    m_pages(),
+    m_glyphs(),
+    m_shelfX(0),
+    m_shelfY(0),
+    m_shelfHeight(0)
+{
+
+}
+
+/**
+ * @brief Clamp a pixel size to the sizes of the glyphs (1 to MAX_PIXEL_SIZE).
+ */
+int GlyphAtlas::clampedPixelSize(int pixelSize)
+{
+    return std::max(1, std::min(MAX_PIXEL_SIZE, pixelSize));
+}
+
+/**
+ * @brief Round a rotation to the rotations of the glyphs.
+ *
+ * @param angle The rotation (degrees).
+ * @return The rotation, rounded to ANGLE_STEP, from 0 to 360.
+ */
+qreal GlyphAtlas::roundedAngle(qreal angle)
+{
+    const int angleStep = Rasterizer::angleStep(angle, ANGLE_STEPS);
+
+    return angleStep * ANGLE_STEP;
+}
+
+/**
+ * @brief Get a glyph, rasterizing it if it is not cached yet.
+ *
+ * @param codePoint The character's Unicode code point.
+ * @param pixelSize The font's pixel size (see clampedPixelSize()).
+ * @param angle The clockwise rotation (degrees) of the glyph (see roundedAngle()).
+ * @param antialiased Set to @c true to draw the glyph with antialiasing.
+ */
+GlyphAtlas::Glyph GlyphAtlas::glyph(uint codePoint, int pixelSize, qreal angle, bool antialiased)
+{
+    pixelSize = clampedPixelSize(pixelSize);
+    angle     = roundedAngle(angle);
+
+    const quint64 key = (static_cast<quint64>(codePoint) << 32)
+                        | (static_cast<quint64>(std::round(angle / ANGLE_STEP)) << 16)
+                        | (static_cast<quint64>(pixelSize) << 1)
+                        | (antialiased ? 1u : 0u);
+
+    QMutexLocker lock(&m_mutex);
+
+    QHash<quint64, Glyph>::const_iterator it = m_glyphs.constFind(key);
+    if (it != m_glyphs.constEnd())
+    {
+        return it.value();
+    }
+
+    const Glyph result = rasterize(codePoint, pixelSize, angle, antialiased);
+    m_glyphs.insert(key, result);
+
+    return result;
+}
+
+/**
+ * @brief Get the distance between the baselines of two lines of text.
+ */
+qreal GlyphAtlas::lineSpacing(int pixelSize) const
+{
+    QMutexLocker lock(&m_mutex);
+
+    QFont font(m_font);
+    font.setPixelSize(clampedPixelSize(pixelSize));
+
+    return QFontMetricsF(font).lineSpacing();
+}
+
+/**
+ * @brief Get the memory used by the pages, in bytes.
+ */
+quint64 GlyphAtlas::bytes() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return static_cast<quint64>(m_pages.size()) * PAGE_SIZE * PAGE_SIZE;
+}
+
+/**
+ * @brief Draw a glyph and copy it into a page.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+GlyphAtlas::Glyph GlyphAtlas::rasterize(uint codePoint, int pixelSize, qreal angle, bool antialiased)
+{
+    QFont font(m_font);
+    font.setPixelSize(pixelSize);
+    if (!antialiased)
+    {
+        font.setStyleStrategy(QFont::NoAntialias);
+    }
+
+    const QString text = QString::fromUcs4(&codePoint, 1);
+    const QFontMetricsF metrics(font);
+
+    Glyph result;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
+    result.advance = metrics.horizontalAdvance(text);
+#else
+    result.advance = metrics.width(text);
+#endif
+
+    QTransform rotation;
+    rotation.rotate(angle);
+
+    // The mask extends a pixel past the glyph's bounds, which are not
+    // always exact.
+    const QRectF bounds = metrics.boundingRect(text);
+    const QRect  pixels = rotation.mapRect(bounds).toAlignedRect().adjusted(-1, -1, 1, 1);
+
+    if (bounds.isEmpty() || (pixels.width() > PAGE_SIZE) || (pixels.height() > PAGE_SIZE))
+    {
+        return result;
+    }
+
+    QImage mask(pixels.size(), QImage::Format_Alpha8);
+    mask.fill(0);
+    {
+        QPainter painter(&mask);
+        painter.setRenderHint(QPainter::TextAntialiasing, antialiased);
+        painter.setFont(font);
+        painter.setPen(Qt::black);
+        painter.translate(-pixels.topLeft());
+        painter.rotate(angle);
+        painter.drawText(QPointF(0.0, 0.0), text);
+    }
+
+    result.rect   = allocate(pixels.size());
+    result.page   = m_pages.last();
+    result.offset = pixels.topLeft();
+
+    QImage& page = *result.page;
+    for (int y = 0; y < mask.height(); y++)
+    {
+        std::memcpy(page.scanLine(result.rect.top() + y) + result.rect.left(),
+                    mask.constScanLine(y),
+                    static_cast<size_t>(mask.width()));
+    }
+
+    return result;
+}
+
+/**
+ * @brief Find room for a glyph's mask in the last page.
+ *
+ * A page is added when the last one is full. When all the pages are full
+ * the atlas is started over: the glyphs already returned keep their pages
+ * until they are released.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @return The mask's pixels in the last page.
+ */
+QRect GlyphAtlas::allocate(const QSize& size)
+{
+    bool fits = !m_pages.isEmpty();
+
+    if (fits && ((m_shelfX + size.width()) > PAGE_SIZE))
+    {
+        m_shelfX      = 0;
+        m_shelfY     += m_shelfHeight;
+        m_shelfHeight = 0;
+    }
+
+    if (fits && ((m_shelfY + size.height()) > PAGE_SIZE))
+    {
+        fits = false;
+    }
+
+    if (!fits)
+    {
+        if (m_pages.size() >= MAX_PAGES)
+        {
+            m_pages.clear();
+            m_glyphs.clear();
+        }
+
+        QSharedPointer<QImage> page(new QImage(PAGE_SIZE, PAGE_SIZE, QImage::Format_Alpha8));
+        page->fill(0);
+        m_pages.append(page);
+
+        m_shelfX      = 0;
+        m_shelfY      = 0;
+        m_shelfHeight = 0;
+    }
+
+    const QRect rect(QPoint(m_shelfX, m_shelfY), size);
+
+    m_shelfX      += size.width();
+    m_shelfHeight  = std::max(m_shelfHeight, size.height());
+
+    return rect;
+}
@@ -0,0 +1,101 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef GLYPHATLAS_H
+#define GLYPHATLAS_H
+
+#include <QFont>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QPoint>
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+/**
+ * @brief Caches the glyphs of the text drawn on the canvas.
+ *
+ * Each glyph is rasterized once per pixel size, rotation and antialiasing
+ * with QPainter, into an 8-bit coverage mask. The masks are packed into
+ * pages of PAGE_SIZE x PAGE_SIZE pixels, row by row, so that drawing text
+ * only blends the rows of each glyph's mask over the canvas with the text
+ * color (see RasterTarget::blendCoverageSpan()).
+ *
+ * Glyphs are drawn with the application's default font. Rotations are
+ * rounded to multiples of ANGLE_STEP degrees. When all MAX_PAGES pages are
+ * full, the atlas is started over and the glyphs are rasterized again as
+ * they are needed.
+ *
+ * glyph() can be called concurrently (e.g. by the TileBinner's workers).
+ * The glyphs returned keep their page alive, so they can be read after the
+ * atlas has been started over.
+ */
+class GlyphAtlas
+{
+public:
+    /// Width and height of the pages, in pixels.
+    static const int PAGE_SIZE = 512;
+
+    /// Maximum number of pages.
+    static const int MAX_PAGES = 16;
+
+    /// Largest pixel size of the glyphs.
+    static const int MAX_PIXEL_SIZE = 256;
+
+    /// Rotations are rounded to a multiple of this angle (degrees).
+    static const qreal ANGLE_STEP;
+
+    /// A rasterized glyph.
+    struct Glyph
+    {
+        QSharedPointer<QImage> page;    ///< The page holding the glyph's mask (Format_Alpha8).
+        QRect                  rect;    ///< The glyph's mask in the page; empty for blank glyphs.
+        QPoint                 offset;  ///< Position of the mask's top-left pixel relative to the pen.
+        qreal                  advance; ///< Distance the pen moves along the baseline.
+    };
+
+    GlyphAtlas();
+
+    static int clampedPixelSize(int pixelSize);
+    static qreal roundedAngle(qreal angle);
+
+    Glyph glyph(uint codePoint, int pixelSize, qreal angle, bool antialiased);
+
+    qreal lineSpacing(int pixelSize) const;
+
+    quint64 bytes() const;
+
+private:
+    Q_DISABLE_COPY(GlyphAtlas)
+
+    Glyph rasterize(uint codePoint, int pixelSize, qreal angle, bool antialiased);
+
+    QRect allocate(const QSize& size);
+
+    mutable QMutex                   m_mutex;       ///< Guards the pages and glyphs.
+    QFont                            m_font;
+    QVector<QSharedPointer<QImage> > m_pages;
+    QHash<quint64, Glyph>            m_glyphs;      ///< By code point, size, rotation and antialiasing.
+    int                              m_shelfX;      ///< Where the next glyph goes in the last page.
+    int                              m_shelfY;      ///< Top of the row of glyphs being filled.
+    int                              m_shelfHeight; ///< Height of the row of glyphs being filled.
+};
+
+#endif // GLYPHATLAS_H
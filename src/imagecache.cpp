@@ -0,0 +1,324 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "imagecache.h"
+#include "rasterizer.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QPainter>
+#include <QTransform>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+const qreal ImageCache::ANGLE_STEP = 0.5;
+const qreal ImageCache::SCALE_STEP = 1.0 / 64.0;
+const qreal ImageCache::MAX_SCALE  = 8.0;
+
+/// Number of rotations of an image (one turn in steps of ANGLE_STEP).
+static const int ANGLE_STEPS = 720;
+
+static quint64 imageBytes(const QImage& image)
+{
+    return static_cast<quint64>(image.bytesPerLine()) * image.height();
+}
+
+ImageCache::ImageCache() :
+    m_mutex(),
+    m_images(),
+    m_paths(),
+    m_imageBytes(0),
+    m_variantBytes(0)
+{
+
+}
+
+ImageCache::~ImageCache()
+{
+    qDeleteAll(m_images);
+}
+
+/**
+ * @brief Load an image file.
+ *
+ * A file which was already loaded, and has not changed since, is not
+ * decoded again.
+ *
+ * @param path The path of the file.
+ * @param error Receives the reason why the image could not be loaded.
+ * @return The image's identifier, or -1 if the image could not be loaded.
+ */
+int ImageCache::load(const QString& path, QString& error)
+{
+    const QFileInfo info(path);
+
+    if (!info.isFile())
+    {
+        error = QString("no such file");
+        return -1;
+    }
+
+    const QString canonicalPath = info.canonicalFilePath();
+
+    {
+        QMutexLocker lock(&m_mutex);
+
+        const int loaded = m_paths.value(canonicalPath, -1);
+
+        if ((loaded >= 0) &&
+            (m_images.at(loaded)->modified == info.lastModified()) &&
+            (m_images.at(loaded)->size == info.size()))
+        {
+            return loaded;
+        }
+    }
+
+    // Decoding can take a while, so the images are not locked meanwhile.
+    const QImage decoded = decode(canonicalPath, error);
+
+    if (decoded.isNull())
+    {
+        return -1;
+    }
+
+    Image* image = new Image();
+    image->path     = canonicalPath;
+    image->modified = info.lastModified();
+    image->size     = info.size();
+    image->levels.append(decoded);
+
+    QMutexLocker lock(&m_mutex);
+
+    m_imageBytes += imageBytes(decoded);
+    m_paths.insert(canonicalPath, m_images.size());
+    m_images.append(image);
+
+    return m_images.size() - 1;
+}
+
+/**
+ * @brief Check whether an image identifier was returned by load().
+ */
+bool ImageCache::contains(int image) const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return (image >= 0) && (image < m_images.size());
+}
+
+/**
+ * @brief Get a variant of an image at a scale and rotation.
+ *
+ * The variant is transformed if it is not cached yet.
+ *
+ * @param image The image's identifier.
+ * @param scale The scale, clamped to MAX_SCALE and MAX_VARIANT_PIXELS.
+ * @param angle The clockwise rotation (degrees) about the image's center.
+ * @param smooth Set to @c true to filter the image's pixels when it is
+ *     scaled or rotated.
+ * @return The variant, whose image is null if the image doesn't exist.
+ */
+ImageCache::Bitmap ImageCache::bitmap(int image, qreal scale, qreal angle, bool smooth)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if ((image < 0) || (image >= m_images.size()))
+    {
+        return Bitmap();
+    }
+
+    Image& cached = *m_images.at(image);
+    const QImage& original = cached.levels.first();
+
+    // Rotations can double the area of the variant.
+    const qreal largest = std::sqrt(static_cast<qreal>(MAX_VARIANT_PIXELS)
+                                    / (2.0 * original.width() * original.height()));
+
+    const qreal clampedScale = std::max(SCALE_STEP, std::min(std::min(MAX_SCALE, largest), scale));
+    const int   scaleStep    = std::max(1, static_cast<int>(std::round(clampedScale / SCALE_STEP)));
+
+    const int angleStep = Rasterizer::angleStep(angle, ANGLE_STEPS);
+
+    const quint32 key = (static_cast<quint32>(angleStep) << 20)
+                        | (static_cast<quint32>(scaleStep) << 1)
+                        | (smooth ? 1u : 0u);
+
+    QHash<quint32, Bitmap>::const_iterator it = cached.variants.constFind(key);
+    if (it != cached.variants.constEnd())
+    {
+        return it.value();
+    }
+
+    const Bitmap result = transform(cached, scaleStep * SCALE_STEP, angleStep * ANGLE_STEP, smooth);
+    const quint64 bytes = imageBytes(result.image);
+
+    if ((m_variantBytes + bytes) > MAX_VARIANT_BYTES)
+    {
+        releaseVariants();
+    }
+
+    cached.variants.insert(key, result);
+    m_variantBytes += bytes;
+
+    return result;
+}
+
+/**
+ * @brief Get the memory used by the images and their variants, in bytes.
+ */
+quint64 ImageCache::bytes() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return m_imageBytes + m_variantBytes;
+}
+
+/**
+ * @brief Decode an image file into premultiplied ARGB32.
+ *
+ * @param path The path of the file.
+ * @param error Receives the reason why the file could not be decoded.
+ * @return The image, or a null image if the file could not be decoded.
+ */
+QImage ImageCache::decode(const QString& path, QString& error)
+{
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        error = file.errorString();
+        return QImage();
+    }
+
+    QImage image;
+
+    const qint64 size = file.size();
+    uchar* data = ((size > 0) && (size <= INT_MAX)) ? file.map(0, size) : nullptr;
+
+    if (nullptr != data)
+    {
+        image.loadFromData(data, static_cast<int>(size));
+        file.unmap(data);
+    }
+    else
+    {
+        // Files which cannot be mapped are read instead.
+        image.load(&file, nullptr);
+    }
+
+    if (image.isNull())
+    {
+        error = QString("not a supported image file");
+        return QImage();
+    }
+
+    return image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+/**
+ * @brief Get the smallest level of an image which is at least as large
+ *     as the image at a scale.
+ *
+ * The levels are made as they are needed.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @return The index of the level in Image::levels.
+ */
+int ImageCache::level(Image& image, qreal scale)
+{
+    int level = 0;
+
+    while (scale <= 0.5)
+    {
+        if ((level + 1) >= image.levels.size())
+        {
+            const QImage& last = image.levels.last();
+
+            if ((last.width() <= 1) && (last.height() <= 1))
+            {
+                break;
+            }
+
+            image.levels.append(last.scaled(std::max(1, last.width()  / 2),
+                                            std::max(1, last.height() / 2),
+                                            Qt::IgnoreAspectRatio,
+                                            Qt::SmoothTransformation));
+            m_imageBytes += imageBytes(image.levels.last());
+        }
+
+        level++;
+        scale *= 2.0;
+    }
+
+    return level;
+}
+
+/**
+ * @brief Scale and rotate an image into a new variant.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+ImageCache::Bitmap ImageCache::transform(Image& image, qreal scale, qreal angle, bool smooth)
+{
+    const int sourceLevel = level(image, scale);
+
+    const QImage& original = image.levels.first();
+    const QImage& source   = image.levels.at(sourceLevel);
+
+    // The level is scaled to the size of the original image times the
+    // scale, and rotated about its center pixel. At a scale of 1 and no
+    // rotation the variant is therefore the image itself.
+    QTransform transform;
+    transform.rotate(angle);
+    transform.scale((scale * original.width())  / source.width(),
+                    (scale * original.height()) / source.height());
+    transform.translate(-(source.width() / 2), -(source.height() / 2));
+
+    const QRect pixels = transform.mapRect(QRectF(source.rect())).toAlignedRect();
+
+    Bitmap result;
+    result.image = QImage(pixels.size(), QImage::Format_ARGB32_Premultiplied);
+    result.image.fill(Qt::transparent);
+    {
+        QPainter painter(&result.image);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform, smooth);
+        painter.setTransform(transform * QTransform::fromTranslate(-pixels.left(), -pixels.top()));
+        painter.drawImage(0, 0, source);
+    }
+
+    result.origin = -pixels.topLeft();
+
+    return result;
+}
+
+/**
+ * @brief Release the variants of all the images.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void ImageCache::releaseVariants()
+{
+    for (Image* image : m_images)
+    {
+        image->variants.clear();
+    }
+
+    m_variantBytes = 0;
+}
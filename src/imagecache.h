@@ -0,0 +1,114 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QPoint>
+#include <QString>
+#include <QVector>
+
+/**
+ * @brief The images loaded by scripts, and their scaled and rotated variants.
+ *
+ * Each image file is decoded once, into premultiplied ARGB32, and is
+ * shared by all the loads of the same file (until the file changes). The
+ * file is memory-mapped and decoded straight from the mapping, so it is
+ * not read into a buffer first; for uncompressed formats, decoding is then
+ * a copy of the mapped pixels.
+ *
+ * Drawing an image at a scale and rotation blends a variant of the image
+ * which is transformed once and cached, with scales rounded to multiples
+ * of SCALE_STEP and rotations to multiples of ANGLE_STEP. Variants are
+ * transformed from pre-scaled levels of the image, each half the size of
+ * the previous one, so that shrinking an image averages all of its pixels.
+ * The variants are released when they use more than MAX_VARIANT_BYTES,
+ * and transformed again as they are needed.
+ *
+ * Images are identified by a number, and are never deleted. bitmap() can
+ * be called concurrently (e.g. by the TileBinner's workers).
+ */
+class ImageCache
+{
+public:
+    /// Rotations are rounded to a multiple of this angle (degrees).
+    static const qreal ANGLE_STEP;
+
+    /// Scales are rounded to a multiple of this scale.
+    static const qreal SCALE_STEP;
+
+    /// Largest scale of the variants; images drawn larger are clamped to it.
+    static const qreal MAX_SCALE;
+
+    /// Images are scaled down so that their variants have at most this many pixels.
+    static const int MAX_VARIANT_PIXELS = 4096 * 4096;
+
+    /// Variants are released when they use more than this (bytes).
+    static const quint64 MAX_VARIANT_BYTES = 128 * 1024 * 1024;
+
+    /// A variant of an image.
+    struct Bitmap
+    {
+        QImage image;  ///< Premultiplied ARGB32, null if there is no such image.
+        QPoint origin; ///< The pixel of the variant where the image's center lies.
+    };
+
+    ImageCache();
+    ~ImageCache();
+
+    int load(const QString& path, QString& error);
+
+    bool contains(int image) const;
+
+    Bitmap bitmap(int image, qreal scale, qreal angle, bool smooth);
+
+    quint64 bytes() const;
+
+private:
+    Q_DISABLE_COPY(ImageCache)
+
+    struct Image
+    {
+        QString                path;     ///< The canonical path of the file.
+        QDateTime              modified; ///< When the file was last modified, when it was decoded.
+        qint64                 size;     ///< The size of the file, when it was decoded.
+        QVector<QImage>        levels;   ///< The decoded image, then each half the size of the previous one.
+        QHash<quint32, Bitmap> variants; ///< By rotation, scale and smoothing.
+    };
+
+    static QImage decode(const QString& path, QString& error);
+
+    int level(Image& image, qreal scale);
+
+    Bitmap transform(Image& image, qreal scale, qreal angle, bool smooth);
+
+    void releaseVariants();
+
+    mutable QMutex      m_mutex;  ///< Guards the images and their variants.
+    QVector<Image*>     m_images;
+    QHash<QString, int> m_paths;  ///< The latest image loaded from each canonical path.
+    quint64             m_imageBytes;
+    quint64             m_variantBytes;
+};
+
+#endif // IMAGECACHE_H
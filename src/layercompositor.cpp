@@ -0,0 +1,237 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "layercompositor.h"
+#include "compositing.h"
+
+LayerCompositor::LayerCompositor() :
+    m_size(),
+    m_tiles(),
+    m_keys(),
+    m_tileCount(0)
+{
+
+}
+
+/**
+ * @brief Get a tile of the composited layers.
+ *
+ * The tile is composited if any of the layers' tiles has changed since
+ * it was last composited.
+ *
+ * @param column The tile's column, in the layers' grid.
+ * @param row The tile's row, in the layers' grid.
+ * @param layers The layers, from the bottom one up.
+ * @return The tile, or nullptr when none of the layers is drawn on there.
+ *     It is valid until the next call.
+ */
+const QImage* LayerCompositor::tile(int column, int row, const QVector<Layer>& layers)
+{
+    if (layers.isEmpty())
+    {
+        return nullptr;
+    }
+
+    resize(*layers.first().tiles);
+
+    const QImage* top = nullptr;
+    bool opaque = false;
+
+    m_keys.resize(0);
+    for (int i = 0; i < layers.size(); i++)
+    {
+        const Layer& layer = layers.at(i);
+
+        if ((layer.opacity > 0) && layer.tiles->isOccupied(column, row))
+        {
+            top    = &layer.tiles->tile(column, row).image;
+            opaque = (0xff == layer.opacity);
+
+            m_keys.append(top->cacheKey());
+            m_keys.append(layer.opacity);
+        }
+    }
+
+    CachedTile& cached = m_tiles[(row * layers.first().tiles->columns()) + column];
+
+    if ((m_keys.size() <= 2) && ((nullptr == top) || opaque))
+    {
+        // Nothing to composite.
+        if (!cached.image.isNull())
+        {
+            cached.image = QImage();
+            cached.keys.clear();
+            m_tileCount--;
+        }
+
+        return top;
+    }
+
+    if (cached.image.isNull())
+    {
+        cached.image = QImage(TileStore::TILE_SIZE, TileStore::TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        m_tileCount++;
+    }
+    else if (cached.keys == m_keys)
+    {
+        return &cached.image;
+    }
+
+    cached.image.fill(Qt::transparent);
+
+    for (int i = 0; i < layers.size(); i++)
+    {
+        const Layer& layer = layers.at(i);
+
+        if ((layer.opacity > 0) && layer.tiles->isOccupied(column, row))
+        {
+            const QImage& image = layer.tiles->tile(column, row).image;
+
+            for (int y = 0; y < TileStore::TILE_SIZE; y++)
+            {
+                Compositing::blendImageSpan(reinterpret_cast<quint32*>(cached.image.scanLine(y)),
+                                            reinterpret_cast<const quint32*>(image.constScanLine(y)),
+                                            TileStore::TILE_SIZE,
+                                            layer.opacity);
+            }
+        }
+    }
+
+    cached.keys = m_keys;
+
+    return &cached.image;
+}
+
+/**
+ * @brief Draw the composited layers overlapping part of the canvas with a painter.
+ *
+ * Tiles which none of the layers were drawn on are skipped.
+ *
+ * @param painter The painter, using canvas coordinates.
+ * @param region The part of the canvas to draw.
+ * @param layers The layers, from the bottom one up.
+ */
+void LayerCompositor::draw(QPainter* painter, const QRect& region, const QVector<Layer>& layers)
+{
+    if (layers.isEmpty())
+    {
+        return;
+    }
+
+    const TileStore& tiles = *layers.first().tiles;
+    const QRect area = region.intersected(tiles.rect());
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    for (int row = tiles.rowAt(area.top()); row <= tiles.rowAt(area.bottom()); row++)
+    {
+        for (int column = tiles.columnAt(area.left()); column <= tiles.columnAt(area.right()); column++)
+        {
+            const QImage* image = tile(column, row, layers);
+
+            if (nullptr != image)
+            {
+                const QRect tileRect = tiles.tileRect(column, row);
+                const QRect target   = area.intersected(tileRect);
+
+                painter->drawImage(target, *image, target.translated(-tileRect.topLeft()));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Composite all the layers into a single one.
+ *
+ * The result shares its pixels with the layers and the cache where it can.
+ *
+ * @param size The size of the layers.
+ * @param layers The layers, from the bottom one up.
+ * @return The composited tiles, with the bounds of the pixels drawn on
+ *     in any of the layers.
+ */
+TileStore LayerCompositor::flatten(const QSize& size, const QVector<Layer>& layers)
+{
+    TileStore result(size);
+
+    for (int row = 0; row < result.rows(); row++)
+    {
+        for (int column = 0; column < result.columns(); column++)
+        {
+            const QImage* image = tile(column, row, layers);
+
+            if (nullptr == image)
+            {
+                continue;
+            }
+
+            TileStore::Tile& resultTile = result.writableTile(column, row);
+            resultTile.image = *image;
+
+            for (int i = 0; i < layers.size(); i++)
+            {
+                const Layer& layer = layers.at(i);
+
+                if ((layer.opacity > 0) && layer.tiles->isOccupied(column, row))
+                {
+                    resultTile.used |= layer.tiles->tile(column, row).used;
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Release the composited tiles.
+ */
+void LayerCompositor::clear()
+{
+    m_size = QSize();
+    m_tiles.clear();
+    m_tileCount = 0;
+}
+
+/**
+ * @brief Get the amount of memory used by the composited tiles.
+ */
+quint64 LayerCompositor::bytes() const
+{
+    return static_cast<quint64>(m_tileCount)
+           * TileStore::TILE_SIZE * TileStore::TILE_SIZE * sizeof(quint32);
+}
+
+/**
+ * @brief Start over the cache if the layers' size has changed.
+ *
+ * @param tiles Any of the layers.
+ */
+void LayerCompositor::resize(const TileStore& tiles)
+{
+    if (tiles.size() != m_size)
+    {
+        m_size      = tiles.size();
+        m_tiles     = QVector<CachedTile>(tiles.columns() * tiles.rows());
+        m_tileCount = 0;
+    }
+}
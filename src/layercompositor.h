@@ -0,0 +1,83 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef LAYERCOMPOSITOR_H
+#define LAYERCOMPOSITOR_H
+
+#include "tilestore.h"
+#include <QImage>
+#include <QPainter>
+#include <QRect>
+#include <QVector>
+
+/**
+ * @brief Composites the layers of the canvas, and caches the result.
+ *
+ * The layers are composited a tile at a time, from the bottom layer up,
+ * each with its own opacity. The composited tiles are cached, along with
+ * the QImage::cacheKey() of each layer's tile and the layers' opacities
+ * when they were composited. Drawing on a tile changes its key, so only
+ * the tiles drawn on since they were last composited are composited
+ * again; the tiles of the layers which did not change are not visited.
+ *
+ * A tile covered by a single opaque layer is not composited at all: the
+ * layer's own tile is used as it is. Drawing a single layer therefore
+ * costs the same as drawing its tiles, and a static background only costs
+ * compositing where the layers over it are drawn on.
+ *
+ * All the layers must have the same size. This class is not thread-safe.
+ */
+class LayerCompositor
+{
+public:
+    /// A layer to composite.
+    struct Layer
+    {
+        const TileStore* tiles;
+        int              opacity; ///< 0 (transparent) to 255 (opaque).
+    };
+
+    LayerCompositor();
+
+    const QImage* tile(int column, int row, const QVector<Layer>& layers);
+
+    void draw(QPainter* painter, const QRect& region, const QVector<Layer>& layers);
+
+    TileStore flatten(const QSize& size, const QVector<Layer>& layers);
+
+    void clear();
+
+    quint64 bytes() const;
+
+private:
+    struct CachedTile
+    {
+        QImage          image; ///< Null until the tile is composited.
+        QVector<qint64> keys;  ///< The key and opacity of each layer's tile, when composited.
+    };
+
+    void resize(const TileStore& tiles);
+
+    QSize               m_size;  ///< Size of the layers composited in m_tiles.
+    QVector<CachedTile> m_tiles; ///< The composited tiles, in the layers' grid.
+    QVector<qint64>     m_keys;  ///< The keys of the tile being looked up.
+    int                 m_tileCount; ///< Number of composited tiles.
+};
+
+#endif // LAYERCOMPOSITOR_H
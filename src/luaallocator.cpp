@@ -0,0 +1,145 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "luaallocator.h"
+#include "perfcounters.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Prefix of every block allocated for Lua.
+// The union keeps the memory returned to Lua aligned as the Lua VM requires
+// (see L_Umaxalign in llimits.h), which takes 8 bytes on 64 bit platforms
+// rather than the 16 bytes of std::max_align_t.
+union BlockHeader
+{
+    lua_Number  number;
+    double      real;
+    void*       pointer;
+    lua_Integer integer;
+    long        longInteger;
+    int         category;
+};
+
+/**
+ * @brief Map the type tag given by Lua for new blocks to a heap category.
+ */
+static int categoryForTag(size_t tag)
+{
+    switch (tag)
+    {
+    case LUA_TSTRING:   return PerfCounters::LuaHeapString;
+    case LUA_TTABLE:    return PerfCounters::LuaHeapTable;
+    case LUA_TFUNCTION: return PerfCounters::LuaHeapFunction;
+    case LUA_TUSERDATA: return PerfCounters::LuaHeapUserdata;
+    case LUA_TTHREAD:   return PerfCounters::LuaHeapThread;
+    case LUA_NUMTAGS:   return PerfCounters::LuaHeapPrototype; // LUA_TPROTO
+    default:            return PerfCounters::LuaHeapOther;
+    }
+}
+
+/**
+ * @brief Create a new Lua state which uses the accounting allocator.
+ *
+ * This is equivalent to @c luaL_newstate().
+ *
+ * @return The new state, or @c nullptr if it could not be created.
+ */
+lua_State* LuaAllocator::newState()
+{
+    lua_State* state = lua_newstate(&LuaAllocator::allocate, &PerfCounters::instance());
+    if (nullptr != state)
+    {
+        lua_atpanic(state, &LuaAllocator::panic);
+    }
+
+    return state;
+}
+
+/**
+ * @brief The Lua allocator function (see @c lua_Alloc).
+ *
+ * @param ud The PerfCounters to update.
+ * @param ptr The block to resize or free, or @c nullptr to allocate a new block.
+ * @param osize The block's current size, or the type of object being allocated
+ *    if @p ptr is @c nullptr.
+ * @param nsize The new size of the block. The block is freed if this is zero.
+ */
+void* LuaAllocator::allocate(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    PerfCounters& counters = *static_cast<PerfCounters*>(ud);
+
+    // The headers are counted in the heap usage, as part of their blocks.
+    const qint64 headerSize = static_cast<qint64>(sizeof(BlockHeader));
+
+    BlockHeader* header = nullptr;
+    int category;
+    qint64 delta = (0 != nsize) ? static_cast<qint64>(nsize) + headerSize : 0;
+
+    if (nullptr == ptr)
+    {
+        category = categoryForTag(osize);
+    }
+    else
+    {
+        header   = static_cast<BlockHeader*>(ptr) - 1;
+        category = header->category;
+        delta   -= static_cast<qint64>(osize) + headerSize;
+    }
+
+    if (0 == nsize)
+    {
+        std::free(header);
+        ptr = nullptr;
+    }
+    else
+    {
+        BlockHeader* newHeader =
+                static_cast<BlockHeader*>(std::realloc(header, sizeof(BlockHeader) + nsize));
+        if (nullptr == newHeader)
+        {
+            // Lua assumes that the original block is unchanged when the allocation fails.
+            return nullptr;
+        }
+
+        newHeader->category = category;
+        ptr = newHeader + 1;
+    }
+
+    if (0 != delta)
+    {
+        counters.luaHeapBytes.add(delta);
+        counters.luaHeapBytesByCategory[category].add(delta);
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Handler for errors in unprotected calls (see @c lua_atpanic).
+ */
+int LuaAllocator::panic(lua_State* state)
+{
+    const char* message = lua_tostring(state, -1);
+    std::fprintf(stderr,
+                 "PANIC: unprotected error in call to Lua API (%s)\n",
+                 (nullptr != message) ? message : "error object is not a string");
+    std::fflush(stderr);
+
+    return 0; // return to Lua to abort
+}
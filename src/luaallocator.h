@@ -0,0 +1,50 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef LUAALLOCATOR_H
+#define LUAALLOCATOR_H
+
+#include "lua.hpp"
+
+/**
+ * @brief Memory allocator for Lua states which accounts for heap usage.
+ *
+ * The allocator tracks the number of bytes allocated by the Lua VM, broken
+ * down by the type of object that the memory was allocated for (strings,
+ * tables, functions, etc.). The statistics are published in PerfCounters.
+ *
+ * Lua tells the allocator which type of object is being allocated, but not
+ * which object is being freed or resized. So each block is prefixed by a
+ * header which remembers the block's category. The header takes 8 bytes
+ * on 64 bit platforms (the alignment required by Lua), which is a
+ * noticeable share of small strings and tables. It is counted in the
+ * published heap usage, which is therefore the memory actually requested
+ * from the C library for the VM.
+ */
+class LuaAllocator
+{
+public:
+    static lua_State* newState();
+
+private:
+    static void* allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+    static int panic(lua_State* state);
+};
+
+#endif // LUAALLOCATOR_H
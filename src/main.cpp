@@ -19,10 +19,13 @@
  ***********************************************************************/
 #include "mainwindow.h"
 #include <QApplication>
+#include <QThread>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+    QThread::currentThread()->setObjectName("UI");
+
     MainWindow w;
     w.show();
 
@@ -19,14 +19,20 @@
  ***********************************************************************/
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
+#include "tracer.h"
+#include "perfcounters.h"
 #include <QFileDialog>
 #include <QImageWriter>
 #include <QMessageBox>
 #include <QTextStream>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
 
+// Interval between samples of the memory usage while recording a trace.
+static const int TRACE_SAMPLE_INTERVAL_MSECS = 100;
+
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
@@ -36,6 +42,9 @@ MainWindow::MainWindow(QWidget *parent) :
     m_prefsDialog(new PreferencesDialog(this)),
     m_aboutDialog(new AboutDialog(this)),
     m_canvasSaveOptionsDialog(new CanvasSaveOptionsDialog(this)),
+    m_performanceHud(nullptr),
+    m_traceSampleTimer(),
+    m_undoCheckpoint(0),
     m_settings("settings.ini")
 {
     ui->setupUi(this);
@@ -54,6 +63,12 @@ MainWindow::MainWindow(QWidget *parent) :
 
     ui->graphicsView->setContextMenuPolicy(Qt::ActionsContextMenu);
 
+    // The performance HUD floats over the canvas view and is hidden by default.
+    m_performanceHud = new PerformanceHud(ui->graphicsView);
+    m_performanceHud->hide();
+    connect(ui->action_Performance_HUD, SIGNAL(toggled(bool)),
+            m_performanceHud,           SLOT(setVisible(bool)));
+
     ui->errorMessagesTextEdit->setTextColor(Qt::red);
 
     // These buttons are only enabled while a script is running.
@@ -74,9 +89,17 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->action_Open_Script, SIGNAL(triggered()), this, SLOT(loadScript()));
     connect(ui->action_Save_Script, SIGNAL(triggered()), this, SLOT(saveScript()));
     connect(ui->action_Save_Canvas, SIGNAL(triggered()), this, SLOT(saveCanvas()));
+    connect(ui->action_Undo_Run,    SIGNAL(triggered()), this, SLOT(undoLastRun()));
+    connect(ui->historySlider,      SIGNAL(valueChanged(int)), this, SLOT(showHistory(int)));
     connect(ui->action_Preferences, SIGNAL(triggered()), m_prefsDialog, SLOT(show()));
     connect(ui->action_About,       SIGNAL(triggered()), m_aboutDialog,  SLOT(show()));
 
+    connect(ui->action_Record_Trace,   SIGNAL(toggled(bool)), this, SLOT(toggleTracing(bool)));
+    connect(&m_traceSampleTimer,       SIGNAL(timeout()),     this, SLOT(traceMemoryCounters()));
+    connect(ui->action_Profile_Script, SIGNAL(toggled(bool)), this, SLOT(toggleProfiling(bool)));
+    connect(ui->action_Profile_Functions, SIGNAL(toggled(bool)),
+            this, SLOT(toggleFunctionProfiling(bool)));
+
     connect(ui->action_Errors, SIGNAL(triggered(bool)), this, SLOT(showErrors()));
     connect(ui->action_Script_Output, SIGNAL(triggered(bool)),
             this, SLOT(showScriptOutputs()));
@@ -93,6 +116,10 @@ MainWindow::MainWindow(QWidget *parent) :
             this,    SLOT(showScriptOutput()),
             Qt::QueuedConnection);
 
+    connect(&m_cmds, SIGNAL(functionProfileReady(QString)),
+            this,    SLOT(saveFunctionProfile(QString)),
+            Qt::QueuedConnection);
+
     loadPreferences();
     applyPreferences();
 
@@ -132,8 +159,16 @@ void MainWindow::runScript()
 {
     ui->errorMessagesTextEdit->clear();
 
+    // Save the canvas so that the run can be undone.
+    m_turtleGraphics->discardCheckpoint(m_undoCheckpoint);
+    m_undoCheckpoint = m_turtleGraphics->checkpoint();
+
     m_cmds.runScript(ui->scriptTextEdit->document()->toPlainText());
 
+    // The history can't be scrubbed while it is being drawn.
+    m_turtleGraphics->showLive();
+    ui->historySlider->setEnabled(false);
+
     ui->runButton->setEnabled(false);
     ui->haltButton->setEnabled(true);
     ui->pauseButton->setEnabled(true);
@@ -142,6 +177,7 @@ void MainWindow::runScript()
     ui->action_Halt->setEnabled(true);
     ui->action_Pause->setEnabled(true);
     ui->action_Save_Canvas->setEnabled(false);
+    ui->action_Undo_Run->setEnabled(false);
 }
 
 void MainWindow::showScriptError(const QString& message)
@@ -182,6 +218,8 @@ void MainWindow::scriptFinished(bool hasErrors)
     ui->action_Halt->setEnabled(false);
     ui->action_Pause->setEnabled(false);
     ui->action_Save_Canvas->setEnabled(true);
+    ui->action_Undo_Run->setEnabled(0 != m_undoCheckpoint);
+    updateHistorySlider();
 
     if (!hasErrors)
     {
@@ -275,6 +313,52 @@ void MainWindow::showScriptOutputs()
 void MainWindow::clearCanvas()
 {
     m_turtleGraphics->clear();
+    updateHistorySlider();
+}
+
+/**
+ * @brief Puts the canvas back to how it was before the last script was run.
+ *
+ * Only the drawings are undone; the turtles stay where the script left them.
+ */
+void MainWindow::undoLastRun()
+{
+    m_turtleGraphics->restore(m_undoCheckpoint);
+    m_turtleGraphics->discardCheckpoint(m_undoCheckpoint);
+    m_undoCheckpoint = 0;
+
+    ui->action_Undo_Run->setEnabled(false);
+    updateHistorySlider();
+}
+
+/**
+ * @brief Sets the history slider's range to the primitives on the canvas,
+ * and moves it to the end (the live canvas).
+ */
+void MainWindow::updateHistorySlider()
+{
+    const int count = m_turtleGraphics->primitiveCount();
+
+    ui->historySlider->blockSignals(true);
+    ui->historySlider->setRange(0, count);
+    ui->historySlider->setValue(count);
+    ui->historySlider->setPageStep(std::max(1, count / 20));
+    ui->historySlider->blockSignals(false);
+    ui->historySlider->setEnabled(count > 0);
+
+    ui->historyLabel->setText(QString("%1 / %1").arg(count));
+}
+
+/**
+ * @brief Shows the canvas as it was after a number of primitives were drawn.
+ *
+ * This is called when the history slider is moved.
+ */
+void MainWindow::showHistory(int step)
+{
+    m_turtleGraphics->showHistory(step);
+
+    ui->historyLabel->setText(QString("%1 / %2").arg(step).arg(ui->historySlider->maximum()));
 }
 
 /**
@@ -303,21 +387,38 @@ void MainWindow::saveCanvas()
     }
     filter += ")";
 
+    QStringList filters;
+    filters << filter
+            << tr("Vector graphics") + " (*.svg *.pdf)";
 
     QFileDialog fileDialog(this);
     fileDialog.setAcceptMode(QFileDialog::AcceptSave);
-    fileDialog.setNameFilter(filter);
+    fileDialog.setNameFilters(filters);
     fileDialog.setWindowTitle(tr("Save Canvas"));
 
     if (fileDialog.exec() != 0)
     {
         if (m_canvasSaveOptionsDialog->exec() != 0)
         {
-            const QImage canvasImage(m_turtleGraphics->toImage(m_canvasSaveOptionsDialog->transparentBackground(),
-                                                               m_canvasSaveOptionsDialog->fitToUsedArea()));
+            const bool transparentBackground = m_canvasSaveOptionsDialog->transparentBackground();
+            const bool fitToUsedArea         = m_canvasSaveOptionsDialog->fitToUsedArea();
+
+            QImage canvasImage;
 
             for (QString filename : fileDialog.selectedFiles())
             {
+                VectorExporter::Format vectorFormat;
+                if (VectorExporter::formatForFile(filename, vectorFormat))
+                {
+                    saveVectorCanvas(filename, vectorFormat, transparentBackground, fitToUsedArea);
+                    continue;
+                }
+
+                if (canvasImage.isNull())
+                {
+                    canvasImage = m_turtleGraphics->toImage(transparentBackground, fitToUsedArea);
+                }
+
                 QImageWriter writer(filename);
 
                 if (!writer.write(canvasImage))
@@ -331,6 +432,30 @@ void MainWindow::saveCanvas()
     }
 }
 
+/**
+ * @brief Save the primitives drawn on the canvas as SVG or PDF.
+ */
+void MainWindow::saveVectorCanvas(const QString& filename,
+                                  VectorExporter::Format format,
+                                  bool transparentBackground,
+                                  bool fitToUsedArea)
+{
+    DisplayList displayList;
+    QVector<DrawStyle> styles;
+    m_turtleGraphics->copyPrimitives(displayList, styles);
+
+    VectorExporter exporter(format);
+    exporter.setRegion(m_turtleGraphics->drawingRect(fitToUsedArea));
+    exporter.setBackground(transparentBackground ? QColor() : m_turtleGraphics->backgroundColor());
+
+    if (!exporter.write(filename, displayList, styles))
+    {
+        QString message = tr("Cannot write to file: ") + filename + '\n'
+                          + exporter.errorString();
+        QMessageBox::critical(this, tr("Save Error"), message);
+    }
+}
+
 void MainWindow::saveScript()
 {
     QStringList filters;
@@ -452,3 +577,171 @@ void MainWindow::applyPreferences()
 
     m_cmds.setRequirePaths(m_prefsDialog->requirePaths().join(';'));
 }
+
+/**
+ * @brief Starts or stops recording a timeline trace.
+ *
+ * When the trace is stopped the user is asked where the trace should be saved.
+ * The trace is saved in the Chrome Trace Event format, which can be viewed
+ * with chrome://tracing or Perfetto.
+ *
+ * @param on @c true to start recording, @c false to stop recording and save the trace.
+ */
+void MainWindow::toggleTracing(bool on)
+{
+    if (on)
+    {
+        Tracer::start();
+        traceMemoryCounters();
+        m_traceSampleTimer.start(TRACE_SAMPLE_INTERVAL_MSECS);
+        return;
+    }
+
+    m_traceSampleTimer.stop();
+    Tracer::stop();
+
+    QStringList filters;
+    filters << tr("Chrome Trace (*.json)")
+            << tr("All Files (*)");
+
+    QFileDialog fileDialog(this);
+    fileDialog.setAcceptMode(QFileDialog::AcceptSave);
+    fileDialog.setNameFilters(filters);
+    fileDialog.setDefaultSuffix("json");
+    fileDialog.setWindowTitle(tr("Save Trace"));
+
+    if (fileDialog.exec() != 0)
+    {
+        for (QString filename : fileDialog.selectedFiles())
+        {
+            QString errorString;
+            if (!Tracer::writeChromeTrace(filename, errorString))
+            {
+                QString message = QString("Cannot save file: %1\n%2")
+                        .arg(filename)
+                        .arg(errorString);
+                QMessageBox::critical(this, tr("Save Error"), message);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Records a sample of the memory usage in the trace.
+ *
+ * This is called periodically while a trace is being recorded.
+ */
+void MainWindow::traceMemoryCounters()
+{
+    PerfCounters::instance().traceMemoryCounters();
+}
+
+/**
+ * @brief Starts or stops the Lua sampling profiler.
+ *
+ * When the profiler is stopped the user is asked where the profile should be
+ * saved. The profile is saved in the folded stacks format, which can be turned
+ * into a flame graph by tools such as flamegraph.pl or speedscope.
+ *
+ * @param on @c true to start profiling, @c false to stop profiling and save the profile.
+ */
+void MainWindow::toggleProfiling(bool on)
+{
+    SamplingProfiler& profiler = m_cmds.samplingProfiler();
+
+    if (on)
+    {
+        profiler.start(SamplingProfiler::DEFAULT_SAMPLE_INTERVAL);
+        return;
+    }
+
+    profiler.stop();
+
+    QStringList filters;
+    filters << tr("Folded Stacks (*.folded)")
+            << tr("Text (*.txt)")
+            << tr("All Files (*)");
+
+    QFileDialog fileDialog(this);
+    fileDialog.setAcceptMode(QFileDialog::AcceptSave);
+    fileDialog.setNameFilters(filters);
+    fileDialog.setDefaultSuffix("folded");
+    fileDialog.setWindowTitle(tr("Save Profile"));
+
+    if (fileDialog.exec() != 0)
+    {
+        const QString folded = profiler.foldedStacks();
+
+        for (QString filename : fileDialog.selectedFiles())
+        {
+            QFile file(filename);
+            if (file.open(QFile::WriteOnly | QFile::Text | QFile::Truncate))
+            {
+                QTextStream stream(&file);
+                stream << folded;
+                stream.flush();
+                file.close();
+            }
+            else
+            {
+                QString message = QString("Cannot save file: %1\n%2")
+                        .arg(filename)
+                        .arg(file.errorString());
+                QMessageBox::critical(this, tr("Save Error"), message);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Switches the exact per-function profiler on or off.
+ *
+ * The profiler's report is produced when the profiled script finishes
+ * (see saveFunctionProfile()).
+ *
+ * @param on @c true to enable the profiler.
+ */
+void MainWindow::toggleFunctionProfiling(bool on)
+{
+    m_cmds.functionProfiler().setEnabled(on);
+}
+
+/**
+ * @brief Asks the user where to save a per-function profile report.
+ *
+ * @param report The report in CSV format.
+ */
+void MainWindow::saveFunctionProfile(const QString& report)
+{
+    QStringList filters;
+    filters << tr("CSV (*.csv)")
+            << tr("All Files (*)");
+
+    QFileDialog fileDialog(this);
+    fileDialog.setAcceptMode(QFileDialog::AcceptSave);
+    fileDialog.setNameFilters(filters);
+    fileDialog.setDefaultSuffix("csv");
+    fileDialog.setWindowTitle(tr("Save Function Profile"));
+
+    if (fileDialog.exec() != 0)
+    {
+        for (QString filename : fileDialog.selectedFiles())
+        {
+            QFile file(filename);
+            if (file.open(QFile::WriteOnly | QFile::Text | QFile::Truncate))
+            {
+                QTextStream stream(&file);
+                stream << report;
+                stream.flush();
+                file.close();
+            }
+            else
+            {
+                QString message = QString("Cannot save file: %1\n%2")
+                        .arg(filename)
+                        .arg(file.errorString());
+                QMessageBox::critical(this, tr("Save Error"), message);
+            }
+        }
+    }
+}
@@ -25,12 +25,15 @@
 #include <QGraphicsView>
 #include <QPlainTextEdit>
 #include <QSpinBox>
+#include <QTimer>
 #include "settings.h"
+#include "performancehud.h"
 #include "scriptrunner.h"
 #include "aboutdialog.h"
 #include "preferencesdialog.h"
 #include "canvassaveoptionsdialog.h"
 #include "turtlecanvasgraphicsitem.h"
+#include "vectorexporter.h"
 
 namespace Ui {
 class MainWindow;
@@ -66,6 +69,10 @@ private slots:
 
     void clearCanvas();
     void saveCanvas();
+    void undoLastRun();
+
+    void updateHistorySlider();
+    void showHistory(int step);
 
     void saveScript();
     void loadScript();
@@ -74,7 +81,18 @@ private slots:
     void savePreferences();
     void applyPreferences();
 
+    void toggleTracing(bool on);
+    void traceMemoryCounters();
+    void toggleProfiling(bool on);
+    void toggleFunctionProfiling(bool on);
+    void saveFunctionProfile(const QString& report);
+
 private:
+    void saveVectorCanvas(const QString& filename,
+                          VectorExporter::Format format,
+                          bool transparentBackground,
+                          bool fitToUsedArea);
+
     Ui::MainWindow *ui;
 
     QGraphicsScene* m_scene;
@@ -84,6 +102,10 @@ private:
     PreferencesDialog* m_prefsDialog;
     AboutDialog* m_aboutDialog;
     CanvasSaveOptionsDialog* m_canvasSaveOptionsDialog;
+    PerformanceHud* m_performanceHud;
+    QTimer m_traceSampleTimer;
+
+    int m_undoCheckpoint; ///< Canvas checkpoint taken before the last run, or 0.
 
     Settings m_settings;
 };
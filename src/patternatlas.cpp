@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "patternatlas.h"
+#include "compositing.h"
+#include <QBrush>
+#include <QImage>
+#include <QPainter>
+#include <cassert>
+#include <cstring>
+
+static const int TILE_PIXELS = Compositing::PATTERN_SIZE * Compositing::PATTERN_SIZE;
+
+PatternAtlas::PatternAtlas() :
+    m_tiles(),
+    m_pixels()
+{
+
+}
+
+/**
+ * @brief Get the tile of a brush pattern, rendering it on first use.
+ *
+ * The patterns of all the brush styles used by scripts (Qt::Dense1Pattern
+ * to Qt::DiagCrossPattern) repeat every 8 pixels, so a single tile rendered
+ * at the origin can be repeated over the whole canvas.
+ *
+ * @param style The brush style.
+ * @param color The (non-premultiplied) brush color.
+ * @return The index of the tile, for use with pixels().
+ */
+int PatternAtlas::tile(Qt::BrushStyle style, QRgb color)
+{
+    const Key key(static_cast<int>(style), color);
+
+    QHash<Key, int>::const_iterator it = m_tiles.constFind(key);
+    if (it != m_tiles.constEnd())
+    {
+        return it.value();
+    }
+
+    QImage image(Compositing::PATTERN_SIZE,
+                 Compositing::PATTERN_SIZE,
+                 QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    {
+        QPainter painter(&image);
+        painter.fillRect(image.rect(), QBrush(QColor::fromRgba(color), style));
+    }
+
+    const int index = m_pixels.size() / TILE_PIXELS;
+    m_pixels.resize(m_pixels.size() + TILE_PIXELS);
+
+    quint32* tilePixels = m_pixels.data() + index * TILE_PIXELS;
+    for (int y = 0; y < Compositing::PATTERN_SIZE; y++)
+    {
+        std::memcpy(tilePixels + y * Compositing::PATTERN_SIZE,
+                    image.constScanLine(y),
+                    Compositing::PATTERN_SIZE * sizeof(quint32));
+    }
+
+    m_tiles.insert(key, index);
+
+    return index;
+}
+
+/**
+ * @brief Get the pixels of a tile.
+ *
+ * The pointer is valid until the next call to tile() or clear().
+ */
+const quint32* PatternAtlas::pixels(int tileIndex) const
+{
+    assert((tileIndex >= 0) && ((tileIndex + 1) * TILE_PIXELS <= m_pixels.size()));
+
+    return m_pixels.constData() + tileIndex * TILE_PIXELS;
+}
+
+void PatternAtlas::clear()
+{
+    m_tiles.clear();
+    m_pixels.clear();
+}
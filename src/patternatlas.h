@@ -0,0 +1,56 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef PATTERNATLAS_H
+#define PATTERNATLAS_H
+
+#include <QHash>
+#include <QPair>
+#include <QRgb>
+#include <QVector>
+
+/**
+ * @brief Cache of pre-rendered brush pattern tiles.
+ *
+ * Each distinct (brush style, color) pair is rendered once by QPainter
+ * into a Compositing::PATTERN_SIZE square tile, which the Rasterizer then
+ * repeats along each span. All tiles are stored one after the other in a
+ * single buffer.
+ *
+ * This class is not thread-safe.
+ */
+class PatternAtlas
+{
+public:
+    PatternAtlas();
+
+    int tile(Qt::BrushStyle style, QRgb color);
+
+    const quint32* pixels(int tileIndex) const;
+
+    void clear();
+
+private:
+    typedef QPair<int, QRgb> Key;
+
+    QHash<Key, int>  m_tiles;
+    QVector<quint32> m_pixels;
+};
+
+#endif // PATTERNATLAS_H
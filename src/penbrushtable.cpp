@@ -0,0 +1,132 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "penbrushtable.h"
+#include <cassert>
+
+uint qHash(const DrawStyle& style, uint seed)
+{
+    uint hash = seed;
+    hash = (hash * 31u) ^ ::qHash(style.penColor);
+    hash = (hash * 31u) ^ ::qHash(style.penWidth);
+    hash = (hash * 31u) ^ ::qHash(static_cast<int>(style.capStyle));
+    hash = (hash * 31u) ^ ::qHash(style.brushColor);
+    hash = (hash * 31u) ^ ::qHash(static_cast<int>(style.brushStyle));
+    return hash;
+}
+
+PenBrushTable::PenBrushTable() :
+    m_handles(),
+    m_entries(),
+    m_patterns(),
+    m_hasLast(false),
+    m_lastStyle(),
+    m_lastHandle(0)
+{
+
+}
+
+PenBrushTable::~PenBrushTable()
+{
+    clear();
+}
+
+bool PenBrushTable::contains(const DrawStyle& style) const
+{
+    return (m_hasLast && (style == m_lastStyle)) || m_handles.contains(style);
+}
+
+/**
+ * @brief Get the handle of a style, adding it to the table if necessary.
+ *
+ * Looking up the same style as the previous call is a simple comparison.
+ *
+ * @pre Either the style is already in the table, or the table is not full.
+ *
+ * @param style The style to look up.
+ * @return The handle of the style.
+ */
+PenBrushTable::Handle PenBrushTable::intern(const DrawStyle& style)
+{
+    if (m_hasLast && (style == m_lastStyle))
+    {
+        return m_lastHandle;
+    }
+
+    Handle handle;
+
+    QHash<DrawStyle, Handle>::const_iterator it = m_handles.constFind(style);
+    if (it != m_handles.constEnd())
+    {
+        handle = it.value();
+    }
+    else
+    {
+        assert(!isFull());
+
+        Entry* entry = new Entry;
+        entry->style = style;
+        entry->pen   = QPen(QColor::fromRgba(style.penColor), style.penWidth);
+        entry->pen.setCapStyle(style.capStyle);
+        entry->brush = QBrush(QColor::fromRgba(style.brushColor), style.brushStyle);
+        entry->premultipliedPenColor   = qPremultiply(style.penColor);
+        entry->premultipliedBrushColor = qPremultiply(style.brushColor);
+        entry->patternTile = -1;
+
+        if ((style.brushStyle != Qt::NoBrush) && (style.brushStyle != Qt::SolidPattern))
+        {
+            entry->patternTile = m_patterns.tile(style.brushStyle, style.brushColor);
+        }
+
+        handle = static_cast<Handle>(m_entries.size());
+        m_entries.append(entry);
+        m_handles.insert(style, handle);
+    }
+
+    m_hasLast    = true;
+    m_lastStyle  = style;
+    m_lastHandle = handle;
+
+    return handle;
+}
+
+/**
+ * @brief Get the pattern tile of an entry's brush.
+ *
+ * @return The tile's pixels (see PatternAtlas::pixels()), or @c nullptr
+ *     if the brush is not a pattern.
+ */
+const quint32* PenBrushTable::pattern(const Entry& entry) const
+{
+    return (entry.patternTile >= 0) ? m_patterns.pixels(entry.patternTile) : nullptr;
+}
+
+/**
+ * @brief Remove all entries from the table.
+ *
+ * All handles and entry references previously obtained become invalid.
+ */
+void PenBrushTable::clear()
+{
+    qDeleteAll(m_entries);
+    m_entries.clear();
+    m_handles.clear();
+    m_patterns.clear();
+    m_hasLast = false;
+}
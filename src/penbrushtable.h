@@ -0,0 +1,124 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef PENBRUSHTABLE_H
+#define PENBRUSHTABLE_H
+
+#include "patternatlas.h"
+#include <QBrush>
+#include <QHash>
+#include <QPen>
+#include <QRgb>
+#include <QVector>
+
+/**
+ * @brief The drawing parameters of a primitive, as given by a script.
+ *
+ * This is a plain value type which is cheap to build and compare, unlike
+ * QPen and QBrush. It is used as the key of the PenBrushTable.
+ */
+struct DrawStyle
+{
+    QRgb            penColor;
+    qreal           penWidth;
+    Qt::PenCapStyle capStyle;
+    QRgb            brushColor;
+    Qt::BrushStyle  brushStyle;
+
+    bool operator==(const DrawStyle& other) const
+    {
+        return (penColor   == other.penColor)   &&
+               (penWidth   == other.penWidth)   &&
+               (capStyle   == other.capStyle)   &&
+               (brushColor == other.brushColor) &&
+               (brushStyle == other.brushStyle);
+    }
+
+    bool operator!=(const DrawStyle& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+uint qHash(const DrawStyle& style, uint seed = 0);
+
+/**
+ * @brief Table of interned pens and brushes.
+ *
+ * Scripts rarely change the pen between primitives, so rather than
+ * carrying a QPen and QBrush with every primitive each distinct DrawStyle
+ * is stored once and referred to by a 16-bit handle. The QPen, QBrush,
+ * premultiplied colors and brush pattern tile (see PatternAtlas) needed for
+ * drawing are built when a style is first interned.
+ *
+ * Entries are never moved, so references returned by entry() remain valid
+ * until the table is cleared.
+ *
+ * This class is not thread-safe.
+ */
+class PenBrushTable
+{
+public:
+    typedef quint16 Handle;
+
+    /// The maximum number of entries in the table.
+    static const int CAPACITY = 65536;
+
+    struct Entry
+    {
+        DrawStyle style;
+        QPen      pen;
+        QBrush    brush;
+        quint32   premultipliedPenColor;
+        quint32   premultipliedBrushColor;
+        int       patternTile; ///< The brush's tile in the pattern atlas, or -1.
+    };
+
+    PenBrushTable();
+    ~PenBrushTable();
+
+    int size() const { return m_entries.size(); }
+    bool isFull() const { return m_entries.size() >= CAPACITY; }
+
+    bool contains(const DrawStyle& style) const;
+
+    Handle intern(const DrawStyle& style);
+
+    const Entry& entry(Handle handle) const
+    {
+        return *m_entries.at(handle);
+    }
+
+    const quint32* pattern(const Entry& entry) const;
+
+    void clear();
+
+private:
+    Q_DISABLE_COPY(PenBrushTable)
+
+    QHash<DrawStyle, Handle> m_handles;
+    QVector<Entry*>          m_entries;
+    PatternAtlas             m_patterns;
+
+    bool      m_hasLast;
+    DrawStyle m_lastStyle;
+    Handle    m_lastHandle;
+};
+
+#endif // PENBRUSHTABLE_H
@@ -0,0 +1,121 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "perfcounters.h"
+#include "tracer.h"
+
+PerfGauge::PerfGauge() :
+    m_value(0),
+    m_peak(0)
+{
+}
+
+/**
+ * @brief Reset the peak to the current value.
+ */
+void PerfGauge::resetPeak()
+{
+    m_peak.store(m_value.load());
+}
+
+PerfCounters::PerfCounters() :
+    primitivesTotal(0),
+    pendingRepaints(0),
+    canvasBytes(),
+    displayListBytes(),
+    framesTotal(0),
+    lastFrameNsecs(0),
+    luaInstructionsTotal(0),
+    messageQueueBytes(),
+    luaHeapBytes(),
+    luaHeapBytesByCategory()
+{
+}
+
+/**
+ * @brief Get the process-wide counters.
+ */
+PerfCounters& PerfCounters::instance()
+{
+    static PerfCounters counters;
+    return counters;
+}
+
+/**
+ * @brief Get the display name of a Lua heap category.
+ *
+ * @param category A value of LuaHeapCategory.
+ * @return The category's name.
+ */
+const char* PerfCounters::luaHeapCategoryName(int category)
+{
+    static const char* const names[LuaHeapCategoryCount] =
+    {
+        "other",
+        "string",
+        "table",
+        "function",
+        "userdata",
+        "thread",
+        "prototype"
+    };
+
+    if ((category < 0) || (category >= LuaHeapCategoryCount))
+    {
+        return "?";
+    }
+
+    return names[category];
+}
+
+/**
+ * @brief Record a sample of the memory gauges in the trace (see Tracer).
+ *
+ * This has no effect when tracing is disabled.
+ */
+void PerfCounters::traceMemoryCounters() const
+{
+    // Counter names must be string literals, see Tracer.
+    static const char* const luaCategoryCounters[LuaHeapCategoryCount] =
+    {
+        "lua heap: other",
+        "lua heap: string",
+        "lua heap: table",
+        "lua heap: function",
+        "lua heap: userdata",
+        "lua heap: thread",
+        "lua heap: prototype"
+    };
+
+    if (!Tracer::enabled())
+    {
+        return;
+    }
+
+    Tracer::recordCounter("lua heap", "memory", static_cast<double>(luaHeapBytes.value()));
+    for (int i = 0; i < LuaHeapCategoryCount; i++)
+    {
+        Tracer::recordCounter(luaCategoryCounters[i], "memory",
+                              static_cast<double>(luaHeapBytesByCategory[i].value()));
+    }
+
+    Tracer::recordCounter("canvas", "memory", static_cast<double>(canvasBytes.value()));
+    Tracer::recordCounter("display list", "memory", static_cast<double>(displayListBytes.value()));
+    Tracer::recordCounter("message queue", "memory", static_cast<double>(messageQueueBytes.value()));
+}
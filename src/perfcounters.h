@@ -0,0 +1,136 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <QAtomicInteger>
+
+/**
+ * @brief A lock-free gauge that also tracks its peak value.
+ *
+ * The gauge can be updated concurrently by several threads.
+ */
+class PerfGauge
+{
+public:
+    PerfGauge();
+
+    inline quint64 value() const
+    {
+        return m_value.load();
+    }
+
+    inline quint64 peak() const
+    {
+        return m_peak.load();
+    }
+
+    inline void set(quint64 newValue)
+    {
+        m_value.store(newValue);
+        updatePeak(newValue);
+    }
+
+    inline void add(qint64 delta)
+    {
+        const quint64 newValue = m_value.fetchAndAddRelaxed(static_cast<quint64>(delta))
+                                 + static_cast<quint64>(delta);
+        updatePeak(newValue);
+    }
+
+    void resetPeak();
+
+private:
+    Q_DISABLE_COPY(PerfGauge)
+
+    inline void updatePeak(quint64 newValue)
+    {
+        quint64 peak = m_peak.load();
+        while ((newValue > peak) && !m_peak.testAndSetRelaxed(peak, newValue, peak))
+        {
+        }
+    }
+
+    QAtomicInteger<quint64> m_value;
+    QAtomicInteger<quint64> m_peak;
+};
+
+/**
+ * @brief Live performance counters shared between the Lua and UI threads.
+ *
+ * The counters are plain atomics so that they can be updated from hot paths
+ * (the Lua debug hook and allocator, the canvas drawing methods) without
+ * taking any locks. They are sampled periodically by the UI (see PerformanceHud).
+ *
+ * Counters suffixed with @c Total only ever increase; rates are computed by
+ * the reader from the difference between two samples. The other counters are
+ * gauges that hold the most recently observed value.
+ *
+ * All accesses use relaxed memory ordering (QAtomicInteger's load() and
+ * store() are relaxed): the counters are informational and are never used
+ * to synchronize other data.
+ */
+class PerfCounters
+{
+public:
+    /**
+     * @brief Categories of Lua heap memory, see LuaAllocator.
+     */
+    enum LuaHeapCategory
+    {
+        LuaHeapOther,
+        LuaHeapString,
+        LuaHeapTable,
+        LuaHeapFunction,
+        LuaHeapUserdata,
+        LuaHeapThread,
+        LuaHeapPrototype,
+
+        LuaHeapCategoryCount
+    };
+
+    static PerfCounters& instance();
+
+    static const char* luaHeapCategoryName(int category);
+
+    void traceMemoryCounters() const;
+
+    // Written by the canvas
+    QAtomicInteger<quint64> primitivesTotal;   // lines and arcs drawn
+    QAtomicInteger<int>     pendingRepaints;   // queued canvasUpdated() signals
+    PerfGauge               canvasBytes;       // size of the canvas backing store
+    PerfGauge               displayListBytes;  // size of the retained drawing primitives
+    QAtomicInteger<quint64> framesTotal;       // calls to paint()
+    QAtomicInteger<quint64> lastFrameNsecs;    // duration of the last paint()
+
+    // Written by the ScriptRunner
+    QAtomicInteger<quint64> luaInstructionsTotal;
+    PerfGauge               messageQueueBytes; // queued scripts and print() messages
+
+    // Written by the Lua allocator
+    PerfGauge               luaHeapBytes;
+    PerfGauge               luaHeapBytesByCategory[LuaHeapCategoryCount];
+
+private:
+    PerfCounters();
+    Q_DISABLE_COPY(PerfCounters)
+};
+
+#endif // PERFCOUNTERS_H
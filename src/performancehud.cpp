@@ -0,0 +1,168 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "performancehud.h"
+#include "perfcounters.h"
+#include "compositing.h"
+#include <algorithm>
+
+static const int SAMPLE_INTERVAL_MSECS = 500;
+
+/**
+ * @brief Format a byte count using binary units (KiB, MiB, ...).
+ */
+static QString formatBytes(quint64 bytes)
+{
+    static const char* const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+
+    double value = static_cast<double>(bytes);
+    unsigned int unit = 0;
+    while ((value >= 1024.0) && (unit < (sizeof(units) / sizeof(units[0])) - 1))
+    {
+        value /= 1024.0;
+        ++unit;
+    }
+
+    return QString("%1 %2").arg(value, 0, 'f', (unit == 0) ? 0 : 1).arg(units[unit]);
+}
+
+/**
+ * @brief Format a memory gauge as "current (peak)".
+ */
+static QString formatGauge(const PerfGauge& gauge)
+{
+    return QString("%1 (peak %2)").arg(formatBytes(gauge.value()))
+                                  .arg(formatBytes(gauge.peak()));
+}
+
+/**
+ * @brief Format a per-second rate with an SI suffix (k, M, G).
+ */
+static QString formatRate(double perSecond)
+{
+    if (perSecond >= 1e9)
+    {
+        return QString("%1 G/s").arg(perSecond / 1e9, 0, 'f', 2);
+    }
+    else if (perSecond >= 1e6)
+    {
+        return QString("%1 M/s").arg(perSecond / 1e6, 0, 'f', 2);
+    }
+    else if (perSecond >= 1e3)
+    {
+        return QString("%1 k/s").arg(perSecond / 1e3, 0, 'f', 1);
+    }
+    else
+    {
+        return QString("%1 /s").arg(perSecond, 0, 'f', 0);
+    }
+}
+
+PerformanceHud::PerformanceHud(QWidget* parent) :
+    QLabel(parent),
+    m_timer(),
+    m_elapsed(),
+    m_lastSample()
+{
+    // The HUD must not steal mouse events from the view underneath
+    // (e.g. for drag-scrolling the canvas).
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+
+    setAutoFillBackground(true);
+    setStyleSheet("QLabel { background-color: rgba(0, 0, 0, 160);"
+                  " color: white; padding: 4px; }");
+    setFont(QFont("Courier"));
+    setTextFormat(Qt::PlainText);
+    move(8, 8);
+
+    m_timer.setInterval(SAMPLE_INTERVAL_MSECS);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(sample()));
+
+    m_lastSample = takeSample();
+}
+
+void PerformanceHud::showEvent(QShowEvent* event)
+{
+    m_lastSample = takeSample();
+    m_elapsed.start();
+    m_timer.start();
+    sample();
+
+    QLabel::showEvent(event);
+}
+
+void PerformanceHud::hideEvent(QHideEvent* event)
+{
+    m_timer.stop();
+
+    QLabel::hideEvent(event);
+}
+
+/**
+ * @brief Read the counters and refresh the displayed text.
+ */
+void PerformanceHud::sample()
+{
+    const PerfCounters& counters = PerfCounters::instance();
+    const Sample current = takeSample();
+
+    // Guard against division by zero on the very first sample.
+    const qint64 elapsedMsecs = std::max<qint64>(1, m_elapsed.restart());
+    const double seconds = static_cast<double>(elapsedMsecs) / 1000.0;
+
+    const double primitivesRate   = static_cast<double>(current.primitives - m_lastSample.primitives) / seconds;
+    const double instructionsRate = static_cast<double>(current.instructions - m_lastSample.instructions) / seconds;
+    const double framesRate       = static_cast<double>(current.frames - m_lastSample.frames) / seconds;
+
+    const double frameMsecs = static_cast<double>(counters.lastFrameNsecs.load()) / 1e6;
+
+    QString text;
+    text += QString("Primitives:  %1\n").arg(formatRate(primitivesRate));
+    text += QString("Lua instr.:  %1\n").arg(formatRate(instructionsRate));
+    text += QString("Repaints:    %1 queued\n").arg(counters.pendingRepaints.load());
+    text += QString("UI frames:   %1 fps, %2 ms\n").arg(framesRate, 0, 'f', 1)
+                                                   .arg(frameMsecs, 0, 'f', 2);
+    text += QString("Lua heap:    %1\n").arg(formatGauge(counters.luaHeapBytes));
+    for (int i = 0; i < PerfCounters::LuaHeapCategoryCount; i++)
+    {
+        text += QString("  %1%2\n").arg(PerfCounters::luaHeapCategoryName(i), -11)
+                                   .arg(formatGauge(counters.luaHeapBytesByCategory[i]));
+    }
+    text += QString("Canvas:      %1\n").arg(formatGauge(counters.canvasBytes));
+    text += QString("Displ. list: %1\n").arg(formatGauge(counters.displayListBytes));
+    text += QString("Messages:    %1\n").arg(formatGauge(counters.messageQueueBytes));
+    text += QString("Rasterizer:  %1").arg(Compositing::instructionSet());
+
+    setText(text);
+    adjustSize();
+
+    m_lastSample = current;
+}
+
+PerformanceHud::Sample PerformanceHud::takeSample() const
+{
+    const PerfCounters& counters = PerfCounters::instance();
+
+    Sample sample;
+    sample.primitives   = counters.primitivesTotal.load();
+    sample.instructions = counters.luaInstructionsTotal.load();
+    sample.frames       = counters.framesTotal.load();
+
+    return sample;
+}
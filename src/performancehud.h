@@ -0,0 +1,69 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef PERFORMANCEHUD_H
+#define PERFORMANCEHUD_H
+
+#include <QElapsedTimer>
+#include <QLabel>
+#include <QTimer>
+
+/**
+ * @brief Overlay showing live performance counters.
+ *
+ * The HUD periodically samples PerfCounters and displays rates
+ * (primitives/s, Lua instructions/s, frames/s) and gauges (queued repaints,
+ * UI frame time). It also shows a breakdown of memory usage: the Lua heap by
+ * object type, the canvas backing store, the display list and the message
+ * queues, each with its peak value.
+ *
+ * The HUD is intended to be placed as a child of the canvas view so that it
+ * floats over the top-left corner of the view. Sampling only takes place
+ * while the HUD is visible.
+ */
+class PerformanceHud : public QLabel
+{
+    Q_OBJECT
+
+public:
+    explicit PerformanceHud(QWidget* parent = nullptr);
+
+protected:
+    virtual void showEvent(QShowEvent* event);
+    virtual void hideEvent(QHideEvent* event);
+
+private slots:
+    void sample();
+
+private:
+    struct Sample
+    {
+        quint64 primitives;
+        quint64 instructions;
+        quint64 frames;
+    };
+
+    Sample takeSample() const;
+
+    QTimer m_timer;
+    QElapsedTimer m_elapsed;
+    Sample m_lastSample;
+};
+
+#endif // PERFORMANCEHUD_H
@@ -0,0 +1,1283 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "rasterizer.h"
+#include "compositing.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+/// Number of entries in the sine/cosine tables (must be a power of 2).
+static const int TRIG_TABLE_SIZE = 4096;
+
+/// Maximum distance (pixels) between a flattened arc and the true curve.
+static const qreal FLATTEN_TOLERANCE = 0.25;
+
+/// Largest angular step (in table entries) used when flattening arcs.
+static const int MAX_ARC_STEP = TRIG_TABLE_SIZE / 16;
+
+static const qreal PI = 3.14159265358979323846;
+
+/// Largest coordinate (pixels) of a thin line walked exactly from its end points.
+static const qreal MAX_EXACT_COORDINATE = 536870912.0;
+
+/**
+ * @brief Sine and cosine of the angles 2*pi*i/TRIG_TABLE_SIZE.
+ */
+class TrigTable
+{
+public:
+    static const TrigTable& instance()
+    {
+        static const TrigTable table;
+        return table;
+    }
+
+    qreal sine(int i) const   { return m_sine[i & (TRIG_TABLE_SIZE - 1)]; }
+    qreal cosine(int i) const { return m_cosine[i & (TRIG_TABLE_SIZE - 1)]; }
+
+private:
+    TrigTable()
+    {
+        for (int i = 0; i < TRIG_TABLE_SIZE; i++)
+        {
+            const qreal angle = (2.0 * PI * i) / TRIG_TABLE_SIZE;
+            m_sine[i]   = std::sin(angle);
+            m_cosine[i] = std::cos(angle);
+        }
+    }
+
+    qreal m_sine[TRIG_TABLE_SIZE];
+    qreal m_cosine[TRIG_TABLE_SIZE];
+};
+
+static inline QPointF normalized(const QPointF& vector)
+{
+    const qreal length = std::sqrt(QPointF::dotProduct(vector, vector));
+    return (length > 0.0) ? vector / length : QPointF(0.0, 0.0);
+}
+
+/**
+ * @brief Convert a whole number to int, clamped to [@p low, @p high].
+ *
+ * The value is clamped before it is converted, as converting a value out
+ * of the range of int is undefined. NaN is converted to @p low.
+ */
+static inline int clampedInt(qreal value, int low, int high)
+{
+    if (!(value > low))
+    {
+        return low;
+    }
+    if (value > high)
+    {
+        return high;
+    }
+    return static_cast<int>(value);
+}
+
+/**
+ * @brief Skip the pixels with no coverage at both ends of a span.
+ *
+ * @return @c false if no pixel of the span is covered.
+ */
+static inline bool trimCoverage(int& x0, const uchar*& coverage, int& count)
+{
+    while ((count > 0) && (0 == coverage[0]))
+    {
+        x0++;
+        coverage++;
+        count--;
+    }
+
+    while ((count > 0) && (0 == coverage[count - 1]))
+    {
+        count--;
+    }
+
+    return count > 0;
+}
+
+/**
+ * @brief Skip the transparent pixels at both ends of a span.
+ *
+ * @return @c false if all the pixels of the span are transparent.
+ */
+static inline bool trimTransparent(int& x0, const quint32*& pixels, int& count)
+{
+    while ((count > 0) && (0u == pixels[0]))
+    {
+        x0++;
+        pixels++;
+        count--;
+    }
+
+    while ((count > 0) && (0u == pixels[count - 1]))
+    {
+        count--;
+    }
+
+    return count > 0;
+}
+
+/**
+ * @brief Get the number of pixels from x to the right edge of its tile (inclusive).
+ */
+int RasterTarget::tileRemaining(int x) const
+{
+    // The tiles are aligned to the canvas origin.
+    return TileStore::TILE_SIZE - ((x - m_tiles.origin().x()) & (TileStore::TILE_SIZE - 1));
+}
+
+RasterTarget::RasterTarget(TileStore& tiles) :
+    m_tiles(tiles),
+    m_rect(tiles.rect()),
+    m_column(-1),
+    m_row(-1),
+    m_tile(nullptr),
+    m_tileOrigin(),
+    m_bits(nullptr),
+    m_bytesPerLine(0)
+{
+
+}
+
+/**
+ * @param tiles The canvas' tiles.
+ * @param clip The area which can be drawn on. It must lie inside the canvas.
+ */
+RasterTarget::RasterTarget(TileStore& tiles, const QRect& clip) :
+    m_tiles(tiles),
+    m_rect(clip),
+    m_column(-1),
+    m_row(-1),
+    m_tile(nullptr),
+    m_tileOrigin(),
+    m_bits(nullptr),
+    m_bytesPerLine(0)
+{
+    assert(tiles.rect().contains(clip));
+}
+
+/**
+ * @brief Get the pixels x0..x1 (inclusive) of row y for drawing on them.
+ *
+ * The pixels must lie in a single tile, whose bounds are extended to
+ * cover them.
+ */
+quint32* RasterTarget::span(int y, int x0, int x1)
+{
+    const int column = m_tiles.columnAt(x0);
+    const int row    = m_tiles.rowAt(y);
+
+    assert(column == m_tiles.columnAt(x1));
+
+    if ((column != m_column) || (row != m_row))
+    {
+        m_column       = column;
+        m_row          = row;
+        m_tile         = &m_tiles.writableTile(column, row);
+        m_tileOrigin   = m_tiles.tileRect(column, row).topLeft();
+        m_bits         = m_tile->image.bits();
+        m_bytesPerLine = m_tile->image.bytesPerLine();
+    }
+
+    const int tileX0 = x0 - m_tileOrigin.x();
+    const int tileX1 = x1 - m_tileOrigin.x();
+    const int tileY  = y  - m_tileOrigin.y();
+
+    QRect& used = m_tile->used;
+    if (used.isNull())
+    {
+        used.setCoords(tileX0, tileY, tileX1, tileY);
+    }
+    else
+    {
+        used.setCoords(std::min(used.left(),   tileX0),
+                       std::min(used.top(),    tileY),
+                       std::max(used.right(),  tileX1),
+                       std::max(used.bottom(), tileY));
+    }
+
+    return reinterpret_cast<quint32*>(m_bits + (tileY * m_bytesPerLine)) + tileX0;
+}
+
+/**
+ * @brief Blend a solid color over the pixels x0..x1 (inclusive) of row y.
+ */
+void RasterTarget::blendSpan(int y, int x0, int x1, quint32 color)
+{
+    assert(y >= m_rect.top() && y <= m_rect.bottom());
+    assert(x0 >= m_rect.left() && x1 <= m_rect.right());
+
+    while (x0 <= x1)
+    {
+        const int end = std::min(x1, x0 + tileRemaining(x0) - 1);
+
+        Compositing::blendSolidSpan(span(y, x0, end), end - x0 + 1, color);
+
+        x0 = end + 1;
+    }
+}
+
+/**
+ * @brief Blend a color over @p count pixels of row y starting at x0,
+ *     weighted by the coverage of each pixel.
+ */
+void RasterTarget::blendCoverageSpan(int y, int x0, const uchar* coverage, int count, quint32 color)
+{
+    assert(y >= m_rect.top() && y <= m_rect.bottom());
+    assert(x0 >= m_rect.left() && x0 + count - 1 <= m_rect.right());
+
+    while (count > 0)
+    {
+        int segmentX0    = x0;
+        const uchar* segmentCoverage = coverage;
+        int segmentCount = std::min(count, tileRemaining(x0));
+
+        x0       += segmentCount;
+        coverage += segmentCount;
+        count    -= segmentCount;
+
+        if (trimCoverage(segmentX0, segmentCoverage, segmentCount))
+        {
+            Compositing::blendCoverageSpan(span(y, segmentX0, segmentX0 + segmentCount - 1),
+                                           segmentCoverage,
+                                           segmentCount,
+                                           color);
+        }
+    }
+}
+
+/**
+ * @brief Blend @p count premultiplied pixels over row y starting at x0.
+ */
+void RasterTarget::blendImageSpan(int y, int x0, const quint32* pixels, int count)
+{
+    assert(y >= m_rect.top() && y <= m_rect.bottom());
+    assert(x0 >= m_rect.left() && x0 + count - 1 <= m_rect.right());
+
+    while (count > 0)
+    {
+        int segmentX0    = x0;
+        const quint32* segmentPixels = pixels;
+        int segmentCount = std::min(count, tileRemaining(x0));
+
+        x0     += segmentCount;
+        pixels += segmentCount;
+        count  -= segmentCount;
+
+        if (trimTransparent(segmentX0, segmentPixels, segmentCount))
+        {
+            Compositing::blendImageSpan(span(y, segmentX0, segmentX0 + segmentCount - 1),
+                                        segmentPixels,
+                                        segmentCount,
+                                        0xff);
+        }
+    }
+}
+
+/**
+ * @brief Fill the pixels x0..x1 (inclusive) of row y with a color or pattern.
+ */
+void RasterTarget::fillSpan(int y, int x0, int x1, const RasterPaint& paint)
+{
+    if (nullptr == paint.pattern)
+    {
+        blendSpan(y, x0, x1, paint.color);
+        return;
+    }
+
+    assert(y >= m_rect.top() && y <= m_rect.bottom());
+    assert(x0 >= m_rect.left() && x1 <= m_rect.right());
+
+    const quint32* patternRow = paint.pattern
+                                + (y & (Compositing::PATTERN_SIZE - 1)) * Compositing::PATTERN_SIZE;
+
+    while (x0 <= x1)
+    {
+        const int end = std::min(x1, x0 + tileRemaining(x0) - 1);
+
+        Compositing::blendPatternSpan(span(y, x0, end), end - x0 + 1, patternRow, x0);
+
+        x0 = end + 1;
+    }
+}
+
+/**
+ * @brief Fill @p count pixels of row y starting at x0 with a color or pattern,
+ *     weighted by the coverage of each pixel.
+ */
+void RasterTarget::fillCoverageSpan(int y, int x0, const uchar* coverage, int count, const RasterPaint& paint)
+{
+    if (nullptr == paint.pattern)
+    {
+        blendCoverageSpan(y, x0, coverage, count, paint.color);
+        return;
+    }
+
+    assert(y >= m_rect.top() && y <= m_rect.bottom());
+    assert(x0 >= m_rect.left() && x0 + count - 1 <= m_rect.right());
+
+    const quint32* patternRow = paint.pattern
+                                + (y & (Compositing::PATTERN_SIZE - 1)) * Compositing::PATTERN_SIZE;
+
+    while (count > 0)
+    {
+        int segmentX0    = x0;
+        const uchar* segmentCoverage = coverage;
+        int segmentCount = std::min(count, tileRemaining(x0));
+
+        x0       += segmentCount;
+        coverage += segmentCount;
+        count    -= segmentCount;
+
+        if (trimCoverage(segmentX0, segmentCoverage, segmentCount))
+        {
+            Compositing::blendPatternCoverageSpan(span(y, segmentX0, segmentX0 + segmentCount - 1),
+                                                  segmentCoverage,
+                                                  segmentCount,
+                                                  patternRow,
+                                                  segmentX0);
+        }
+    }
+}
+
+Rasterizer::Rasterizer() :
+    m_antialiased(false),
+    m_points(),
+    m_normals(),
+    m_outline(),
+    m_edges(),
+    m_edgeBounds(),
+    m_activeEdges(),
+    m_crossings(),
+    m_accumulator(),
+    m_coverage()
+{
+    // Build the table now rather than on the first arc.
+    (void)TrigTable::instance();
+}
+
+/**
+ * @brief Enable or disable antialiasing for the following primitives.
+ */
+void Rasterizer::setAntialiased(bool on)
+{
+    m_antialiased = on;
+}
+
+/**
+ * @brief Get the margin around a stroke's path covered by the pen.
+ */
+static qreal penMargin(qreal penWidth, Qt::PenCapStyle capStyle)
+{
+    // The corners of square caps stick out further than the pen's half-width.
+    // The extra pixel covers rounding of thin strokes.
+    qreal margin = std::max(penWidth, 1.0) / 2.0;
+    if (capStyle == Qt::SquareCap)
+    {
+        margin *= std::sqrt(2.0);
+    }
+    return margin + 1.0;
+}
+
+/**
+ * @brief Get the bounding rectangle of a line, including the pen.
+ */
+QRectF Rasterizer::lineBounds(const QLineF& line,
+                              qreal penWidth,
+                              Qt::PenCapStyle capStyle)
+{
+    const qreal margin = penMargin(penWidth, capStyle);
+    const qreal left   = std::min(line.x1(), line.x2()) - margin;
+    const qreal top    = std::min(line.y1(), line.y2()) - margin;
+
+    return QRectF(left,
+                  top,
+                  std::abs(line.x2() - line.x1()) + margin * 2.0,
+                  std::abs(line.y2() - line.y1()) + margin * 2.0);
+}
+
+/**
+ * @brief Round a rotation to the nearest of evenly spaced rotations.
+ *
+ * This is used by the caches of rotated bitmaps (stamps, glyphs and
+ * images), which draw each rotation once.
+ *
+ * @param angle The rotation (degrees).
+ * @param stepsPerTurn The number of rotations in a turn.
+ * @return The index of the rotation, from 0 to @p stepsPerTurn - 1.
+ */
+int Rasterizer::angleStep(qreal angle, int stepsPerTurn)
+{
+    if (!std::isfinite(angle))
+    {
+        return 0;
+    }
+
+    int step = static_cast<int>(std::round(std::fmod(angle, 360.0) * stepsPerTurn / 360.0)) % stepsPerTurn;
+    if (step < 0)
+    {
+        step += stepsPerTurn;
+    }
+
+    return step;
+}
+
+/**
+ * @brief Get the bounding rectangle of an arc's ellipse, including the pen.
+ *
+ * The bounds are those of the whole (rotated) ellipse, which also covers
+ * any pie drawn from the arc. It is used to skip arcs lying entirely
+ * outside of the target.
+ */
+QRectF Rasterizer::arcBounds(const ArcShape& arc,
+                             qreal penWidth,
+                             Qt::PenCapStyle capStyle)
+{
+    const qreal rotation = arc.rotation * PI / 180.0;
+    const qreal c        = std::cos(rotation);
+    const qreal s        = std::sin(rotation);
+
+    // Half extents of the rotated ellipse.
+    const qreal rx = std::abs(arc.xradius);
+    const qreal ry = std::abs(arc.yradius);
+    const qreal halfWidth  = std::sqrt((rx * c) * (rx * c) + (ry * s) * (ry * s));
+    const qreal halfHeight = std::sqrt((rx * s) * (rx * s) + (ry * c) * (ry * c));
+
+    const qreal margin = penMargin(penWidth, capStyle);
+
+    return QRectF(arc.center.x() - halfWidth - margin,
+                  arc.center.y() - halfHeight - margin,
+                  (halfWidth + margin) * 2.0,
+                  (halfHeight + margin) * 2.0);
+}
+
+/**
+ * @brief Draw a straight line.
+ *
+ * @param line The line to draw.
+ * @param penWidth The width of the stroke. Without antialiasing, widths
+ *     of 1 pixel or less are drawn as a connected 1 pixel line (like
+ *     QPainter's cosmetic pens).
+ * @param capStyle The shape of the ends of the stroke.
+ * @param color The premultiplied ARGB color.
+ * @param target Where to draw the line.
+ */
+void Rasterizer::strokeLine(const QLineF& line,
+                            qreal penWidth,
+                            Qt::PenCapStyle capStyle,
+                            quint32 color,
+                            RasterTarget& target)
+{
+    m_points.clear();
+    m_points.append(line.p1());
+    m_points.append(line.p2());
+
+    if (!m_antialiased && (penWidth <= 1.0))
+    {
+        plotPolyline(m_points, color, target);
+        return;
+    }
+
+    QPointF normal = normalized(QPointF(line.y1() - line.y2(), line.x2() - line.x1()));
+    if (normal.isNull())
+    {
+        // Zero length lines are only visible through their caps.
+        normal = QPointF(0.0, 1.0);
+    }
+
+    m_normals.clear();
+    m_normals.append(normal);
+    m_normals.append(normal);
+
+    strokePoints(false, std::max(penWidth, 1.0) / 2.0, capStyle, color, target);
+}
+
+/**
+ * @brief Draw the outline of an arc.
+ *
+ * @param arc The arc to draw. Both radiuses must be positive.
+ * @param penWidth The width of the stroke. Without antialiasing, widths
+ *     of 1 pixel or less are drawn as a connected 1 pixel line (like
+ *     QPainter's cosmetic pens).
+ * @param capStyle The shape of the ends of the stroke. This has no effect
+ *     for arcs spanning the whole ellipse.
+ * @param color The premultiplied ARGB color.
+ * @param target Where to draw the arc.
+ */
+void Rasterizer::strokeArc(const ArcShape& arc,
+                           qreal penWidth,
+                           Qt::PenCapStyle capStyle,
+                           quint32 color,
+                           RasterTarget& target)
+{
+    if (arc.spanAngle == 0.0)
+    {
+        return;
+    }
+
+    if (!m_antialiased && (penWidth <= 1.0))
+    {
+        flattenArc(arc, 0.0);
+        plotPolyline(m_points, color, target);
+        return;
+    }
+
+    const qreal penRadius = std::max(penWidth, 1.0) / 2.0;
+
+    flattenArc(arc, penRadius);
+    strokePoints(std::abs(arc.spanAngle) >= 360.0, penRadius, capStyle, color, target);
+}
+
+/**
+ * @brief Fill the pie (wedge) enclosed by an arc and its center.
+ *
+ * @param arc The arc bounding the pie. Both radiuses must be positive.
+ * @param paint The color or pattern to fill the pie with.
+ * @param target Where to draw the pie.
+ */
+void Rasterizer::fillPie(const ArcShape& arc,
+                         const RasterPaint& paint,
+                         RasterTarget& target)
+{
+    if (arc.spanAngle == 0.0)
+    {
+        return;
+    }
+
+    flattenArc(arc, 0.0);
+
+    if (std::abs(arc.spanAngle) < 360.0)
+    {
+        m_points.prepend(arc.center);
+    }
+
+    fillPolygon(m_points, paint, target);
+}
+
+/**
+ * @brief Stroke the path through m_points.
+ *
+ * @param closed Set to @c true when the last point joins the first point,
+ *     in which case no caps are drawn.
+ * @param penRadius Half the width of the stroke.
+ * @param capStyle The shape of the ends of the stroke.
+ * @param color The premultiplied ARGB color.
+ * @param target Where to draw the stroke.
+ *
+ * @pre m_normals holds the unit normal of the path at each point.
+ */
+void Rasterizer::strokePoints(bool closed,
+                              qreal penRadius,
+                              Qt::PenCapStyle capStyle,
+                              quint32 color,
+                              RasterTarget& target)
+{
+    const int count       = m_points.size();
+    const int capSegments = std::max(2, static_cast<int>(std::ceil(penRadius)));
+
+    assert(count >= 2);
+    assert(m_normals.size() == count);
+
+    // Direction of travel at each end of the path.
+    const QPointF startNormal = m_normals.first();
+    const QPointF endNormal   = m_normals.last();
+    QPointF startTangent(-startNormal.y(), startNormal.x());
+    QPointF endTangent(-endNormal.y(), endNormal.x());
+    if (QPointF::dotProduct(startTangent, m_points[1] - m_points[0]) < 0.0)
+    {
+        startTangent = -startTangent;
+    }
+    if (QPointF::dotProduct(endTangent, m_points[count - 1] - m_points[count - 2]) < 0.0)
+    {
+        endTangent = -endTangent;
+    }
+
+    // The outline is the path offset to one side, followed by the path offset
+    // to the other side in the reverse direction. For closed paths the edges
+    // joining the two offset paths cancel out under the non-zero rule,
+    // leaving a ring.
+    m_outline.clear();
+
+    for (int i = 0; i < count; i++)
+    {
+        m_outline.append(m_points[i] + m_normals[i] * penRadius);
+    }
+
+    if (!closed)
+    {
+        const QPointF end = m_points[count - 1];
+
+        if (capStyle == Qt::SquareCap)
+        {
+            m_outline.append(end + (endNormal + endTangent) * penRadius);
+            m_outline.append(end + (endTangent - endNormal) * penRadius);
+        }
+        else if (capStyle == Qt::RoundCap)
+        {
+            for (int i = 1; i < capSegments; i++)
+            {
+                const qreal a = (PI * i) / capSegments;
+                m_outline.append(end + (endNormal * std::cos(a) + endTangent * std::sin(a)) * penRadius);
+            }
+        }
+    }
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        m_outline.append(m_points[i] - m_normals[i] * penRadius);
+    }
+
+    if (!closed)
+    {
+        const QPointF start = m_points[0];
+
+        if (capStyle == Qt::SquareCap)
+        {
+            m_outline.append(start - (startNormal + startTangent) * penRadius);
+            m_outline.append(start + (startNormal - startTangent) * penRadius);
+        }
+        else if (capStyle == Qt::RoundCap)
+        {
+            for (int i = 1; i < capSegments; i++)
+            {
+                const qreal a = (PI * i) / capSegments;
+                m_outline.append(start - (startNormal * std::cos(a) + startTangent * std::sin(a)) * penRadius);
+            }
+        }
+    }
+
+    fillPolygon(m_outline, RasterPaint::solid(color), target);
+}
+
+/**
+ * @brief Approximate an arc with line segments.
+ *
+ * The points are stored in m_points, and the outward unit normal of the
+ * ellipse at each point is stored in m_normals.
+ *
+ * @param arc The arc to flatten.
+ * @param penRadius Half the width of the pen. The segments are made short
+ *     enough for the curves offset by this distance to be accurate too.
+ */
+void Rasterizer::flattenArc(const ArcShape& arc, qreal penRadius)
+{
+    const TrigTable& table = TrigTable::instance();
+
+    const qreal span         = std::max(-360.0, std::min(360.0, arc.spanAngle));
+    const qreal spanRadians  = std::abs(span) * PI / 180.0;
+    const qreal direction    = (span < 0.0) ? -1.0 : 1.0;
+    const qreal rotation     = arc.rotation * PI / 180.0;
+    const qreal rotationCos  = std::cos(rotation);
+    const qreal rotationSin  = std::sin(rotation);
+    const qreal radius       = std::max(arc.xradius, arc.yradius) + penRadius;
+
+    // Largest step which keeps the chords within FLATTEN_TOLERANCE of the curve.
+    int step = MAX_ARC_STEP;
+    if (radius > FLATTEN_TOLERANCE)
+    {
+        const qreal maxAngle = 2.0 * std::acos(1.0 - FLATTEN_TOLERANCE / radius);
+        step = static_cast<int>(maxAngle * TRIG_TABLE_SIZE / (2.0 * PI));
+        step = std::max(1, std::min(MAX_ARC_STEP, step));
+    }
+
+    // Index of the last table entry strictly inside the arc.
+    const qreal spanIndex = spanRadians * TRIG_TABLE_SIZE / (2.0 * PI);
+    const int   lastIndex = static_cast<int>(std::ceil(spanIndex)) - 1;
+
+    m_points.clear();
+    m_normals.clear();
+
+    auto addPoint = [&](qreal c, qreal s)
+    {
+        // Point on the ellipse, before and after rotation.
+        const qreal x = arc.xradius * c;
+        const qreal y = -arc.yradius * s;
+        m_points.append(QPointF(arc.center.x() + x * rotationCos - y * rotationSin,
+                                arc.center.y() + x * rotationSin + y * rotationCos));
+
+        const qreal nx = arc.yradius * c;
+        const qreal ny = -arc.xradius * s;
+        m_normals.append(normalized(QPointF(nx * rotationCos - ny * rotationSin,
+                                            nx * rotationSin + ny * rotationCos)));
+    };
+
+    addPoint(1.0, 0.0);
+
+    for (int i = step; i <= lastIndex; i += step)
+    {
+        addPoint(table.cosine(i), direction * table.sine(i));
+    }
+
+    const qreal endAngle = direction * spanRadians;
+    addPoint(std::cos(endAngle), std::sin(endAngle));
+}
+
+/**
+ * @brief Build the (non-horizontal) edges of a polygon into m_edges.
+ *
+ * The bounds of the polygon are stored in m_edgeBounds.
+ */
+void Rasterizer::buildEdges(const QVector<QPointF>& polygon)
+{
+    const int count = polygon.size();
+
+    qreal left   = std::numeric_limits<qreal>::max();
+    qreal right  = -std::numeric_limits<qreal>::max();
+    qreal top    = std::numeric_limits<qreal>::max();
+    qreal bottom = -std::numeric_limits<qreal>::max();
+
+    m_edges.clear();
+    for (int i = 0; i < count; i++)
+    {
+        const QPointF& p = polygon[i];
+        const QPointF& q = polygon[(i + 1) % count];
+
+        if (p.y() == q.y())
+        {
+            continue;
+        }
+
+        const bool downward = p.y() < q.y();
+        const QPointF& upper = downward ? p : q;
+        const QPointF& lower = downward ? q : p;
+
+        Edge edge;
+        edge.x       = upper.x();
+        edge.dxdy    = (lower.x() - upper.x()) / (lower.y() - upper.y());
+        edge.top     = upper.y();
+        edge.bottom  = lower.y();
+        edge.winding = downward ? 1 : -1;
+        m_edges.append(edge);
+
+        left   = std::min(left, std::min(p.x(), q.x()));
+        right  = std::max(right, std::max(p.x(), q.x()));
+        top    = std::min(top, upper.y());
+        bottom = std::max(bottom, lower.y());
+    }
+
+    m_edgeBounds = m_edges.isEmpty() ? QRectF() : QRectF(QPointF(left, top), QPointF(right, bottom));
+
+    std::sort(m_edges.begin(), m_edges.end(),
+              [](const Edge& a, const Edge& b) { return a.top < b.top; });
+}
+
+/**
+ * @brief Fill a polygon using the non-zero winding rule.
+ *
+ * Each pixel is blended at most once, even where the polygon overlaps itself.
+ */
+void Rasterizer::fillPolygon(const QVector<QPointF>& polygon,
+                             const RasterPaint& paint,
+                             RasterTarget& target)
+{
+    if (m_antialiased)
+    {
+        fillPolygonAntialiased(polygon, paint, target);
+        return;
+    }
+
+    // Without antialiasing a pixel is filled when its center is inside the polygon.
+    const QRect clip = target.rect();
+
+    buildEdges(polygon);
+
+    const int firstRow = std::max(clip.top(),
+                                  clampedInt(std::ceil(m_edgeBounds.top() - 0.5),
+                                             clip.top() - 1, clip.bottom() + 1));
+    const int lastRow  = std::min(clip.bottom(),
+                                  clampedInt(std::ceil(m_edgeBounds.bottom() - 0.5),
+                                             clip.top() - 1, clip.bottom() + 1) - 1);
+
+    if (m_edges.isEmpty() || firstRow > lastRow)
+    {
+        return;
+    }
+
+    m_activeEdges.clear();
+    int nextEdge = 0;
+
+    for (int y = firstRow; y <= lastRow; y++)
+    {
+        const qreal sampleY = y + 0.5;
+
+        while (nextEdge < m_edges.size() && m_edges[nextEdge].top <= sampleY)
+        {
+            m_activeEdges.append(nextEdge);
+            nextEdge++;
+        }
+
+        // Drop the edges ending above this row and intersect the others.
+        m_crossings.clear();
+        int kept = 0;
+        for (int i = 0; i < m_activeEdges.size(); i++)
+        {
+            const Edge& edge = m_edges[m_activeEdges[i]];
+            if (edge.bottom > sampleY)
+            {
+                m_activeEdges[kept++] = m_activeEdges[i];
+
+                Crossing crossing;
+                crossing.x       = edge.x + (sampleY - edge.top) * edge.dxdy;
+                crossing.winding = edge.winding;
+                m_crossings.append(crossing);
+            }
+        }
+        m_activeEdges.resize(kept);
+
+        std::sort(m_crossings.begin(), m_crossings.end(),
+                  [](const Crossing& a, const Crossing& b) { return a.x < b.x; });
+
+        int   winding   = 0;
+        qreal spanStart = 0.0;
+        for (int i = 0; i < m_crossings.size(); i++)
+        {
+            const int previous = winding;
+            winding += m_crossings[i].winding;
+
+            if (previous == 0 && winding != 0)
+            {
+                spanStart = m_crossings[i].x;
+            }
+            else if (previous != 0 && winding == 0)
+            {
+                const int x0 = std::max(clip.left(),
+                                        clampedInt(std::ceil(spanStart - 0.5),
+                                                   clip.left() - 1, clip.right() + 1));
+                const int x1 = std::min(clip.right(),
+                                        clampedInt(std::ceil(m_crossings[i].x - 0.5),
+                                                   clip.left() - 1, clip.right() + 1) - 1);
+                if (x0 <= x1)
+                {
+                    target.fillSpan(y, x0, x1, paint);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fill a polygon with antialiasing.
+ *
+ * Each row is processed in turn: the part of every edge crossing the row
+ * deposits the signed area it encloses into m_accumulator, which is then
+ * summed into the coverage of each pixel. Overlapping parts of the polygon
+ * are clamped to full coverage, which matches the non-zero rule for the
+ * outlines built by the stroking code.
+ */
+void Rasterizer::fillPolygonAntialiased(const QVector<QPointF>& polygon,
+                                        const RasterPaint& paint,
+                                        RasterTarget& target)
+{
+    const QRect clip = target.rect();
+
+    buildEdges(polygon);
+
+    if (m_edges.isEmpty())
+    {
+        return;
+    }
+
+    const int firstRow = std::max(clip.top(),
+                                  clampedInt(std::floor(m_edgeBounds.top()),
+                                             clip.top() - 1, clip.bottom() + 1));
+    const int lastRow  = std::min(clip.bottom(),
+                                  clampedInt(std::ceil(m_edgeBounds.bottom()),
+                                             clip.top() - 1, clip.bottom() + 1) - 1);
+    const int left     = std::max(clip.left(),
+                                  clampedInt(std::floor(m_edgeBounds.left()),
+                                             clip.left() - 1, clip.right() + 1));
+    const int right    = std::min(clip.right(),
+                                  clampedInt(std::floor(m_edgeBounds.right()),
+                                             clip.left() - 1, clip.right() + 1));
+
+    if (firstRow > lastRow || left > right)
+    {
+        return;
+    }
+
+    // Area deposited just past the right edge needs two extra cells,
+    // the third keeps the SIMD kernels within the buffer.
+    const int width = right - left + 1;
+    m_accumulator.fill(0.0f, width + 3);
+    m_coverage.resize(width);
+
+    m_activeEdges.clear();
+    int nextEdge = 0;
+
+    for (int y = firstRow; y <= lastRow; y++)
+    {
+        const qreal rowTop    = y;
+        const qreal rowBottom = y + 1.0;
+
+        while (nextEdge < m_edges.size() && m_edges[nextEdge].top < rowBottom)
+        {
+            m_activeEdges.append(nextEdge);
+            nextEdge++;
+        }
+
+        int kept = 0;
+        for (int i = 0; i < m_activeEdges.size(); i++)
+        {
+            const Edge& edge = m_edges[m_activeEdges[i]];
+            if (edge.bottom <= rowTop)
+            {
+                continue;
+            }
+            m_activeEdges[kept++] = m_activeEdges[i];
+
+            const qreal y0 = std::max(rowTop, edge.top);
+            const qreal y1 = std::min(rowBottom, edge.bottom);
+            const qreal x0 = edge.x + (y0 - edge.top) * edge.dxdy;
+            const qreal x1 = edge.x + (y1 - edge.top) * edge.dxdy;
+
+            accumulateEdge(x0 - left, y0 - rowTop,
+                           x1 - left, y1 - rowTop,
+                           edge.winding,
+                           width + 1.0);
+        }
+        m_activeEdges.resize(kept);
+
+        if (kept == 0)
+        {
+            continue;
+        }
+
+        Compositing::accumulateCoverage(m_accumulator.data(), m_coverage.data(), width);
+        m_accumulator[width]     = 0.0f;
+        m_accumulator[width + 1] = 0.0f;
+        m_accumulator[width + 2] = 0.0f;
+
+        target.fillCoverageSpan(y, left, m_coverage.constData(), width, paint);
+    }
+}
+
+/**
+ * @brief Accumulate the area covered by an edge within one row.
+ *
+ * The coordinates are relative to the left of the accumulator and to the
+ * top of the row, with y0 < y1. Parts of the edge left of the accumulator
+ * still cover every pixel to their right, so they are moved onto its left
+ * side. Parts at or beyond @p right cannot affect the accumulated pixels
+ * and are dropped.
+ */
+void Rasterizer::accumulateEdge(qreal x0, qreal y0, qreal x1, qreal y1, int winding, qreal right)
+{
+    if ((x0 < 0.0) && (x1 < 0.0))
+    {
+        accumulateArea(0.0, 0.0, (y1 - y0) * winding);
+        return;
+    }
+
+    if ((x0 >= right) && (x1 >= right))
+    {
+        return;
+    }
+
+    if ((x0 < 0.0) || (x1 < 0.0))
+    {
+        const qreal y = y0 + (y1 - y0) * (0.0 - x0) / (x1 - x0);
+        if (x0 < 0.0)
+        {
+            accumulateArea(0.0, 0.0, (y - y0) * winding);
+            x0 = 0.0;
+            y0 = y;
+        }
+        else
+        {
+            accumulateArea(0.0, 0.0, (y1 - y) * winding);
+            x1 = 0.0;
+            y1 = y;
+        }
+    }
+
+    if ((x0 > right) || (x1 > right))
+    {
+        const qreal y = y0 + (y1 - y0) * (right - x0) / (x1 - x0);
+        if (x0 > right)
+        {
+            x0 = right;
+            y0 = y;
+        }
+        else
+        {
+            x1 = right;
+            y1 = y;
+        }
+    }
+
+    accumulateArea(x0, x1, (y1 - y0) * winding);
+}
+
+/**
+ * @brief Accumulate the signed area to the right of a line segment
+ *     within one row.
+ *
+ * @param x0 The X coordinate at the top of the segment.
+ * @param x1 The X coordinate at the bottom of the segment.
+ * @param delta The signed height of the segment.
+ */
+void Rasterizer::accumulateArea(qreal x0, qreal x1, qreal delta)
+{
+    float* const accumulator = m_accumulator.data();
+
+    const qreal xmin = std::min(x0, x1);
+    const qreal xmax = std::max(x0, x1);
+    // accumulateEdge() keeps x0 and x1 within the accumulator, the clamps
+    // only keep the conversions defined.
+    const int   lastCell  = m_accumulator.size() - 1;
+    const int   xminFloor = clampedInt(std::floor(xmin), 0, lastCell - 1);
+    const int   xmaxCeil  = clampedInt(std::ceil(xmax), 0, lastCell);
+
+    if (xmaxCeil <= xminFloor + 1)
+    {
+        // The segment lies within a single pixel column.
+        const qreal xmid = (x0 + x1) * 0.5 - xminFloor;
+        accumulator[xminFloor]     += static_cast<float>(delta * (1.0 - xmid));
+        accumulator[xminFloor + 1] += static_cast<float>(delta * xmid);
+    }
+    else
+    {
+        const qreal slope     = 1.0 / (xmax - xmin);
+        const qreal xminFract = xmin - xminFloor;
+        const qreal xmaxFract = xmax - xmaxCeil + 1.0;
+        const qreal areaFirst = 0.5 * slope * (1.0 - xminFract) * (1.0 - xminFract);
+        const qreal areaLast  = 0.5 * slope * xmaxFract * xmaxFract;
+
+        accumulator[xminFloor] += static_cast<float>(delta * areaFirst);
+
+        if (xmaxCeil == xminFloor + 2)
+        {
+            accumulator[xminFloor + 1] += static_cast<float>(delta * (1.0 - areaFirst - areaLast));
+        }
+        else
+        {
+            const qreal areaSecond = slope * (1.5 - xminFract);
+            accumulator[xminFloor + 1] += static_cast<float>(delta * (areaSecond - areaFirst));
+
+            for (int x = xminFloor + 2; x < xmaxCeil - 1; x++)
+            {
+                accumulator[x] += static_cast<float>(delta * slope);
+            }
+
+            const qreal areaBeforeLast = areaSecond + (xmaxCeil - xminFloor - 3) * slope;
+            accumulator[xmaxCeil - 1] += static_cast<float>(delta * (1.0 - areaBeforeLast - areaLast));
+        }
+
+        accumulator[xmaxCeil] += static_cast<float>(delta * areaLast);
+    }
+}
+
+/**
+ * @brief Clip the segment from @p p0 to @p p1 with the Liang-Barsky algorithm.
+ *
+ * On return @p t0 and @p t1 are the parameters of the part of the segment
+ * inside the rectangle (left, top) - (right, bottom).
+ *
+ * @return @c false if no part of the segment is inside the rectangle.
+ */
+static bool clipSegment(const QPointF& p0, const QPointF& p1,
+                        qreal left, qreal top, qreal right, qreal bottom,
+                        qreal& t0, qreal& t1)
+{
+    const qreal dx = p1.x() - p0.x();
+    const qreal dy = p1.y() - p0.y();
+    const qreal direction[4] = { -dx, dx, -dy, dy };
+    const qreal distance[4]  = { p0.x() - left, right - p0.x(), p0.y() - top, bottom - p0.y() };
+
+    t0 = 0.0;
+    t1 = 1.0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (direction[i] == 0.0)
+        {
+            if (distance[i] < 0.0)
+            {
+                return false;
+            }
+        }
+        else if (direction[i] < 0.0)
+        {
+            t0 = std::max(t0, distance[i] / direction[i]);
+        }
+        else
+        {
+            t1 = std::min(t1, distance[i] / direction[i]);
+        }
+    }
+
+    return t0 <= t1;
+}
+
+/**
+ * @brief Plot the pixels of a Bresenham line inside the target's rectangle.
+ *
+ * The segment is clipped first, and the walk starts from the step where it
+ * enters the rectangle, with the error term it would have had there. The
+ * pixels plotted are the same as when walking the whole segment.
+ *
+ * The end points must be small enough for the products of the error term
+ * to fit in 64 bits (see MAX_EXACT_COORDINATE).
+ *
+ * @param skipFirst @c true to leave out the first pixel of the segment,
+ *     which was already plotted as the last pixel of the previous one.
+ */
+static void plotSegment(qint64 x0, qint64 y0, qint64 x1, qint64 y1,
+                        bool skipFirst,
+                        quint32 color,
+                        RasterTarget& target)
+{
+    const QRect& clip = target.rect();
+
+    // The pixels are within half a pixel of the line along the minor axis,
+    // so clipping to the rectangle grown by a pixel keeps every one of them.
+    qreal t0;
+    qreal t1;
+    if (!clipSegment(QPointF(x0, y0), QPointF(x1, y1),
+                     clip.left() - 1.0, clip.top() - 1.0,
+                     clip.right() + 1.0, clip.bottom() + 1.0,
+                     t0, t1))
+    {
+        return;
+    }
+
+    const qint64 dx = std::abs(x1 - x0);
+    const qint64 dy = std::abs(y1 - y0);
+    const qint64 sx = (x0 < x1) ? 1 : -1;
+    const qint64 sy = (y0 < y1) ? 1 : -1;
+    const qint64 steps = std::max(dx, dy);
+
+    const qint64 firstStep = std::max<qint64>(skipFirst ? 1 : 0,
+                                              static_cast<qint64>(std::floor(t0 * steps)) - 1);
+    const qint64 lastStep  = std::min<qint64>(steps,
+                                              static_cast<qint64>(std::ceil(t1 * steps)) + 1);
+    if (firstStep > lastStep)
+    {
+        return;
+    }
+
+    // Number of steps taken along each axis before the first step.
+    qint64 stepsX;
+    qint64 stepsY;
+    if (dx >= dy)
+    {
+        stepsX = firstStep;
+        stepsY = (dx > 0) ? (dx + 2 * firstStep * dy) / (2 * dx) : 0;
+    }
+    else
+    {
+        stepsY = firstStep;
+        stepsX = (dy + 2 * firstStep * dx) / (2 * dy);
+    }
+
+    qint64 x = x0 + sx * stepsX;
+    qint64 y = y0 + sy * stepsY;
+    qint64 error = dx * (stepsY + 1) - dy * (stepsX + 1);
+
+    for (qint64 step = firstStep; ; step++)
+    {
+        if ((x >= clip.left()) && (x <= clip.right()) &&
+            (y >= clip.top())  && (y <= clip.bottom()))
+        {
+            target.blendSpan(static_cast<int>(y), static_cast<int>(x), static_cast<int>(x), color);
+        }
+
+        if (step == lastStep)
+        {
+            break;
+        }
+
+        const qint64 error2 = 2 * error;
+        if (error2 >= -dy)
+        {
+            error -= dy;
+            x += sx;
+        }
+        if (error2 <= dx)
+        {
+            error += dx;
+            y += sy;
+        }
+    }
+}
+
+/**
+ * @brief Plot a 1 pixel wide connected line through the points.
+ *
+ * Each segment is walked with Bresenham's algorithm, over the part of it
+ * inside the target's rectangle only, so drawing a line one row of tiles
+ * at a time walks each of its pixels once. Pixels shared by consecutive
+ * segments are only blended once.
+ */
+void Rasterizer::plotPolyline(const QVector<QPointF>& points,
+                              quint32 color,
+                              RasterTarget& target)
+{
+    const QRect& clip = target.rect();
+    const qreal  top    = clip.top();
+    const qreal  bottom = clip.bottom() + 1.0;
+
+    for (int i = 0; i + 1 < points.size(); i++)
+    {
+        // Skip the segments entirely above or below the target, such as
+        // most of an arc's segments when drawing a single row of tiles.
+        if ((std::max(points[i].y(), points[i + 1].y()) < top) ||
+            (std::min(points[i].y(), points[i + 1].y()) >= bottom))
+        {
+            continue;
+        }
+
+        const QPointF p0(std::floor(points[i].x()), std::floor(points[i].y()));
+        const QPointF p1(std::floor(points[i + 1].x()), std::floor(points[i + 1].y()));
+
+        if (!std::isfinite(p0.x()) || !std::isfinite(p0.y()) ||
+            !std::isfinite(p1.x()) || !std::isfinite(p1.y()))
+        {
+            continue;
+        }
+
+        if ((std::abs(p0.x()) <= MAX_EXACT_COORDINATE) && (std::abs(p0.y()) <= MAX_EXACT_COORDINATE) &&
+            (std::abs(p1.x()) <= MAX_EXACT_COORDINATE) && (std::abs(p1.y()) <= MAX_EXACT_COORDINATE))
+        {
+            plotSegment(static_cast<qint64>(p0.x()), static_cast<qint64>(p0.y()),
+                        static_cast<qint64>(p1.x()), static_cast<qint64>(p1.y()),
+                        i > 0, color, target);
+            continue;
+        }
+
+        // Too far out to walk exactly: walk the part near the target instead.
+        qreal t0;
+        qreal t1;
+        if (clipSegment(p0, p1,
+                        clip.left() - 1.0, clip.top() - 1.0,
+                        clip.right() + 1.0, clip.bottom() + 1.0,
+                        t0, t1))
+        {
+            const QPointF entry = p0 + (p1 - p0) * t0;
+            const QPointF exit  = p0 + (p1 - p0) * t1;
+            plotSegment(static_cast<qint64>(std::floor(entry.x())), static_cast<qint64>(std::floor(entry.y())),
+                        static_cast<qint64>(std::floor(exit.x())), static_cast<qint64>(std::floor(exit.y())),
+                        (i > 0) && (t0 == 0.0), color, target);
+        }
+    }
+}
@@ -0,0 +1,226 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "tilestore.h"
+#include <QImage>
+#include <QLineF>
+#include <QPointF>
+#include <QRect>
+#include <QRectF>
+#include <QVector>
+
+/**
+ * @brief An elliptical arc, in pixel coordinates.
+ *
+ * The angles follow the same conventions as QPainter::drawArc(), i.e.
+ * the Y axis points down, 0 degrees is at the 3 o'clock position and
+ * positive span angles turn counter-clockwise.
+ */
+struct ArcShape
+{
+    QPointF center;    ///< The center of the ellipse.
+    qreal   rotation;  ///< Clockwise rotation (degrees) of the ellipse about its center.
+    qreal   spanAngle; ///< The span (degrees) of the arc, clamped to +/- 360.
+    qreal   xradius;   ///< The radius along the (unrotated) X axis.
+    qreal   yradius;   ///< The radius along the (unrotated) Y axis.
+};
+
+/**
+ * @brief What to fill a shape with: a solid color or a repeating pattern.
+ *
+ * Patterns are tiles of Compositing::PATTERN_SIZE x PATTERN_SIZE
+ * premultiplied pixels (row by row), aligned to the canvas coordinates so
+ * that neighbouring shapes join seamlessly.
+ */
+struct RasterPaint
+{
+    quint32        color;   ///< The premultiplied color, when @c pattern is null.
+    const quint32* pattern; ///< The pattern tile, or null for a solid color.
+
+    static RasterPaint solid(quint32 color)
+    {
+        RasterPaint paint = {color, nullptr};
+        return paint;
+    }
+
+    static RasterPaint tiled(const quint32* pattern)
+    {
+        RasterPaint paint = {0u, pattern};
+        return paint;
+    }
+};
+
+/**
+ * @brief The part of the canvas' tiles to draw on.
+ *
+ * Coordinates passed to blendSpan() etc. are canvas coordinates and must
+ * lie inside rect(). Spans are split at tile boundaries, and the bounds
+ * of each tile drawn on are extended to cover the pixels which were
+ * actually touched. Pixels with no coverage at either end of a span are
+ * not drawn, so that they don't count as used, and tiles which would only
+ * receive such pixels are not allocated.
+ */
+class RasterTarget
+{
+public:
+    explicit RasterTarget(TileStore& tiles);
+    RasterTarget(TileStore& tiles, const QRect& clip);
+
+    const QRect& rect() const { return m_rect; }
+
+    void blendSpan(int y, int x0, int x1, quint32 color);
+
+    void blendCoverageSpan(int y, int x0, const uchar* coverage, int count, quint32 color);
+
+    void blendImageSpan(int y, int x0, const quint32* pixels, int count);
+
+    void fillSpan(int y, int x0, int x1, const RasterPaint& paint);
+
+    void fillCoverageSpan(int y, int x0, const uchar* coverage, int count, const RasterPaint& paint);
+
+private:
+    quint32* span(int y, int x0, int x1);
+    int tileRemaining(int x) const;
+
+    TileStore&       m_tiles;
+    QRect            m_rect;
+    int              m_column;       ///< Column of the cached tile, or -1.
+    int              m_row;          ///< Row of the cached tile.
+    TileStore::Tile* m_tile;
+    QPoint           m_tileOrigin;   ///< Canvas position of the cached tile's pixel (0,0).
+    uchar*           m_bits;
+    int              m_bytesPerLine;
+};
+
+/**
+ * @brief Scanline rasterizer for the canvas primitives.
+ *
+ * Shapes are flattened into polygons which are then filled with the
+ * non-zero winding rule, one row at a time. Points along arcs are taken
+ * from a precomputed sine/cosine table, so only the end points of an arc
+ * require calls to the trigonometric functions.
+ *
+ * Without antialiasing a pixel is filled when its center is inside the
+ * polygon, and thin (1 pixel) strokes are plotted as connected pixel runs
+ * so that they have no gaps.
+ *
+ * With antialiasing the exact area of each pixel covered by the polygon
+ * is computed by accumulating the signed area under each edge, then
+ * summing along the row (see Compositing::accumulateCoverage()).
+ *
+ * Strokes are drawn with solid colors; fills can also use a repeating
+ * pattern (see RasterPaint).
+ *
+ * A Rasterizer keeps scratch buffers between calls to avoid memory
+ * allocations, so an instance must not be used by more than one thread
+ * at a time.
+ */
+class Rasterizer
+{
+public:
+    Rasterizer();
+
+    bool antialiased() const { return m_antialiased; }
+    void setAntialiased(bool on);
+
+    static QRectF lineBounds(const QLineF& line,
+                             qreal penWidth,
+                             Qt::PenCapStyle capStyle);
+
+    static QRectF arcBounds(const ArcShape& arc,
+                            qreal penWidth,
+                            Qt::PenCapStyle capStyle);
+
+    static int angleStep(qreal angle, int stepsPerTurn);
+
+    void strokeLine(const QLineF& line,
+                    qreal penWidth,
+                    Qt::PenCapStyle capStyle,
+                    quint32 color,
+                    RasterTarget& target);
+
+    void strokeArc(const ArcShape& arc,
+                   qreal penWidth,
+                   Qt::PenCapStyle capStyle,
+                   quint32 color,
+                   RasterTarget& target);
+
+    void fillPie(const ArcShape& arc,
+                 const RasterPaint& paint,
+                 RasterTarget& target);
+
+private:
+    struct Edge
+    {
+        qreal x;       ///< X coordinate at the top of the edge.
+        qreal dxdy;    ///< Change in X per unit of Y.
+        qreal top;
+        qreal bottom;
+        int   winding; ///< +1 for downward edges, -1 for upward edges.
+    };
+
+    struct Crossing
+    {
+        qreal x;
+        int   winding;
+    };
+
+    void flattenArc(const ArcShape& arc, qreal penRadius);
+
+    void strokePoints(bool closed,
+                      qreal penRadius,
+                      Qt::PenCapStyle capStyle,
+                      quint32 color,
+                      RasterTarget& target);
+
+    void buildEdges(const QVector<QPointF>& polygon);
+
+    void fillPolygon(const QVector<QPointF>& polygon,
+                     const RasterPaint& paint,
+                     RasterTarget& target);
+
+    void fillPolygonAntialiased(const QVector<QPointF>& polygon,
+                                const RasterPaint& paint,
+                                RasterTarget& target);
+
+    void accumulateEdge(qreal x0, qreal y0, qreal x1, qreal y1, int winding, qreal right);
+
+    void accumulateArea(qreal x0, qreal x1, qreal delta);
+
+    void plotPolyline(const QVector<QPointF>& points,
+                      quint32 color,
+                      RasterTarget& target);
+
+    bool m_antialiased;
+
+    QVector<QPointF>  m_points;
+    QVector<QPointF>  m_normals;
+    QVector<QPointF>  m_outline;
+    QVector<Edge>     m_edges;
+    QRectF            m_edgeBounds;
+    QVector<int>      m_activeEdges;
+    QVector<Crossing> m_crossings;
+    QVector<float>    m_accumulator;
+    QVector<uchar>    m_coverage;
+};
+
+#endif // RASTERIZER_H
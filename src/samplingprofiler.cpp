@@ -0,0 +1,185 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "samplingprofiler.h"
+#include <QMutexLocker>
+#include <QStringList>
+#include <QTextStream>
+#include <algorithm>
+#include <cstring>
+
+// Deeply recursive scripts are truncated to the innermost frames.
+static const int MAX_STACK_DEPTH = 256;
+
+/**
+ * @brief Return a human readable name for a stack frame.
+ *
+ * The name has the format "function@source:line", where @c line is the
+ * line on which the function is defined.
+ */
+static QString frameName(const lua_Debug& ar)
+{
+    QString name;
+
+    if (0 == strcmp(ar.what, "main"))
+    {
+        name = "main chunk";
+    }
+    else if (nullptr != ar.name)
+    {
+        name = ar.name;
+    }
+    else
+    {
+        name = "?";
+    }
+
+    if (0 == strcmp(ar.what, "C"))
+    {
+        return "[C] " + name;
+    }
+
+    // Frame separators must not appear in frame names.
+    QString source = QString(ar.short_src).replace(';', ':');
+
+    return QString("%1@%2:%3").arg(name).arg(source).arg(ar.linedefined);
+}
+
+SamplingProfiler::SamplingProfiler() :
+    m_running(0),
+    m_mutex(),
+    m_interval(1),
+    m_instructionsUntilSample(1),
+    m_stacks()
+{
+}
+
+/**
+ * @brief Start collecting samples.
+ *
+ * The samples collected by a previous run of the profiler are discarded.
+ *
+ * @param intervalInstructions The number of Lua VM instructions between samples.
+ *    The effective interval is rounded up to the granularity of the ScriptRunner's
+ *    count hook.
+ */
+void SamplingProfiler::start(int intervalInstructions)
+{
+    QMutexLocker lock(&m_mutex);
+    m_interval                = std::max(1, intervalInstructions);
+    m_instructionsUntilSample = m_interval;
+    m_stacks.clear();
+    m_running.storeRelease(1);
+}
+
+/**
+ * @brief Stop collecting samples.
+ *
+ * The samples collected so far are available from foldedStacks().
+ */
+void SamplingProfiler::stop()
+{
+    QMutexLocker lock(&m_mutex);
+    m_running.storeRelease(0);
+}
+
+int SamplingProfiler::sampleInterval() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_interval;
+}
+
+/**
+ * @brief Account for executed instructions and take a sample if one is due.
+ *
+ * @param state The Lua VM. This must be called from within a hook of this VM.
+ * @param instructions The number of VM instructions executed since the last call.
+ */
+void SamplingProfiler::sample(lua_State* state, int instructions)
+{
+    QMutexLocker lock(&m_mutex);
+
+    // The profiler might have been stopped since the caller checked running().
+    if (!running())
+    {
+        return;
+    }
+
+    m_instructionsUntilSample -= instructions;
+    if (m_instructionsUntilSample > 0)
+    {
+        return;
+    }
+    m_instructionsUntilSample = m_interval;
+
+    // Walk the stack from the innermost frame (level 0) outwards.
+    QStringList frames;
+    lua_Debug ar;
+    for (int level = 0; level < MAX_STACK_DEPTH; level++)
+    {
+        if (0 == lua_getstack(state, level, &ar))
+        {
+            break;
+        }
+
+        if (0 != lua_getinfo(state, "Sn", &ar))
+        {
+            frames.prepend(frameName(ar));
+        }
+    }
+
+    if (!frames.isEmpty())
+    {
+        m_stacks[frames.join(';')] += 1;
+    }
+}
+
+/**
+ * @brief Get the collected samples in the folded stacks format.
+ *
+ * The stacks are sorted by decreasing sample count.
+ */
+QString SamplingProfiler::foldedStacks() const
+{
+    QList<QPair<quint64, QString> > stacks;
+
+    {
+        QMutexLocker lock(&m_mutex);
+        for (auto it = m_stacks.constBegin(); it != m_stacks.constEnd(); ++it)
+        {
+            stacks.append(qMakePair(it.value(), it.key()));
+        }
+    }
+
+    std::sort(stacks.begin(), stacks.end(),
+              [](const QPair<quint64, QString>& a, const QPair<quint64, QString>& b)
+              {
+                  return a.first > b.first;
+              });
+
+    QString folded;
+    QTextStream stream(&folded);
+    for (const QPair<quint64, QString>& stack : stacks)
+    {
+        stream << stack.second << ' ' << stack.first << '\n';
+    }
+    stream.flush();
+
+    return folded;
+}
@@ -0,0 +1,82 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef SAMPLINGPROFILER_H
+#define SAMPLINGPROFILER_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include "lua.hpp"
+
+/**
+ * @brief Statistical profiler for Lua scripts.
+ *
+ * While the profiler is running, sample() is called periodically by the
+ * ScriptRunner's count hook. Every sampleInterval() VM instructions the Lua
+ * call stack is captured (via @c lua_getstack and @c lua_getinfo) and
+ * aggregated.
+ *
+ * The aggregated samples are returned by foldedStacks() in the "folded stacks"
+ * format used by flame graph tools (e.g. flamegraph.pl, speedscope):
+ *
+ * @code
+ * main chunk@[string "..."]:0;spiral@[string "..."]:3;fd@turtle.lua:269 42
+ * @endcode
+ *
+ * i.e. one line per unique stack, with the outermost frame first, followed
+ * by the number of samples in which that stack was observed.
+ *
+ * start(), stop() and foldedStacks() can be called from any thread.
+ * sample() must only be called by the thread running the Lua VM.
+ */
+class SamplingProfiler
+{
+public:
+    static const int DEFAULT_SAMPLE_INTERVAL = 10000;
+
+    SamplingProfiler();
+
+    void start(int intervalInstructions);
+    void stop();
+
+    inline bool running() const
+    {
+        return 0 != m_running.loadAcquire();
+    }
+
+    int sampleInterval() const;
+
+    void sample(lua_State* state, int instructions);
+
+    QString foldedStacks() const;
+
+private:
+    Q_DISABLE_COPY(SamplingProfiler)
+
+    QAtomicInt m_running;
+
+    mutable QMutex m_mutex;
+    int m_interval;
+    int m_instructionsUntilSample;
+    QHash<QString, quint64> m_stacks;
+};
+
+#endif // SAMPLINGPROFILER_H
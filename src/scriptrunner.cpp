@@ -18,13 +18,29 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  ***********************************************************************/
 #include "scriptrunner.h"
+#include "perfcounters.h"
+#include "luaallocator.h"
+#include "tracer.h"
+#include <QElapsedTimer>
 #include <QMutexLocker>
-#include <QPen>
+#include <algorithm>
 #include <cassert>
+#include <climits>
 
 static const int DRAW_LINE_ARGS_COUNT = 10;
 static const int DRAW_ARC_ARGS_COUNT = 18;
 static const int SET_BACKGROUND_COLOR_ARGS_COUNT = 3;
+static const int GET_PIXEL_ARGS_COUNT = 2;
+static const int FLOOD_FILL_ARGS_COUNT = 6;
+static const int STAMP_ARGS_COUNT = 4;
+static const int DRAW_TEXT_ARGS_COUNT = 8;
+static const int DRAW_IMAGE_ARGS_COUNT = 3;
+
+// Number of Lua VM instructions between each call to the debug hook.
+static const int DEBUG_HOOK_INSTRUCTION_COUNT = 100;
+
+// Maximum time (ms) for which the drawings of the tasks run by _ui.sched.run() are batched.
+static const qint64 TASK_BATCH_INTERVAL = 16;
 
 static const char* LUA_SCRIPT_RUNNER_NAME = "_turtyl_script_runner";
 
@@ -110,6 +126,55 @@ static lua_Integer getInteger(lua_State* state, int stackPos, const char* funcNa
     return static_cast<lua_Integer>(integer);
 }
 
+/**
+ * @brief Get a layer number from the stack.
+ *
+ * Layers are numbered from 1 in Lua, and from 0 by the canvas.
+ *
+ * @return The canvas' layer index. A Lua error is raised if the layer
+ *     does not exist.
+ */
+static int getLayer(lua_State* state, int stackPos, const char* funcName)
+{
+    const lua_Integer layer = getInteger(state, stackPos, funcName);
+    if ((layer < 1) || (layer > TurtleCanvasGraphicsItem::MAX_LAYERS))
+    {
+        lua_pushstring(state,
+                       QString("argument %1 to %2 must be a layer from 1 to %3")
+                        .arg(stackPos)
+                        .arg(funcName)
+                        .arg(TurtleCanvasGraphicsItem::MAX_LAYERS)
+                        .toStdString().c_str());
+        lua_error(state);
+    }
+    return static_cast<int>(layer - 1);
+}
+
+/**
+ * @brief Get a string from the lua stack, or call lua_error if the stack argument isn't a string.
+ *
+ * @warning If the value at the specified position on the lua stack is not a string, then
+ * lua_error is called and this function does not return.
+ *
+ * @return The string, decoded from UTF-8.
+ */
+static QString getString(lua_State* state, int stackPos, const char* funcName)
+{
+    if (LUA_TSTRING != lua_type(state, stackPos))
+    {
+        lua_pushstring(state,
+                       QString("argument %1 to %2 must be a string")
+                        .arg(stackPos)
+                        .arg(funcName)
+                        .toStdString().c_str());
+        lua_error(state);
+    }
+
+    size_t length = 0;
+    const char* string = lua_tolstring(state, stackPos, &length);
+    return QString::fromUtf8(string, static_cast<int>(length));
+}
+
 static bool getBoolean(lua_State* state, int stackPos, const char* funcName)
 {
     if (0 == lua_isboolean(state, stackPos))
@@ -130,7 +195,15 @@ static bool getBoolean(lua_State* state, int stackPos, const char* funcName)
 }
 
 /**
- * @brief Return a QColor from real RGBA components.
+ * @brief Clamp a lua integer to the range of an int.
+ */
+static int clampedInt(lua_Integer value)
+{
+    return static_cast<int>(std::max<lua_Integer>(INT_MIN, std::min<lua_Integer>(INT_MAX, value)));
+}
+
+/**
+ * @brief Return a QRgb from real RGBA components.
  *
  * If any of the RGBA components are outside the range [0,255] then
  * they are clipped to the valid range. E.g. the value 300 is clipped
@@ -145,109 +218,139 @@ static bool getBoolean(lua_State* state, int stackPos, const char* funcName)
  * @param a
  * @return
  */
-static QColor clippedColor(qreal r, qreal g, qreal b, qreal a)
+static QRgb clippedRgba(qreal r, qreal g, qreal b, qreal a)
 {
     // Add 0.5 to round to the nearest integer color value.
-    return QColor(static_cast<int>(std::min(255.0, std::max(0.0, r + 0.5))),
-                  static_cast<int>(std::min(255.0, std::max(0.0, g + 0.5))),
-                  static_cast<int>(std::min(255.0, std::max(0.0, b + 0.5))),
-                  static_cast<int>(std::min(255.0, std::max(0.0, a + 0.5))));
+    return qRgba(static_cast<int>(std::min(255.0, std::max(0.0, r + 0.5))),
+                 static_cast<int>(std::min(255.0, std::max(0.0, g + 0.5))),
+                 static_cast<int>(std::min(255.0, std::max(0.0, b + 0.5))),
+                 static_cast<int>(std::min(255.0, std::max(0.0, a + 0.5))));
+}
+
+/**
+ * @brief Return a QColor from real RGBA components.
+ *
+ * The components are clipped and rounded as for clippedRgba().
+ */
+static QColor clippedColor(qreal r, qreal g, qreal b, qreal a)
+{
+    return QColor::fromRgba(clippedRgba(r, g, b, a));
 }
 
-static void setPenCapStyle(QPen& pen, lua_Integer capStyle)
+static Qt::PenCapStyle toPenCapStyle(lua_Integer capStyle)
 {
     switch (capStyle)
     {
     case 2:
-        pen.setCapStyle(Qt::FlatCap);
-        break;
+        return Qt::FlatCap;
 
     case 3:
-        pen.setCapStyle(Qt::RoundCap);
-        break;
+        return Qt::RoundCap;
 
     case 1:
     default:
-        pen.setCapStyle(Qt::SquareCap);
-
+        return Qt::SquareCap;
     }
 }
 
-static void setBrushStyle(QBrush& brush, lua_Integer brushStyle)
+static Qt::BrushStyle toBrushStyle(lua_Integer brushStyle)
 {
     switch (brushStyle)
     {
     case 2:
-        brush.setStyle(Qt::Dense1Pattern);
-        break;
+        return Qt::Dense1Pattern;
 
     case 3:
-        brush.setStyle(Qt::Dense2Pattern);
-        break;
+        return Qt::Dense2Pattern;
 
     case 4:
-        brush.setStyle(Qt::Dense3Pattern);
-        break;
+        return Qt::Dense3Pattern;
 
     case 5:
-        brush.setStyle(Qt::Dense4Pattern);
-        break;
+        return Qt::Dense4Pattern;
 
     case 6:
-        brush.setStyle(Qt::Dense5Pattern);
-        break;
+        return Qt::Dense5Pattern;
 
     case 7:
-        brush.setStyle(Qt::Dense6Pattern);
-        break;
+        return Qt::Dense6Pattern;
 
     case 8:
-        brush.setStyle(Qt::Dense7Pattern);
-        break;
+        return Qt::Dense7Pattern;
 
     case 9:
-        brush.setStyle(Qt::NoBrush);
-        break;
+        return Qt::NoBrush;
 
     case 10:
-        brush.setStyle(Qt::HorPattern);
-        break;
+        return Qt::HorPattern;
 
     case 11:
-        brush.setStyle(Qt::VerPattern);
-        break;
+        return Qt::VerPattern;
 
     case 12:
-        brush.setStyle(Qt::CrossPattern);
-        break;
+        return Qt::CrossPattern;
 
     case 13:
-        brush.setStyle(Qt::BDiagPattern);
-        break;
+        return Qt::BDiagPattern;
 
     case 14:
-        brush.setStyle(Qt::FDiagPattern);
-        break;
+        return Qt::FDiagPattern;
 
     case 15:
-        brush.setStyle(Qt::DiagCrossPattern);
-        break;
+        return Qt::DiagCrossPattern;
 
     case 1:
     default:
-        brush.setStyle(Qt::SolidPattern);
-        break;
+        return Qt::SolidPattern;
     }
 }
 
+/**
+ * @brief Return the number of bytes used by the characters of a string.
+ *
+ * This is used to account for the memory used by the message queues.
+ */
+static qint64 stringBytes(const QString& str)
+{
+    return static_cast<qint64>(str.size()) * static_cast<qint64>(sizeof(QChar));
+}
+
+/**
+ * @brief Push a table of memory gauges onto the Lua stack.
+ *
+ * The table has the fields @c bytes and @c peak.
+ */
+static void pushGauge(lua_State* state, const PerfGauge& gauge)
+{
+    lua_createtable(state, 0, 2);
+
+    lua_pushinteger(state, static_cast<lua_Integer>(gauge.value()));
+    lua_setfield(state, -2, "bytes");
+
+    lua_pushinteger(state, static_cast<lua_Integer>(gauge.peak()));
+    lua_setfield(state, -2, "peak");
+}
+
 /**
  * @brief Constructor
  *
  * @param graphicsWidget Pointer to the canvas to where scripts will draw.
  */
 ScriptRunner::ScriptRunner(TurtleCanvasGraphicsItem* const graphicsWidget) :
-    m_state(luaL_newstate()),
+    m_state(LuaAllocator::newState()),
     m_graphicsWidget(graphicsWidget),
+    m_samplingProfiler(),
+    m_functionProfiler(),
+    m_exactProfiling(false),
+    m_hookTicks(0),
+    m_tracerSteps(1),
+    m_tracerCount(0),
+    m_turtlePending(false),
+    m_pendingTurtlePos(),
+    m_pendingTurtleHeading(0.0),
+    m_pendingTurtleColor(),
+    m_scheduler(),
+    m_taskSwitchRef(LUA_NOREF),
     m_scriptsQueueSema(),
     m_scriptsQueueMutex(),
     m_scriptsQueue(),
@@ -264,6 +367,8 @@ ScriptRunner::ScriptRunner(TurtleCanvasGraphicsItem* const graphicsWidget) :
     m_requirePaths(),
     m_requirePathsChanged(false)
 {
+    setObjectName("Lua");
+
     assert(NULL != m_state);
     assert(NULL != graphicsWidget);
 
@@ -301,6 +406,26 @@ TurtleCanvasGraphicsItem* ScriptRunner::graphicsWidget() const
     return m_graphicsWidget;
 }
 
+/**
+ * @brief Get the Lua sampling profiler.
+ *
+ * @return The profiler.
+ */
+SamplingProfiler& ScriptRunner::samplingProfiler()
+{
+    return m_samplingProfiler;
+}
+
+/**
+ * @brief Get the exact per-function profiler.
+ *
+ * @return The profiler.
+ */
+FunctionProfiler& ScriptRunner::functionProfiler()
+{
+    return m_functionProfiler;
+}
+
 /**
  * @brief Send a request to stop the thread.
  *
@@ -353,6 +478,9 @@ void ScriptRunner::haltScript()
         m_sleepCond.wakeAll();
     }
 
+    // The script might be waiting for a frame.
+    m_graphicsWidget->cancelFrameWait();
+
     // The script might be waiting to send a message.
     // If so, then wake it up, so that it can detect the halt request.
     // (see emitMessage())
@@ -432,6 +560,7 @@ void ScriptRunner::runScript(const QString& script)
     {
         QMutexLocker lock(&m_scriptsQueueMutex);
         m_scriptsQueue.push_back(script);
+        PerfCounters::instance().messageQueueBytes.add(stringBytes(script));
     }
 
     m_scriptsQueueSema.release();
@@ -457,7 +586,17 @@ void ScriptRunner::runScriptFile(const QString& filename)
     applyRequirePaths();
 
     lua_pop(m_state, lua_gettop(m_state));
-    if (0 == luaL_dofile(m_state, filename.toStdString().c_str()))
+    int status;
+    {
+        TraceScope scope("compile script", "lua");
+        status = luaL_loadfile(m_state, filename.toStdString().c_str());
+    }
+    if (LUA_OK == status)
+    {
+        status = callLoadedChunk();
+    }
+
+    if (0 == status)
     {
         emit scriptFinished(false);
     }
@@ -505,6 +644,111 @@ void ScriptRunner::applyRequirePaths()
     }
 }
 
+/**
+ * @brief Run the chunk on the top of the Lua stack (see luaL_loadstring()).
+ *
+ * @pre @c m_luaMutex is locked by the caller.
+ *
+ * @return The status code returned by lua_pcall().
+ */
+int ScriptRunner::callLoadedChunk()
+{
+    applyHookMode(m_state);
+
+    int status;
+    {
+        TraceScope scope("run script", "lua");
+        status = lua_pcall(m_state, 0, LUA_MULTRET, 0);
+    }
+
+    finishFunctionProfile();
+
+    publishTurtle();
+
+    // Tasks which were not run to completion (e.g. after an error), and the
+    // task switch function, which would otherwise be called by the next
+    // script's _ui.sched.run().
+    m_scheduler.clear(m_state);
+    luaL_unref(m_state, LUA_REGISTRYINDEX, m_taskSwitchRef);
+    m_taskSwitchRef = LUA_NOREF;
+
+    // Scripts which animated the canvas may leave it mid-frame.
+    m_graphicsWidget->endFrames();
+
+    return status;
+}
+
+/**
+ * @brief Install the debug hooks needed by the current profiling mode.
+ *
+ * Normally only the count hook is installed, which runs every
+ * DEBUG_HOOK_INSTRUCTION_COUNT instructions. While the FunctionProfiler is
+ * enabled the call and return hooks are also installed and the count hook
+ * runs for every instruction.
+ *
+ * Each coroutine has its own hooks, copied from the thread which created
+ * it, so the hooks are installed on @p state as well as on m_state. The
+ * other coroutines are updated by debugHook() when they next run.
+ *
+ * @param state The Lua thread which is running.
+ *
+ * @pre This is called by the Lua thread.
+ */
+void ScriptRunner::applyHookMode(lua_State* state)
+{
+    const bool exact = m_functionProfiler.enabled();
+    if (exact != m_exactProfiling)
+    {
+        m_exactProfiling = exact;
+        m_hookTicks      = 0;
+
+        if (!exact)
+        {
+            // The frames that are still open will never see their return events.
+            m_functionProfiler.finish();
+        }
+    }
+
+    (void)installHook(m_state);
+    (void)installHook(state);
+}
+
+/**
+ * @brief Install the debug hooks of the current profiling mode on a Lua
+ *     thread, unless they are already installed.
+ *
+ * @param state The Lua thread.
+ * @return @c true if the hooks were installed, @c false if they already were.
+ */
+bool ScriptRunner::installHook(lua_State* state) const
+{
+    const int mask  = m_exactProfiling ? (LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT) : LUA_MASKCOUNT;
+    const int count = m_exactProfiling ? 1 : DEBUG_HOOK_INSTRUCTION_COUNT;
+
+    if ((lua_gethookmask(state) != mask) || (lua_gethookcount(state) != count))
+    {
+        lua_sethook(state, &debugHookEntry, mask, count);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Publish the FunctionProfiler's report (if any) and reset it.
+ *
+ * @pre This is called by the Lua thread.
+ */
+void ScriptRunner::finishFunctionProfile()
+{
+    if (!m_functionProfiler.isEmpty())
+    {
+        m_functionProfiler.finish();
+        emit functionProfileReady(m_functionProfiler.report());
+        m_functionProfiler.reset();
+    }
+}
+
 /**
  * @brief Blocks for the specified delay.
  *
@@ -521,6 +765,8 @@ void ScriptRunner::doSleep(int msecs)
 {
     if (msecs > 0)
     {
+        TraceScope scope("sleep", "lua");
+
         QMutexLocker lock(&m_sleepMutex);
         if (m_sleepAllowed)
         {
@@ -529,6 +775,45 @@ void ScriptRunner::doSleep(int msecs)
     }
 }
 
+/**
+ * @brief Display the frame drawn by the script, and wait until it is painted.
+ *
+ * Like doSleep(), this does not block if the script is being halted.
+ *
+ * @see TurtleCanvasGraphicsItem::presentFrame()
+ */
+void ScriptRunner::doWaitFrame()
+{
+    {
+        QMutexLocker lock(&m_sleepMutex);
+        if (!m_sleepAllowed)
+        {
+            return;
+        }
+    }
+
+    publishTurtle();
+    m_graphicsWidget->presentFrame();
+}
+
+/**
+ * @brief Move the on-screen turtle to its position held back by the tracer.
+ *
+ * @see setTracer()
+ */
+void ScriptRunner::publishTurtle()
+{
+    if (m_turtlePending)
+    {
+        m_graphicsWidget->setTurtle(m_pendingTurtlePos,
+                                    m_pendingTurtleHeading,
+                                    m_pendingTurtleColor);
+        m_turtlePending = false;
+    }
+
+    m_tracerCount = 0;
+}
+
 /**
  * @brief Check for a request to halt/abort the current execution of the script.
  *
@@ -546,12 +831,14 @@ bool ScriptRunner::haltRequested() const
  *
  * @warning This function will not return if it halts the script, since it calls
  * lua_error().
+ *
+ * @param state The Lua thread running the script, which may be a coroutine.
  */
-void ScriptRunner::haltIfRequested()
+void ScriptRunner::haltIfRequested(lua_State* state)
 {
     if (haltRequested())
     {
-        lua_error(m_state);
+        lua_error(state);
     }
 }
 
@@ -586,15 +873,20 @@ void ScriptRunner::emitMessage(const QString& message)
 
     // If the UI hasn't yet read the previous message then wait for the UI to
     // catch up before sending the next one to avoid overloading the UI.
-    while ((!haltRequested()) && m_scriptMessagePending)
     {
-        m_scriptMessageCond.wait(&m_scriptMessageMutex);
+        TraceScope scope("message wait", "lua");
+
+        while ((!haltRequested()) && m_scriptMessagePending)
+        {
+            m_scriptMessageCond.wait(&m_scriptMessageMutex);
+        }
     }
 
     // Don't do anything if the script needs to halt.
     if (!haltRequested())
     {
         m_scriptMessage = message;
+        PerfCounters::instance().messageQueueBytes.add(stringBytes(m_scriptMessage));
         m_scriptMessagePending = true;
 
         emit scriptMessageReceived();
@@ -612,6 +904,7 @@ QString ScriptRunner::pendingScriptMessage()
 
     QMutexLocker lock(&m_scriptMessageMutex);
     message.swap(m_scriptMessage);
+    PerfCounters::instance().messageQueueBytes.add(-stringBytes(message));
     m_scriptMessagePending = false;
     m_scriptMessageCond.wakeAll();
 
@@ -624,6 +917,7 @@ QString ScriptRunner::pendingScriptMessage()
 void ScriptRunner::clearPendingScriptMessage()
 {
     QMutexLocker lock(&m_scriptMessageMutex);
+    PerfCounters::instance().messageQueueBytes.add(-stringBytes(m_scriptMessage));
     m_scriptMessage.clear();
     m_scriptMessagePending = false;
     m_scriptMessageCond.wakeAll();
@@ -657,6 +951,7 @@ void ScriptRunner::run()
             {
                 scriptData = m_scriptsQueue.front();
                 m_scriptsQueue.pop_front();
+                PerfCounters::instance().messageQueueBytes.add(-stringBytes(scriptData));
                 hasScriptData = true;
             }
             else
@@ -675,7 +970,17 @@ void ScriptRunner::run()
 
             lua_pop(m_state, lua_gettop(m_state));
 
-            if (0 == luaL_dostring(m_state, scriptData.toStdString().c_str()))
+            int status;
+            {
+                TraceScope scope("compile script", "lua");
+                status = luaL_loadstring(m_state, scriptData.toStdString().c_str());
+            }
+            if (LUA_OK == status)
+            {
+                status = callLoadedChunk();
+            }
+
+            if (0 == status)
             {
                 emit scriptFinished(false);
             }
@@ -792,9 +1097,28 @@ void ScriptRunner::setupCommands()
     static const luaL_Reg uiTableFuncs[] =
     {
         {"print", &ScriptRunner::printMessage},
+        {"stats", &ScriptRunner::memoryStats},
+        {"frame", &ScriptRunner::frame},
+        {nullptr, nullptr}
+    };
+
+    static const luaL_Reg profileTableFuncs[] =
+    {
+        {"start", &ScriptRunner::profileStart},
+        {"stop",  &ScriptRunner::profileStop},
+        {"exact", &ScriptRunner::profileExact},
         {nullptr, nullptr}
     };
 
+    static const luaL_Reg schedTableFuncs[] =
+    {
+        {"spawn",    &ScriptRunner::spawnTask},
+        {"run",      &ScriptRunner::runTasks},
+        {"onswitch", &ScriptRunner::setTaskSwitch},
+        {"current",  &ScriptRunner::currentTask},
+        {nullptr,    nullptr}
+    };
+
     static const luaL_Reg canvasTableFuncs[] =
     {
         {"drawline",           &ScriptRunner::drawLine},
@@ -808,6 +1132,20 @@ void ScriptRunner::setupCommands()
         {"hideturtle",         &ScriptRunner::hideTurtle},
         {"turtlehidden",       &ScriptRunner::turtleHidden},
         {"setaa",              &ScriptRunner::setAntialiasing},
+        {"checkpoint",         &ScriptRunner::checkpoint},
+        {"restore",            &ScriptRunner::restoreCheckpoint},
+        {"discardcheckpoint",  &ScriptRunner::discardCheckpoint},
+        {"tracer",             &ScriptRunner::setTracer},
+        {"getpixel",           &ScriptRunner::getPixel},
+        {"floodfill",          &ScriptRunner::floodFill},
+        {"layer",              &ScriptRunner::setLayer},
+        {"setlayervisible",    &ScriptRunner::setLayerVisible},
+        {"setlayeropacity",    &ScriptRunner::setLayerOpacity},
+        {"definestamp",        &ScriptRunner::defineStamp},
+        {"stamp",              &ScriptRunner::drawStamp},
+        {"drawtext",           &ScriptRunner::drawText},
+        {"loadimage",          &ScriptRunner::loadImage},
+        {"drawimage",          &ScriptRunner::drawImage},
         {nullptr,              nullptr}
     };
 
@@ -825,28 +1163,97 @@ void ScriptRunner::setupCommands()
 
     lua_rawset(m_state, 1); // _ui['canvas'] = canvas
 
+    lua_pushliteral(m_state, "profile");
+    luaL_newlib(m_state, profileTableFuncs);
+
+    lua_rawset(m_state, 1); // _ui['profile'] = profile
+
+    lua_pushliteral(m_state, "sched");
+    luaL_newlib(m_state, schedTableFuncs);
+
+    lua_rawset(m_state, 1); // _ui['sched'] = sched
+
     lua_setglobal(m_state, "_ui"); // _G['_ui'] = _ui
 
     lua_register(m_state, "sleep", &ScriptRunner::sleep);
+    lua_register(m_state, "waitframe", &ScriptRunner::frame);
 
-    lua_sethook(m_state, &debugHookEntry, LUA_MASKCOUNT, 100);
+    lua_sethook(m_state, &debugHookEntry, LUA_MASKCOUNT, DEBUG_HOOK_INSTRUCTION_COUNT);
 }
 
 /**
  * @brief Debug hook.
  *
  * This debug hook is called periodically by the Lua VM (via debugHookEntry())
- * and handles pausing and halting scripts.
+ * and handles pausing and halting scripts. It also publishes the VM's
+ * performance counters (see PerfCounters) and drives the profilers.
  *
  * @param state The Lua VM.
+ * @param ar The activation record of the hook event.
  */
-void ScriptRunner::debugHook(lua_State* state)
+void ScriptRunner::debugHook(lua_State* state, lua_Debug* ar)
 {
-    assert(state == m_state);
+    // The state is a coroutine (e.g. a task of m_scheduler) rather than
+    // m_state while one is running. A coroutine keeps the hooks it was
+    // created with, so the event is dropped if they belong to a profiling
+    // mode which is not current anymore.
+    if (installHook(state))
+    {
+        return;
+    }
+
+    // Call and return events are only enabled for the FunctionProfiler.
+    switch (ar->event)
+    {
+    case LUA_HOOKCALL:
+        m_functionProfiler.enterFunction(state, ar, false);
+        return;
+
+    case LUA_HOOKTAILCALL:
+        m_functionProfiler.enterFunction(state, ar, true);
+        return;
+
+    case LUA_HOOKRET:
+        m_functionProfiler.leaveFunction(state);
+        return;
+
+    default:
+        break;
+    }
+
+    // The count hook runs for every instruction while exact profiling
+    // is enabled, but the periodic checks below don't need to run that often.
+    if (m_exactProfiling)
+    {
+        m_functionProfiler.countInstruction(state);
+
+        if (++m_hookTicks < DEBUG_HOOK_INSTRUCTION_COUNT)
+        {
+            return;
+        }
+        m_hookTicks = 0;
+    }
+
+    PerfCounters& counters = PerfCounters::instance();
+    counters.luaInstructionsTotal.fetchAndAddRelaxed(DEBUG_HOOK_INSTRUCTION_COUNT);
+
+    if (m_samplingProfiler.running())
+    {
+        m_samplingProfiler.sample(state, DEBUG_HOOK_INSTRUCTION_COUNT);
+    }
+
+    applyHookMode(state);
 
     pauseIfRequested();
 
-    haltIfRequested();
+    haltIfRequested(state);
+
+    // A task which has used its budget is yielded back to _ui.sched.run().
+    // It is yielded later if it is running a C function which can't yield.
+    if (m_scheduler.consume(state, DEBUG_HOOK_INSTRUCTION_COUNT) && lua_isyieldable(state))
+    {
+        (void)lua_yield(state, 0);
+    }
 }
 
 /**
@@ -898,13 +1305,17 @@ int ScriptRunner::drawLine(lua_State* state)
     QLineF line(x1, -y1,
                 x2, -y2);
 
-    QPen pen(clippedColor(r,g,b,a), size);
-    setPenCapStyle(pen, capStyle);
+    DrawStyle style;
+    style.penColor   = clippedRgba(r,g,b,a);
+    style.penWidth   = size;
+    style.capStyle   = toPenCapStyle(capStyle);
+    style.brushColor = 0;
+    style.brushStyle = Qt::NoBrush;
 
     ScriptRunner& runner = getScriptRunner(state);
-    runner.graphicsWidget()->drawLine(line, pen);
+    runner.graphicsWidget()->drawLine(line, style);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     return 0;
 }
@@ -975,11 +1386,12 @@ int ScriptRunner::drawArc(lua_State* state)
     // In Qt the top-left is (0,0) so the coordinates from the script are flipped
     QPointF arcCenterPos(centerx, -centery);
 
-    QPen pen(clippedColor(r,g,b,a), size);
-    setPenCapStyle(pen, capStyle);
-
-    QBrush brush(clippedColor(brush_r, brush_g, brush_b, brush_a));
-    setBrushStyle(brush, brushStyle);
+    DrawStyle style;
+    style.penColor   = clippedRgba(r,g,b,a);
+    style.penWidth   = size;
+    style.capStyle   = toPenCapStyle(capStyle);
+    style.brushColor = clippedRgba(brush_r, brush_g, brush_b, brush_a);
+    style.brushStyle = toBrushStyle(brushStyle);
 
     ScriptRunner& runner = getScriptRunner(state);
     runner.graphicsWidget()->drawArc(arcCenterPos,
@@ -987,11 +1399,10 @@ int ScriptRunner::drawArc(lua_State* state)
                                      angle,
                                      xradius,
                                      yradius,
-                                     pen,
-                                     brush,
+                                     style,
                                      filled);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     return 0;
 }
@@ -1009,7 +1420,7 @@ int ScriptRunner::clearScreen(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.graphicsWidget()->clear();
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
     return 0;
 }
 
@@ -1035,7 +1446,7 @@ int ScriptRunner::setBackgroundColor(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.graphicsWidget()->setBackgroundColor(color);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     return 0;
 }
@@ -1047,7 +1458,7 @@ int ScriptRunner::getBackgroundColor(lua_State* state)
 
     ScriptRunner& runner = getScriptRunner(state);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     const QColor color = runner.graphicsWidget()->backgroundColor();
 
@@ -1058,52 +1469,442 @@ int ScriptRunner::getBackgroundColor(lua_State* state)
     return 3;
 }
 
-int ScriptRunner::setTurtle(lua_State* state)
+/**
+ * @brief Get the color displayed at a point of the canvas.
+ *
+ * This function receives 2 parameters from lua: the x and y coordinates
+ * of the point.
+ *
+ * @param state The lua state.
+ * @return Returns 3 values to Lua: the R, G and B components (0-255) of
+ *     the drawings composited over the background color.
+ */
+int ScriptRunner::getPixel(lua_State* state)
 {
-    lua_Number x,y;
-    lua_Number heading;
-    lua_Number r,g,b,a;
-
-    // Check number of arguments
-    if (lua_gettop(state) < SET_BACKGROUND_COLOR_ARGS_COUNT)
+    if (lua_gettop(state) < GET_PIXEL_ARGS_COUNT)
     {
-        lua_pushstring(state, "too few arguments to bgcolor()");
+        lua_pushstring(state, "too few arguments to _ui.canvas.getpixel()");
         lua_error(state);
     }
 
-    // Read each argument from the Lua stack
-    x       = getNumber(state, 1, "_ui.setturtle()");
-    y       = getNumber(state, 2, "_ui.setturtle()");
-    heading = getNumber(state, 3, "_ui.setturtle()");
-    r       = getNumber(state, 4, "_ui.setturtle()");
-    g       = getNumber(state, 5, "_ui.setturtle()");
-    b       = getNumber(state, 6, "_ui.setturtle()");
-    a       = getNumber(state, 7, "_ui.setturtle()");
-
-    QPointF pos(x,y);
-    QColor color(clippedColor(r,g,b,a));
+    const lua_Number x = getNumber(state, 1, "_ui.canvas.getpixel()");
+    const lua_Number y = getNumber(state, 2, "_ui.canvas.getpixel()");
 
     ScriptRunner& runner = getScriptRunner(state);
-    runner.graphicsWidget()->setTurtle(pos, heading, color);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
-    return 0;
-}
+    // The coordinates from the script are flipped (see drawLine()).
+    const QColor color = runner.graphicsWidget()->pixelColor(QPointF(x, -y));
 
-int ScriptRunner::getTurtle(lua_State* state)
-{
-    // Clear the stack
-    lua_pop(state, lua_gettop(state));
+    lua_settop(state, 0);
+    lua_pushinteger(state, color.red());
+    lua_pushinteger(state, color.green());
+    lua_pushinteger(state, color.blue());
 
-    QPointF pos;
-    qreal heading;
-    QColor color;
+    return 3;
+}
 
-    ScriptRunner& runner = getScriptRunner(state);
-    runner.graphicsWidget()->getTurtle(pos, heading, color);
-    runner.pauseIfRequested();
-    runner.haltIfRequested();
+/**
+ * @brief Flood fill the area around a point of the canvas.
+ *
+ * This function receives 7 parameters from lua:
+ *   1. The x coordinate of the point.
+ *   2. The y coordinate of the point.
+ *   3. The R component of the fill color.
+ *   4. The G component of the fill color.
+ *   5. The B component of the fill color.
+ *   6. The A component of the fill color.
+ *   7. Optional: the tolerance (0-255, 0 by default), i.e. the largest
+ *      difference in any of the color's components between the pixel at
+ *      the point and the pixels filled.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::floodFill(lua_State* state)
+{
+    if (lua_gettop(state) < FLOOD_FILL_ARGS_COUNT)
+    {
+        lua_pushstring(state, "too few arguments to _ui.canvas.floodfill()");
+        lua_error(state);
+    }
+
+    const lua_Number x = getNumber(state, 1, "_ui.canvas.floodfill()");
+    const lua_Number y = getNumber(state, 2, "_ui.canvas.floodfill()");
+    const lua_Number r = getNumber(state, 3, "_ui.canvas.floodfill()");
+    const lua_Number g = getNumber(state, 4, "_ui.canvas.floodfill()");
+    const lua_Number b = getNumber(state, 5, "_ui.canvas.floodfill()");
+    const lua_Number a = getNumber(state, 6, "_ui.canvas.floodfill()");
+    const lua_Integer tolerance = lua_isnoneornil(state, 7)
+                                      ? 0
+                                      : getInteger(state, 7, "_ui.canvas.floodfill()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.graphicsWidget()->floodFill(QPointF(x, -y),
+                                       clippedColor(r, g, b, a),
+                                       static_cast<int>(std::max<lua_Integer>(0, std::min<lua_Integer>(255, tolerance))));
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Select the canvas layer drawn on.
+ *
+ * This function receives 1 parameter from lua: the layer, from 1 (the
+ * bottom layer, drawn on by default) to TurtleCanvasGraphicsItem::MAX_LAYERS.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::setLayer(lua_State* state)
+{
+    const int layer = getLayer(state, 1, "_ui.canvas.layer()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.graphicsWidget()->setLayer(layer);
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Show or hide a canvas layer.
+ *
+ * This function receives 2 parameters from lua: the layer (see setLayer())
+ * and whether it is visible.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::setLayerVisible(lua_State* state)
+{
+    const int  layer   = getLayer(state, 1, "_ui.canvas.setlayervisible()");
+    const bool visible = getBoolean(state, 2, "_ui.canvas.setlayervisible()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.graphicsWidget()->setLayerVisible(layer, visible);
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Set the opacity of a canvas layer.
+ *
+ * This function receives 2 parameters from lua: the layer (see setLayer())
+ * and its opacity, from 0 (transparent) to 255 (opaque).
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::setLayerOpacity(lua_State* state)
+{
+    const int        layer   = getLayer(state, 1, "_ui.canvas.setlayeropacity()");
+    const lua_Number opacity = getNumber(state, 2, "_ui.canvas.setlayeropacity()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.graphicsWidget()->setLayerOpacity(layer,
+                                             static_cast<int>(std::min(255.0, std::max(0.0, opacity + 0.5))));
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Draw a string on the canvas.
+ *
+ * This function receives 9 parameters from lua:
+ *   1. The x coordinate of the left end of the baseline.
+ *   2. The y coordinate of the left end of the baseline.
+ *   3. The string. Newline characters start a new line.
+ *   4. The height of the font, in pixels.
+ *   5. The R component of the text color.
+ *   6. The G component of the text color.
+ *   7. The B component of the text color.
+ *   8. The A component of the text color.
+ *   9. Optional: the clockwise rotation (degrees) of the text (0 by default).
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::drawText(lua_State* state)
+{
+    if (lua_gettop(state) < DRAW_TEXT_ARGS_COUNT)
+    {
+        lua_pushstring(state, "too few arguments to _ui.canvas.drawtext()");
+        lua_error(state);
+    }
+
+    const lua_Number  x     = getNumber(state, 1, "_ui.canvas.drawtext()");
+    const lua_Number  y     = getNumber(state, 2, "_ui.canvas.drawtext()");
+    const QString     text  = getString(state, 3, "_ui.canvas.drawtext()");
+    const lua_Integer size  = getInteger(state, 4, "_ui.canvas.drawtext()");
+    const lua_Number  r     = getNumber(state, 5, "_ui.canvas.drawtext()");
+    const lua_Number  g     = getNumber(state, 6, "_ui.canvas.drawtext()");
+    const lua_Number  b     = getNumber(state, 7, "_ui.canvas.drawtext()");
+    const lua_Number  a     = getNumber(state, 8, "_ui.canvas.drawtext()");
+    const lua_Number  angle = lua_isnoneornil(state, 9)
+                                  ? 0.0
+                                  : getNumber(state, 9, "_ui.canvas.drawtext()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+
+    // The coordinates from the script are flipped (see drawLine()).
+    runner.graphicsWidget()->drawText(QPointF(x, -y), text, clampedInt(size), clippedColor(r, g, b, a), angle);
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Load an image file, to be drawn by _ui.canvas.drawimage().
+ *
+ * This function receives 1 parameter from lua: the path of the file. A
+ * Lua error is raised if the image cannot be loaded.
+ *
+ * @param state The lua state.
+ * @return Returns 1 value to Lua: the image's handle.
+ */
+int ScriptRunner::loadImage(lua_State* state)
+{
+    const QString path = getString(state, 1, "_ui.canvas.loadimage()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+
+    QString error;
+    const int image = runner.graphicsWidget()->loadImage(path, error);
+    if (image < 0)
+    {
+        lua_pushstring(state,
+                       QString("could not load image \"%1\": %2")
+                        .arg(path)
+                        .arg(error)
+                        .toStdString().c_str());
+        lua_error(state);
+    }
+
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    lua_settop(state, 0);
+    lua_pushinteger(state, image);
+
+    return 1;
+}
+
+/**
+ * @brief Draw an image loaded by _ui.canvas.loadimage().
+ *
+ * This function receives 5 parameters from lua:
+ *   1. The image's handle.
+ *   2. The x coordinate of the image's center.
+ *   3. The y coordinate of the image's center.
+ *   4. Optional: the scale of the image (1 by default).
+ *   5. Optional: the clockwise rotation (degrees) of the image (0 by default).
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::drawImage(lua_State* state)
+{
+    if (lua_gettop(state) < DRAW_IMAGE_ARGS_COUNT)
+    {
+        lua_pushstring(state, "too few arguments to _ui.canvas.drawimage()");
+        lua_error(state);
+    }
+
+    const lua_Integer image = getInteger(state, 1, "_ui.canvas.drawimage()");
+    const lua_Number  x     = getNumber(state, 2, "_ui.canvas.drawimage()");
+    const lua_Number  y     = getNumber(state, 3, "_ui.canvas.drawimage()");
+    const lua_Number  scale = lua_isnoneornil(state, 4)
+                                  ? 1.0
+                                  : getNumber(state, 4, "_ui.canvas.drawimage()");
+    const lua_Number  angle = lua_isnoneornil(state, 5)
+                                  ? 0.0
+                                  : getNumber(state, 5, "_ui.canvas.drawimage()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+
+    // The coordinates from the script are flipped (see drawLine()).
+    if (!runner.graphicsWidget()->drawImage(clampedInt(image), QPointF(x, -y), scale, angle))
+    {
+        lua_pushstring(state, "argument 1 to _ui.canvas.drawimage() must be an image handle");
+        lua_error(state);
+    }
+
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Define a stamp from the lines and arcs drawn by a function.
+ *
+ * This function receives 2 parameters from lua: the stamp's name, and a
+ * function which draws the stamp around the origin. While the function
+ * runs, its lines and arcs are recorded instead of being drawn, and its
+ * fills and stamps are ignored (see TurtleCanvasGraphicsItem::beginStamp()).
+ * If the function fails then the stamp is discarded and the error is
+ * raised again.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::defineStamp(lua_State* state)
+{
+    const QString name = getString(state, 1, "_ui.canvas.definestamp()");
+
+    if (LUA_TFUNCTION != lua_type(state, 2))
+    {
+        lua_pushstring(state, "argument 2 to _ui.canvas.definestamp() must be a function");
+        lua_error(state);
+    }
+
+    ScriptRunner& runner = getScriptRunner(state);
+    TurtleCanvasGraphicsItem* const canvas = runner.graphicsWidget();
+
+    if (!canvas->beginStamp())
+    {
+        lua_pushstring(state, "_ui.canvas.definestamp() cannot be called while defining a stamp");
+        lua_error(state);
+    }
+
+    lua_settop(state, 2);
+
+    // The recording must be ended before any error is raised.
+    const int status = lua_pcall(state, 0, 0, 0);
+    canvas->endStamp(name, LUA_OK == status);
+
+    if (LUA_OK != status)
+    {
+        lua_error(state);
+    }
+
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Draw a stamp defined by _ui.canvas.definestamp().
+ *
+ * This function receives 5 parameters from lua:
+ *   1. The stamp's name.
+ *   2. The x coordinate of the stamp's origin.
+ *   3. The y coordinate of the stamp's origin.
+ *   4. The clockwise rotation (degrees) of the stamp.
+ *   5. Optional: the scale of the stamp (1 by default).
+ *
+ * A Lua error is raised if there is no stamp with this name.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::drawStamp(lua_State* state)
+{
+    if (lua_gettop(state) < STAMP_ARGS_COUNT)
+    {
+        lua_pushstring(state, "too few arguments to _ui.canvas.stamp()");
+        lua_error(state);
+    }
+
+    const QString    name  = getString(state, 1, "_ui.canvas.stamp()");
+    const lua_Number x     = getNumber(state, 2, "_ui.canvas.stamp()");
+    const lua_Number y     = getNumber(state, 3, "_ui.canvas.stamp()");
+    const lua_Number angle = getNumber(state, 4, "_ui.canvas.stamp()");
+    const lua_Number scale = lua_isnoneornil(state, 5)
+                                 ? 1.0
+                                 : getNumber(state, 5, "_ui.canvas.stamp()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+
+    // The coordinates from the script are flipped (see drawLine()).
+    if (!runner.graphicsWidget()->drawStamp(name, QPointF(x, -y), angle, scale))
+    {
+        lua_pushstring(state,
+                       QString("no stamp named \"%1\" in _ui.canvas.stamp()")
+                        .arg(name)
+                        .toStdString().c_str());
+        lua_error(state);
+    }
+
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+int ScriptRunner::setTurtle(lua_State* state)
+{
+    lua_Number x,y;
+    lua_Number heading;
+    lua_Number r,g,b,a;
+
+    // Check number of arguments
+    if (lua_gettop(state) < SET_BACKGROUND_COLOR_ARGS_COUNT)
+    {
+        lua_pushstring(state, "too few arguments to bgcolor()");
+        lua_error(state);
+    }
+
+    // Read each argument from the Lua stack
+    x       = getNumber(state, 1, "_ui.setturtle()");
+    y       = getNumber(state, 2, "_ui.setturtle()");
+    heading = getNumber(state, 3, "_ui.setturtle()");
+    r       = getNumber(state, 4, "_ui.setturtle()");
+    g       = getNumber(state, 5, "_ui.setturtle()");
+    b       = getNumber(state, 6, "_ui.setturtle()");
+    a       = getNumber(state, 7, "_ui.setturtle()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.m_pendingTurtlePos     = QPointF(x,y);
+    runner.m_pendingTurtleHeading = heading;
+    runner.m_pendingTurtleColor   = clippedColor(r,g,b,a);
+    runner.m_turtlePending        = true;
+    runner.m_tracerCount++;
+
+    if ((runner.m_tracerSteps > 0) && (runner.m_tracerCount >= runner.m_tracerSteps))
+    {
+        runner.publishTurtle();
+    }
+
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+int ScriptRunner::getTurtle(lua_State* state)
+{
+    // Clear the stack
+    lua_pop(state, lua_gettop(state));
+
+    QPointF pos;
+    qreal heading;
+    QColor color;
+
+    ScriptRunner& runner = getScriptRunner(state);
+    if (runner.m_turtlePending)
+    {
+        pos     = runner.m_pendingTurtlePos;
+        heading = runner.m_pendingTurtleHeading;
+        color   = runner.m_pendingTurtleColor;
+    }
+    else
+    {
+        runner.graphicsWidget()->getTurtle(pos, heading, color);
+    }
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
 
     lua_pushnumber(state,  pos.x());
     lua_pushnumber(state,  pos.y());
@@ -1121,7 +1922,7 @@ int ScriptRunner::showTurtle(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.graphicsWidget()->showTurtle();
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
     return 0;
 }
 
@@ -1130,7 +1931,7 @@ int ScriptRunner::hideTurtle(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.graphicsWidget()->hideTurtle();
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
     return 0;
 }
 
@@ -1138,7 +1939,7 @@ int ScriptRunner::turtleHidden(lua_State* state)
 {
     ScriptRunner& runner = getScriptRunner(state);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     const bool hidden = runner.graphicsWidget()->turtleHidden();
 
@@ -1164,7 +1965,7 @@ int ScriptRunner::printMessage(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.emitMessage(message);
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
 
     return 0;
 }
@@ -1184,7 +1985,17 @@ int ScriptRunner::sleep(lua_State* state)
     ScriptRunner& runner = getScriptRunner(state);
     runner.doSleep(static_cast<int>(msecs));
     runner.pauseIfRequested();
-    runner.haltIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+int ScriptRunner::frame(lua_State* state)
+{
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.doWaitFrame();
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
 
     return 0;
 }
@@ -1202,13 +2013,418 @@ int ScriptRunner::setAntialiasing(lua_State* state)
     return 0;
 }
 
+/**
+ * @brief Set how often the turtle's updates are shown on the canvas.
+ *
+ * This function receives one parameter from lua:
+ *   1. The number of calls to _ui.canvas.setturtle() between updates of the
+ *      on-screen turtle. With 1 (the default) every call is shown. With 0
+ *      the turtle is only updated by _ui.frame() and when the script ends.
+ *
+ * Any update held back is published immediately.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always.
+ */
+int ScriptRunner::setTracer(lua_State* state)
+{
+    const lua_Integer steps = getInteger(state, 1, "_ui.canvas.tracer()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.publishTurtle();
+    runner.m_tracerSteps = static_cast<int>(std::max<lua_Integer>(0, std::min<lua_Integer>(steps, INT_MAX)));
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    return 0;
+}
+
+/**
+ * @brief Create a task, to be run by _ui.sched.run().
+ *
+ * This function receives the following parameters from lua:
+ *   1. The function run by the task.
+ *   2. (optional) The task's priority, for the "priority" policy. The default is 0.
+ *   3. (optional) The number of VM instructions the task runs each time it
+ *      is resumed. The default is TaskScheduler::DEFAULT_BUDGET.
+ *   4. (optional) The task's context value, passed to the function given
+ *      to _ui.sched.onswitch() and returned by _ui.sched.current().
+ *
+ * The task's identifier is returned to lua.
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::spawnTask(lua_State* state)
+{
+    if (LUA_TFUNCTION != lua_type(state, 1))
+    {
+        lua_pushstring(state, "argument 1 to _ui.sched.spawn() must be a function");
+        lua_error(state);
+    }
+
+    const lua_Integer priority = lua_isnoneornil(state, 2)
+                                     ? 0
+                                     : getInteger(state, 2, "_ui.sched.spawn()");
+    const lua_Integer budget   = lua_isnoneornil(state, 3)
+                                     ? TaskScheduler::DEFAULT_BUDGET
+                                     : getInteger(state, 3, "_ui.sched.spawn()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    const int id = runner.m_scheduler.spawn(state, 1, clampedInt(priority), clampedInt(budget), 4);
+
+    lua_pushinteger(state, id);
+    return 1;
+}
+
+/**
+ * @brief Run the tasks created by _ui.sched.spawn() until they have all returned.
+ *
+ * This function receives two optional parameters from lua:
+ *   1. The scheduling policy: "roundrobin" (the default) or "priority".
+ *   2. A boolean, true to present a frame (see _ui.frame()) after each
+ *      round of the tasks.
+ *
+ * Before a task is resumed, the function given to _ui.sched.onswitch() (if
+ * any) is called with the task's context value, unless the same task was
+ * resumed last. The canvas updates made by the tasks are batched until the
+ * end of each round (or for at most TASK_BATCH_INTERVAL milliseconds), so
+ * that the primitives drawn by all of the tasks are rasterized together, in
+ * parallel, and repainted once.
+ *
+ * If a task fails then the remaining tasks are discarded, and the error is
+ * raised again.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always.
+ */
+int ScriptRunner::runTasks(lua_State* state)
+{
+    static const char* const policyNames[] = {"roundrobin", "priority", nullptr};
+
+    const TaskScheduler::Policy policy = (0 == luaL_checkoption(state, 1, "roundrobin", policyNames))
+                                             ? TaskScheduler::RoundRobin
+                                             : TaskScheduler::Priority;
+    const bool frames = (0 != lua_toboolean(state, 2));
+
+    ScriptRunner& runner = getScriptRunner(state);
+    TaskScheduler& scheduler = runner.m_scheduler;
+
+    if (scheduler.isRunning())
+    {
+        lua_pushstring(state, "_ui.sched.run() cannot be called by a task");
+        lua_error(state);
+    }
+
+    lua_settop(state, 0);
+
+    TurtleCanvasGraphicsItem* const canvas = runner.m_graphicsWidget;
+    QElapsedTimer batchTimer;
+    bool batched = false;
+
+    while (!scheduler.isEmpty())
+    {
+        bool newRound;
+        const int task = scheduler.next(policy, newRound);
+
+        if (batched && (newRound || batchTimer.hasExpired(TASK_BATCH_INTERVAL)))
+        {
+            canvas->endBatch();
+            batched = false;
+        }
+
+        if (newRound && frames)
+        {
+            runner.doWaitFrame();
+        }
+
+        if (!batched)
+        {
+            canvas->beginBatch();
+            batchTimer.start();
+            batched = true;
+        }
+
+        // The batch must be ended before any error is raised.
+        if (scheduler.switchesTask(task) && (LUA_NOREF != runner.m_taskSwitchRef))
+        {
+            lua_rawgeti(state, LUA_REGISTRYINDEX, runner.m_taskSwitchRef);
+            scheduler.pushContext(state, task);
+            if (LUA_OK != lua_pcall(state, 1, 0, 0))
+            {
+                canvas->endBatch();
+                scheduler.clear(state);
+                lua_error(state);
+            }
+        }
+
+        const int status = scheduler.resume(state, task);
+
+        if ((LUA_OK != status) && (LUA_YIELD != status))
+        {
+            canvas->endBatch();
+            scheduler.clear(state);
+            lua_error(state);
+        }
+
+        runner.pauseIfRequested();
+        if (runner.haltRequested())
+        {
+            canvas->endBatch();
+            scheduler.clear(state);
+            runner.haltIfRequested(state);
+        }
+    }
+
+    if (batched)
+    {
+        canvas->endBatch();
+    }
+
+    if (frames)
+    {
+        runner.doWaitFrame();
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Set the function called when _ui.sched.run() switches tasks.
+ *
+ * This function receives one parameter from lua: the function, which is
+ * called with the context value of the task about to be resumed, or nil
+ * to remove the function.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always.
+ */
+int ScriptRunner::setTaskSwitch(lua_State* state)
+{
+    if (!lua_isnil(state, 1) && (LUA_TFUNCTION != lua_type(state, 1)))
+    {
+        lua_pushstring(state, "argument 1 to _ui.sched.onswitch() must be a function or nil");
+        lua_error(state);
+    }
+
+    ScriptRunner& runner = getScriptRunner(state);
+    luaL_unref(state, LUA_REGISTRYINDEX, runner.m_taskSwitchRef);
+    runner.m_taskSwitchRef = LUA_NOREF;
+
+    if (!lua_isnil(state, 1))
+    {
+        lua_pushvalue(state, 1);
+        runner.m_taskSwitchRef = luaL_ref(state, LUA_REGISTRYINDEX);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the context value of the running task.
+ *
+ * The context value given to _ui.sched.spawn() is returned to lua, or nil
+ * if no task is running.
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::currentTask(lua_State* state)
+{
+    getScriptRunner(state).m_scheduler.pushCurrentContext(state);
+    return 1;
+}
+
+/**
+ * @brief Save the drawings on the canvas.
+ *
+ * The identifier of the checkpoint is returned to lua, to be passed to
+ * _ui.canvas.restore() and _ui.canvas.discardcheckpoint().
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::checkpoint(lua_State* state)
+{
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    lua_pushinteger(state, runner.graphicsWidget()->checkpoint());
+
+    return 1;
+}
+
+/**
+ * @brief Put back the drawings saved by _ui.canvas.checkpoint().
+ *
+ * This function receives one parameter from lua:
+ *   1. The identifier of the checkpoint.
+ *
+ * A boolean is returned to lua, which is false if there is no such checkpoint.
+ *
+ * @note If an error occurs then @c lua_error is called and this function does not return.
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::restoreCheckpoint(lua_State* state)
+{
+    const lua_Integer id = getInteger(state, 1, "_ui.canvas.restore()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    const bool restored = runner.graphicsWidget()->restore(static_cast<int>(id));
+    runner.pauseIfRequested();
+    runner.haltIfRequested(state);
+
+    lua_pushboolean(state, restored ? 1 : 0);
+
+    return 1;
+}
+
+/**
+ * @brief Release a checkpoint saved by _ui.canvas.checkpoint().
+ *
+ * This function receives one parameter from lua:
+ *   1. The identifier of the checkpoint.
+ *
+ * @note If an error occurs then @c lua_error is called and this function does not return.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::discardCheckpoint(lua_State* state)
+{
+    const lua_Integer id = getInteger(state, 1, "_ui.canvas.discardcheckpoint()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.graphicsWidget()->discardCheckpoint(static_cast<int>(id));
+
+    return 0;
+}
+
+
+/**
+ * @brief Starts the sampling profiler.
+ *
+ * This function receives an optional parameter from lua:
+ *   1. The number of VM instructions between samples (default 10000).
+ *
+ * Any samples from a previous profile are discarded.
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::profileStart(lua_State* state)
+{
+    lua_Integer interval = SamplingProfiler::DEFAULT_SAMPLE_INTERVAL;
+    if (lua_gettop(state) >= 1)
+    {
+        interval = getInteger(state, 1, "_ui.profile.start()");
+    }
+
+    interval = std::max<lua_Integer>(1, std::min<lua_Integer>(interval, INT_MAX));
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.m_samplingProfiler.start(static_cast<int>(interval));
+
+    return 0;
+}
+
+/**
+ * @brief Stops the sampling profiler.
+ *
+ * The collected samples are returned to Lua as a string in the folded
+ * stacks format (see SamplingProfiler::foldedStacks()).
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::profileStop(lua_State* state)
+{
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.m_samplingProfiler.stop();
+
+    lua_pushstring(state, runner.m_samplingProfiler.foldedStacks().toStdString().c_str());
+
+    return 1;
+}
+
+/**
+ * @brief Switches the exact per-function profiler on or off.
+ *
+ * This function receives 1 parameter from lua:
+ *   1. A boolean, @c true to enable the profiler.
+ *
+ * The report is published when the script finishes
+ * (see ScriptRunner::functionProfileReady()).
+ *
+ * @param state The lua state.
+ * @return Returns 0 always. No values are returned to Lua.
+ */
+int ScriptRunner::profileExact(lua_State* state)
+{
+    const bool on = getBoolean(state, 1, "_ui.profile.exact()");
+
+    ScriptRunner& runner = getScriptRunner(state);
+    runner.m_functionProfiler.setEnabled(on);
+
+    return 0;
+}
+
+/**
+ * @brief Returns a breakdown of the memory used by the program.
+ *
+ * The following table is returned to lua, where each gauge is a table
+ * containing the fields @c bytes (the current value) and @c peak:
+ *
+ * @code
+ * {
+ *     lua      = gauge, -- with an extra field for each object type:
+ *                       -- string, table, function, userdata, thread,
+ *                       -- prototype and other
+ *     canvas   = gauge, -- canvas backing store
+ *     displaylist = gauge, -- retained drawing primitives
+ *     messages = gauge, -- queued scripts and print() messages
+ * }
+ * @endcode
+ *
+ * @param state The lua state.
+ * @return Returns 1 always.
+ */
+int ScriptRunner::memoryStats(lua_State* state)
+{
+    const PerfCounters& counters = PerfCounters::instance();
+
+    lua_settop(state, 0);
+    lua_createtable(state, 0, 4);
+
+    pushGauge(state, counters.luaHeapBytes);
+    for (int i = 0; i < PerfCounters::LuaHeapCategoryCount; i++)
+    {
+        pushGauge(state, counters.luaHeapBytesByCategory[i]);
+        lua_setfield(state, -2, PerfCounters::luaHeapCategoryName(i));
+    }
+    lua_setfield(state, -2, "lua");
+
+    pushGauge(state, counters.canvasBytes);
+    lua_setfield(state, -2, "canvas");
+
+    pushGauge(state, counters.displayListBytes);
+    lua_setfield(state, -2, "displaylist");
+
+    pushGauge(state, counters.messageQueueBytes);
+    lua_setfield(state, -2, "messages");
+
+    return 1;
+}
 
 /**
  * @brief Lua debug hook.
  *
  * This hook is used to pause/resume, and halt the current script.
  */
-void ScriptRunner::debugHookEntry(lua_State* state, lua_Debug* )
+void ScriptRunner::debugHookEntry(lua_State* state, lua_Debug* ar)
 {
-    getScriptRunner(state).debugHook(state);
+    getScriptRunner(state).debugHook(state, ar);
 }
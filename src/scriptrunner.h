@@ -25,6 +25,9 @@
 #include <QQueue>
 #include <QWaitCondition>
 #include "turtlecanvasgraphicsitem.h"
+#include "samplingprofiler.h"
+#include "functionprofiler.h"
+#include "taskscheduler.h"
 #include "lua.hpp"
 
 /**
@@ -69,6 +72,23 @@
  * drawing lines. The target canvas is passed in the constructor of the
  * ScriptRunner.
  *
+ * @subsection Animation
+ *
+ * Scripts call @c _ui.frame() (or @c waitframe()) after drawing each frame
+ * of an animation. The frame is then displayed all at once, and the script
+ * waits until it is painted, rather than using @c sleep(). See
+ * TurtleCanvasGraphicsItem::presentFrame().
+ *
+ * Moving the turtle sprite costs a repaint, which is wasted when a script
+ * moves it thousands of times per frame. @c _ui.canvas.tracer(n) holds the
+ * turtle's updates back so that it is only published every @c n updates,
+ * or only by @c _ui.frame() and at the end of the script if @c n is 0.
+ *
+ * @subsection Tasks
+ *
+ * Scripts can run several functions (e.g. one per turtle) concurrently as
+ * cooperative tasks, via @c _ui.sched. See TaskScheduler and runTasks().
+ *
  * @section Script Messages
  *
  * Scripts can call the @c _ui.print() message to print strings. When
@@ -81,6 +101,17 @@
  * @warning There @b must be a slot handler for scriptMessageReceived()
  * which calls @c pendingScriptMessage() or clearPendingScriptMessage().
  * Otherwise, the script may be blocked until it is explicitly halted.
+ *
+ * @section Profiling
+ *
+ * A statistical profiler can be started and stopped either by scripts
+ * (@c _ui.profile.start() and @c _ui.profile.stop()) or by the UI via
+ * samplingProfiler(). See SamplingProfiler.
+ *
+ * An exact per-function profiler can be switched on and off at runtime by
+ * scripts (@c _ui.profile.exact(on)) or by the UI via functionProfiler().
+ * When a script finishes after having been profiled, the functionProfileReady()
+ * signal is emitted with the report. See FunctionProfiler.
  */
 class ScriptRunner : public QThread
 {
@@ -92,6 +123,9 @@ public:
 
     TurtleCanvasGraphicsItem* graphicsWidget() const;
 
+    SamplingProfiler& samplingProfiler();
+    FunctionProfiler& functionProfiler();
+
     void requestThreadStop();
 
     void pauseScript();
@@ -129,14 +163,28 @@ signals:
      */
     void scriptMessageReceived();
 
+    /**
+     * @brief This signal is emitted when a script profiled by the
+     * FunctionProfiler has finished.
+     *
+     * @param report The profile report, in CSV format.
+     */
+    void functionProfileReady(const QString& report);
+
 protected:
     virtual void run();
 
 private:
     void applyRequirePaths();
+    int callLoadedChunk();
+    void applyHookMode(lua_State* state);
+    bool installHook(lua_State* state) const;
+    void finishFunctionProfile();
     void doSleep(int msecs);
+    void doWaitFrame();
+    void publishTurtle();
     bool haltRequested() const;
-    void haltIfRequested();
+    void haltIfRequested(lua_State* state);
     void pauseIfRequested();
     void emitMessage(const QString& message);
 
@@ -145,7 +193,7 @@ private:
 
     void setupCommands();
 
-    void debugHook(lua_State* state);
+    void debugHook(lua_State* state, lua_Debug* ar);
 
     static int drawLine(lua_State* state);
     static int drawArc(lua_State* state);
@@ -157,9 +205,32 @@ private:
     static int showTurtle(lua_State* state);
     static int hideTurtle(lua_State* state);
     static int turtleHidden(lua_State* state);
+    static int getPixel(lua_State* state);
+    static int floodFill(lua_State* state);
+    static int setLayer(lua_State* state);
+    static int setLayerVisible(lua_State* state);
+    static int setLayerOpacity(lua_State* state);
+    static int defineStamp(lua_State* state);
+    static int drawStamp(lua_State* state);
+    static int drawText(lua_State* state);
+    static int loadImage(lua_State* state);
+    static int drawImage(lua_State* state);
     static int printMessage(lua_State* state);
+    static int memoryStats(lua_State* state);
     static int sleep(lua_State* state);
+    static int frame(lua_State* state);
+    static int setTracer(lua_State* state);
+    static int spawnTask(lua_State* state);
+    static int runTasks(lua_State* state);
+    static int setTaskSwitch(lua_State* state);
+    static int currentTask(lua_State* state);
     static int setAntialiasing(lua_State* state);
+    static int checkpoint(lua_State* state);
+    static int restoreCheckpoint(lua_State* state);
+    static int discardCheckpoint(lua_State* state);
+    static int profileStart(lua_State* state);
+    static int profileStop(lua_State* state);
+    static int profileExact(lua_State* state);
 
     static void debugHookEntry(lua_State* state, lua_Debug* );
 
@@ -167,6 +238,25 @@ private:
     lua_State* m_state;
     TurtleCanvasGraphicsItem* m_graphicsWidget;
 
+    SamplingProfiler m_samplingProfiler;
+    FunctionProfiler m_functionProfiler;
+
+    // Only accessed by the Lua thread.
+    bool m_exactProfiling; // true while the FunctionProfiler's hooks are installed
+    int m_hookTicks;       // count hook calls since the last periodic check
+
+    // Turtle updates held back by _ui.canvas.tracer(). Only accessed by the Lua thread.
+    int m_tracerSteps;           // publish every this many updates, or only at frames if 0
+    int m_tracerCount;           // updates held back since the turtle was last published
+    bool m_turtlePending;        // true if the turtle below is not yet published
+    QPointF m_pendingTurtlePos;
+    qreal m_pendingTurtleHeading;
+    QColor m_pendingTurtleColor;
+
+    // Tasks run by _ui.sched.run(). Only accessed by the Lua thread.
+    TaskScheduler m_scheduler;
+    int m_taskSwitchRef; // registry reference to the _ui.sched.onswitch() function
+
     mutable QMutex m_luaMutex; // locked while a script is running
 
     // Used to send Lua scripts to the thread to be run.
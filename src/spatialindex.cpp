@@ -0,0 +1,176 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "spatialindex.h"
+#include <algorithm>
+#include <cmath>
+
+SpatialIndex::SpatialIndex() :
+    m_cells(),
+    m_largeItems(),
+    m_cellEntries(0)
+{
+
+}
+
+/**
+ * @brief Add an item to the index.
+ *
+ * @param item The item's index. This must be greater than all previously
+ *     inserted items.
+ * @param bounds The item's bounding box.
+ */
+void SpatialIndex::insert(int item, const QRectF& bounds)
+{
+    const QRect cells = cellRange(bounds);
+
+    if (static_cast<qint64>(cells.width()) * cells.height() > MAX_CELLS_PER_ITEM)
+    {
+        m_largeItems.append(item);
+        return;
+    }
+
+    for (int row = cells.top(); row <= cells.bottom(); row++)
+    {
+        for (int column = cells.left(); column <= cells.right(); column++)
+        {
+            m_cells[cellKey(column, row)].append(item);
+            m_cellEntries++;
+        }
+    }
+}
+
+/**
+ * @brief Call @p visit with the items of each cell in use overlapping a
+ *     rectangle.
+ */
+template <typename Visitor>
+void SpatialIndex::visitCells(const QRectF& rect, Visitor visit) const
+{
+    const QRect cells = cellRange(rect);
+
+    if (static_cast<qint64>(cells.width()) * cells.height() < m_cells.size())
+    {
+        for (int row = cells.top(); row <= cells.bottom(); row++)
+        {
+            for (int column = cells.left(); column <= cells.right(); column++)
+            {
+                QHash<quint64, QVector<int> >::const_iterator it = m_cells.constFind(cellKey(column, row));
+                if (it != m_cells.constEnd())
+                {
+                    visit(it.value());
+                }
+            }
+        }
+    }
+    else
+    {
+        // The region covers more cells than are in use,
+        // so it is quicker to check every cell in use.
+        for (QHash<quint64, QVector<int> >::const_iterator it = m_cells.constBegin();
+             it != m_cells.constEnd();
+             ++it)
+        {
+            const int column = static_cast<qint32>(it.key() >> 32);
+            const int row    = static_cast<qint32>(it.key() & 0xffffffffu);
+            if (cells.contains(column, row))
+            {
+                visit(it.value());
+            }
+        }
+    }
+}
+
+/**
+ * @brief Find the items which may intersect a rectangle.
+ *
+ * The results are candidates: their cells overlap @p rect, but their
+ * bounding boxes may not. Each item is listed once, in increasing order.
+ *
+ * @param rect The region to query.
+ * @param items Receives the items. Its previous contents are discarded.
+ */
+void SpatialIndex::query(const QRectF& rect, QVector<int>& items) const
+{
+    items = m_largeItems;
+
+    visitCells(rect, [&items](const QVector<int>& cell) { items += cell; });
+
+    std::sort(items.begin(), items.end());
+    items.erase(std::unique(items.begin(), items.end()), items.end());
+}
+
+/**
+ * @brief Get the number of entries query() gathers for a rectangle,
+ *     before removing the duplicates.
+ *
+ * This is the cost of a query, and is found without gathering them.
+ */
+quint64 SpatialIndex::count(const QRectF& rect) const
+{
+    quint64 entries = m_largeItems.size();
+
+    visitCells(rect, [&entries](const QVector<int>& cell) { entries += cell.size(); });
+
+    return entries;
+}
+
+void SpatialIndex::clear()
+{
+    m_cells.clear();
+    m_largeItems.clear();
+    m_cellEntries = 0;
+}
+
+/**
+ * @brief Get the approximate amount of memory used by the index.
+ */
+quint64 SpatialIndex::bytes() const
+{
+    return m_cellEntries * sizeof(int)
+           + static_cast<quint64>(m_cells.size()) * (sizeof(quint64) + sizeof(QVector<int>))
+           + static_cast<quint64>(m_largeItems.size()) * sizeof(int);
+}
+
+quint64 SpatialIndex::cellKey(int column, int row)
+{
+    return (static_cast<quint64>(static_cast<quint32>(column)) << 32)
+           | static_cast<quint64>(static_cast<quint32>(row));
+}
+
+/**
+ * @brief Get the range of cells (columns and rows) overlapped by a rectangle.
+ */
+QRect SpatialIndex::cellRange(const QRectF& rect)
+{
+    // Clamp to a range which cannot overflow the cell coordinates.
+    static const qreal LIMIT = 1.0e9;
+
+    const auto cell = [](qreal coordinate)
+    {
+        return static_cast<int>(std::floor(std::min(LIMIT, std::max(-LIMIT, coordinate)) / CELL_SIZE));
+    };
+
+    const int left   = cell(rect.left());
+    const int top    = cell(rect.top());
+    const int right  = cell(rect.right());
+    const int bottom = cell(rect.bottom());
+
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
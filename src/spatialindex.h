@@ -0,0 +1,75 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include <QHash>
+#include <QRectF>
+#include <QVector>
+
+/**
+ * @brief Uniform grid over the bounding boxes of a set of items.
+ *
+ * Each item is listed in every grid cell its bounding box overlaps, so
+ * finding the items in a region only visits the cells covering the region.
+ * Cells are only allocated once an item is added to them.
+ *
+ * Items covering a large number of cells (e.g. a circle around the whole
+ * drawing) are kept in a separate list instead, which is always part of
+ * the query results, so that they don't bloat the grid.
+ *
+ * Items are identified by their index, which must be increasing as items
+ * are inserted.
+ *
+ * This class is not thread-safe.
+ */
+class SpatialIndex
+{
+public:
+    /// Width and height of the grid cells.
+    static const int CELL_SIZE = 128;
+
+    /// Items overlapping more cells than this go in the large items list.
+    static const int MAX_CELLS_PER_ITEM = 64;
+
+    SpatialIndex();
+
+    void insert(int item, const QRectF& bounds);
+
+    void query(const QRectF& rect, QVector<int>& items) const;
+    quint64 count(const QRectF& rect) const;
+
+    void clear();
+
+    quint64 bytes() const;
+
+private:
+    static quint64 cellKey(int column, int row);
+    static QRect cellRange(const QRectF& rect);
+
+    template <typename Visitor>
+    void visitCells(const QRectF& rect, Visitor visit) const;
+
+    QHash<quint64, QVector<int> > m_cells;
+    QVector<int>                  m_largeItems;
+    quint64                       m_cellEntries;
+};
+
+#endif // SPATIALINDEX_H
@@ -0,0 +1,362 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "stampcache.h"
+#include <QPainter>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+const qreal StampCache::ANGLE_STEP = 0.5;
+const qreal StampCache::SCALE_STEP = 1.0 / 64.0;
+const qreal StampCache::MAX_SCALE  = 16.0;
+
+/// Number of rotations of a stamp (one turn in steps of ANGLE_STEP).
+static const int ANGLE_STEPS = 720;
+
+StampCache::StampCache() :
+    m_mutex(),
+    m_stamps(),
+    m_names(),
+    m_recording(nullptr),
+    m_rasterizer(),
+    m_bitmapBytes(0)
+{
+
+}
+
+StampCache::~StampCache()
+{
+    delete m_recording;
+    qDeleteAll(m_stamps);
+}
+
+/**
+ * @brief Start recording a stamp.
+ *
+ * The lines and arcs added until endStamp() is called make up the stamp.
+ *
+ * @return @c false if a stamp is already being recorded.
+ */
+bool StampCache::beginStamp()
+{
+    if (nullptr != m_recording)
+    {
+        return false;
+    }
+
+    m_recording = new Stamp();
+    return true;
+}
+
+/**
+ * @brief Add a line to the stamp being recorded.
+ *
+ * Primitives with new styles are ignored once the stamp's pen/brush table
+ * is full.
+ *
+ * @param line The line, relative to the stamp's origin.
+ */
+void StampCache::addLine(const QLineF& line, const DrawStyle& style, bool antialiased)
+{
+    Stamp& stamp = *m_recording;
+
+    if (stamp.styles.isFull() && !stamp.styles.contains(style))
+    {
+        return;
+    }
+
+    const PenBrushTable::Handle handle = stamp.styles.intern(style);
+    const QPen& pen = stamp.styles.entry(handle).pen;
+
+    stamp.commands.append(DrawCommand::line(line, handle, antialiased));
+    stamp.bounds |= Rasterizer::lineBounds(line, pen.widthF(), pen.capStyle());
+}
+
+/**
+ * @brief Add an arc to the stamp being recorded.
+ *
+ * @param arc The arc, relative to the stamp's origin.
+ */
+void StampCache::addArc(const ArcShape& arc, const DrawStyle& style, bool filled, bool antialiased)
+{
+    Stamp& stamp = *m_recording;
+
+    if (stamp.styles.isFull() && !stamp.styles.contains(style))
+    {
+        return;
+    }
+
+    const PenBrushTable::Handle handle = stamp.styles.intern(style);
+    const QPen& pen = stamp.styles.entry(handle).pen;
+
+    stamp.commands.append(DrawCommand::arc(arc, handle, filled, antialiased));
+    stamp.bounds |= Rasterizer::arcBounds(arc, pen.widthF(), pen.capStyle());
+}
+
+/**
+ * @brief Stop recording a stamp.
+ *
+ * @param name The stamp's name. It replaces any stamp of the same name.
+ * @param keep Set to @c false to discard the stamp (e.g. when the script
+ *     recording it failed).
+ */
+void StampCache::endStamp(const QString& name, bool keep)
+{
+    Stamp* stamp = m_recording;
+    m_recording = nullptr;
+
+    if (!keep)
+    {
+        delete stamp;
+        return;
+    }
+
+    QMutexLocker lock(&m_mutex);
+
+    m_names.insert(name, m_stamps.size());
+    m_stamps.append(stamp);
+}
+
+/**
+ * @brief Get the identifier of the stamp defined with a name.
+ *
+ * @return The stamp's identifier, or -1 if no stamp has this name.
+ */
+int StampCache::find(const QString& name) const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return m_names.value(name, -1);
+}
+
+/**
+ * @brief Get the bitmap of a stamp at a rotation and scale.
+ *
+ * The bitmap is rasterized if it is not cached yet.
+ *
+ * @param stamp The stamp's identifier.
+ * @param angle The clockwise rotation (degrees).
+ * @param scale The scale, clamped to MAX_SCALE.
+ * @param render Draws the stamp's primitives when rasterizing.
+ * @return The bitmap, whose image is null if the stamp doesn't exist or
+ *     is empty.
+ */
+StampCache::Bitmap StampCache::bitmap(int stamp, qreal angle, qreal scale, const RenderFunction& render)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if ((stamp < 0) || (stamp >= m_stamps.size()))
+    {
+        return Bitmap();
+    }
+
+    Stamp& cached = *m_stamps.at(stamp);
+
+    qreal roundedAngle;
+    qreal roundedScale;
+    const quint32 key = bitmapKey(angle, scale, roundedAngle, roundedScale);
+
+    QHash<quint32, Bitmap>::const_iterator it = cached.bitmaps.constFind(key);
+    if (it != cached.bitmaps.constEnd())
+    {
+        return it.value();
+    }
+
+    const Bitmap result = rasterize(cached, roundedAngle, roundedScale, render);
+    const quint64 bytes = static_cast<quint64>(result.image.bytesPerLine()) * result.image.height();
+
+    if ((m_bitmapBytes + bytes) > MAX_BITMAP_BYTES)
+    {
+        releaseBitmaps();
+    }
+
+    cached.bitmaps.insert(key, result);
+    m_bitmapBytes += bytes;
+
+    return result;
+}
+
+/**
+ * @brief Get the memory used by the bitmaps, in bytes.
+ */
+quint64 StampCache::bytes() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return m_bitmapBytes;
+}
+
+/**
+ * @brief Round a rotation and scale to their steps.
+ *
+ * @param angle The rotation (degrees).
+ * @param scale The scale.
+ * @param roundedAngle Receives the rotation, rounded to ANGLE_STEP, from 0 to 360.
+ * @param roundedScale Receives the scale, rounded to SCALE_STEP, from SCALE_STEP to MAX_SCALE.
+ * @return The key of the bitmap in Stamp::bitmaps.
+ */
+quint32 StampCache::bitmapKey(qreal angle, qreal scale, qreal& roundedAngle, qreal& roundedScale)
+{
+    const int angleStep = Rasterizer::angleStep(angle, ANGLE_STEPS);
+
+    const qreal clampedScale = std::max(SCALE_STEP, std::min(MAX_SCALE, scale));
+    const int scaleStep = static_cast<int>(std::round(clampedScale / SCALE_STEP));
+
+    roundedAngle = angleStep * ANGLE_STEP;
+    roundedScale = scaleStep * SCALE_STEP;
+
+    return (static_cast<quint32>(angleStep) << 16) | static_cast<quint32>(scaleStep);
+}
+
+/**
+ * @brief Draw a stamp, rotated and scaled, into a new bitmap.
+ *
+ * The primitives are transformed rather than the bitmap, so that the
+ * bitmap is as sharp as the primitives drawn directly on the canvas.
+ * Pen widths are scaled along with the geometry.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+StampCache::Bitmap StampCache::rasterize(const Stamp& stamp,
+                                         qreal angle,
+                                         qreal scale,
+                                         const RenderFunction& render)
+{
+    Bitmap result;
+
+    if (stamp.commands.isEmpty() || stamp.bounds.isNull())
+    {
+        return result;
+    }
+
+    // The Y axis points down, so the rotation is clockwise.
+    const qreal radians = qDegreesToRadians(angle);
+    const qreal cosine  = std::cos(radians) * scale;
+    const qreal sine    = std::sin(radians) * scale;
+
+    const auto transform = [cosine, sine](const QPointF& point)
+    {
+        return QPointF((point.x() * cosine) - (point.y() * sine),
+                       (point.x() * sine)   + (point.y() * cosine));
+    };
+
+    const QPointF corners[4] =
+    {
+        transform(stamp.bounds.topLeft()),
+        transform(stamp.bounds.topRight()),
+        transform(stamp.bounds.bottomLeft()),
+        transform(stamp.bounds.bottomRight())
+    };
+
+    qreal left   = corners[0].x();
+    qreal right  = corners[0].x();
+    qreal top    = corners[0].y();
+    qreal bottom = corners[0].y();
+    for (const QPointF& corner : corners)
+    {
+        left   = std::min(left,   corner.x());
+        right  = std::max(right,  corner.x());
+        top    = std::min(top,    corner.y());
+        bottom = std::max(bottom, corner.y());
+    }
+
+    // The primitives are drawn around a whole pixel near the middle of the
+    // stamp, in tiles which extend a pixel past them on every side (for
+    // the rounding of aliased lines) and have an even size, so that the
+    // pixel lies at the tiles' center.
+    const QPoint center(qRound((left + right) / 2.0), qRound((top + bottom) / 2.0));
+    const int halfWidth  = static_cast<int>(std::ceil(std::max(right - center.x(), center.x() - left))) + 1;
+    const int halfHeight = static_cast<int>(std::ceil(std::max(bottom - center.y(), center.y() - top))) + 1;
+
+    TileStore tiles(QSize(halfWidth * 2, halfHeight * 2));
+    PenBrushTable styles;
+
+    for (const DrawCommand& command : stamp.commands)
+    {
+        DrawStyle style = stamp.styles.entry(command.style()).style;
+        style.penWidth *= scale;
+
+        const PenBrushTable::Handle handle = styles.intern(style);
+
+        switch (command.type())
+        {
+        case DrawCommand::Line:
+        {
+            const QLineF line = command.line();
+            render(DrawCommand::line(QLineF(transform(line.p1()) - center,
+                                            transform(line.p2()) - center),
+                                     handle,
+                                     command.antialiased()),
+                   styles,
+                   tiles,
+                   m_rasterizer);
+            break;
+        }
+
+        case DrawCommand::Arc:
+        {
+            ArcShape arc  = command.arc();
+            arc.center    = transform(arc.center) - center;
+            arc.rotation += angle;
+            arc.xradius  *= scale;
+            arc.yradius  *= scale;
+            render(DrawCommand::arc(arc, handle, command.filled(), command.antialiased()),
+                   styles,
+                   tiles,
+                   m_rasterizer);
+            break;
+        }
+
+        case DrawCommand::Fill:
+        case DrawCommand::Stamp:
+        case DrawCommand::Glyph:
+        case DrawCommand::Image:
+            // Not recorded in stamps.
+            break;
+        }
+    }
+
+    result.image = QImage(tiles.size(), QImage::Format_ARGB32_Premultiplied);
+    result.image.fill(Qt::transparent);
+    {
+        QPainter painter(&result.image);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        tiles.draw(&painter, tiles.rect());
+    }
+
+    result.origin = QPoint(halfWidth, halfHeight) - center;
+
+    return result;
+}
+
+/**
+ * @brief Release the bitmaps of all the stamps.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void StampCache::releaseBitmaps()
+{
+    for (Stamp* stamp : m_stamps)
+    {
+        stamp->bitmaps.clear();
+    }
+
+    m_bitmapBytes = 0;
+}
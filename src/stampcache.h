@@ -0,0 +1,130 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef STAMPCACHE_H
+#define STAMPCACHE_H
+
+#include "drawcommand.h"
+#include "penbrushtable.h"
+#include "rasterizer.h"
+#include "tilestore.h"
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QPoint>
+#include <QRectF>
+#include <QString>
+#include <QVector>
+#include <functional>
+
+/**
+ * @brief The stamps defined by scripts, and their bitmaps.
+ *
+ * A stamp is a drawing made of lines and arcs which is recorded once
+ * (see beginStamp()) and can then be drawn any number of times, anywhere
+ * on the canvas, rotated and scaled. Rather than drawing its primitives
+ * each time, the stamp is rasterized once into a bitmap for each rotation
+ * and scale it is drawn at, and the bitmap is blended onto the canvas.
+ *
+ * Rotations are rounded to multiples of ANGLE_STEP degrees and scales to
+ * multiples of SCALE_STEP, so that stamps drawn at nearly the same angle
+ * or scale share a bitmap. The bitmaps are released when they use more
+ * than MAX_BITMAP_BYTES, and rasterized again as they are needed.
+ *
+ * Stamps are identified by a number, and are never deleted: defining a
+ * stamp again with the same name adds a new stamp, so that the canvas can
+ * still redraw the primitives which used the previous one.
+ *
+ * Recording is done by the thread drawing on the canvas. bitmap() can be
+ * called concurrently (e.g. by the TileBinner's workers).
+ */
+class StampCache
+{
+public:
+    /// Draws a primitive, whose handle is in @p styles, on all of @p tiles.
+    typedef std::function<void(const DrawCommand& command,
+                               const PenBrushTable& styles,
+                               TileStore& tiles,
+                               Rasterizer& rasterizer)> RenderFunction;
+
+    /// Rotations are rounded to a multiple of this angle (degrees).
+    static const qreal ANGLE_STEP;
+
+    /// Scales are rounded to a multiple of this scale.
+    static const qreal SCALE_STEP;
+
+    /// Largest scale of the bitmaps; stamps drawn larger are clamped to it.
+    static const qreal MAX_SCALE;
+
+    /// Bitmaps are released when they use more than this (bytes).
+    static const quint64 MAX_BITMAP_BYTES = 64 * 1024 * 1024;
+
+    /// A rasterized stamp.
+    struct Bitmap
+    {
+        QImage image;  ///< Premultiplied ARGB32, null if the stamp is empty.
+        QPoint origin; ///< The pixel of the image where the stamp's origin lies.
+    };
+
+    StampCache();
+    ~StampCache();
+
+    bool beginStamp();
+    bool isRecording() const { return nullptr != m_recording; }
+
+    void addLine(const QLineF& line, const DrawStyle& style, bool antialiased);
+    void addArc(const ArcShape& arc, const DrawStyle& style, bool filled, bool antialiased);
+
+    void endStamp(const QString& name, bool keep);
+
+    int find(const QString& name) const;
+
+    Bitmap bitmap(int stamp, qreal angle, qreal scale, const RenderFunction& render);
+
+    quint64 bytes() const;
+
+private:
+    Q_DISABLE_COPY(StampCache)
+
+    struct Stamp
+    {
+        PenBrushTable          styles;
+        QVector<DrawCommand>   commands; ///< Relative to the stamp's origin.
+        QRectF                 bounds;   ///< The area covered by the commands, including their pens.
+        QHash<quint32, Bitmap> bitmaps;  ///< By rotation and scale (see bitmapKey()).
+    };
+
+    static quint32 bitmapKey(qreal angle, qreal scale, qreal& roundedAngle, qreal& roundedScale);
+
+    Bitmap rasterize(const Stamp& stamp,
+                     qreal angle,
+                     qreal scale,
+                     const RenderFunction& render);
+
+    void releaseBitmaps();
+
+    mutable QMutex      m_mutex;     ///< Guards the stamps and their bitmaps.
+    QVector<Stamp*>     m_stamps;
+    QHash<QString, int> m_names;     ///< The latest stamp defined with each name.
+    Stamp*              m_recording; ///< The stamp being recorded, or nullptr.
+    Rasterizer          m_rasterizer;
+    quint64             m_bitmapBytes;
+};
+
+#endif // STAMPCACHE_H
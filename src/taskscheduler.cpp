@@ -0,0 +1,259 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "taskscheduler.h"
+#include <algorithm>
+
+TaskScheduler::TaskScheduler() :
+    m_tasks(),
+    m_cursor(0),
+    m_current(-1),
+    m_budgetLeft(0),
+    m_nextId(1),
+    m_lastId(-1)
+{
+
+}
+
+/**
+ * @brief Create a task.
+ *
+ * @param state The Lua state.
+ * @param function Stack index of the function run by the task.
+ * @param priority The task's priority (used by the Priority policy).
+ * @param budget Number of VM instructions the task runs each time it is
+ *     resumed, before it is yielded.
+ * @param context Stack index of the task's context value (see
+ *     pushContext()), or 0 for none.
+ * @return The task's identifier.
+ */
+int TaskScheduler::spawn(lua_State* state, int function, int priority, int budget, int context)
+{
+    function = lua_absindex(state, function);
+
+    Task task;
+    task.priority   = priority;
+    task.budget     = std::max(1, budget);
+    task.id         = m_nextId++;
+    task.contextRef = LUA_REFNIL;
+
+    if ((0 != context) && !lua_isnoneornil(state, context))
+    {
+        lua_pushvalue(state, context);
+        task.contextRef = luaL_ref(state, LUA_REGISTRYINDEX);
+    }
+
+    task.thread = lua_newthread(state);
+    lua_pushvalue(state, function);
+    lua_xmove(state, task.thread, 1);
+    task.threadRef = luaL_ref(state, LUA_REGISTRYINDEX);
+
+    // After the tasks with the same or a higher priority.
+    const int index = static_cast<int>(std::upper_bound(m_tasks.constBegin(),
+                                                        m_tasks.constEnd(),
+                                                        priority,
+                                                        &TaskScheduler::higherPriority)
+                                       - m_tasks.constBegin());
+    m_tasks.insert(index, task);
+
+    // Keep the indexes of the tasks which were after the new one.
+    if (index < m_cursor)
+    {
+        m_cursor++;
+    }
+    if ((m_current >= 0) && (index <= m_current))
+    {
+        m_current++;
+    }
+
+    return task.id;
+}
+
+/**
+ * @brief Pick the next task to resume.
+ *
+ * @pre The scheduler is not empty.
+ *
+ * @param policy How the task is picked.
+ * @param newRound Set to @c true if all the tasks which can be picked have
+ *     been picked since the last time @p newRound was set.
+ * @return The index of the task.
+ */
+int TaskScheduler::next(Policy policy, bool& newRound)
+{
+    int limit = m_tasks.size();
+
+    if (Priority == policy)
+    {
+        // Only the tasks with the highest priority are picked.
+        limit = static_cast<int>(std::upper_bound(m_tasks.constBegin(),
+                                                  m_tasks.constEnd(),
+                                                  m_tasks.first().priority,
+                                                  &TaskScheduler::higherPriority)
+                                 - m_tasks.constBegin());
+    }
+
+    newRound = (m_cursor >= limit);
+    if (newRound)
+    {
+        m_cursor = 0;
+    }
+
+    return m_cursor++;
+}
+
+/**
+ * @brief Get whether a task is not the task resumed last.
+ */
+bool TaskScheduler::switchesTask(int task) const
+{
+    return m_tasks.at(task).id != m_lastId;
+}
+
+/**
+ * @brief Run a task until it yields, returns or fails.
+ *
+ * Tasks which return or fail are removed. If the task failed then its
+ * error value is moved to the top of @p state.
+ *
+ * @param state The Lua state resuming the task.
+ * @param task The index of the task.
+ * @return The status returned by @c lua_resume().
+ */
+int TaskScheduler::resume(lua_State* state, int task)
+{
+    lua_State* thread = m_tasks.at(task).thread;
+
+    m_current    = task;
+    m_budgetLeft = m_tasks.at(task).budget;
+    m_lastId     = m_tasks.at(task).id;
+
+    // Discard the values given to coroutine.yield().
+    if (LUA_YIELD == lua_status(thread))
+    {
+        lua_settop(thread, 0);
+    }
+
+    const int status = lua_resume(thread, state, 0);
+
+    // The task may have moved if it spawned tasks.
+    const int current = m_current;
+    m_current = -1;
+
+    if (LUA_YIELD != status)
+    {
+        if (LUA_OK != status)
+        {
+            lua_xmove(thread, state, 1);
+        }
+
+        remove(state, current);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Count instructions run by the current task against its budget.
+ *
+ * This is called by the count hook.
+ *
+ * @param state The Lua thread running the instructions.
+ * @param instructions The number of instructions run.
+ * @return @c true if @p state is the current task and it has used its
+ *     budget, i.e. it should be yielded.
+ */
+bool TaskScheduler::consume(lua_State* state, int instructions)
+{
+    if ((m_current < 0) || (state != m_tasks.at(m_current).thread))
+    {
+        return false;
+    }
+
+    m_budgetLeft -= instructions;
+    return m_budgetLeft <= 0;
+}
+
+/**
+ * @brief Push the context value given to spawn() for a task.
+ */
+void TaskScheduler::pushContext(lua_State* state, int task) const
+{
+    const int ref = m_tasks.at(task).contextRef;
+
+    if (LUA_REFNIL == ref)
+    {
+        lua_pushnil(state);
+    }
+    else
+    {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, ref);
+    }
+}
+
+/**
+ * @brief Push the context value of the task being resumed, or nil.
+ */
+void TaskScheduler::pushCurrentContext(lua_State* state) const
+{
+    if (m_current < 0)
+    {
+        lua_pushnil(state);
+    }
+    else
+    {
+        pushContext(state, m_current);
+    }
+}
+
+/**
+ * @brief Remove all the tasks.
+ */
+void TaskScheduler::clear(lua_State* state)
+{
+    for (const Task& task : m_tasks)
+    {
+        luaL_unref(state, LUA_REGISTRYINDEX, task.threadRef);
+        luaL_unref(state, LUA_REGISTRYINDEX, task.contextRef);
+    }
+
+    m_tasks.clear();
+    m_cursor  = 0;
+    m_current = -1;
+    m_lastId  = -1;
+}
+
+/// Orders tasks by decreasing priority.
+bool TaskScheduler::higherPriority(int priority, const Task& task)
+{
+    return priority > task.priority;
+}
+
+void TaskScheduler::remove(lua_State* state, int task)
+{
+    luaL_unref(state, LUA_REGISTRYINDEX, m_tasks.at(task).threadRef);
+    luaL_unref(state, LUA_REGISTRYINDEX, m_tasks.at(task).contextRef);
+
+    m_tasks.remove(task);
+
+    if (task < m_cursor)
+    {
+        m_cursor--;
+    }
+}
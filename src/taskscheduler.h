@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <QVector>
+#include "lua.hpp"
+
+/**
+ * @brief Runs Lua functions as cooperative tasks, each in its own coroutine.
+ *
+ * Scripts spawn tasks (e.g. one per turtle) with @c _ui.sched.spawn() and
+ * run them with @c _ui.sched.run(), which resumes them one at a time until
+ * they have all returned. A task runs until it yields (@c coroutine.yield())
+ * or until it has used its budget of VM instructions, at which point the
+ * ScriptRunner's count hook yields it (see consume()).
+ *
+ * Tasks are picked either round-robin, or by priority: the tasks with the
+ * highest priority are run round-robin until they have returned, before
+ * any task with a lower priority.
+ *
+ * The coroutines and the values given to spawn() are kept in the Lua
+ * registry until the task returns or clear() is called.
+ *
+ * This class is only used by the thread running the Lua VM.
+ */
+class TaskScheduler
+{
+public:
+    enum Policy
+    {
+        RoundRobin,
+        Priority
+    };
+
+    /// Default number of VM instructions a task runs before it is yielded.
+    static const int DEFAULT_BUDGET = 10000;
+
+    TaskScheduler();
+
+    int size() const { return m_tasks.size(); }
+    bool isEmpty() const { return m_tasks.isEmpty(); }
+    bool isRunning() const { return m_current >= 0; }
+
+    int spawn(lua_State* state, int function, int priority, int budget, int context);
+
+    int next(Policy policy, bool& newRound);
+
+    bool switchesTask(int task) const;
+
+    int resume(lua_State* state, int task);
+
+    bool consume(lua_State* state, int instructions);
+
+    void pushContext(lua_State* state, int task) const;
+    void pushCurrentContext(lua_State* state) const;
+
+    void clear(lua_State* state);
+
+private:
+    struct Task
+    {
+        lua_State* thread;
+        int        threadRef;  ///< Keeps the coroutine from being collected.
+        int        contextRef; ///< The task's context value, or LUA_REFNIL.
+        int        priority;
+        int        budget;     ///< Instructions per resume.
+        int        id;
+    };
+
+    static bool higherPriority(int priority, const Task& task);
+
+    void remove(lua_State* state, int task);
+
+    QVector<Task> m_tasks;   ///< Sorted by decreasing priority, then by age.
+    int m_cursor;            ///< The next task to consider in next().
+    int m_current;           ///< The task being resumed, or -1.
+    int m_budgetLeft;        ///< Instructions left to the current task.
+    int m_nextId;
+    int m_lastId;            ///< The last task resumed, or -1.
+};
+
+#endif // TASKSCHEDULER_H
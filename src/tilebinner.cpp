@@ -0,0 +1,164 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "tilebinner.h"
+#include "tracer.h"
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+
+/**
+ * @brief Draws rows of tiles on a thread of the pool.
+ */
+class TileBinner::Worker : public QRunnable
+{
+public:
+    Worker(TileBinner& binner, Rasterizer& rasterizer, const DrawFunction& drawFunction) :
+        m_binner(binner),
+        m_rasterizer(rasterizer),
+        m_drawFunction(drawFunction)
+    {
+
+    }
+
+    virtual void run()
+    {
+        m_binner.drawRows(m_rasterizer, m_drawFunction);
+    }
+
+private:
+    TileBinner&         m_binner;
+    Rasterizer&         m_rasterizer;
+    const DrawFunction& m_drawFunction;
+};
+
+/**
+ * @brief Create a binner drawing with as many threads as there are cores.
+ */
+TileBinner::TileBinner() :
+    m_tiles(nullptr),
+    m_rows(),
+    m_usedRows(),
+    m_nextRow(0),
+    m_rasterizers(std::max(1, QThread::idealThreadCount())),
+    m_allocationLock(),
+    m_pool()
+{
+    // The thread calling draw() also draws rows.
+    m_pool.setMaxThreadCount(std::max(1, m_rasterizers.size() - 1));
+}
+
+/**
+ * @brief Start binning primitives to draw on some tiles.
+ *
+ * The tiles must not be resized until draw() has returned.
+ */
+void TileBinner::reset(TileStore& tiles)
+{
+    m_tiles = &tiles;
+
+    for (int row : m_usedRows)
+    {
+        m_rows[row].clear();
+    }
+    m_usedRows.clear();
+
+    m_rows.resize(tiles.rows());
+}
+
+/**
+ * @brief Add a primitive to the rows of tiles it overlaps.
+ *
+ * Primitives must be added in the order they are to be drawn.
+ *
+ * @param item The primitive, as passed to the draw function.
+ * @param bounds The pixels drawn on by the primitive, in canvas coordinates.
+ */
+void TileBinner::add(int item, const QRect& bounds)
+{
+    const QRect area = bounds.intersected(m_tiles->rect());
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    for (int row = m_tiles->rowAt(area.top()); row <= m_tiles->rowAt(area.bottom()); row++)
+    {
+        QVector<int>& items = m_rows[row];
+
+        if (items.isEmpty())
+        {
+            m_usedRows.append(row);
+        }
+
+        items.append(item);
+    }
+}
+
+/**
+ * @brief Draw the primitives added since reset().
+ *
+ * This returns once every row has been drawn. @p drawFunction is called
+ * concurrently by several threads, for different rows of tiles: it may
+ * draw on the tiles inside its clip rect, but must not otherwise modify
+ * any state shared with the other threads.
+ */
+void TileBinner::draw(const DrawFunction& drawFunction)
+{
+    const int threads = std::min(m_usedRows.size(), m_rasterizers.size());
+
+    m_nextRow.storeRelease(0);
+    m_tiles->setAllocationLock(&m_allocationLock);
+
+    for (int i = 1; i < threads; i++)
+    {
+        m_pool.start(new Worker(*this, m_rasterizers[i], drawFunction));
+    }
+
+    drawRows(m_rasterizers[0], drawFunction);
+    m_pool.waitForDone();
+
+    m_tiles->setAllocationLock(nullptr);
+}
+
+/**
+ * @brief Draw rows of tiles until there are none left.
+ */
+void TileBinner::drawRows(Rasterizer& rasterizer, const DrawFunction& drawFunction)
+{
+    TraceScope scope("drawRows", "canvas");
+
+    const QRect canvasRect = m_tiles->rect();
+
+    for (int index = m_nextRow.fetchAndAddRelaxed(1);
+         index < m_usedRows.size();
+         index = m_nextRow.fetchAndAddRelaxed(1))
+    {
+        const int   row     = m_usedRows.at(index);
+        const QRect rowRect = m_tiles->tileRect(0, row);
+        const QRect clip    = QRect(canvasRect.left(), rowRect.top(), canvasRect.width(), rowRect.height())
+                                  .intersected(canvasRect);
+
+        for (int item : m_rows.at(row))
+        {
+            drawFunction(item, rasterizer, clip);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef TILEBINNER_H
+#define TILEBINNER_H
+
+#include "rasterizer.h"
+#include "tilestore.h"
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+/**
+ * @brief Draws a sequence of primitives on the canvas' tiles in parallel.
+ *
+ * Each primitive is added to the bin of every row of tiles its bounds
+ * overlap, in the order the primitives were drawn. The rows are then drawn
+ * by a pool of worker threads, each with its own Rasterizer. A row is
+ * drawn by a single thread, which draws the row's primitives in order,
+ * clipped to the row. Each pixel is therefore blended with the same
+ * primitives, in the same order, as when the primitives are drawn one
+ * after the other on the whole canvas, and the result is identical.
+ *
+ * The bins are whole rows of tiles rather than single tiles because the
+ * antialiased rasterizer sums the coverage of a row of pixels from the
+ * left of its clip rect. Rows of pixels are independent of each other, so
+ * clipping to a row of tiles does not change the pixels drawn, whereas a
+ * different left edge could change their rounding.
+ *
+ * The rasterizer only walks the pixels of a primitive inside the row it
+ * is drawn on. Thin lines and arcs are clipped segment by segment, so
+ * drawing them over several rows costs about as much as drawing them once.
+ *
+ * This class is used by a single thread, apart from its workers.
+ */
+class TileBinner
+{
+public:
+    /// Draws the primitive @p item with @p rasterizer, clipped to @p clip.
+    typedef std::function<void(int item, Rasterizer& rasterizer, const QRect& clip)> DrawFunction;
+
+    /// Minimum number of primitives worth binning and drawing in parallel.
+    static const int MIN_PARALLEL_ITEMS = 64;
+
+    TileBinner();
+
+    void reset(TileStore& tiles);
+    void add(int item, const QRect& bounds);
+
+    void draw(const DrawFunction& drawFunction);
+
+private:
+    class Worker;
+
+    void drawRows(Rasterizer& rasterizer, const DrawFunction& drawFunction);
+
+    TileStore*            m_tiles;       ///< The tiles given to reset().
+    QVector<QVector<int> > m_rows;       ///< The items overlapping each row of tiles, in order.
+    QVector<int>          m_usedRows;    ///< The rows with at least one item.
+    QAtomicInt            m_nextRow;     ///< Index in m_usedRows of the next row to draw.
+    QVector<Rasterizer>   m_rasterizers; ///< One for each thread drawing rows.
+    QMutex                m_allocationLock;
+    QThreadPool           m_pool;
+};
+
+#endif // TILEBINNER_H
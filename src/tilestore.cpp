@@ -0,0 +1,293 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "tilestore.h"
+#include <algorithm>
+
+TileStore::TileStore() :
+    m_size(),
+    m_origin(),
+    m_firstColumn(0),
+    m_firstRow(0),
+    m_columns(0),
+    m_rows(0),
+    m_tiles(),
+    m_occupied(),
+    m_tileCount(0),
+    m_allocationLock(nullptr)
+{
+
+}
+
+/**
+ * @brief Create an empty (transparent) canvas.
+ *
+ * @param size The size of the canvas, in pixels.
+ */
+TileStore::TileStore(const QSize& size) :
+    m_size(),
+    m_origin(),
+    m_firstColumn(0),
+    m_firstRow(0),
+    m_columns(0),
+    m_rows(0),
+    m_tiles(),
+    m_occupied(),
+    m_tileCount(0),
+    m_allocationLock(nullptr)
+{
+    resize(size);
+}
+
+/**
+ * @brief Get the area of the canvas covered by a tile.
+ *
+ * The tiles at the edges may extend past the canvas.
+ */
+QRect TileStore::tileRect(int column, int row) const
+{
+    return QRect(m_origin.x() + ((m_firstColumn + column) * TILE_SIZE),
+                 m_origin.y() + ((m_firstRow + row) * TILE_SIZE),
+                 TILE_SIZE,
+                 TILE_SIZE);
+}
+
+/**
+ * @brief Get a tile for drawing on it.
+ *
+ * The tile is allocated (and filled with transparent pixels) if it was
+ * not allocated yet. Drawing on the tile must also update its bounds.
+ */
+TileStore::Tile& TileStore::writableTile(int column, int row)
+{
+    const int index = (row * m_columns) + column;
+    Tile& tile = m_tiles[index];
+
+    if (tile.image.isNull())
+    {
+        tile.image = QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        tile.image.fill(Qt::transparent);
+        tile.used = QRect();
+
+        // The occupancy bits of neighbouring tiles share bytes.
+        QMutexLocker lock(m_allocationLock);
+        m_occupied.setBit(index);
+        m_tileCount++;
+    }
+
+    return tile;
+}
+
+/**
+ * @brief Permit drawing on different tiles from several threads.
+ *
+ * While a lock is set, writableTile() can be called concurrently for
+ * different tiles: the lock is held while a tile is being allocated. The
+ * grid of tiles, which may be shared with copies of the store, is
+ * unshared first so that none of the threads has to copy it. Pass nullptr
+ * once the threads are done.
+ *
+ * @param lock The lock to use, or nullptr.
+ */
+void TileStore::setAllocationLock(QMutex* lock)
+{
+    m_tiles.detach();
+    m_allocationLock = lock;
+}
+
+/**
+ * @brief Get the bounding rect of the pixels drawn on.
+ *
+ * @return The area drawn on, or an empty rect if nothing was drawn.
+ */
+QRect TileStore::usedRect() const
+{
+    QRect used;
+
+    for (int row = 0; row < m_rows; row++)
+    {
+        for (int column = 0; column < m_columns; column++)
+        {
+            if (isOccupied(column, row))
+            {
+                used |= tile(column, row).used.translated(tileRect(column, row).topLeft());
+            }
+        }
+    }
+
+    return used.intersected(rect());
+}
+
+/**
+ * @brief Erase the canvas, releasing all tiles.
+ */
+void TileStore::clear()
+{
+    m_tiles.fill(Tile());
+    m_occupied.fill(false);
+    m_tileCount = 0;
+}
+
+/**
+ * @brief Change the size of the canvas.
+ *
+ * The size changes about the center of the canvas, which is where the
+ * tiles are aligned, so the tiles are kept as they are: only the tiles
+ * which are no longer part of the canvas are released, and the pixels of
+ * the edge tiles which fell outside the canvas are erased. No tiles are
+ * allocated; the tiles uncovered by growing the canvas are allocated when
+ * they are first drawn on.
+ *
+ * @param newSize The new size of the canvas.
+ */
+void TileStore::resize(const QSize& newSize)
+{
+    const QPoint newOrigin(newSize.width() / 2, newSize.height() / 2);
+    const QRect  newRect(QPoint(0, 0), newSize);
+
+    const int firstColumn = floorDiv(-newOrigin.x());
+    const int firstRow    = floorDiv(-newOrigin.y());
+    const int columns     = newSize.isEmpty() ? 0 : floorDiv(newSize.width()  - 1 - newOrigin.x()) - firstColumn + 1;
+    const int rows        = newSize.isEmpty() ? 0 : floorDiv(newSize.height() - 1 - newOrigin.y()) - firstRow + 1;
+
+    QVector<Tile> tiles(columns * rows);
+    QBitArray     occupied(columns * rows);
+    int           tileCount = 0;
+
+    for (int row = 0; row < m_rows; row++)
+    {
+        const int newRow = m_firstRow + row - firstRow;
+
+        for (int column = 0; column < m_columns; column++)
+        {
+            const int newColumn = m_firstColumn + column - firstColumn;
+
+            if (!isOccupied(column, row)
+                || (newColumn < 0) || (newColumn >= columns)
+                || (newRow < 0) || (newRow >= rows))
+            {
+                continue;
+            }
+
+            Tile tile = this->tile(column, row);
+
+            const QRect tileRect(newOrigin.x() + ((firstColumn + newColumn) * TILE_SIZE),
+                                 newOrigin.y() + ((firstRow + newRow) * TILE_SIZE),
+                                 TILE_SIZE,
+                                 TILE_SIZE);
+            const QRect visible = newRect.intersected(tileRect).translated(-tileRect.topLeft());
+
+            if (!visible.contains(tile.used))
+            {
+                // The drawings which fell off the edge of the canvas are erased,
+                // so that they don't reappear if the canvas grows again.
+                tile.used = tile.used.intersected(visible);
+
+                if (tile.used.isEmpty())
+                {
+                    continue;
+                }
+
+                erase(tile, visible);
+            }
+
+            const int index = (newRow * columns) + newColumn;
+            tiles[index] = tile;
+            occupied.setBit(index);
+            tileCount++;
+        }
+    }
+
+    m_size        = newSize;
+    m_origin      = newOrigin;
+    m_firstColumn = firstColumn;
+    m_firstRow    = firstRow;
+    m_columns     = columns;
+    m_rows        = rows;
+    m_tiles       = tiles;
+    m_occupied    = occupied;
+    m_tileCount   = tileCount;
+}
+
+/**
+ * @brief Draw the tiles overlapping part of the canvas with a painter.
+ *
+ * Tiles which were never drawn on are skipped.
+ *
+ * @param painter The painter, using canvas coordinates.
+ * @param region The part of the canvas to draw.
+ */
+void TileStore::draw(QPainter* painter, const QRect& region) const
+{
+    const QRect area = region.intersected(rect());
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    for (int row = rowAt(area.top()); row <= rowAt(area.bottom()); row++)
+    {
+        for (int column = columnAt(area.left()); column <= columnAt(area.right()); column++)
+        {
+            if (isOccupied(column, row))
+            {
+                const QRect tileRect = this->tileRect(column, row);
+                const QRect target   = area.intersected(tileRect);
+
+                painter->drawImage(target,
+                                   tile(column, row).image,
+                                   target.translated(-tileRect.topLeft()));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Get the amount of memory used by the allocated tiles.
+ */
+quint64 TileStore::bytes() const
+{
+    return static_cast<quint64>(m_tileCount)
+           * TILE_SIZE * TILE_SIZE * sizeof(quint32);
+}
+
+/**
+ * @brief Make the pixels of a tile outside of an area transparent.
+ *
+ * @param tile The tile.
+ * @param keep The area to keep, relative to the tile.
+ */
+void TileStore::erase(Tile& tile, const QRect& keep)
+{
+    for (int y = 0; y < TILE_SIZE; y++)
+    {
+        quint32* pixels = reinterpret_cast<quint32*>(tile.image.scanLine(y));
+
+        if ((y < keep.top()) || (y > keep.bottom()))
+        {
+            std::fill(pixels, pixels + TILE_SIZE, 0u);
+        }
+        else
+        {
+            std::fill(pixels, pixels + keep.left(), 0u);
+            std::fill(pixels + keep.right() + 1, pixels + TILE_SIZE, 0u);
+        }
+    }
+}
@@ -0,0 +1,169 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <QBitArray>
+#include <QImage>
+#include <QMutex>
+#include <QPainter>
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+/**
+ * @brief The pixels of the canvas, stored as a grid of square tiles.
+ *
+ * Tiles are only allocated when they are first drawn on, so the parts of
+ * the canvas which have never been drawn on cost neither memory nor time
+ * when the canvas is painted or exported.
+ *
+ * Each tile has an occupancy bit, which is set when the tile is allocated,
+ * and keeps the tight bounds of the pixels drawn on it. The bounds are
+ * maintained by whatever draws on the tile (see RasterTarget and paint()),
+ * so usedRect() finds the area drawn on by visiting each tile once.
+ *
+ * The grid is aligned to the center of the canvas, origin(), rather than
+ * to its top-left corner, so that resizing the canvas (which keeps the
+ * center in place) only changes which tiles are part of the grid. The
+ * tiles at the edges of the canvas may therefore extend past it.
+ *
+ * Tile images are premultiplied ARGB32, and their pixel (0,0) is the
+ * pixel tileRect().topLeft() of the canvas.
+ *
+ * This class is not thread-safe, with one exception: once an allocation
+ * lock is set (see setAllocationLock()), different threads can draw on
+ * different tiles at the same time.
+ */
+class TileStore
+{
+public:
+    /// Width and height of the tiles, in pixels (must be a power of 2).
+    static const int TILE_SIZE = 64;
+
+    struct Tile
+    {
+        QImage image; ///< Null until the tile is first drawn on.
+        QRect  used;  ///< Bounds of the pixels drawn on, relative to the tile.
+    };
+
+    TileStore();
+    explicit TileStore(const QSize& size);
+
+    QSize size() const { return m_size; }
+    QRect rect() const { return QRect(QPoint(0, 0), m_size); }
+
+    /// The pixel at the center of the canvas, where the tile corners meet.
+    QPoint origin() const { return m_origin; }
+
+    int columns() const { return m_columns; }
+    int rows() const { return m_rows; }
+
+    int columnAt(int x) const { return floorDiv(x - m_origin.x()) - m_firstColumn; }
+    int rowAt(int y) const { return floorDiv(y - m_origin.y()) - m_firstRow; }
+
+    QRect tileRect(int column, int row) const;
+
+    bool isOccupied(int column, int row) const
+    {
+        return m_occupied.testBit((row * m_columns) + column);
+    }
+
+    const Tile& tile(int column, int row) const
+    {
+        return m_tiles.at((row * m_columns) + column);
+    }
+
+    Tile& writableTile(int column, int row);
+
+    void setAllocationLock(QMutex* lock);
+
+    QRect usedRect() const;
+
+    void clear();
+
+    void resize(const QSize& newSize);
+
+    template <typename PaintFunction>
+    void paint(const QRect& rect, PaintFunction paintFunction);
+
+    void draw(QPainter* painter, const QRect& region) const;
+
+    quint64 bytes() const;
+
+private:
+    static int floorDiv(int value)
+    {
+        return (value >= 0) ? (value / TILE_SIZE) : -((TILE_SIZE - 1 - value) / TILE_SIZE);
+    }
+
+    static void erase(Tile& tile, const QRect& keep);
+
+    QSize         m_size;
+    QPoint        m_origin;
+    int           m_firstColumn; ///< Column of the leftmost tile, relative to the origin.
+    int           m_firstRow;    ///< Row of the topmost tile, relative to the origin.
+    int           m_columns;
+    int           m_rows;
+    QVector<Tile> m_tiles;
+    QBitArray     m_occupied;
+    int           m_tileCount; ///< Number of allocated tiles.
+    QMutex*       m_allocationLock; ///< Serializes the allocation of tiles, or nullptr.
+};
+
+/**
+ * @brief Draw on part of the canvas using QPainter.
+ *
+ * This is for drawings which the Rasterizer doesn't support. The painter
+ * passed to @p paintFunction uses canvas coordinates and is clipped to
+ * @p rect, which is marked as drawn on in each tile it overlaps.
+ *
+ * @param rect The area drawn on.
+ * @param paintFunction Called with a QPainter& once per tile overlapping
+ *     @p rect.
+ */
+template <typename PaintFunction>
+void TileStore::paint(const QRect& rect, PaintFunction paintFunction)
+{
+    const QRect area = rect.intersected(this->rect());
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    for (int row = rowAt(area.top()); row <= rowAt(area.bottom()); row++)
+    {
+        for (int column = columnAt(area.left()); column <= columnAt(area.right()); column++)
+        {
+            Tile& tile = writableTile(column, row);
+            const QRect tileRect = this->tileRect(column, row);
+
+            QPainter painter(&tile.image);
+            painter.translate(-tileRect.topLeft());
+            painter.setClipRect(area);
+            paintFunction(painter);
+
+            tile.used |= area.intersected(tileRect).translated(-tileRect.topLeft());
+        }
+    }
+}
+
+#endif // TILESTORE_H
@@ -0,0 +1,411 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "tracer.h"
+#include <QAtomicPointer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTextStream>
+#include <QThread>
+
+namespace
+{
+
+const int EVENTS_PER_CHUNK = 4096;
+
+struct TraceEvent
+{
+    const char* name;
+    const char* category;
+    qint64 timestamp; // nanoseconds since the trace clock was started
+    qint64 duration;  // nanoseconds, complete ('X') events only
+    double value;     // counter ('C') events only
+    char phase;
+};
+
+/**
+ * Events are stored in a linked list of fixed size chunks.
+ *
+ * Only the owning thread appends to a chunk. The number of valid events
+ * in a chunk is published with release semantics so that the events can
+ * be read by another thread without locking.
+ */
+struct EventChunk
+{
+    EventChunk() :
+        count(0),
+        next(nullptr)
+    {
+    }
+
+    TraceEvent events[EVENTS_PER_CHUNK];
+    QAtomicInt count;
+    QAtomicPointer<EventChunk> next;
+};
+
+/**
+ * The events recorded by a thread.
+ *
+ * The buffer is reset for a new session by its thread with the registry
+ * mutex locked, so writeChromeTrace() can read generation and the chunks
+ * while holding it. Only the owning thread modifies the buffer otherwise.
+ */
+struct ThreadBuffer
+{
+    int threadId;
+    QString threadName; // protected by the registry mutex
+    int generation;     // written with the registry mutex locked
+    EventChunk* head;
+    EventChunk* tail;   // only accessed by the owning thread
+};
+
+// Incremented each time tracing is started, so that each thread can discard
+// the events it recorded during the previous session.
+QAtomicInt s_generation(0);
+
+QMutex& registryMutex()
+{
+    static QMutex mutex;
+    return mutex;
+}
+
+// Buffers are never freed, since the events recorded by a thread must remain
+// available after the thread has finished.
+QList<ThreadBuffer*>& registry()
+{
+    static QList<ThreadBuffer*> buffers;
+    return buffers;
+}
+
+thread_local ThreadBuffer* t_buffer = nullptr;
+
+QElapsedTimer startedTimer()
+{
+    QElapsedTimer timer;
+    timer.start();
+    return timer;
+}
+
+const QElapsedTimer& traceClock()
+{
+    static const QElapsedTimer clock = startedTimer();
+    return clock;
+}
+
+/**
+ * Get the calling thread's buffer, registering it on first use.
+ */
+ThreadBuffer& currentThreadBuffer()
+{
+    if (nullptr == t_buffer)
+    {
+        ThreadBuffer* buffer = new ThreadBuffer;
+        buffer->generation = s_generation.loadAcquire();
+        buffer->head       = new EventChunk;
+        buffer->tail       = buffer->head;
+
+        QMutexLocker lock(&registryMutex());
+        buffer->threadId = registry().size() + 1;
+
+        const QThread* thread = QThread::currentThread();
+        if ((nullptr != thread) && !thread->objectName().isEmpty())
+        {
+            buffer->threadName = thread->objectName();
+        }
+        else
+        {
+            buffer->threadName = QString("Thread %1").arg(buffer->threadId);
+        }
+
+        registry().append(buffer);
+        t_buffer = buffer;
+    }
+
+    return *t_buffer;
+}
+
+/**
+ * Reserve space for a new event in the calling thread's buffer.
+ *
+ * The event becomes visible to readers when commitEvent() is called.
+ */
+TraceEvent& beginEvent(ThreadBuffer& buffer)
+{
+    const int generation = s_generation.loadAcquire();
+    if (buffer.generation != generation)
+    {
+        // A new trace was started: discard the previous session's events,
+        // which writeChromeTrace() may be reading.
+        QMutexLocker lock(&registryMutex());
+
+        EventChunk* chunk = buffer.head->next.loadAcquire();
+        while (nullptr != chunk)
+        {
+            EventChunk* next = chunk->next.loadAcquire();
+            delete chunk;
+            chunk = next;
+        }
+
+        buffer.head->next.storeRelease(nullptr);
+        buffer.head->count.storeRelease(0);
+        buffer.tail       = buffer.head;
+        buffer.generation = generation;
+    }
+
+    EventChunk* tail = buffer.tail;
+    if (tail->count.loadAcquire() >= EVENTS_PER_CHUNK)
+    {
+        EventChunk* chunk = new EventChunk;
+        tail->next.storeRelease(chunk);
+        buffer.tail = chunk;
+        tail = chunk;
+    }
+
+    return tail->events[tail->count.loadAcquire()];
+}
+
+void commitEvent(ThreadBuffer& buffer)
+{
+    buffer.tail->count.fetchAndAddRelease(1);
+}
+
+/**
+ * Escape a string for use in a JSON string literal.
+ */
+QString jsonEscaped(const QString& str)
+{
+    QString escaped;
+    escaped.reserve(str.size());
+
+    for (const QChar c : str)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            escaped.append('\\');
+            escaped.append(c);
+        }
+        else if (c.unicode() < 0x20)
+        {
+            escaped.append(QString("\\u%1").arg(c.unicode(), 4, 16, QChar('0')));
+        }
+        else
+        {
+            escaped.append(c);
+        }
+    }
+
+    return escaped;
+}
+
+} // namespace
+
+QAtomicInt Tracer::s_enabled(0);
+
+/**
+ * @brief Start recording trace events.
+ *
+ * Any events recorded by a previous trace are discarded.
+ */
+void Tracer::start()
+{
+    // Start the clock now, rather than on the first event.
+    (void)traceClock();
+
+    s_generation.fetchAndAddOrdered(1);
+    s_enabled.storeRelease(1);
+}
+
+/**
+ * @brief Stop recording trace events.
+ *
+ * The events recorded so far are kept until the next call to start(), so
+ * they can be written out with writeChromeTrace().
+ */
+void Tracer::stop()
+{
+    s_enabled.storeRelease(0);
+}
+
+/**
+ * @brief Get the current time of the trace clock.
+ *
+ * @return The number of nanoseconds since the trace clock was started.
+ */
+qint64 Tracer::now()
+{
+    return traceClock().nsecsElapsed();
+}
+
+/**
+ * @brief Set the name of the calling thread as it appears in the trace.
+ *
+ * By default the thread's QObject::objectName() is used.
+ */
+void Tracer::setCurrentThreadName(const QString& name)
+{
+    ThreadBuffer& buffer = currentThreadBuffer();
+
+    QMutexLocker lock(&registryMutex());
+    buffer.threadName = name;
+}
+
+/**
+ * @brief Record an event with a duration.
+ *
+ * @param name The name of the event. Must have static storage duration.
+ * @param category The event's category. Must have static storage duration.
+ * @param startNsecs The time at which the event started (see now()).
+ * @param durationNsecs The duration of the event.
+ */
+void Tracer::recordComplete(const char* name,
+                            const char* category,
+                            qint64 startNsecs,
+                            qint64 durationNsecs)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    ThreadBuffer& buffer = currentThreadBuffer();
+    TraceEvent& event = beginEvent(buffer);
+    event.name      = name;
+    event.category  = category;
+    event.timestamp = startNsecs;
+    event.duration  = durationNsecs;
+    event.value     = 0.0;
+    event.phase     = 'X';
+    commitEvent(buffer);
+}
+
+/**
+ * @brief Record a sample of a counter at the current time.
+ *
+ * @param name The name of the counter. Must have static storage duration.
+ * @param category The counter's category. Must have static storage duration.
+ * @param value The value of the counter.
+ */
+void Tracer::recordCounter(const char* name,
+                           const char* category,
+                           double value)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    ThreadBuffer& buffer = currentThreadBuffer();
+    TraceEvent& event = beginEvent(buffer);
+    event.name      = name;
+    event.category  = category;
+    event.timestamp = now();
+    event.duration  = 0;
+    event.value     = value;
+    event.phase     = 'C';
+    commitEvent(buffer);
+}
+
+/**
+ * @brief Write the events recorded during the last trace to a file.
+ *
+ * The file is written in the Chrome Trace Event JSON format.
+ *
+ * @param filename The name of the file to write.
+ * @param[out] errorString Set to a description of the error if the file cannot be written.
+ * @return @c true if the file was written successfully, @c false otherwise.
+ */
+bool Tracer::writeChromeTrace(const QString& filename, QString& errorString)
+{
+    QFile file(filename);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text))
+    {
+        errorString = file.errorString();
+        return false;
+    }
+
+    QTextStream stream(&file);
+    stream.setRealNumberNotation(QTextStream::FixedNotation);
+    stream.setRealNumberPrecision(3);
+
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    const int generation = s_generation.loadAcquire();
+    bool first = true;
+
+    QMutexLocker lock(&registryMutex());
+    for (const ThreadBuffer* buffer : registry())
+    {
+        // Threads which haven't recorded anything in this session still
+        // hold the events from a previous session.
+        if (buffer->generation != generation)
+        {
+            continue;
+        }
+
+        if (!first)
+        {
+            stream << ",\n";
+        }
+        first = false;
+
+        stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+               << ",\"args\":{\"name\":\"" << jsonEscaped(buffer->threadName) << "\"}}";
+
+        for (const EventChunk* chunk = buffer->head;
+             nullptr != chunk;
+             chunk = chunk->next.loadAcquire())
+        {
+            const int count = chunk->count.loadAcquire();
+            for (int i = 0; i < count; i++)
+            {
+                const TraceEvent& event = chunk->events[i];
+
+                // Trace Event timestamps are in microseconds.
+                stream << ",\n{\"name\":\"" << event.name
+                       << "\",\"cat\":\"" << event.category
+                       << "\",\"ph\":\"" << event.phase
+                       << "\",\"pid\":1,\"tid\":" << buffer->threadId
+                       << ",\"ts\":" << (static_cast<double>(event.timestamp) / 1000.0);
+
+                if (event.phase == 'X')
+                {
+                    stream << ",\"dur\":" << (static_cast<double>(event.duration) / 1000.0) << "}";
+                }
+                else
+                {
+                    stream << ",\"args\":{\"value\":" << event.value << "}}";
+                }
+            }
+        }
+    }
+
+    stream << "\n]}\n";
+    stream.flush();
+
+    if (stream.status() != QTextStream::Ok)
+    {
+        errorString = file.errorString();
+        return false;
+    }
+
+    return true;
+}
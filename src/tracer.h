@@ -0,0 +1,128 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QAtomicInt>
+#include <QString>
+
+/**
+ * @brief Opt-in timeline tracing of script and render activity.
+ *
+ * When tracing is enabled (see start()) scoped events are recorded together
+ * with the ID of the thread that produced them. The recorded events can be
+ * written out in the Chrome Trace Event JSON format (see writeChromeTrace()),
+ * which can be loaded into @c chrome://tracing or Perfetto.
+ *
+ * @section Recording events
+ *
+ * Events are normally recorded using TraceScope, which records a "complete"
+ * event spanning the lifetime of the TraceScope object:
+ *
+ * @code
+ * {
+ *     TraceScope scope("paint", "ui");
+ *     // ... work to be measured ...
+ * }
+ * @endcode
+ *
+ * Event names and categories are stored by pointer and therefore @b must be
+ * string literals (or otherwise have static storage duration).
+ *
+ * @section Buffering
+ *
+ * Each thread appends events to its own buffer, so recording an event never
+ * takes a lock (a mutex is only taken the first time a thread records an event,
+ * to register its buffer). When tracing is disabled the cost of a TraceScope
+ * is a single atomic load.
+ *
+ * The events recorded by a thread are discarded when tracing is restarted.
+ */
+class Tracer
+{
+public:
+    static inline bool enabled()
+    {
+        return 0 != s_enabled.loadAcquire();
+    }
+
+    static void start();
+    static void stop();
+
+    static qint64 now();
+
+    static void setCurrentThreadName(const QString& name);
+
+    static void recordComplete(const char* name,
+                               const char* category,
+                               qint64 startNsecs,
+                               qint64 durationNsecs);
+
+    static void recordCounter(const char* name,
+                              const char* category,
+                              double value);
+
+    static bool writeChromeTrace(const QString& filename, QString& errorString);
+
+private:
+    static QAtomicInt s_enabled;
+};
+
+/**
+ * @brief Records a trace event covering the lifetime of this object.
+ *
+ * Nothing is recorded if tracing was disabled when the object was created.
+ */
+class TraceScope
+{
+public:
+    inline TraceScope(const char* name, const char* category) :
+        m_name(name),
+        m_category(category),
+        m_start(Tracer::enabled() ? Tracer::now() : -1)
+    {
+    }
+
+    inline ~TraceScope()
+    {
+        end();
+    }
+
+    /**
+     * @brief End the event before the object is destroyed.
+     */
+    inline void end()
+    {
+        if (m_start >= 0)
+        {
+            Tracer::recordComplete(m_name, m_category, m_start, Tracer::now() - m_start);
+            m_start = -1;
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(TraceScope)
+
+    const char* m_name;
+    const char* m_category;
+    qint64 m_start;
+};
+
+#endif // TRACER_H
@@ -0,0 +1,82 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <QAtomicInt>
+
+/**
+ * @brief Passes the latest value from one writer thread to one reader
+ * thread, without locks.
+ *
+ * The writer and the reader each own one of three copies of the value.
+ * The third copy holds the latest value published. publish() swaps the
+ * writer's copy with it, and read() swaps it with the reader's copy if
+ * a value was published since the last read(). The swaps are atomic, so
+ * neither thread ever waits for the other, and the reader never sees a
+ * value which is partly written.
+ *
+ * Only one thread may call publish(), and only one thread may call read().
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+    explicit TripleBuffer(const T& value) :
+        m_buffers{value, value, value},
+        m_middle(1),
+        m_back(2),
+        m_front(0)
+    {
+
+    }
+
+    /// Make @p value the latest value. Only called by the writer.
+    void publish(const T& value)
+    {
+        m_buffers[m_back] = value;
+        m_back = m_middle.fetchAndStoreOrdered(m_back | PUBLISHED) & INDEX_MASK;
+    }
+
+    /// Get the latest value. Only called by the reader.
+    const T& read()
+    {
+        if (0 != (m_middle.loadAcquire() & PUBLISHED))
+        {
+            m_front = m_middle.fetchAndStoreOrdered(m_front) & INDEX_MASK;
+        }
+
+        return m_buffers[m_front];
+    }
+
+private:
+    Q_DISABLE_COPY(TripleBuffer)
+
+    /// Set in m_middle when it holds a value not yet read.
+    static const int PUBLISHED  = 4;
+    static const int INDEX_MASK = 3;
+
+    T          m_buffers[3];
+    QAtomicInt m_middle; ///< Index of the latest value, and the PUBLISHED flag.
+    int        m_back;   ///< Index of the writer's copy.
+    int        m_front;  ///< Index of the reader's copy.
+};
+
+#endif // TRIPLEBUFFER_H
@@ -18,25 +18,93 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  ***********************************************************************/
 #include "turtlecanvasgraphicsitem.h"
-#include <QMutexLocker>
+#include "floodfill.h"
+#include "perfcounters.h"
+#include "tracer.h"
+#include <QElapsedTimer>
 #include <QPainter>
 #include <QPaintEvent>
 #include <QResizeEvent>
 #include <QStyleOptionGraphicsItem>
-#include <cassert>
+#include <QtMath>
+#include <algorithm>
 #include <cmath>
 
 static const int DEFAULT_SIZE = 2048;
 
+/// Longest wait (milliseconds) for a presented frame to be painted, e.g.
+/// while the canvas is not visible.
+static const unsigned long FRAME_TIMEOUT = 100;
+
+/// Wait (milliseconds) for the next frame when nothing has changed.
+static const unsigned long FRAME_INTERVAL = 16;
+
+/**
+ * @brief Scoped lock for the canvas mutex.
+ *
+ * This behaves like QMutexLocker, except that the time spent waiting for
+ * the mutex is recorded in the trace (see Tracer) when the mutex is
+ * contended.
+ */
+class CanvasLocker
+{
+public:
+    explicit CanvasLocker(QMutex* mutex) :
+        m_mutex(mutex)
+    {
+        if (!m_mutex->tryLock())
+        {
+            TraceScope scope("canvas lock wait", "canvas");
+            m_mutex->lock();
+        }
+    }
+
+    ~CanvasLocker()
+    {
+        m_mutex->unlock();
+    }
+
+private:
+    Q_DISABLE_COPY(CanvasLocker)
+
+    QMutex* m_mutex;
+};
+
 TurtleCanvasGraphicsItem::TurtleCanvasGraphicsItem() :
     m_mutex(),
-    m_pixmap(DEFAULT_SIZE, DEFAULT_SIZE),
+    m_tiles(QSize(DEFAULT_SIZE, DEFAULT_SIZE)),
     m_backgroundColor(Qt::white),
-    m_usedRect(DEFAULT_SIZE/2,DEFAULT_SIZE/2,1,1),
-    m_turtlePos(0.0, 0.0),
-    m_turtleHeading(0.0),
-    m_turtleColor(Qt::black),
-    m_turtleHidden(false),
+    m_rasterizer(),
+    m_styles(),
+    m_currentStyle(-1),
+    m_style(nullptr),
+    m_styleGeneration(0),
+    m_displayList(),
+    m_rasterized(0),
+    m_binner(),
+    m_layers(1),
+    m_currentLayer(0),
+    m_compositor(),
+    m_stamps(),
+    m_glyphs(),
+    m_images(),
+    m_checkpoints(),
+    m_nextCheckpoint(1),
+    m_historyTiles(),
+    m_historyStep(-1),
+    m_turtleMutex(),
+    m_turtle{QPointF(0.0, 0.0), 0.0, QColor(Qt::black), false},
+    m_sprite(m_turtle),
+    m_batchDepth(0),
+    m_batchDirty(0),
+    m_frameMode(0),
+    m_frameDirty(0),
+    m_frameLayers(),
+    m_frameBackground(),
+    m_frameTurtle(),
+    m_framesPresented(0),
+    m_framesPainted(0),
+    m_frameCond(),
     m_antialiased(false)
 {
     // We need to call update() each time the canvas is updated (i.e. drawn on)
@@ -45,7 +113,10 @@ TurtleCanvasGraphicsItem::TurtleCanvasGraphicsItem() :
             this, SLOT(callUpdate()),
             Qt::QueuedConnection);
 
-    m_pixmap.fill(Qt::transparent);
+    updateCanvasBytes();
+
+    // paint() only draws the tiles in the exposed area.
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
 
     const qreal newpos = static_cast<qreal>(DEFAULT_SIZE) / 2.0;
     setPos(-newpos, -newpos);
@@ -65,17 +136,15 @@ TurtleCanvasGraphicsItem::TurtleCanvasGraphicsItem() :
 QImage TurtleCanvasGraphicsItem::toImage(bool transparentBackground,
                                          bool fitToUsedArea) const
 {
-    QMutexLocker lock(&m_mutex);
-    QRect pixmapRect;
+    CanvasLocker lock(&m_mutex);
+    const QRect imageRect = exportRect(fitToUsedArea);
     QImage::Format imageFormat;
 
-    pixmapRect  = fitToUsedArea ? m_usedRect : m_pixmap.rect();
-
     imageFormat = transparentBackground
                     ? QImage::Format_ARGB32_Premultiplied
                     : QImage::Format_RGB32;
 
-    QImage image = QImage(pixmapRect.size(), imageFormat);
+    QImage image = QImage(imageRect.size(), imageFormat);
 
     QPainter painter(&image);
     if (transparentBackground)
@@ -86,14 +155,138 @@ QImage TurtleCanvasGraphicsItem::toImage(bool transparentBackground,
     {
         painter.fillRect(image.rect(), m_backgroundColor);
     }
-    painter.drawPixmap(image.rect(), m_pixmap, pixmapRect);
+    painter.translate(-imageRect.topLeft());
+    m_compositor.draw(&painter, imageRect, visibleLayers(m_tiles));
 
     return image;
 }
 
+/**
+ * @brief Get the area of the canvas saved by toImage().
+ *
+ * @param fitToUsedArea Set to @c true to get only the area drawn on.
+ * @return The area, relative to the center of the canvas with the Y axis
+ *     pointing down (as for the primitives in copyPrimitives()).
+ */
+QRectF TurtleCanvasGraphicsItem::drawingRect(bool fitToUsedArea) const
+{
+    CanvasLocker lock(&m_mutex);
+
+    const QPointF origin(static_cast<qreal>(m_tiles.size().width())  / 2.0,
+                         static_cast<qreal>(m_tiles.size().height()) / 2.0);
+
+    return QRectF(exportRect(fitToUsedArea)).translated(-origin);
+}
+
+/**
+ * @brief Get a copy of the primitives drawn on the canvas.
+ *
+ * The copy shares its storage with the canvas' display list, so this is
+ * cheap. It can be used to export the drawing as vector graphics.
+ *
+ * Fills cannot be exported as vector graphics, so when there are fills
+ * the drawing up to the last one is redrawn as the copy's base tiles,
+ * and only the following primitives are copied. Likewise, when layers
+ * other than the current one are shown (or the current layer is not
+ * opaque), the composited layers are copied as the base tiles, without
+ * any primitives.
+ *
+ * @param displayList Receives the primitives.
+ * @param styles Receives the styles of the primitives, by handle.
+ */
+void TurtleCanvasGraphicsItem::copyPrimitives(DisplayList& displayList,
+                                              QVector<DrawStyle>& styles) const
+{
+    CanvasLocker lock(&m_mutex);
+
+    const QVector<LayerCompositor::Layer> layers = visibleLayers(m_tiles);
+
+    // Only lines and arcs are exported as vectors. The fills, stamps, text
+    // and images are exported as part of the base image.
+    int lastFill = m_displayList.size() - 1;
+    while ((lastFill >= 0) &&
+           ((DrawCommand::Line == m_displayList.at(lastFill).type()) ||
+            (DrawCommand::Arc  == m_displayList.at(lastFill).type())))
+    {
+        lastFill--;
+    }
+
+    if ((1 != layers.size()) || (&m_tiles != layers.first().tiles) || (0xff != layers.first().opacity))
+    {
+        displayList.rebase(m_compositor.flatten(m_tiles.size(), layers));
+
+        // The copy published its size in place of the canvas' display list.
+        m_displayList.updateBytes();
+    }
+    else if (lastFill < 0)
+    {
+        displayList = m_displayList;
+    }
+    else
+    {
+        int firstCommand;
+        TileStore tiles = m_displayList.keyframeBefore(lastFill + 1, firstCommand);
+        tiles.resize(m_tiles.size());
+
+        Rasterizer rasterizer;
+        for (int i = firstCommand; i <= lastFill; i++)
+        {
+            render(m_displayList.at(i), m_styles, tiles, rasterizer, tiles.rect());
+        }
+
+        displayList.rebase(tiles);
+        for (int i = lastFill + 1; i < m_displayList.size(); i++)
+        {
+            displayList.append(m_displayList.at(i), m_displayList.bounds(i));
+        }
+
+        // The copy published its size in place of the canvas' display list.
+        m_displayList.updateBytes();
+    }
+
+    styles.clear();
+    styles.reserve(m_styles.size());
+    for (int i = 0; i < m_styles.size(); i++)
+    {
+        styles.append(m_styles.entry(static_cast<PenBrushTable::Handle>(i)).style);
+    }
+}
+
+/**
+ * @brief Get the area of the canvas to save, in image coordinates.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+QRect TurtleCanvasGraphicsItem::exportRect(bool fitToUsedArea) const
+{
+    if (!fitToUsedArea)
+    {
+        return m_tiles.rect();
+    }
+
+    const QVector<LayerCompositor::Layer> layers = visibleLayers(m_tiles);
+
+    QRect usedRect;
+    for (int i = 0; i < layers.size(); i++)
+    {
+        usedRect |= layers.at(i).tiles->usedRect();
+    }
+
+    if (usedRect.isEmpty())
+    {
+        // Nothing is drawn, so the area is a single pixel at the origin.
+        return QRect(m_tiles.size().width()  / 2,
+                     m_tiles.size().height() / 2,
+                     1,
+                     1);
+    }
+
+    return usedRect;
+}
+
 bool TurtleCanvasGraphicsItem::antialiased() const
 {
-    QMutexLocker lock(&m_mutex);
+    CanvasLocker lock(&m_mutex);
     return m_antialiased;
 }
 
@@ -107,13 +300,13 @@ bool TurtleCanvasGraphicsItem::antialiased() const
  */
 void TurtleCanvasGraphicsItem::setAntialiased(const bool on)
 {
-    QMutexLocker lock(&m_mutex);
+    CanvasLocker lock(&m_mutex);
     m_antialiased = on;
 }
 
 QColor TurtleCanvasGraphicsItem::backgroundColor() const
 {
-    QMutexLocker lock(&m_mutex);
+    CanvasLocker lock(&m_mutex);
     return m_backgroundColor;
 }
 
@@ -128,11 +321,11 @@ QColor TurtleCanvasGraphicsItem::backgroundColor() const
 void TurtleCanvasGraphicsItem::setBackgroundColor(const QColor& color)
 {
     {
-        QMutexLocker lock(&m_mutex);
+        CanvasLocker lock(&m_mutex);
         m_backgroundColor = color;
     }
 
-    emit canvasUpdated();
+    notifyCanvasUpdated();
 }
 
 /**
@@ -147,13 +340,14 @@ void TurtleCanvasGraphicsItem::setTurtle(const QPointF& position,
                                          const QColor& color)
 {
     {
-        QMutexLocker lock(&m_mutex);
-        m_turtlePos     = position;
-        m_turtleHeading = heading;
-        m_turtleColor   = color;
+        QMutexLocker lock(&m_turtleMutex);
+        m_turtle.position = position;
+        m_turtle.heading  = heading;
+        m_turtle.color    = color;
+        m_sprite.publish(m_turtle);
     }
 
-    emit canvasUpdated();
+    notifyCanvasUpdated();
 }
 
 /**
@@ -167,10 +361,10 @@ void TurtleCanvasGraphicsItem::getTurtle(QPointF& position,
                                          qreal& heading,
                                          QColor& color) const
 {
-    QMutexLocker lock(&m_mutex);
-    position = m_turtlePos;
-    heading  = m_turtleHeading;
-    color    = m_turtleColor;
+    QMutexLocker lock(&m_turtleMutex);
+    position = m_turtle.position;
+    heading  = m_turtle.heading;
+    color    = m_turtle.color;
 }
 
 /**
@@ -179,11 +373,12 @@ void TurtleCanvasGraphicsItem::getTurtle(QPointF& position,
 void TurtleCanvasGraphicsItem::showTurtle()
 {
     {
-        QMutexLocker lock(&m_mutex);
-        m_turtleHidden = false;
+        QMutexLocker lock(&m_turtleMutex);
+        m_turtle.hidden = false;
+        m_sprite.publish(m_turtle);
     }
 
-    emit canvasUpdated();
+    notifyCanvasUpdated();
 }
 
 /**
@@ -192,11 +387,12 @@ void TurtleCanvasGraphicsItem::showTurtle()
 void TurtleCanvasGraphicsItem::hideTurtle()
 {
     {
-        QMutexLocker lock(&m_mutex);
-        m_turtleHidden = true;
+        QMutexLocker lock(&m_turtleMutex);
+        m_turtle.hidden = true;
+        m_sprite.publish(m_turtle);
     }
 
-    emit canvasUpdated();
+    notifyCanvasUpdated();
 }
 
 /**
@@ -205,28 +401,27 @@ void TurtleCanvasGraphicsItem::hideTurtle()
  */
 bool TurtleCanvasGraphicsItem::turtleHidden()
 {
-    QMutexLocker lock(&m_mutex);
-    return m_turtleHidden;
+    QMutexLocker lock(&m_turtleMutex);
+    return m_turtle.hidden;
 }
 
 /**
- * @brief Clear all drawings on the canvas.
+ * @brief Clear all drawings on the current layer.
  *
- * The canvasUpdated() signal is emitted after the canvas is cleared.
+ * The canvasUpdated() signal is emitted after the layer is cleared.
  */
 void TurtleCanvasGraphicsItem::clear()
 {
     {
-        QMutexLocker lock(&m_mutex);
-        m_pixmap.fill(Qt::transparent);
-
-        m_usedRect = QRect(m_pixmap.width() / 2,
-                           m_pixmap.height() / 2,
-                           1,
-                           1);
+        CanvasLocker lock(&m_mutex);
+        m_tiles.clear();
+        m_displayList.clear();
+        m_rasterized = 0;
+        leaveHistory();
+        updateCanvasBytes();
     }
 
-    emit canvasUpdated();
+    notifyCanvasUpdated();
 }
 
 /**
@@ -235,62 +430,28 @@ void TurtleCanvasGraphicsItem::clear()
  * The canvasUpdated() signal is emitted after the line is drawn.
  *
  * @param[in] line The line to draw.
- * @param[in] pen The pen to use for drawing the line.
+ * @param[in] style The pen to use for drawing the line.
  */
-void TurtleCanvasGraphicsItem::drawLine(QLineF line, const QPen &pen)
+void TurtleCanvasGraphicsItem::drawLine(const QLineF& line, const DrawStyle& style)
 {
-    {
-        QMutexLocker lock(&m_mutex);
+    TraceScope scope("drawLine", "canvas");
 
-        QPainter painter(&m_pixmap);
-        painter.setRenderHint(QPainter::Antialiasing, m_antialiased);
-
-        painter.setPen(pen);
-
-        line.translate(static_cast<qreal>(m_pixmap.width())  / 2.0,
-                       static_cast<qreal>(m_pixmap.height()) / 2.0);
+    {
+        CanvasLocker lock(&m_mutex);
 
-        if (!m_antialiased)
+        if (m_stamps.isRecording())
         {
-            // Rendering artifacts can occur when AA is disabled due to QPainter::drawLine's
-            // apparent behaviour of casting the line's points from a qreal to an int without
-            // rounding, which causes rendering artifacts where some lines are offset by 1 pixel.
-            //
-            // For example, if a coordinate value is 4.99999 then QPainter clips this to 4, which
-            // causes an artifact.
-            //
-            // An example of a lua script which generates these artifacts is:
-            //    for n=1,1000,1 do fd(n) rt(90) end
-            //
-            // which generates a square spiral. There should always be a 1px gap between each line,
-            // but this is not always the case without this rounding fix.
-            line = QLineF(std::round(line.x1()),
-                          std::round(line.y1()),
-                          std::round(line.x2()),
-                          std::round(line.y2()));
+            m_stamps.addLine(line, style, m_antialiased);
+        }
+        else
+        {
+            record(DrawCommand::line(line, internStyle(style), m_antialiased));
         }
-
-        // Translate the origin from the user's perspective (center of the drawing area)
-        // to QPixmap's origin (top-left of the pixmap).
-        painter.drawLine(line);
-
-        const QPointF p1 = line.p1();
-        const QPointF p2 = line.p2();
-
-        const QRectF boundingBox(std::min(p1.x(), p2.x()),
-                                 std::min(p1.y(), p2.y()),
-                                 std::abs(p1.x() - p2.x()),
-                                 std::abs(p1.y() - p2.y()));
-
-        // Take the pen's width into account, otherwise the used rect
-        // won't cover the actual area drawn.
-        qreal margin = pen.widthF() / 2.0;
-        QMarginsF margins(margin, margin, margin, margin);
-
-        updateUsedArea(boundingBox.marginsAdded(margins));
     }
 
-    emit canvasUpdated();
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(1);
+
+    notifyCanvasUpdated();
 }
 
 /**
@@ -345,267 +506,1719 @@ void TurtleCanvasGraphicsItem::drawLine(QLineF line, const QPen &pen)
  * @param centerPos The position of the arc's center on the canvas.
  * @param startAngle The starting angle (degrees) of the arc. 0 degrees is aiming straight up.
  * @param angle The angle (degrees) of the arc (positive values turn clockwise).
- * @param radius The radius of the arc.
- * @param pen The pen to use for drawing the arc.
+ * @param xradius The radius of the arc along its X axis.
+ * @param yradius The radius of the arc along its Y axis.
+ * @param style The pen to use for drawing the arc, and the brush to fill it.
+ * @param filled Set to @c true to fill the pie enclosed by the arc.
  */
 void TurtleCanvasGraphicsItem::drawArc(const QPointF &centerPos,
                                    qreal startAngle,
                                    qreal angle,
                                    qreal xradius,
                                    qreal yradius,
-                                   const QPen &pen,
-                                   const QBrush& brush,
+                                   const DrawStyle& style,
                                    bool filled)
 {
-    {
-        QMutexLocker lock(&m_mutex);
-
-        QPainter painter(&m_pixmap);
-        painter.setRenderHint(QPainter::Antialiasing, m_antialiased);
-
-        // SmoothPixMapTransform is also used when AA is turned on to reduce
-        // aliasing artifacts for filled arcs with a non-solid pattern such as
-        // Dense3Pattern, which appear when rotation is used.
-        painter.setRenderHint(QPainter::SmoothPixmapTransform, m_antialiased);
+    TraceScope scope("drawArc", "canvas");
 
-        // Bounding box centered around the origin.
-        // This permits rotating the drawing around the origing, based on startAngle.
-        QRectF boundingBox(-xradius,
-                           -yradius,
-                           xradius * 2.0,
-                           yradius * 2.0);
+    {
+        CanvasLocker lock(&m_mutex);
 
         // From the user's point of view arcs are drawn clockwise, but Qt draws them
-        // counter-clockwise.
-        angle = -angle;
+        // counter-clockwise. The rotation also adjusts for the 90 degree difference
+        // in the coordinate systems.
+        ArcShape arc;
+        arc.center    = centerPos;
+        arc.rotation  = startAngle - 90.0;
+        arc.spanAngle = std::max(-360.0, std::min(360.0, -angle));
+        arc.xradius   = xradius;
+        arc.yradius   = yradius;
+
+        if (m_stamps.isRecording())
+        {
+            m_stamps.addArc(arc, style, filled, m_antialiased);
+        }
+        else
+        {
+            record(DrawCommand::arc(arc, internStyle(style), filled, m_antialiased));
+        }
+    }
 
-        // Angles given to drawArc() are integers representing 1/16th a degree.
-        const int angleInt      = static_cast<int>(angle * 16.0);
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(1);
 
-        // Translate the origin from the user's perspective (center of the drawing area)
-        // to QPixmap's origin (top-left of the pixmap).
-        painter.translate(static_cast<qreal>(m_pixmap.width())  / 2.0,
-                          static_cast<qreal>(m_pixmap.height()) / 2.0);
+    notifyCanvasUpdated();
+}
 
-        // Translate from the origin to the final position.
-        painter.translate(centerPos.x(), centerPos.y());
+/**
+ * @brief Flood fill the area around a point.
+ *
+ * The pixels reached from the point by moving up, down, left or right
+ * through pixels of the same color as the one at the point are replaced
+ * by @p color (see FloodFill). Only the pixels of the current layer are
+ * looked at and filled. The canvasUpdated() signal is emitted after the
+ * area is filled.
+ *
+ * @param seedPos The point to fill from, with the same coordinates as drawLine().
+ * @param color The fill color.
+ * @param tolerance The largest difference (0-255) in any channel between
+ *     the color of the pixel at @p seedPos and the colors of the pixels
+ *     filled.
+ */
+void TurtleCanvasGraphicsItem::floodFill(const QPointF& seedPos, const QColor& color, int tolerance)
+{
+    TraceScope scope("floodFill", "canvas");
 
-        // Rotate the entire arc about its center point,
-        // also adjust for the 90 degree difference in the coordinate systems.
-        painter.rotate(startAngle - 90.0);
+    {
+        CanvasLocker lock(&m_mutex);
 
-        if (filled)
+        // Stamps are made of lines and arcs only.
+        if (m_stamps.isRecording())
         {
-            painter.setPen(QPen(Qt::NoPen));
-            painter.setBrush(brush);
-            painter.drawPie(boundingBox, 0, angleInt);
+            return;
         }
 
-        painter.setPen(pen);
-        painter.drawArc(boundingBox, 0, angleInt);
-
-        // Map boundingBox from local coordinates to global coordinates.
-        // Note that QMartrix::mapRect() returns the bounding rectangle
-        // of the mapped rectangle (if rotations are applied), which is
-        // exactly what we want.
-        QTransform worldMatrix = painter.worldTransform();
-        boundingBox = worldMatrix.mapRect(boundingBox);
+        DrawStyle style;
+        style.penColor   = color.rgba();
+        style.penWidth   = 0.0;
+        style.capStyle   = Qt::FlatCap;
+        style.brushColor = color.rgba();
+        style.brushStyle = Qt::SolidPattern;
 
-        // Take the pen's width into account, otherwise the used rect
-        // won't cover the actual area drawn.
-        qreal margin = pen.widthF() / 2.0;
-        QMarginsF margins(margin, margin, margin, margin);
-
-        updateUsedArea(boundingBox.marginsAdded(margins));
+        record(DrawCommand::fill(seedPos, internStyle(style), tolerance));
     }
 
-    emit canvasUpdated();
-}
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(1);
 
-/**
- * @brief Get the canvas size.
- *
- * @return The canvas size.
- */
-QSize TurtleCanvasGraphicsItem::size() const
-{
-    QMutexLocker lock(&m_mutex);
-    return m_pixmap.size();
+    notifyCanvasUpdated();
 }
 
 /**
- * @brief Change the canvas size.
+ * @brief Draw a string on the canvas.
  *
- * The canvasResized() signal is emitted after after the canvas is resized.
+ * The string is drawn along its baseline from @p position, with the
+ * glyphs cached by GlyphAtlas. Each line after a newline character starts
+ * below the previous one. Nothing is drawn while a stamp is recorded. The
+ * canvasUpdated() signal is emitted after the text is drawn.
  *
- * @param newSize The size (in pixels) of the new canvas. If the size is the same
- *     as the current size then this method has no effect.
+ * @param position The left end of the first line's baseline, with the same
+ *     coordinates as drawLine().
+ * @param text The string to draw.
+ * @param pixelSize The height of the font, in pixels (up to GlyphAtlas::MAX_PIXEL_SIZE).
+ * @param color The text color.
+ * @param angle The clockwise rotation (degrees) of the text.
  */
-void TurtleCanvasGraphicsItem::resize(QSize newSize)
+void TurtleCanvasGraphicsItem::drawText(const QPointF& position,
+                                        const QString& text,
+                                        int pixelSize,
+                                        const QColor& color,
+                                        qreal angle)
 {
-    bool wasResized = false;
+    TraceScope scope("drawText", "canvas");
 
-    {
-        QMutexLocker lock(&m_mutex);
+    int glyphs = 0;
 
-        const QSize oldSize = m_pixmap.size();
+    {
+        CanvasLocker lock(&m_mutex);
 
-        if (newSize != oldSize)
+        if (m_stamps.isRecording())
         {
-            prepareGeometryChange();
+            return;
+        }
 
-            QPixmap newpixmap(newSize);
-            newpixmap.fill(Qt::transparent);
+        DrawStyle style;
+        style.penColor   = color.rgba();
+        style.penWidth   = 0.0;
+        style.capStyle   = Qt::FlatCap;
+        style.brushColor = color.rgba();
+        style.brushStyle = Qt::NoBrush;
 
-            QPainter painter(&newpixmap);
+        const PenBrushTable::Handle handle = internStyle(style);
 
-            int xoffset = (newSize.width() - oldSize.width()) / 2;
-            int yoffset = (newSize.height() - oldSize.height()) / 2;
-            painter.drawPixmap(QPoint(xoffset, yoffset),
-                               m_pixmap,
-                               m_pixmap.rect());
+        // The glyphs are laid out at the rotation they are rasterized at.
+        const int     size     = GlyphAtlas::clampedPixelSize(pixelSize);
+        const qreal   rotation = GlyphAtlas::roundedAngle(angle);
+        const qreal   radians  = qDegreesToRadians(rotation);
+        const QPointF advance(std::cos(radians), std::sin(radians));
+        const QPointF newline  = QPointF(-advance.y(), advance.x()) * m_glyphs.lineSpacing(size);
 
-            m_pixmap = newpixmap;
+        QPointF lineStart = position;
+        QPointF pen       = position;
 
-            const QRect pixmapRect = m_pixmap.rect();
-            if (m_usedRect.left() < pixmapRect.left())
-            {
-                m_usedRect.setLeft(pixmapRect.left());
-            }
-            if (m_usedRect.right() > pixmapRect.right())
-            {
-                m_usedRect.setRight(pixmapRect.right());
-            }
-            if (m_usedRect.top() < pixmapRect.top())
-            {
-                m_usedRect.setTop(pixmapRect.top());
-            }
-            if (m_usedRect.bottom() > pixmapRect.bottom())
+        const QVector<uint> codePoints = text.toUcs4();
+        for (int i = 0; i < codePoints.size(); i++)
+        {
+            const uint codePoint = codePoints.at(i);
+
+            if ('\n' == codePoint)
             {
-                m_usedRect.setBottom(pixmapRect.bottom());
+                lineStart += newline;
+                pen        = lineStart;
+                continue;
             }
 
-            update();
+            const GlyphAtlas::Glyph glyph = m_glyphs.glyph(codePoint, size, rotation, m_antialiased);
 
-            setPos(-static_cast<qreal>(newSize.width()) / 2.0,
-                   -static_cast<qreal>(newSize.height()) / 2.0);
+            if (!glyph.rect.isEmpty())
+            {
+                record(DrawCommand::glyph(codePoint, pen, size, rotation, handle, m_antialiased));
+                glyphs++;
+            }
 
-            wasResized = true;
+            pen += advance * glyph.advance;
         }
     }
 
-    if (wasResized)
-    {
-        emit canvasResized();
-    }
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(glyphs);
+
+    notifyCanvasUpdated();
 }
 
-QRectF TurtleCanvasGraphicsItem::boundingRect() const
+/**
+ * @brief Load an image file, to be drawn by drawImage().
+ *
+ * Files are decoded once, and shared by all the loads of the same file
+ * (see ImageCache). The canvas is not locked while the file is decoded.
+ *
+ * @param path The path of the file.
+ * @param error Receives the reason why the image could not be loaded.
+ * @return The image's identifier, or -1 if the image could not be loaded.
+ */
+int TurtleCanvasGraphicsItem::loadImage(const QString& path, QString& error)
 {
-    return m_pixmap.rect();
+    TraceScope scope("loadImage", "canvas");
+
+    return m_images.load(path, error);
 }
 
-void TurtleCanvasGraphicsItem::paint(QPainter *painter,
-                               const QStyleOptionGraphicsItem *,
-                               QWidget *)
+/**
+ * @brief Draw an image loaded by loadImage() on the canvas.
+ *
+ * A variant of the image at the scale and rotation (see ImageCache) is
+ * blended onto the canvas, with the image's center at the nearest pixel
+ * to @p position. The image is smoothed when it is scaled or rotated if
+ * antialiasing is on. Nothing is drawn while a stamp is recorded. The
+ * canvasUpdated() signal is emitted after the image is drawn.
+ *
+ * @param image The image's identifier.
+ * @param position Where the image's center is drawn, with the same coordinates as drawLine().
+ * @param scale The scale of the image.
+ * @param angle The clockwise rotation (degrees) of the image.
+ * @return @c false if there is no image with this identifier.
+ */
+bool TurtleCanvasGraphicsItem::drawImage(int image, const QPointF& position, qreal scale, qreal angle)
 {
-    static const QPointF turtlePoints[] =
-    {
-        QPointF(-10.0,  0.5),
-        QPointF( 10.0,  0.5),
-        QPointF(  0.0, -10.5)
-    };
+    TraceScope scope("drawImage", "canvas");
 
-    QMutexLocker lock(&m_mutex);
-    painter->fillRect(boundingRect(), m_backgroundColor);
-    painter->drawPixmap(boundingRect(), m_pixmap, m_pixmap.rect());
+    if (!m_images.contains(image))
+    {
+        return false;
+    }
 
-    // Paint the turtle
-    if (!m_turtleHidden)
     {
-        painter->setRenderHint(QPainter::Antialiasing, true);
-        painter->translate(static_cast<qreal>(m_pixmap.width())  / 2.0,
-                           static_cast<qreal>(m_pixmap.height()) / 2.0);
-        painter->translate(QPointF(m_turtlePos.x(),
-                                   -m_turtlePos.y()));
-        painter->rotate(m_turtleHeading);
-        painter->setPen(m_turtleColor);
+        CanvasLocker lock(&m_mutex);
 
-        painter->drawPolygon(&turtlePoints[0],
-                             sizeof(turtlePoints)/sizeof(turtlePoints[0]));
+        if (m_stamps.isRecording())
+        {
+            return true;
+        }
+
+        record(DrawCommand::image(image, position, scale, angle, m_antialiased));
     }
+
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(1);
+
+    notifyCanvasUpdated();
+
+    return true;
 }
 
 /**
- * @brief Calls this->update()
+ * @brief Start recording a stamp.
  *
- * The purpose of this method is to allow update() to be indirectly called
- * by the UI thread by a queued signal.
+ * Until endStamp() is called, the lines and arcs drawn make up the stamp
+ * instead of being drawn on the canvas. Fills and stamps drawn meanwhile
+ * are ignored.
+ *
+ * @return @c false if a stamp is already being recorded.
  */
-void TurtleCanvasGraphicsItem::callUpdate()
+bool TurtleCanvasGraphicsItem::beginStamp()
 {
-    update();
+    CanvasLocker lock(&m_mutex);
+
+    return m_stamps.beginStamp();
 }
 
-void TurtleCanvasGraphicsItem::updateUsedArea(const QPoint& point)
+/**
+ * @brief Stop recording a stamp.
+ *
+ * @param name The stamp's name, which replaces any stamp of the same name.
+ * @param keep Set to @c false to discard the stamp.
+ */
+void TurtleCanvasGraphicsItem::endStamp(const QString& name, bool keep)
 {
-    const QRect rect = m_pixmap.rect();
-    int top;
-    int bottom;
-    int left;
-    int right;
+    CanvasLocker lock(&m_mutex);
 
-    if (rect.contains(point))
+    if (m_stamps.isRecording())
     {
-        top    = point.y();
-        bottom = point.y();
-        left   = point.x();
-        right  = point.x();
-    }
-    else
-    {
-        top    = rect.top();
-        bottom = rect.bottom();
-        left   = rect.left();
-        right  = rect.right();
+        m_stamps.endStamp(name, keep);
     }
+}
+
+/**
+ * @brief Draw a stamp on the canvas.
+ *
+ * The stamp's bitmap at the rotation and scale (see StampCache) is
+ * blended onto the canvas, with its origin at the nearest pixel to
+ * @p position. The canvasUpdated() signal is emitted after the stamp is
+ * drawn.
+ *
+ * @param name The stamp's name.
+ * @param position Where the stamp's origin is drawn, with the same coordinates as drawLine().
+ * @param angle The clockwise rotation (degrees) of the stamp.
+ * @param scale The scale of the stamp.
+ * @return @c false if there is no stamp with this name.
+ */
+bool TurtleCanvasGraphicsItem::drawStamp(const QString& name, const QPointF& position, qreal angle, qreal scale)
+{
+    TraceScope scope("drawStamp", "canvas");
 
-    if (point.x() < m_usedRect.left())
-    {
-        m_usedRect.setLeft(left);
-    }
-    if (point.x() > m_usedRect.right())
-    {
-        m_usedRect.setRight(right);
-    }
-    if (point.y() < m_usedRect.top())
     {
-        m_usedRect.setTop(top);
+        CanvasLocker lock(&m_mutex);
+
+        const int stamp = m_stamps.find(name);
+        if (stamp < 0)
+        {
+            return false;
+        }
+
+        if (m_stamps.isRecording())
+        {
+            return true;
+        }
+
+        record(DrawCommand::stamp(stamp, position, angle, scale));
     }
-    if (point.y() > m_usedRect.bottom())
+
+    PerfCounters::instance().primitivesTotal.fetchAndAddRelaxed(1);
+
+    notifyCanvasUpdated();
+
+    return true;
+}
+
+/**
+ * @brief Get the color of the canvas at a point, as it is displayed.
+ *
+ * The visible layers are composited over the background color, so the
+ * color is always opaque. The background color is returned for points
+ * outside of the canvas.
+ *
+ * @param pos The point, with the same coordinates as drawLine().
+ */
+QColor TurtleCanvasGraphicsItem::pixelColor(const QPointF& pos)
+{
+    CanvasLocker lock(&m_mutex);
+
+    // The pixel must include the primitives drawn so far in a batch.
+    rasterizePending();
+
+    const QPoint pixel(static_cast<int>(std::floor(pos.x() + (m_tiles.size().width()  / 2.0))),
+                       static_cast<int>(std::floor(pos.y() + (m_tiles.size().height() / 2.0))));
+
+    QRgb premultiplied = 0u;
+
+    if (m_tiles.rect().contains(pixel))
     {
-        m_usedRect.setBottom(bottom);
+        const int column = m_tiles.columnAt(pixel.x());
+        const int row    = m_tiles.rowAt(pixel.y());
+
+        const QImage* image = m_compositor.tile(column, row, visibleLayers(m_tiles));
+
+        if (nullptr != image)
+        {
+            const QPoint tilePixel = pixel - m_tiles.tileRect(column, row).topLeft();
+
+            // QImage::pixel() would unpremultiply the pixel.
+            premultiplied = reinterpret_cast<const QRgb*>(image->constScanLine(tilePixel.y()))[tilePixel.x()];
+        }
     }
 
-    assert(m_pixmap.rect().contains(point)
-           ? m_usedRect.contains(point)
-           : true);
-    assert(m_pixmap.rect().contains(m_usedRect.topLeft()));
-    assert(m_pixmap.rect().contains(m_usedRect.topRight()));
-    assert(m_pixmap.rect().contains(m_usedRect.bottomLeft()));
-    assert(m_pixmap.rect().contains(m_usedRect.bottomRight()));
+    const int inverseAlpha = 255 - qAlpha(premultiplied);
+
+    return QColor(qRed(premultiplied)   + ((m_backgroundColor.red()   * inverseAlpha) + 127) / 255,
+                  qGreen(premultiplied) + ((m_backgroundColor.green() * inverseAlpha) + 127) / 255,
+                  qBlue(premultiplied)  + ((m_backgroundColor.blue()  * inverseAlpha) + 127) / 255);
 }
 
-void TurtleCanvasGraphicsItem::updateUsedArea(const QPointF& point)
+/**
+ * @brief Select the layer drawn on.
+ *
+ * The layers up to @p layer are added if they do not exist yet. A new
+ * layer is transparent, visible and opaque. The primitives pending in a
+ * batch are drawn on the previous layer first.
+ *
+ * @param layer The layer, from 0 (the bottom layer) to MAX_LAYERS - 1.
+ */
+void TurtleCanvasGraphicsItem::setLayer(int layer)
 {
-    updateUsedArea(QPoint(static_cast<int>(std::round(point.x())),
-                          static_cast<int>(std::round(point.y()))));
+    {
+        CanvasLocker lock(&m_mutex);
+
+        layer = std::max(0, std::min(MAX_LAYERS - 1, layer));
+
+        if (layer == m_currentLayer)
+        {
+            return;
+        }
+
+        rasterizePending();
+        leaveHistory();
+        addLayers(layer + 1);
+
+        storeCurrentLayer();
+        m_currentLayer = layer;
+        loadCurrentLayer();
+
+        m_displayList.updateBytes();
+        updateCanvasBytes();
+    }
+
+    notifyCanvasUpdated();
 }
 
-void TurtleCanvasGraphicsItem::updateUsedArea(const QRectF& rect)
+/**
+ * @brief Show or hide a layer.
+ *
+ * The canvasUpdated() signal is emitted after the layer is shown or hidden.
+ *
+ * @param layer The layer, from 0 (the bottom layer) to MAX_LAYERS - 1.
+ * @param visible Set to @c false to hide the layer.
+ */
+void TurtleCanvasGraphicsItem::setLayerVisible(int layer, bool visible)
 {
-    updateUsedArea(rect.topLeft());
-    updateUsedArea(rect.topRight());
-    updateUsedArea(rect.bottomLeft());
-    updateUsedArea(rect.bottomRight());
+    {
+        CanvasLocker lock(&m_mutex);
+
+        layer = std::max(0, std::min(MAX_LAYERS - 1, layer));
+        addLayers(layer + 1);
+        m_layers[layer].visible = visible;
+    }
+
+    notifyCanvasUpdated();
+}
+
+/**
+ * @brief Set the opacity of a layer.
+ *
+ * The canvasUpdated() signal is emitted after the opacity is changed.
+ *
+ * @param layer The layer, from 0 (the bottom layer) to MAX_LAYERS - 1.
+ * @param opacity The opacity, from 0 (transparent) to 255 (opaque).
+ */
+void TurtleCanvasGraphicsItem::setLayerOpacity(int layer, int opacity)
+{
+    {
+        CanvasLocker lock(&m_mutex);
+
+        layer = std::max(0, std::min(MAX_LAYERS - 1, layer));
+        addLayers(layer + 1);
+        m_layers[layer].opacity = std::max(0, std::min(255, opacity));
+    }
+
+    notifyCanvasUpdated();
+}
+
+/**
+ * @brief Get the handle of a drawing style in the pen/brush table.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+PenBrushTable::Handle TurtleCanvasGraphicsItem::internStyle(const DrawStyle& style)
+{
+    if (m_styles.isFull() && !m_styles.contains(style))
+    {
+        // The retained commands refer to the table's handles, so they are
+        // replaced by the current drawing before the table is started over.
+        rasterizePending();
+        for (int i = 0; i < m_layers.size(); i++)
+        {
+            if (i != m_currentLayer)
+            {
+                m_layers[i].displayList.rebase(m_layers[i].tiles);
+            }
+        }
+        m_displayList.rebase(m_tiles);
+        m_rasterized = 0;
+        leaveHistory();
+        m_styles.clear();
+        m_styleGeneration++;
+        m_currentStyle = -1;
+        m_style = nullptr;
+    }
+
+    return m_styles.intern(style);
+}
+
+/**
+ * @brief Make a style the current pen and brush.
+ *
+ * Nothing is done when the style is already current, which is the usual
+ * case as scripts rarely change the pen between primitives.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::applyStyle(PenBrushTable::Handle handle)
+{
+    if (m_currentStyle != handle)
+    {
+        m_currentStyle = handle;
+        m_style = &m_styles.entry(handle);
+    }
+}
+
+/**
+ * @brief Draw a primitive on the canvas image and retain it in the display list.
+ *
+ * During a batch the primitive is only retained, and is drawn later by
+ * rasterizePending(). Fills are always drawn straight away.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::record(const DrawCommand& command)
+{
+    // Stamps and images have no style.
+    if ((DrawCommand::Stamp != command.type()) && (DrawCommand::Image != command.type()))
+    {
+        applyStyle(command.style());
+    }
+
+    if (DrawCommand::Fill == command.type())
+    {
+        // A fill depends on the pixels drawn before it, and its bounds are
+        // only known once it is done.
+        rasterizePending();
+
+        const QRect filled = renderFill(command, m_styles, m_tiles);
+        if (filled.isEmpty())
+        {
+            return;
+        }
+
+        const QPointF origin(static_cast<qreal>(m_tiles.size().width())  / 2.0,
+                             static_cast<qreal>(m_tiles.size().height()) / 2.0);
+
+        m_displayList.append(command, QRectF(filled).translated(-origin));
+        m_rasterized = m_displayList.size();
+    }
+    else
+    {
+        const QRectF bounds = commandBounds(command);
+
+        // Stamps which are empty, and images which could not be drawn, are skipped.
+        if (((DrawCommand::Stamp == command.type()) || (DrawCommand::Image == command.type())) &&
+            bounds.isNull())
+        {
+            return;
+        }
+
+        m_displayList.append(command, bounds);
+    }
+
+    const bool keyframe = (0 == (m_displayList.size() % DisplayList::KEYFRAME_INTERVAL));
+
+    if (keyframe || (0 == m_batchDepth.loadAcquire()))
+    {
+        rasterizePending();
+    }
+
+    if (keyframe)
+    {
+        m_displayList.addKeyframe(m_tiles);
+    }
+
+    updateCanvasBytes();
+}
+
+/**
+ * @brief Get the area covered by a primitive, including its pen.
+ *
+ * The bitmap of a stamp is rasterized if it is not cached yet.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ * @pre The command's style is current (see applyStyle()).
+ *
+ * @return The bounding box, relative to the center of the canvas.
+ */
+QRectF TurtleCanvasGraphicsItem::commandBounds(const DrawCommand& command) const
+{
+    switch (command.type())
+    {
+    case DrawCommand::Line:
+        return Rasterizer::lineBounds(command.line(), m_style->pen.widthF(), m_style->pen.capStyle());
+
+    case DrawCommand::Arc:
+        return Rasterizer::arcBounds(command.arc(), m_style->pen.widthF(), m_style->pen.capStyle());
+
+    case DrawCommand::Fill:
+        // The bounds of a fill are those of the pixels it fills (see record()).
+        break;
+
+    case DrawCommand::Stamp:
+    {
+        const StampCache::Bitmap bitmap = stampBitmap(command);
+
+        if (!bitmap.image.isNull())
+        {
+            // Widened by a pixel for the rounding of the position (see renderBitmap()).
+            return QRectF(command.position() - QPointF(bitmap.origin), QSizeF(bitmap.image.size()))
+                       .adjusted(-1.0, -1.0, 1.0, 1.0);
+        }
+        break;
+    }
+
+    case DrawCommand::Glyph:
+    {
+        const GlyphAtlas::Glyph glyph = m_glyphs.glyph(command.codePoint(),
+                                                       command.pixelSize(),
+                                                       command.angle(),
+                                                       command.antialiased());
+
+        // Widened by a pixel for the rounding of the position (see renderGlyph()).
+        return QRectF(command.position() + QPointF(glyph.offset), QSizeF(glyph.rect.size()))
+                   .adjusted(-1.0, -1.0, 1.0, 1.0);
+    }
+
+    case DrawCommand::Image:
+    {
+        const ImageCache::Bitmap bitmap = imageBitmap(command);
+
+        if (!bitmap.image.isNull())
+        {
+            // Widened by a pixel for the rounding of the position (see renderBitmap()).
+            return QRectF(command.position() - QPointF(bitmap.origin), QSizeF(bitmap.image.size()))
+                       .adjusted(-1.0, -1.0, 1.0, 1.0);
+        }
+        break;
+    }
+    }
+
+    return QRectF();
+}
+
+/**
+ * @brief Draw the primitives retained in the display list since the
+ *     last one drawn on the canvas' tiles.
+ *
+ * A few primitives are drawn one after the other. Larger numbers of them
+ * (typically drawn by several turtles during a batch) are binned into the
+ * rows of tiles they overlap, and the rows are drawn in parallel. The
+ * result is the same either way.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::rasterizePending()
+{
+    const int count = m_displayList.size() - m_rasterized;
+
+    if (count < TileBinner::MIN_PARALLEL_ITEMS)
+    {
+        for (int i = m_rasterized; i < m_displayList.size(); i++)
+        {
+            render(m_displayList.at(i), m_tiles);
+        }
+    }
+    else
+    {
+        TraceScope scope("rasterizePending", "canvas");
+
+        const QPointF origin(static_cast<qreal>(m_tiles.size().width())  / 2.0,
+                             static_cast<qreal>(m_tiles.size().height()) / 2.0);
+
+        m_binner.reset(m_tiles);
+
+        for (int i = m_rasterized; i < m_displayList.size(); i++)
+        {
+            // The bounds are widened by a pixel to cover the rounding of
+            // aliased lines to whole pixels (see renderLine()).
+            m_binner.add(i, m_displayList.bounds(i).translated(origin).toAlignedRect()
+                                .adjusted(-1, -1, 1, 1));
+        }
+
+        m_binner.draw([this](int item, Rasterizer& rasterizer, const QRect& clip)
+        {
+            render(m_displayList.at(item), m_styles, m_tiles, rasterizer, clip);
+        });
+    }
+
+    m_rasterized = m_displayList.size();
+}
+
+/**
+ * @brief Draw a primitive on the canvas' tiles, or on a copy of them.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::render(const DrawCommand& command, TileStore& tiles)
+{
+    render(command, m_styles, tiles, m_rasterizer, tiles.rect());
+}
+
+/**
+ * @brief Draw part of a primitive on some tiles.
+ *
+ * This can be called concurrently for different parts of the same tiles,
+ * each with its own rasterizer (see rasterizePending()).
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @param command The primitive to draw.
+ * @param styles The table holding the primitive's style: the canvas' own
+ *     table, or a stamp's (see StampCache).
+ * @param tiles The tiles to draw on.
+ * @param rasterizer The rasterizer to draw with.
+ * @param clip The part of the tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::render(const DrawCommand& command,
+                                      const PenBrushTable& styles,
+                                      TileStore& tiles,
+                                      Rasterizer& rasterizer,
+                                      const QRect& clip) const
+{
+    rasterizer.setAntialiased(command.antialiased());
+
+    // Translate the origin from the user's perspective (center of the drawing area)
+    // to the tiles' origin (top-left of the canvas).
+    const QPointF origin(static_cast<qreal>(tiles.size().width())  / 2.0,
+                         static_cast<qreal>(tiles.size().height()) / 2.0);
+
+    switch (command.type())
+    {
+    case DrawCommand::Line:
+        renderLine(command.line().translated(origin),
+                   command.antialiased(),
+                   styles.entry(command.style()),
+                   tiles,
+                   rasterizer,
+                   clip);
+        break;
+
+    case DrawCommand::Arc:
+    {
+        ArcShape arc = command.arc();
+        arc.center += origin;
+        renderArc(arc, command.filled(), styles, styles.entry(command.style()), tiles, rasterizer, clip);
+        break;
+    }
+
+    case DrawCommand::Fill:
+        // Fills are never drawn in parallel (see record()), so the clip is the whole canvas.
+        renderFill(command, styles, tiles);
+        break;
+
+    case DrawCommand::Stamp:
+    {
+        const StampCache::Bitmap bitmap = stampBitmap(command);
+        renderBitmap(bitmap.image, bitmap.origin, command.position() + origin, tiles, clip);
+        break;
+    }
+
+    case DrawCommand::Glyph:
+        renderGlyph(m_glyphs.glyph(command.codePoint(),
+                                   command.pixelSize(),
+                                   command.angle(),
+                                   command.antialiased()),
+                    command.position() + origin,
+                    styles.entry(command.style()).premultipliedPenColor,
+                    tiles,
+                    clip);
+        break;
+
+    case DrawCommand::Image:
+    {
+        const ImageCache::Bitmap bitmap = imageBitmap(command);
+        renderBitmap(bitmap.image, bitmap.origin, command.position() + origin, tiles, clip);
+        break;
+    }
+    }
+}
+
+/**
+ * @brief Draw a line.
+ *
+ * @param line The line, in image coordinates.
+ * @param antialiased Set to @c true to draw the line with antialiasing.
+ * @param style The line's pen.
+ * @param tiles The tiles to draw on.
+ * @param rasterizer The rasterizer to draw with.
+ * @param clip The part of the tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::renderLine(QLineF line,
+                                          bool antialiased,
+                                          const PenBrushTable::Entry& style,
+                                          TileStore& tiles,
+                                          Rasterizer& rasterizer,
+                                          const QRect& clip)
+{
+    const QPen& pen = style.pen;
+
+    const QRectF bounds = Rasterizer::lineBounds(line, pen.widthF(), pen.capStyle());
+
+    // Lines lying entirely outside of the clip rect are skipped.
+    if (!bounds.intersects(clip))
+    {
+        return;
+    }
+
+    if (!antialiased)
+    {
+        // Rendering artifacts can occur when AA is disabled if the line's points are
+        // truncated from a qreal to an int without rounding, which causes rendering
+        // artifacts where some lines are offset by 1 pixel.
+        //
+        // For example, if a coordinate value is 4.99999 then it is truncated to 4, which
+        // causes an artifact.
+        //
+        // An example of a lua script which generates these artifacts is:
+        //    for n=1,1000,1 do fd(n) rt(90) end
+        //
+        // which generates a square spiral. There should always be a 1px gap between each line,
+        // but this is not always the case without this rounding fix.
+        line = QLineF(std::round(line.x1()),
+                      std::round(line.y1()),
+                      std::round(line.x2()),
+                      std::round(line.y2()));
+    }
+
+    RasterTarget target(tiles, clip);
+    rasterizer.strokeLine(line,
+                          pen.widthF(),
+                          pen.capStyle(),
+                          style.premultipliedPenColor,
+                          target);
+}
+
+/**
+ * @brief Draw an arc.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @param arc The arc, in image coordinates.
+ * @param filled Set to @c true to also fill the arc's pie.
+ * @param styles The table holding @p style.
+ * @param style The arc's pen, and the brush for its pie.
+ * @param tiles The tiles to draw on.
+ * @param rasterizer The rasterizer to draw with.
+ * @param clip The part of the tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::renderArc(const ArcShape& arc,
+                                         bool filled,
+                                         const PenBrushTable& styles,
+                                         const PenBrushTable::Entry& style,
+                                         TileStore& tiles,
+                                         Rasterizer& rasterizer,
+                                         const QRect& clip)
+{
+    const QPen&   pen   = style.pen;
+    const QBrush& brush = style.brush;
+
+    const QRectF bounds = Rasterizer::arcBounds(arc, pen.widthF(), pen.capStyle());
+
+    // Arcs lying entirely outside of the clip rect are skipped.
+    if (!bounds.intersects(clip))
+    {
+        return;
+    }
+
+    // Degenerate arcs (with a zero or negative radius) are left to QPainter.
+    if ((arc.xradius > 0.0) && (arc.yradius > 0.0))
+    {
+        RasterTarget target(tiles, clip);
+
+        if (filled && (brush.style() != Qt::NoBrush))
+        {
+            const quint32* pattern = styles.pattern(style);
+
+            rasterizer.fillPie(arc,
+                               (nullptr != pattern)
+                                   ? RasterPaint::tiled(pattern)
+                                   : RasterPaint::solid(style.premultipliedBrushColor),
+                               target);
+        }
+
+        rasterizer.strokeArc(arc,
+                             pen.widthF(),
+                             pen.capStyle(),
+                             style.premultipliedPenColor,
+                             target);
+    }
+    else
+    {
+        paintArc(arc, bounds, pen, brush, filled, true, rasterizer.antialiased(), clip, tiles);
+    }
+}
+
+/**
+ * @brief Flood fill some tiles.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @param command The Fill command.
+ * @param styles The table holding the fill's style.
+ * @param tiles The tiles to fill.
+ * @return The bounds of the pixels filled, in image coordinates.
+ */
+QRect TurtleCanvasGraphicsItem::renderFill(const DrawCommand& command,
+                                           const PenBrushTable& styles,
+                                           TileStore& tiles)
+{
+    const QPointF seed = command.seed() + QPointF(static_cast<qreal>(tiles.size().width())  / 2.0,
+                                                  static_cast<qreal>(tiles.size().height()) / 2.0);
+
+    FloodFill fill(tiles,
+                   styles.entry(command.style()).premultipliedBrushColor,
+                   command.tolerance());
+
+    return fill.fill(QPoint(static_cast<int>(std::floor(seed.x())),
+                            static_cast<int>(std::floor(seed.y()))));
+}
+
+/**
+ * @brief Blend the bitmap of a stamp or image onto some tiles.
+ *
+ * @param image The bitmap, in premultiplied ARGB32.
+ * @param origin The pixel of @p image which is drawn at @p position.
+ * @param position Where @p origin is drawn, in image coordinates. It is
+ *     rounded to the nearest pixel.
+ * @param tiles The tiles to draw on.
+ * @param clip The part of the tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::renderBitmap(const QImage& image,
+                                            const QPoint& origin,
+                                            const QPointF& position,
+                                            TileStore& tiles,
+                                            const QRect& clip)
+{
+    if (image.isNull())
+    {
+        return;
+    }
+
+    const QPoint topLeft = QPoint(static_cast<int>(std::floor(position.x() + 0.5)),
+                                  static_cast<int>(std::floor(position.y() + 0.5)))
+                           - origin;
+
+    const QRect area = QRect(topLeft, image.size()).intersected(clip);
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    RasterTarget target(tiles, clip);
+
+    for (int y = area.top(); y <= area.bottom(); y++)
+    {
+        const quint32* row = reinterpret_cast<const quint32*>(image.constScanLine(y - topLeft.y()));
+
+        target.blendImageSpan(y, area.left(), row + (area.left() - topLeft.x()), area.width());
+    }
+}
+
+/**
+ * @brief Get the bitmap of a Stamp command, rasterizing it if necessary.
+ *
+ * This can be called concurrently (see StampCache).
+ */
+StampCache::Bitmap TurtleCanvasGraphicsItem::stampBitmap(const DrawCommand& command) const
+{
+    return m_stamps.bitmap(command.stampId(),
+                           command.angle(),
+                           command.scale(),
+                           [this](const DrawCommand& primitive,
+                                  const PenBrushTable& styles,
+                                  TileStore& tiles,
+                                  Rasterizer& rasterizer)
+    {
+        render(primitive, styles, tiles, rasterizer, tiles.rect());
+    });
+}
+
+/**
+ * @brief Get the variant of an Image command, transforming it if necessary.
+ *
+ * This can be called concurrently (see ImageCache).
+ */
+ImageCache::Bitmap TurtleCanvasGraphicsItem::imageBitmap(const DrawCommand& command) const
+{
+    return m_images.bitmap(command.imageId(),
+                           command.scale(),
+                           command.angle(),
+                           command.antialiased());
+}
+
+/**
+ * @brief Blend a glyph's coverage mask onto some tiles.
+ *
+ * @param glyph The glyph.
+ * @param position The pen position on the baseline, in image coordinates.
+ *     It is rounded to the nearest pixel.
+ * @param color The premultiplied text color.
+ * @param tiles The tiles to draw on.
+ * @param clip The part of the tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::renderGlyph(const GlyphAtlas::Glyph& glyph,
+                                           const QPointF& position,
+                                           quint32 color,
+                                           TileStore& tiles,
+                                           const QRect& clip)
+{
+    if (glyph.rect.isEmpty())
+    {
+        return;
+    }
+
+    const QPoint topLeft = QPoint(static_cast<int>(std::floor(position.x() + 0.5)),
+                                  static_cast<int>(std::floor(position.y() + 0.5)))
+                           + glyph.offset;
+
+    const QRect area = QRect(topLeft, glyph.rect.size()).intersected(clip);
+
+    if (area.isEmpty())
+    {
+        return;
+    }
+
+    RasterTarget target(tiles, clip);
+
+    for (int y = area.top(); y <= area.bottom(); y++)
+    {
+        const uchar* coverage = glyph.page->constScanLine(glyph.rect.top() + (y - topLeft.y()))
+                                + glyph.rect.left() + (area.left() - topLeft.x());
+
+        target.blendCoverageSpan(y, area.left(), coverage, area.width(), color);
+    }
+}
+
+/**
+ * @brief Draw an arc and/or its pie using QPainter.
+ *
+ * This is used for the cases not supported by the Rasterizer, i.e. arcs
+ * with a zero or negative radius.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @param arc The arc to draw, in canvas pixel coordinates.
+ * @param bounds The area covered by the arc, including its pen.
+ * @param pen The pen to use for drawing the arc.
+ * @param brush The brush to use for filling the pie.
+ * @param drawPie Set to @c true to fill the pie.
+ * @param drawArc Set to @c true to draw the arc.
+ * @param antialiased Set to @c true to draw with antialiasing.
+ * @param clip The part of the tiles to draw on.
+ * @param tiles The tiles to draw on.
+ */
+void TurtleCanvasGraphicsItem::paintArc(const ArcShape& arc,
+                                        const QRectF& bounds,
+                                        const QPen& pen,
+                                        const QBrush& brush,
+                                        bool drawPie,
+                                        bool drawArc,
+                                        bool antialiased,
+                                        const QRect& clip,
+                                        TileStore& tiles)
+{
+    // Bounding box centered around the origin.
+    // This permits rotating the drawing around the origing, based on startAngle.
+    const QRectF boundingBox(-arc.xradius,
+                             -arc.yradius,
+                             arc.xradius * 2.0,
+                             arc.yradius * 2.0);
+
+    // Angles given to drawArc() are integers representing 1/16th a degree.
+    const int angleInt = static_cast<int>(arc.spanAngle * 16.0);
+
+    tiles.paint(bounds.toAlignedRect().intersected(clip), [&](QPainter& painter)
+    {
+        painter.setRenderHint(QPainter::Antialiasing, antialiased);
+
+        // SmoothPixMapTransform is also used when AA is turned on to reduce
+        // aliasing artifacts for filled arcs with a non-solid pattern such as
+        // Dense3Pattern, which appear when rotation is used.
+        painter.setRenderHint(QPainter::SmoothPixmapTransform, antialiased);
+
+        // Rotate the entire arc about its center point.
+        painter.translate(arc.center);
+        painter.rotate(arc.rotation);
+
+        if (drawPie)
+        {
+            painter.setPen(QPen(Qt::NoPen));
+            painter.setBrush(brush);
+            painter.drawPie(boundingBox, 0, angleInt);
+        }
+
+        if (drawArc)
+        {
+            painter.setPen(pen);
+            painter.setBrush(Qt::NoBrush);
+            painter.drawArc(boundingBox, 0, angleInt);
+        }
+    });
+}
+
+/**
+ * @brief Save the drawings on the canvas.
+ *
+ * All the layers are saved, along with their visibility and opacity. The
+ * checkpoint shares the layers' tiles, so this is cheap regardless of the
+ * canvas size: tiles are only copied when they are next drawn on.
+ *
+ * @return The checkpoint's identifier, to be passed to restore().
+ */
+int TurtleCanvasGraphicsItem::checkpoint()
+{
+    CanvasLocker lock(&m_mutex);
+
+    rasterizePending();
+
+    Checkpoint checkpoint;
+    checkpoint.layers          = saveLayers();
+    checkpoint.styleGeneration = m_styleGeneration;
+
+    const int id = m_nextCheckpoint++;
+    m_checkpoints.insert(id, checkpoint);
+
+    return id;
+}
+
+/**
+ * @brief Replace the drawings on the canvas by the ones saved in a checkpoint.
+ *
+ * The checkpoint is kept, so it can be restored again. The canvas keeps its
+ * current size, background color, turtle and current layer.
+ *
+ * The canvasUpdated() signal is emitted after the canvas is restored.
+ *
+ * @param id The identifier returned by checkpoint().
+ * @return @c false if there is no such checkpoint.
+ */
+bool TurtleCanvasGraphicsItem::restore(int id)
+{
+    {
+        CanvasLocker lock(&m_mutex);
+
+        QHash<int, Checkpoint>::const_iterator it = m_checkpoints.constFind(id);
+        if (it == m_checkpoints.constEnd())
+        {
+            return false;
+        }
+
+        const QSize size = m_tiles.size();
+        m_layers = it->layers;
+        addLayers(m_currentLayer + 1);
+
+        for (int i = 0; i < m_layers.size(); i++)
+        {
+            Layer& layer = m_layers[i];
+            layer.tiles.resize(size);
+
+            if (it->styleGeneration != m_styleGeneration)
+            {
+                // The commands refer to pen/brush handles which have since been
+                // reused, so only the drawing is kept.
+                layer.displayList.rebase(layer.tiles);
+            }
+        }
+
+        // The checkpoint's commands were all drawn on its tiles, and any
+        // commands pending in the current batch are discarded.
+        loadCurrentLayer();
+        m_displayList.updateBytes();
+
+        leaveHistory();
+        updateCanvasBytes();
+    }
+
+    notifyCanvasUpdated();
+
+    return true;
+}
+
+/**
+ * @brief Release a checkpoint.
+ *
+ * The tiles only referenced by the checkpoint are freed.
+ *
+ * @param id The identifier returned by checkpoint().
+ */
+void TurtleCanvasGraphicsItem::discardCheckpoint(int id)
+{
+    CanvasLocker lock(&m_mutex);
+    m_checkpoints.remove(id);
+}
+
+/**
+ * @brief Find the primitives drawn in a region of the canvas.
+ *
+ * The primitives are found using the display list's spatial index, so
+ * only the primitives near the region are visited. This is used for hit
+ * testing, and for limiting re-rendering or exports to a region.
+ *
+ * Primitives drawn before the canvas' pen/brush table was last started
+ * over are not retained, and are not returned.
+ *
+ * @param rect The region, in the canvas' coordinate system (see above).
+ * @return The indexes of the primitives whose bounding box intersects
+ *     the region, in drawing order.
+ */
+QVector<int> TurtleCanvasGraphicsItem::primitivesIn(const QRectF& rect) const
+{
+    // The display list uses the flipped (Y down) coordinates of the commands.
+    const QRectF flipped(QPointF(rect.left(), -rect.bottom()),
+                         QPointF(rect.right(), -rect.top()));
+
+    QVector<int> primitives;
+
+    CanvasLocker lock(&m_mutex);
+    m_displayList.query(flipped.normalized(), primitives);
+    return primitives;
+}
+
+/**
+ * @brief Get the number of primitives retained in the display list.
+ */
+int TurtleCanvasGraphicsItem::primitiveCount() const
+{
+    CanvasLocker lock(&m_mutex);
+    return m_displayList.size();
+}
+
+/**
+ * @brief Display the canvas as it was after a number of primitives were drawn.
+ *
+ * The primitives following the nearest keyframe are redrawn on a copy of
+ * the keyframe's tiles, so this takes at most DisplayList::KEYFRAME_INTERVAL
+ * primitives to draw. When moving forward from the step currently shown,
+ * only the primitives in between are drawn.
+ *
+ * The canvasUpdated() signal is emitted after the history is shown.
+ *
+ * @param step The number of primitives, from 0 to primitiveCount(). The
+ *     live canvas is shown for primitiveCount().
+ */
+void TurtleCanvasGraphicsItem::showHistory(int step)
+{
+    TraceScope scope("showHistory", "canvas");
+
+    {
+        CanvasLocker lock(&m_mutex);
+
+        step = std::max(0, step);
+
+        if (step >= m_displayList.size())
+        {
+            leaveHistory();
+        }
+        else
+        {
+            int firstCommand;
+            const TileStore& keyframe = m_displayList.keyframeBefore(step, firstCommand);
+
+            if ((m_historyStep < firstCommand) || (m_historyStep > step))
+            {
+                m_historyTiles = keyframe;
+                m_historyTiles.resize(m_tiles.size());
+                m_historyStep = firstCommand;
+            }
+
+            for (; m_historyStep < step; m_historyStep++)
+            {
+                render(m_displayList.at(m_historyStep), m_historyTiles);
+            }
+        }
+    }
+
+    notifyCanvasUpdated();
+}
+
+/**
+ * @brief Go back to displaying the canvas after showHistory().
+ *
+ * The canvasUpdated() signal is emitted after the live canvas is shown.
+ */
+void TurtleCanvasGraphicsItem::showLive()
+{
+    {
+        CanvasLocker lock(&m_mutex);
+        leaveHistory();
+    }
+
+    notifyCanvasUpdated();
+}
+
+/**
+ * @brief Stop displaying the history, and release its tiles.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::leaveHistory()
+{
+    m_historyTiles = TileStore();
+    m_historyStep  = -1;
+}
+
+/**
+ * @brief Add empty layers, up to a number of layers.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::addLayers(int count)
+{
+    while (m_layers.size() < count)
+    {
+        Layer layer;
+        layer.tiles = TileStore(m_tiles.size());
+        m_layers.append(layer);
+    }
+}
+
+/**
+ * @brief Move the current layer's drawings into m_layers.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ * @pre The current layer's primitives have all been drawn (see rasterizePending()).
+ */
+void TurtleCanvasGraphicsItem::storeCurrentLayer()
+{
+    Layer& layer = m_layers[m_currentLayer];
+    layer.tiles       = m_tiles;
+    layer.displayList = m_displayList;
+}
+
+/**
+ * @brief Move the current layer's drawings out of m_layers, to draw on them.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+void TurtleCanvasGraphicsItem::loadCurrentLayer()
+{
+    Layer& layer = m_layers[m_currentLayer];
+    m_tiles       = layer.tiles;
+    m_displayList = layer.displayList;
+    m_rasterized  = m_displayList.size();
+
+    // Tiles still shared with the layer would be copied when drawn on.
+    layer.tiles       = TileStore();
+    layer.displayList = DisplayList();
+}
+
+/**
+ * @brief Get a copy of all the layers, including the current one.
+ *
+ * The copy shares the layers' tiles and display lists.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ */
+QVector<TurtleCanvasGraphicsItem::Layer> TurtleCanvasGraphicsItem::saveLayers() const
+{
+    QVector<Layer> layers = m_layers;
+    layers[m_currentLayer].tiles       = m_tiles;
+    layers[m_currentLayer].displayList = m_displayList;
+    return layers;
+}
+
+/**
+ * @brief Get the layers to composite.
+ *
+ * Hidden and transparent layers are left out, and so are the layers
+ * other than the current one which have never been drawn on.
+ *
+ * @pre @c m_mutex is locked by the caller.
+ *
+ * @param currentTiles The tiles to show for the current layer, i.e.
+ *     m_tiles or m_historyTiles.
+ * @return The layers, from the bottom one up.
+ */
+QVector<LayerCompositor::Layer> TurtleCanvasGraphicsItem::visibleLayers(const TileStore& currentTiles) const
+{
+    QVector<LayerCompositor::Layer> layers;
+
+    for (int i = 0; i < m_layers.size(); i++)
+    {
+        const Layer& layer = m_layers.at(i);
+        const TileStore& tiles = (i == m_currentLayer) ? currentTiles : layer.tiles;
+
+        if (layer.visible && (layer.opacity > 0)
+            && ((i == m_currentLayer) || (0u != tiles.bytes())))
+        {
+            const LayerCompositor::Layer visible = {&tiles, layer.opacity};
+            layers.append(visible);
+        }
+    }
+
+    return layers;
+}
+
+/**
+ * @brief Start batching the canvasUpdated() signals.
+ *
+ * Until the matching endBatch(), changes to the canvas do not emit
+ * canvasUpdated(), and the primitives drawn are only retained in the
+ * display list. Batches can be nested.
+ */
+void TurtleCanvasGraphicsItem::beginBatch()
+{
+    m_batchDepth.ref();
+}
+
+/**
+ * @brief End a batch started by beginBatch().
+ *
+ * When the outermost batch ends, the primitives drawn during the batch
+ * are drawn on the canvas (see rasterizePending()), and the canvasUpdated()
+ * signal is emitted once if the canvas was changed during the batch.
+ */
+void TurtleCanvasGraphicsItem::endBatch()
+{
+    if (!m_batchDepth.deref())
+    {
+        {
+            CanvasLocker lock(&m_mutex);
+            rasterizePending();
+            updateCanvasBytes();
+        }
+
+        if (0 != m_batchDirty.fetchAndStoreOrdered(0))
+        {
+            notifyCanvasUpdated();
+        }
+    }
+}
+
+/**
+ * @brief Display the changes made since the previous frame, all at once.
+ *
+ * The visible layers, background color and turtle are saved as the frame
+ * to display until the next call to presentFrame() or endFrames(). This
+ * then blocks until the frame has been painted (or for at most
+ * FRAME_TIMEOUT milliseconds, e.g. when the canvas is not visible).
+ *
+ * If nothing changed since the previous frame, nothing is repainted and
+ * this blocks for FRAME_INTERVAL milliseconds instead.
+ *
+ * cancelFrameWait() stops the wait early.
+ */
+void TurtleCanvasGraphicsItem::presentFrame()
+{
+    TraceScope scope("frame", "canvas");
+
+    bool changed;
+
+    {
+        CanvasLocker lock(&m_mutex);
+
+        // The first frame is always presented.
+        changed = (0 == m_frameMode.fetchAndStoreOrdered(1))
+                  || (0 != m_frameDirty.fetchAndStoreOrdered(0));
+
+        if (changed)
+        {
+            rasterizePending();
+
+            const QVector<LayerCompositor::Layer> layers = visibleLayers(m_tiles);
+
+            m_frameLayers.resize(layers.size());
+            for (int i = 0; i < layers.size(); i++)
+            {
+                m_frameLayers[i].tiles   = *layers.at(i).tiles;
+                m_frameLayers[i].opacity = layers.at(i).opacity;
+            }
+
+            m_frameBackground = m_backgroundColor;
+            m_framesPresented++;
+
+            QMutexLocker turtleLock(&m_turtleMutex);
+            m_frameTurtle = m_turtle;
+        }
+    }
+
+    if (changed)
+    {
+        requestRepaint();
+    }
+
+    CanvasLocker lock(&m_mutex);
+
+    if (changed)
+    {
+        const quint64 frame = m_framesPresented;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        while (m_framesPainted < frame)
+        {
+            const qint64 elapsed = timer.elapsed();
+            if ((elapsed >= static_cast<qint64>(FRAME_TIMEOUT))
+                || !m_frameCond.wait(&m_mutex, FRAME_TIMEOUT - static_cast<unsigned long>(elapsed)))
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        (void)m_frameCond.wait(&m_mutex, FRAME_INTERVAL);
+    }
+}
+
+/**
+ * @brief Wake up a thread waiting in presentFrame().
+ */
+void TurtleCanvasGraphicsItem::cancelFrameWait()
+{
+    CanvasLocker lock(&m_mutex);
+    m_framesPainted = m_framesPresented;
+    m_frameCond.wakeAll();
+}
+
+/**
+ * @brief Go back to displaying every change to the canvas.
+ *
+ * The canvasUpdated() signal is emitted if frames were displayed.
+ */
+void TurtleCanvasGraphicsItem::endFrames()
+{
+    {
+        CanvasLocker lock(&m_mutex);
+
+        if (0 == m_frameMode.fetchAndStoreOrdered(0))
+        {
+            return;
+        }
+
+        m_frameDirty.storeRelease(0);
+        m_frameLayers.clear();
+    }
+
+    requestRepaint();
+}
+
+/**
+ * @brief Get the canvas size.
+ *
+ * @return The canvas size.
+ */
+QSize TurtleCanvasGraphicsItem::size() const
+{
+    CanvasLocker lock(&m_mutex);
+    return m_tiles.size();
+}
+
+/**
+ * @brief Change the canvas size.
+ *
+ * The canvasResized() signal is emitted after after the canvas is resized.
+ *
+ * @param newSize The size (in pixels) of the new canvas. If the size is the same
+ *     as the current size then this method has no effect.
+ */
+void TurtleCanvasGraphicsItem::resize(QSize newSize)
+{
+    bool wasResized = false;
+
+    {
+        CanvasLocker lock(&m_mutex);
+
+        const QSize oldSize = m_tiles.size();
+
+        if (newSize != oldSize)
+        {
+            prepareGeometryChange();
+
+            rasterizePending();
+            m_tiles.resize(newSize);
+            for (int i = 0; i < m_layers.size(); i++)
+            {
+                if (i != m_currentLayer)
+                {
+                    m_layers[i].tiles.resize(newSize);
+                }
+            }
+            leaveHistory();
+            updateCanvasBytes();
+
+            for (int i = 0; i < m_frameLayers.size(); i++)
+            {
+                m_frameLayers[i].tiles.resize(newSize);
+            }
+
+            update();
+
+            setPos(-static_cast<qreal>(newSize.width()) / 2.0,
+                   -static_cast<qreal>(newSize.height()) / 2.0);
+
+            wasResized = true;
+        }
+    }
+
+    if (wasResized)
+    {
+        emit canvasResized();
+    }
+}
+
+QRectF TurtleCanvasGraphicsItem::boundingRect() const
+{
+    return m_tiles.rect();
+}
+
+void TurtleCanvasGraphicsItem::paint(QPainter *painter,
+                               const QStyleOptionGraphicsItem *option,
+                               QWidget *)
+{
+    static const QPointF turtlePoints[] =
+    {
+        QPointF(-10.0,  0.5),
+        QPointF( 10.0,  0.5),
+        QPointF(  0.0, -10.5)
+    };
+
+    TraceScope scope("paint", "ui");
+
+    QElapsedTimer frameTimer;
+    frameTimer.start();
+
+    Turtle frameTurtle = Turtle();
+    bool showFrame;
+    QSize canvasSize;
+
+    {
+        CanvasLocker lock(&m_mutex);
+
+        showFrame  = (m_historyStep < 0) && (0 != m_frameMode.loadAcquire());
+        canvasSize = m_tiles.size();
+
+        QVector<LayerCompositor::Layer> layers;
+
+        if (showFrame)
+        {
+            for (int i = 0; i < m_frameLayers.size(); i++)
+            {
+                const LayerCompositor::Layer layer = {&m_frameLayers.at(i).tiles, m_frameLayers.at(i).opacity};
+                layers.append(layer);
+            }
+        }
+        else
+        {
+            layers = visibleLayers((m_historyStep >= 0) ? m_historyTiles : m_tiles);
+        }
+
+        painter->fillRect(boundingRect(), showFrame ? m_frameBackground : m_backgroundColor);
+        m_compositor.draw(painter, option->exposedRect.toAlignedRect(), layers);
+        updateCanvasBytes();
+
+        if (showFrame)
+        {
+            frameTurtle = m_frameTurtle;
+
+            if (m_framesPainted != m_framesPresented)
+            {
+                m_framesPainted = m_framesPresented;
+                m_frameCond.wakeAll();
+            }
+        }
+    }
+
+    // The live turtle is read without locking (see TripleBuffer).
+    const Turtle& turtle = showFrame ? frameTurtle : m_sprite.read();
+
+    // Paint the turtle
+    if (!turtle.hidden)
+    {
+        painter->setRenderHint(QPainter::Antialiasing, true);
+        painter->translate(static_cast<qreal>(canvasSize.width())  / 2.0,
+                           static_cast<qreal>(canvasSize.height()) / 2.0);
+        painter->translate(QPointF(turtle.position.x(),
+                                   -turtle.position.y()));
+        painter->rotate(turtle.heading);
+        painter->setPen(turtle.color);
+
+        painter->drawPolygon(&turtlePoints[0],
+                             sizeof(turtlePoints)/sizeof(turtlePoints[0]));
+    }
+
+    PerfCounters& counters = PerfCounters::instance();
+    counters.framesTotal.fetchAndAddRelaxed(1);
+    counters.lastFrameNsecs.store(static_cast<quint64>(frameTimer.nsecsElapsed()));
+}
+
+/**
+ * @brief Calls this->update()
+ *
+ * The purpose of this method is to allow update() to be indirectly called
+ * by the UI thread by a queued signal.
+ */
+void TurtleCanvasGraphicsItem::callUpdate()
+{
+    PerfCounters::instance().pendingRepaints.fetchAndSubRelaxed(1);
+    update();
+}
+
+/**
+ * @brief Emit the canvasUpdated() signal.
+ *
+ * The number of queued (not yet delivered) updates is tracked in
+ * PerfCounters::pendingRepaints.
+ */
+void TurtleCanvasGraphicsItem::notifyCanvasUpdated()
+{
+    // Changes made during a batch are notified by endBatch().
+    if (0 != m_batchDepth.loadAcquire())
+    {
+        m_batchDirty.storeRelease(1);
+        return;
+    }
+
+    // While frames are displayed, changes are shown by the next frame.
+    if (0 != m_frameMode.loadAcquire())
+    {
+        m_frameDirty.storeRelease(1);
+        return;
+    }
+
+    requestRepaint();
+}
+
+/**
+ * @brief Emit the canvasUpdated() signal, even while frames are displayed.
+ */
+void TurtleCanvasGraphicsItem::requestRepaint()
+{
+    PerfCounters::instance().pendingRepaints.fetchAndAddRelaxed(1);
+    emit canvasUpdated();
+}
+
+/**
+ * @brief Publish the size of the backing store to PerfCounters::canvasBytes.
+ *
+ * Only the tiles which have been drawn on are counted, in every layer,
+ * along with the composited tiles cached for them.
+ *
+ * @pre @c m_mutex is locked by the caller (or the object is being constructed).
+ */
+void TurtleCanvasGraphicsItem::updateCanvasBytes()
+{
+    quint64 bytes = m_tiles.bytes() + m_compositor.bytes();
+    bytes += m_stamps.bytes() + m_glyphs.bytes() + m_images.bytes();
+
+    for (int i = 0; i < m_layers.size(); i++)
+    {
+        if (i != m_currentLayer)
+        {
+            bytes += m_layers.at(i).tiles.bytes();
+        }
+    }
+
+    PerfCounters::instance().canvasBytes.set(bytes);
 }
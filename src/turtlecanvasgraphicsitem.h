@@ -20,9 +20,23 @@
 #ifndef TURTLEGRAPHICSWIDGET_H
 #define TURTLEGRAPHICSWIDGET_H
 
+#include "displaylist.h"
+#include "drawcommand.h"
+#include "glyphatlas.h"
+#include "imagecache.h"
+#include "layercompositor.h"
+#include "penbrushtable.h"
+#include "rasterizer.h"
+#include "stampcache.h"
+#include "tilebinner.h"
+#include "tilestore.h"
+#include "triplebuffer.h"
+#include <QAtomicInt>
+#include <QHash>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QGraphicsItem>
-#include <QPixmap>
+#include <QImage>
 
 /**
  * @brief Canvas for real-time drawing & rendering of turtle graphics.
@@ -33,9 +47,38 @@
  *    * clear()
  *    * drawLine()
  *    * drawArc()
+ *    * floodFill()
+ *    * drawText()
+ *    * loadImage()
+ *    * drawImage()
+ *    * pixelColor()
+ *    * setLayer()
+ *    * setLayerVisible()
+ *    * setLayerOpacity()
+ *    * beginStamp()
+ *    * endStamp()
+ *    * drawStamp()
+ *    * primitivesIn()
+ *    * checkpoint()
+ *    * restore()
+ *    * discardCheckpoint()
+ *    * beginBatch()
+ *    * endBatch()
+ *    * presentFrame()
+ *    * cancelFrameWait()
+ *    * endFrames()
  *
  * Other methods can only be called by the UI thread.
  *
+ * Primitives drawn during a batch (see beginBatch()) are only drawn on the
+ * canvas when the outermost batch ends, all at once: they are binned into
+ * rows of tiles which are drawn in parallel (see TileBinner). Until then,
+ * paint() and the exports show the canvas as it was when the batch began.
+ *
+ * The turtle has its own lock, so moving it does not wait for drawing.
+ * It is published to paint() through a TripleBuffer, which paint() reads
+ * without taking any lock.
+ *
  * @section Coordinate System
  *
  * The coordinate system used by this class is different to the rest of the Qt framework.
@@ -83,6 +126,77 @@
  *
  * Similarly, if the canvas size is increased then extra space is added at the
  * edges of the canvas.
+ *
+ * @section Checkpoints
+ *
+ * checkpoint() saves the drawings on the canvas, which can later be put
+ * back by restore(). A checkpoint only shares the canvas' tiles: when the
+ * canvas is next drawn on, only the tiles touched are copied. Checkpoints
+ * are kept until discardCheckpoint() is called.
+ *
+ * @section History
+ *
+ * The display list records the primitives drawn since the canvas was last
+ * cleared, with keyframes of the tiles every DisplayList::KEYFRAME_INTERVAL
+ * primitives. showHistory() displays the canvas as it was after any number
+ * of these primitives by redrawing the primitives following the nearest
+ * keyframe, without affecting the canvas itself. showLive() goes back to
+ * displaying the canvas. Clearing, resizing or restoring the canvas also
+ * goes back to the live canvas.
+ *
+ * @section Layers
+ *
+ * The canvas has a stack of up to MAX_LAYERS layers, which are composited
+ * over the background color from the bottom layer (0) up, each with its
+ * own visibility and opacity. Only layer 0 exists until another one is
+ * used. Primitives are drawn on the current layer (see setLayer()), and
+ * clear() only clears the current layer. Each layer has its own display
+ * list, so the history, fills and batches apply to the current layer.
+ * Checkpoints save all the layers.
+ *
+ * The composited tiles are cached (see LayerCompositor), so a static
+ * background on one layer is not composited again while the layers over
+ * it are drawn on. Exports composite the visible layers as well, and
+ * vector exports save them as an image when more than one is visible.
+ *
+ * @section Fills
+ *
+ * floodFill() is retained in the display list like the other primitives,
+ * with the bounds of the pixels it filled. As a fill depends on what was
+ * drawn before it, copyPrimitives() exports it as part of a base image of
+ * the primitives drawn up to it. Every primitive except lines and arcs is
+ * exported as part of the base image, so only the lines and arcs drawn
+ * after the last of them are exported as vectors.
+ *
+ * @section Stamps
+ *
+ * The lines and arcs drawn between beginStamp() and endStamp() are
+ * recorded as a stamp instead of being drawn. drawStamp() then draws the
+ * stamp anywhere, rotated and scaled, by blending a bitmap of it which is
+ * rasterized once per rotation and scale (see StampCache). Stamps are
+ * retained in the display list.
+ *
+ * @section Text
+ *
+ * drawText() lays out a string with the metrics of the glyphs cached by
+ * GlyphAtlas, and retains a primitive for each glyph, which blends the
+ * glyph's coverage mask with the text color.
+ *
+ * @section Images
+ *
+ * loadImage() decodes an image file once into a shared ImageCache, and
+ * drawImage() blends a scaled and rotated variant of it, which is also
+ * cached.
+ *
+ * @section Frames
+ *
+ * Animations call presentFrame() once they have drawn a frame. From the
+ * first call, the canvas only displays the drawings, background and turtle
+ * as they were at the last presented frame, so that a frame is never shown
+ * partly drawn. The frame shares the canvas' tiles, so presenting it does
+ * not copy any pixels. presentFrame() blocks until the frame has been
+ * painted, which paces the animation to the display. endFrames() goes back
+ * to displaying every change to the canvas.
  */
 class TurtleCanvasGraphicsItem : public QObject, public QGraphicsItem
 {
@@ -90,11 +204,17 @@ class TurtleCanvasGraphicsItem : public QObject, public QGraphicsItem
     Q_INTERFACES(QGraphicsItem)
 
 public:
+    /// Maximum number of layers (see setLayer()).
+    static const int MAX_LAYERS = 16;
+
     TurtleCanvasGraphicsItem();
 
     QImage toImage(bool transparentBackground,
                    bool fitToUsedArea) const;
 
+    QRectF drawingRect(bool fitToUsedArea) const;
+    void copyPrimitives(DisplayList& displayList, QVector<DrawStyle>& styles) const;
+
     bool antialiased() const;
     void setAntialiased(bool on = true);
 
@@ -115,17 +235,54 @@ public:
 
     void clear();
 
-    void drawLine(QLineF line, const QPen& pen);
+    void drawLine(const QLineF& line, const DrawStyle& style);
 
     void drawArc(const QPointF& centerPos,
                  qreal startAngle,
                  qreal angle,
                  qreal xradius,
                  qreal yradius,
-                 const QPen& pen,
-                 const QBrush& brush,
+                 const DrawStyle& style,
                  bool filled);
 
+    void floodFill(const QPointF& seedPos, const QColor& color, int tolerance);
+
+    void drawText(const QPointF& position,
+                  const QString& text,
+                  int pixelSize,
+                  const QColor& color,
+                  qreal angle);
+
+    int loadImage(const QString& path, QString& error);
+    bool drawImage(int image, const QPointF& position, qreal scale, qreal angle);
+
+    QColor pixelColor(const QPointF& pos);
+
+    void setLayer(int layer);
+    void setLayerVisible(int layer, bool visible);
+    void setLayerOpacity(int layer, int opacity);
+
+    bool beginStamp();
+    void endStamp(const QString& name, bool keep);
+    bool drawStamp(const QString& name, const QPointF& position, qreal angle, qreal scale);
+
+    int checkpoint();
+    bool restore(int id);
+    void discardCheckpoint(int id);
+
+    QVector<int> primitivesIn(const QRectF& rect) const;
+    int primitiveCount() const;
+
+    void showHistory(int step);
+    void showLive();
+
+    void beginBatch();
+    void endBatch();
+
+    void presentFrame();
+    void cancelFrameWait();
+    void endFrames();
+
     QSize size() const;
     void resize(QSize newSize);
 
@@ -141,21 +298,160 @@ private slots:
     void callUpdate();
 
 private:
-    void updateUsedArea(const QPoint& point);
-    void updateUsedArea(const QPointF& point);
-    void updateUsedArea(const QRectF& rect);
+    /// The on-screen turtle.
+    struct Turtle
+    {
+        QPointF position;
+        qreal   heading;
+        QColor  color;
+        bool    hidden;
+    };
+
+    /// A layer of drawings (see setLayer()).
+    struct Layer
+    {
+        Layer() :
+            tiles(),
+            displayList(),
+            visible(true),
+            opacity(255)
+        {
+
+        }
+
+        TileStore   tiles;       ///< Unused while the layer is current (see m_tiles).
+        DisplayList displayList; ///< Unused while the layer is current (see m_displayList).
+        bool        visible;
+        int         opacity;     ///< 0 (transparent) to 255 (opaque).
+    };
+
+    /// The drawings saved by checkpoint().
+    struct Checkpoint
+    {
+        QVector<Layer> layers;
+        int            styleGeneration; ///< The value of m_styleGeneration when saved.
+    };
+
+    QRect exportRect(bool fitToUsedArea) const;
+
+    PenBrushTable::Handle internStyle(const DrawStyle& style);
+    void applyStyle(PenBrushTable::Handle handle);
+
+    void leaveHistory();
+
+    void addLayers(int count);
+    void storeCurrentLayer();
+    void loadCurrentLayer();
+    QVector<Layer> saveLayers() const;
+    QVector<LayerCompositor::Layer> visibleLayers(const TileStore& currentTiles) const;
+
+    void record(const DrawCommand& command);
+    QRectF commandBounds(const DrawCommand& command) const;
+
+    void rasterizePending();
+
+    void render(const DrawCommand& command, TileStore& tiles);
+
+    void render(const DrawCommand& command,
+                const PenBrushTable& styles,
+                TileStore& tiles,
+                Rasterizer& rasterizer,
+                const QRect& clip) const;
+
+    static void renderLine(QLineF line,
+                           bool antialiased,
+                           const PenBrushTable::Entry& style,
+                           TileStore& tiles,
+                           Rasterizer& rasterizer,
+                           const QRect& clip);
+
+    static void renderArc(const ArcShape& arc,
+                          bool filled,
+                          const PenBrushTable& styles,
+                          const PenBrushTable::Entry& style,
+                          TileStore& tiles,
+                          Rasterizer& rasterizer,
+                          const QRect& clip);
+
+    static QRect renderFill(const DrawCommand& command,
+                            const PenBrushTable& styles,
+                            TileStore& tiles);
+
+    static void renderBitmap(const QImage& image,
+                             const QPoint& origin,
+                             const QPointF& position,
+                             TileStore& tiles,
+                             const QRect& clip);
+
+    StampCache::Bitmap stampBitmap(const DrawCommand& command) const;
+    ImageCache::Bitmap imageBitmap(const DrawCommand& command) const;
+
+    static void renderGlyph(const GlyphAtlas::Glyph& glyph,
+                            const QPointF& position,
+                            quint32 color,
+                            TileStore& tiles,
+                            const QRect& clip);
+
+    static void paintArc(const ArcShape& arc,
+                         const QRectF& bounds,
+                         const QPen& pen,
+                         const QBrush& brush,
+                         bool drawPie,
+                         bool drawArc,
+                         bool antialiased,
+                         const QRect& clip,
+                         TileStore& tiles);
+
+    void notifyCanvasUpdated();
+    void requestRepaint();
+    void updateCanvasBytes();
 
     mutable QMutex m_mutex;
 
-    QPixmap m_pixmap;
+    TileStore m_tiles;
     QColor m_backgroundColor;
 
-    QRect m_usedRect;
+    Rasterizer m_rasterizer;
+
+    PenBrushTable m_styles;
+    int m_currentStyle; ///< Handle of the style in m_style, or -1.
+    const PenBrushTable::Entry* m_style;
+    int m_styleGeneration; ///< Incremented each time m_styles is started over.
+
+    DisplayList m_displayList;
+    int         m_rasterized; ///< Number of commands in m_displayList drawn on m_tiles.
+    TileBinner  m_binner;
+
+    // m_tiles and m_displayList are those of the current layer.
+    QVector<Layer>          m_layers;       ///< From the bottom layer up.
+    int                     m_currentLayer;
+    mutable LayerCompositor m_compositor;   ///< Caches the composited layers.
+    mutable StampCache      m_stamps;       ///< The stamps, and their bitmaps.
+    mutable GlyphAtlas      m_glyphs;       ///< The glyphs of the text drawn.
+    mutable ImageCache      m_images;       ///< The images loaded, and their variants.
+
+    QHash<int, Checkpoint> m_checkpoints;
+    int m_nextCheckpoint;
+
+    TileStore m_historyTiles; ///< The drawing shown by showHistory().
+    int m_historyStep;        ///< Primitives drawn in m_historyTiles, or -1 when live.
+
+    mutable QMutex       m_turtleMutex; ///< Guards m_turtle and publishing to m_sprite.
+    Turtle               m_turtle;
+    TripleBuffer<Turtle> m_sprite;      ///< m_turtle, as read by paint().
+
+    QAtomicInt m_batchDepth; ///< Number of nested beginBatch() calls.
+    QAtomicInt m_batchDirty; ///< Non-zero when changed during the batch.
 
-    QPointF m_turtlePos;
-    qreal m_turtleHeading;
-    QColor m_turtleColor;
-    bool m_turtleHidden;
+    // The last frame presented by presentFrame().
+    QAtomicInt     m_frameMode;       ///< Non-zero while frames are displayed.
+    QAtomicInt     m_frameDirty;      ///< Non-zero when changed since the last frame.
+    QVector<Layer> m_frameLayers;     ///< The tiles and opacity of the visible layers.
+    QColor         m_frameBackground;
+    Turtle         m_frameTurtle;
+    quint64        m_framesPresented; ///< Number of frames presented.
+    quint64        m_framesPainted;   ///< Number of frames presented when last painted.
+    QWaitCondition m_frameCond;       ///< Woken when a frame is painted.
 
     bool m_antialiased;
 };
@@ -0,0 +1,1044 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#include "vectorexporter.h"
+#include "compositing.h"
+#include "patternatlas.h"
+#include <QBuffer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QImage>
+#include <QPainter>
+#include <QScopedPointer>
+#include <QSet>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+/// Buffered output is written to the file once it reaches this size.
+const int FLUSH_SIZE = 64 * 1024;
+
+/// Maximum number of points in a path of merged lines.
+const int MAX_PATH_POINTS = 10000;
+
+const int PATTERN_SIZE = Compositing::PATTERN_SIZE;
+
+/// Format a number with at most @p decimals decimals, without trailing zeros.
+QByteArray number(qreal value, int decimals = 2)
+{
+    QByteArray text = QByteArray::number(value, 'f', decimals);
+
+    if (text.contains('.'))
+    {
+        while (text.endsWith('0'))
+        {
+            text.chop(1);
+        }
+        if (text.endsWith('.'))
+        {
+            text.chop(1);
+        }
+    }
+
+    if (text == "-0")
+    {
+        text = "0";
+    }
+
+    return text;
+}
+
+QByteArray point(const QPointF& p)
+{
+    return number(p.x()) + ' ' + number(p.y());
+}
+
+qreal penWidth(const DrawStyle& style)
+{
+    // Zero width pens are drawn one pixel wide.
+    return (style.penWidth > 0.0) ? style.penWidth : 1.0;
+}
+
+/// A brush pattern tile as an image.
+QImage patternImage(const quint32* pixels)
+{
+    return QImage(reinterpret_cast<const uchar*>(pixels),
+                  PATTERN_SIZE,
+                  PATTERN_SIZE,
+                  QImage::Format_ARGB32_Premultiplied).copy();
+}
+
+/**
+ * @brief The part of the base tiles of a display list inside a region.
+ *
+ * @param position Receives the position of the image, relative to the
+ *     center of the canvas.
+ * @return The image, or a null image if nothing is drawn in the region.
+ */
+QImage baseImage(const TileStore& tiles, const QRectF& region, QPointF& position)
+{
+    const QPointF origin(static_cast<qreal>(tiles.size().width())  / 2.0,
+                         static_cast<qreal>(tiles.size().height()) / 2.0);
+
+    const QRect rect = region.translated(origin).toAlignedRect().intersected(tiles.usedRect());
+
+    if (rect.isEmpty())
+    {
+        return QImage();
+    }
+
+    QImage image(rect.size(), QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.translate(-rect.topLeft());
+    tiles.draw(&painter, rect);
+    painter.end();
+
+    position = QPointF(rect.topLeft()) - origin;
+    return image;
+}
+
+/**
+ * @brief Writes paths in a vector format.
+ *
+ * Each path is started by beginStroke() or beginFill(), which give how
+ * it is painted, and finished by endPath(). The coordinates are relative
+ * to the center of the canvas, with the Y axis down.
+ */
+class VectorWriter
+{
+public:
+    explicit VectorWriter(QFile& file) :
+        m_buffer(),
+        m_file(file),
+        m_written(0),
+        m_failed(false)
+    {
+
+    }
+
+    virtual ~VectorWriter()
+    {
+
+    }
+
+    virtual void begin(const QRectF& region,
+                       const QColor& background,
+                       const QImage& baseImage,
+                       const QPointF& basePosition) = 0;
+
+    virtual void beginStroke(const DrawStyle& style) = 0;
+    virtual void beginFill(const DrawStyle& style, int patternTile, const quint32* pattern) = 0;
+
+    virtual void moveTo(const QPointF& p) = 0;
+    virtual void lineTo(const QPointF& p) = 0;
+    virtual void cubicTo(const QPointF& c1, const QPointF& c2, const QPointF& p) = 0;
+    virtual void closePath() = 0;
+    virtual void endPath() = 0;
+
+    virtual void end() = 0;
+
+    /**
+     * @brief Write the buffered output to the file.
+     *
+     * @param all Set to @c false to only write once FLUSH_SIZE is buffered.
+     * @return @c false if writing to the file failed.
+     */
+    bool flush(bool all)
+    {
+        if (!m_failed && (all || (m_buffer.size() >= FLUSH_SIZE)))
+        {
+            if (m_file.write(m_buffer) != m_buffer.size())
+            {
+                m_failed = true;
+            }
+            m_written += m_buffer.size();
+            m_buffer.clear();
+        }
+
+        return !m_failed;
+    }
+
+protected:
+    /// The position in the file of the next byte written.
+    qint64 offset() const
+    {
+        return m_written + m_buffer.size();
+    }
+
+    QByteArray m_buffer;
+
+private:
+    QFile& m_file;
+    qint64 m_written;
+    bool   m_failed;
+};
+
+class SvgWriter : public VectorWriter
+{
+public:
+    explicit SvgWriter(QFile& file) :
+        VectorWriter(file),
+        m_patterns()
+    {
+
+    }
+
+    virtual void begin(const QRectF& region,
+                       const QColor& background,
+                       const QImage& baseImage,
+                       const QPointF& basePosition)
+    {
+        m_buffer += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<svg xmlns=\"http://www.w3.org/2000/svg\""
+                    " xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.1\"";
+        m_buffer += " width=\"" + number(region.width())
+                  + "\" height=\"" + number(region.height())
+                  + "\" viewBox=\"" + point(region.topLeft()) + ' '
+                  + number(region.width()) + ' ' + number(region.height()) + "\">\n";
+
+        if (background.isValid())
+        {
+            m_buffer += "<rect x=\"" + number(region.x())
+                      + "\" y=\"" + number(region.y())
+                      + "\" width=\"" + number(region.width())
+                      + "\" height=\"" + number(region.height()) + '"'
+                      + paint("fill", background.rgba()) + "/>\n";
+        }
+
+        if (!baseImage.isNull())
+        {
+            m_buffer += "<image x=\"" + number(basePosition.x())
+                      + "\" y=\"" + number(basePosition.y())
+                      + "\" width=\"" + QByteArray::number(baseImage.width())
+                      + "\" height=\"" + QByteArray::number(baseImage.height())
+                      + "\" xlink:href=\"" + pngData(baseImage) + "\"/>\n";
+        }
+    }
+
+    virtual void beginStroke(const DrawStyle& style)
+    {
+        m_buffer += "<path fill=\"none\"" + paint("stroke", style.penColor);
+        m_buffer += " stroke-width=\"" + number(penWidth(style)) + '"';
+
+        switch (style.capStyle)
+        {
+        case Qt::RoundCap:
+            m_buffer += " stroke-linecap=\"round\" stroke-linejoin=\"round\"";
+            break;
+
+        case Qt::SquareCap:
+            m_buffer += " stroke-linecap=\"square\"";
+            break;
+
+        default:
+            // SVG's defaults are butt caps and miter joins.
+            break;
+        }
+
+        m_buffer += " d=\"";
+    }
+
+    virtual void beginFill(const DrawStyle& style, int patternTile, const quint32* pattern)
+    {
+        if (nullptr == pattern)
+        {
+            m_buffer += "<path" + paint("fill", style.brushColor) + " d=\"";
+            return;
+        }
+
+        if (!m_patterns.contains(patternTile))
+        {
+            // Patterns are defined when first used, so that nothing
+            // has to be kept until the end of the file.
+            m_patterns.insert(patternTile);
+
+            const QByteArray size = QByteArray::number(PATTERN_SIZE);
+
+            m_buffer += "<defs><pattern id=\"p" + QByteArray::number(patternTile)
+                      + "\" width=\"" + size + "\" height=\"" + size
+                      + "\" patternUnits=\"userSpaceOnUse\"><image width=\"" + size
+                      + "\" height=\"" + size + "\" style=\"image-rendering:pixelated\" xlink:href=\""
+                      + pngData(patternImage(pattern)) + "\"/></pattern></defs>\n";
+        }
+
+        m_buffer += "<path fill=\"url(#p" + QByteArray::number(patternTile) + ")\" d=\"";
+    }
+
+    virtual void moveTo(const QPointF& p)
+    {
+        m_buffer += 'M' + point(p);
+    }
+
+    virtual void lineTo(const QPointF& p)
+    {
+        m_buffer += 'L' + point(p);
+    }
+
+    virtual void cubicTo(const QPointF& c1, const QPointF& c2, const QPointF& p)
+    {
+        m_buffer += 'C' + point(c1) + ' ' + point(c2) + ' ' + point(p);
+    }
+
+    virtual void closePath()
+    {
+        m_buffer += 'Z';
+    }
+
+    virtual void endPath()
+    {
+        m_buffer += "\"/>\n";
+    }
+
+    virtual void end()
+    {
+        m_buffer += "</svg>\n";
+    }
+
+private:
+    /// The attributes to paint with a color, e.g. @c fill="#ff0000".
+    static QByteArray paint(const char* attribute, QRgb color)
+    {
+        QByteArray text = QByteArray(" ") + attribute + "=\""
+                          + QColor(color).name().toLatin1() + '"';
+
+        if (qAlpha(color) < 255)
+        {
+            text += QByteArray(" ") + attribute + "-opacity=\""
+                    + number(qAlpha(color) / 255.0, 3) + '"';
+        }
+
+        return text;
+    }
+
+    static QByteArray pngData(const QImage& image)
+    {
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+        image.save(&buffer, "PNG");
+        return "data:image/png;base64," + buffer.data().toBase64();
+    }
+
+    QSet<int> m_patterns; ///< The pattern tiles defined so far.
+};
+
+/**
+ * @brief Writes a single page PDF file.
+ *
+ * The page's content stream is written as the paths arrive, so its length
+ * is written after it as an indirect object. The resources it uses (the
+ * transparency states, the brush patterns and the base image) are written
+ * after the content stream.
+ */
+class PdfWriter : public VectorWriter
+{
+public:
+    explicit PdfWriter(QFile& file) :
+        VectorWriter(file),
+        m_offsets(),
+        m_region(),
+        m_baseImage(),
+        m_contentStart(0),
+        m_patterns(),
+        m_patternPixels(),
+        m_strokeAlphas(256, false),
+        m_fillAlphas(256, false),
+        m_hasStroke(false),
+        m_strokeColor(0),
+        m_lineWidth(0.0),
+        m_capStyle(Qt::FlatCap),
+        m_strokeAlpha(255),
+        m_hasFill(false),
+        m_fillColor(0),
+        m_fillPattern(-1),
+        m_fillAlpha(255),
+        m_paintOperator()
+    {
+
+    }
+
+    virtual void begin(const QRectF& region,
+                       const QColor& background,
+                       const QImage& baseImage,
+                       const QPointF& basePosition)
+    {
+        m_region    = region;
+        m_baseImage = baseImage;
+
+        m_buffer += "%PDF-1.4\n%\xe2\xe3\xcf\xd3\n";
+
+        beginObject(1);
+        m_buffer += "<< /Type /Catalog /Pages 2 0 R >>\n";
+        endObject();
+
+        beginObject(2);
+        m_buffer += "<< /Type /Pages /Kids [3 0 R] /Count 1 >>\n";
+        endObject();
+
+        // One pixel of the canvas is one point on the page.
+        beginObject(3);
+        m_buffer += "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 "
+                  + number(region.width()) + ' ' + number(region.height())
+                  + "] /Resources 6 0 R /Contents 4 0 R >>\n";
+        endObject();
+
+        beginObject(4);
+        m_buffer += "<< /Length 5 0 R >>\nstream\n";
+        m_contentStart = offset();
+
+        // Flip the page's Y axis to match the canvas.
+        m_buffer += "1 0 0 -1 " + number(-region.left()) + ' ' + number(region.bottom()) + " cm\n";
+
+        if (background.isValid())
+        {
+            setFill(background.rgba(), -1);
+            m_buffer += point(region.topLeft()) + ' '
+                      + number(region.width()) + ' ' + number(region.height()) + " re f\n";
+        }
+
+        if (!baseImage.isNull())
+        {
+            m_buffer += "q " + QByteArray::number(baseImage.width()) + " 0 0 "
+                      + QByteArray::number(-baseImage.height()) + ' '
+                      + number(basePosition.x()) + ' '
+                      + number(basePosition.y() + baseImage.height()) + " cm /Base Do Q\n";
+        }
+    }
+
+    virtual void beginStroke(const DrawStyle& style)
+    {
+        const qreal width = penWidth(style);
+
+        if (!m_hasStroke || (style.penColor != m_strokeColor))
+        {
+            m_buffer += color(style.penColor) + " RG\n";
+            m_strokeColor = style.penColor;
+        }
+
+        if (!m_hasStroke || (width != m_lineWidth))
+        {
+            m_buffer += number(width) + " w\n";
+            m_lineWidth = width;
+        }
+
+        if (!m_hasStroke || (style.capStyle != m_capStyle))
+        {
+            switch (style.capStyle)
+            {
+            case Qt::RoundCap:
+                m_buffer += "1 J 1 j\n";
+                break;
+
+            case Qt::SquareCap:
+                m_buffer += "2 J 0 j\n";
+                break;
+
+            default:
+                m_buffer += "0 J 0 j\n";
+                break;
+            }
+            m_capStyle = style.capStyle;
+        }
+
+        m_hasStroke = true;
+
+        const int alpha = qAlpha(style.penColor);
+        if (alpha != m_strokeAlpha)
+        {
+            m_strokeAlphas[alpha] = true;
+            m_buffer += "/SA" + QByteArray::number(alpha) + " gs\n";
+            m_strokeAlpha = alpha;
+        }
+
+        m_paintOperator = "S\n";
+    }
+
+    virtual void beginFill(const DrawStyle& style, int patternTile, const quint32* pattern)
+    {
+        if ((nullptr != pattern) && !m_patterns.contains(patternTile))
+        {
+            m_patterns.insert(patternTile, 0);
+            m_patternPixels.insert(patternTile, patternImage(pattern));
+        }
+
+        setFill(style.brushColor, (nullptr != pattern) ? patternTile : -1);
+
+        m_paintOperator = "f\n";
+    }
+
+    virtual void moveTo(const QPointF& p)
+    {
+        m_buffer += point(p) + " m\n";
+    }
+
+    virtual void lineTo(const QPointF& p)
+    {
+        m_buffer += point(p) + " l\n";
+    }
+
+    virtual void cubicTo(const QPointF& c1, const QPointF& c2, const QPointF& p)
+    {
+        m_buffer += point(c1) + ' ' + point(c2) + ' ' + point(p) + " c\n";
+    }
+
+    virtual void closePath()
+    {
+        m_buffer += "h\n";
+    }
+
+    virtual void endPath()
+    {
+        m_buffer += m_paintOperator;
+    }
+
+    virtual void end()
+    {
+        const qint64 length = offset() - m_contentStart;
+
+        m_buffer += "endstream\nendobj\n";
+
+        beginObject(5);
+        m_buffer += QByteArray::number(length) + '\n';
+        endObject();
+
+        int nextObject = 7;
+
+        QByteArray xobjects;
+        if (!m_baseImage.isNull())
+        {
+            xobjects += "/Base " + reference(writeImage(m_baseImage, nextObject));
+        }
+
+        QByteArray patterns;
+        for (auto it = m_patterns.begin(); it != m_patterns.end(); ++it)
+        {
+            const int image = writeImage(m_patternPixels.value(it.key()), nextObject);
+            const QByteArray size = QByteArray::number(PATTERN_SIZE);
+            const QByteArray content = size + " 0 0 " + size + " 0 0 cm /Im Do\n";
+
+            // The pattern space is the page's default space, so the
+            // pattern is aligned to the canvas' origin here.
+            it.value() = nextObject++;
+            beginObject(it.value());
+            m_buffer += "<< /Type /Pattern /PatternType 1 /PaintType 1 /TilingType 1"
+                        " /BBox [0 0 " + size + ' ' + size + "] /XStep " + size
+                      + " /YStep " + size + " /Matrix [1 0 0 1 "
+                      + number(-m_region.left()) + ' ' + number(m_region.bottom())
+                      + "] /Resources << /XObject << /Im " + reference(image)
+                      + ">> >> /Length " + QByteArray::number(content.size())
+                      + " >>\nstream\n" + content + "endstream\n";
+            endObject();
+
+            patterns += "/P" + QByteArray::number(it.key()) + ' ' + reference(it.value());
+        }
+
+        QByteArray states;
+        for (int alpha = 0; alpha < 256; alpha++)
+        {
+            if (m_strokeAlphas[alpha])
+            {
+                states += "/SA" + QByteArray::number(alpha)
+                          + " << /CA " + number(alpha / 255.0, 3) + " >> ";
+            }
+            if (m_fillAlphas[alpha])
+            {
+                states += "/FA" + QByteArray::number(alpha)
+                          + " << /ca " + number(alpha / 255.0, 3) + " >> ";
+            }
+        }
+
+        beginObject(6);
+        m_buffer += "<< /ExtGState << " + states + ">> /Pattern << " + patterns
+                  + ">> /XObject << " + xobjects + ">> >>\n";
+        endObject();
+
+        const qint64 xref = offset();
+        m_buffer += "xref\n0 " + QByteArray::number(m_offsets.size())
+                  + "\n0000000000 65535 f \n";
+        for (int i = 1; i < m_offsets.size(); i++)
+        {
+            m_buffer += QByteArray::number(m_offsets[i]).rightJustified(10, '0') + " 00000 n \n";
+        }
+
+        m_buffer += "trailer\n<< /Size " + QByteArray::number(m_offsets.size())
+                  + " /Root 1 0 R >>\nstartxref\n" + QByteArray::number(xref) + "\n%%EOF\n";
+    }
+
+private:
+    static QByteArray reference(int object)
+    {
+        return QByteArray::number(object) + " 0 R ";
+    }
+
+    static QByteArray color(QRgb rgb)
+    {
+        return number(qRed(rgb)   / 255.0, 3) + ' '
+             + number(qGreen(rgb) / 255.0, 3) + ' '
+             + number(qBlue(rgb)  / 255.0, 3);
+    }
+
+    void beginObject(int object)
+    {
+        if (m_offsets.size() <= object)
+        {
+            m_offsets.resize(object + 1);
+        }
+        m_offsets[object] = offset();
+        m_buffer += QByteArray::number(object) + " 0 obj\n";
+    }
+
+    void endObject()
+    {
+        m_buffer += "endobj\n";
+    }
+
+    /// Set the fill to a color, or to a pattern tile when @p patternTile is not -1.
+    void setFill(QRgb rgb, int patternTile)
+    {
+        if (patternTile >= 0)
+        {
+            if (!m_hasFill || (patternTile != m_fillPattern))
+            {
+                m_buffer += "/Pattern cs /P" + QByteArray::number(patternTile) + " scn\n";
+            }
+        }
+        else if (!m_hasFill || (m_fillPattern >= 0) || (rgb != m_fillColor))
+        {
+            m_buffer += color(rgb) + " rg\n";
+        }
+
+        m_hasFill     = true;
+        m_fillColor   = rgb;
+        m_fillPattern = patternTile;
+
+        // The transparency of patterns is in their pixels.
+        const int alpha = (patternTile >= 0) ? 255 : qAlpha(rgb);
+        if (alpha != m_fillAlpha)
+        {
+            m_fillAlphas[alpha] = true;
+            m_buffer += "/FA" + QByteArray::number(alpha) + " gs\n";
+            m_fillAlpha = alpha;
+        }
+    }
+
+    /**
+     * @brief Write an image XObject, with its alpha channel as a soft mask.
+     *
+     * @param nextObject The next free object number, updated.
+     * @return The image's object number.
+     */
+    int writeImage(const QImage& image, int& nextObject)
+    {
+        const QImage argb = image.convertToFormat(QImage::Format_ARGB32);
+
+        QByteArray rgb;
+        QByteArray alpha;
+        rgb.reserve(argb.width() * argb.height() * 3);
+        alpha.reserve(argb.width() * argb.height());
+
+        for (int y = 0; y < argb.height(); y++)
+        {
+            const QRgb* line = reinterpret_cast<const QRgb*>(argb.constScanLine(y));
+            for (int x = 0; x < argb.width(); x++)
+            {
+                rgb   += static_cast<char>(qRed(line[x]));
+                rgb   += static_cast<char>(qGreen(line[x]));
+                rgb   += static_cast<char>(qBlue(line[x]));
+                alpha += static_cast<char>(qAlpha(line[x]));
+            }
+        }
+
+        const QByteArray size = " /Width " + QByteArray::number(argb.width())
+                              + " /Height " + QByteArray::number(argb.height())
+                              + " /BitsPerComponent 8";
+
+        const int mask = nextObject++;
+        writeStream(mask, "/Type /XObject /Subtype /Image /ColorSpace /DeviceGray" + size, alpha);
+
+        const int object = nextObject++;
+        writeStream(object,
+                    "/Type /XObject /Subtype /Image /ColorSpace /DeviceRGB" + size
+                    + " /SMask " + reference(mask),
+                    rgb);
+
+        return object;
+    }
+
+    /// Write a stream object, compressed with zlib.
+    void writeStream(int object, const QByteArray& dictionary, const QByteArray& data)
+    {
+        // qCompress() prefixes the zlib stream with its uncompressed length.
+        const QByteArray compressed = qCompress(data).mid(4);
+
+        beginObject(object);
+        m_buffer += "<< " + dictionary + " /Filter /FlateDecode /Length "
+                  + QByteArray::number(compressed.size()) + " >>\nstream\n"
+                  + compressed + "\nendstream\n";
+        endObject();
+    }
+
+    QVector<qint64> m_offsets; ///< Offsets of the objects in the file, by object number.
+
+    QRectF m_region;
+    QImage m_baseImage;
+    qint64 m_contentStart;
+
+    QHash<int, int>    m_patterns;      ///< Object number of the pattern of each tile used.
+    QHash<int, QImage> m_patternPixels; ///< Image of each pattern tile used.
+    QVector<bool>      m_strokeAlphas;  ///< The stroke transparency states used.
+    QVector<bool>      m_fillAlphas;    ///< The fill transparency states used.
+
+    // The current graphics state, to avoid repeating it for each path.
+    bool            m_hasStroke;
+    QRgb            m_strokeColor;
+    qreal           m_lineWidth;
+    Qt::PenCapStyle m_capStyle;
+    int             m_strokeAlpha;
+    bool            m_hasFill;
+    QRgb            m_fillColor;
+    int             m_fillPattern;
+    int             m_fillAlpha;
+
+    QByteArray m_paintOperator; ///< Paints the current path at endPath().
+};
+
+/**
+ * @brief Add an arc to the current path as cubic Bézier curves.
+ *
+ * The arc is split into curves of at most 90 degrees, which keeps the
+ * error of the approximation well below a pixel.
+ *
+ * @param pie Set to @c true to add the pie (closed by the center) instead.
+ */
+void addArc(VectorWriter& writer, const ArcShape& arc, bool pie)
+{
+    const qreal span     = qDegreesToRadians(arc.spanAngle);
+    const int   segments = std::max(1, static_cast<int>(std::ceil((std::abs(span) / M_PI_2) - 1e-9)));
+    const qreal step     = span / segments;
+    const qreal k        = (4.0 / 3.0) * std::tan(step / 4.0);
+
+    const qreal rotation = qDegreesToRadians(arc.rotation);
+    const qreal cosR     = std::cos(rotation);
+    const qreal sinR     = std::sin(rotation);
+
+    // As drawn by QPainter::drawArc(): counter-clockwise on the screen
+    // from the X axis, then rotated clockwise about the center.
+    auto map = [&](qreal x, qreal y)
+    {
+        return QPointF((x * cosR) - (y * sinR) + arc.center.x(),
+                       (x * sinR) + (y * cosR) + arc.center.y());
+    };
+
+    qreal x0 = arc.xradius;
+    qreal y0 = 0.0;
+
+    if (pie)
+    {
+        writer.moveTo(arc.center);
+        writer.lineTo(map(x0, y0));
+    }
+    else
+    {
+        writer.moveTo(map(x0, y0));
+    }
+
+    for (int i = 1; i <= segments; i++)
+    {
+        const qreal t0 = step * (i - 1);
+        const qreal t1 = step * i;
+
+        const qreal x1 = arc.xradius * std::cos(t1);
+        const qreal y1 = -arc.yradius * std::sin(t1);
+
+        // Tangents at both ends, scaled by k.
+        const qreal dx0 = -k * arc.xradius * std::sin(t0);
+        const qreal dy0 = -k * arc.yradius * std::cos(t0);
+        const qreal dx1 = -k * arc.xradius * std::sin(t1);
+        const qreal dy1 = -k * arc.yradius * std::cos(t1);
+
+        writer.cubicTo(map(x0 + dx0, y0 + dy0), map(x1 - dx1, y1 - dy1), map(x1, y1));
+
+        x0 = x1;
+        y0 = y1;
+    }
+
+    if (pie || (std::abs(arc.spanAngle) >= 360.0))
+    {
+        writer.closePath();
+    }
+}
+
+/**
+ * @brief Visits the commands of a display list touching a region, in order.
+ *
+ * Small regions are looked up in the list's spatial index. Otherwise the
+ * bounds of every command are tested as the commands are visited, so that
+ * exporting most of a large drawing does not gather its commands first.
+ */
+class RegionCommands
+{
+public:
+    RegionCommands(const DisplayList& displayList, const QRectF& region) :
+        m_displayList(displayList),
+        m_region(region),
+        m_indexed(displayList.isSelective(region)),
+        m_commands(),
+        m_position(0),
+        m_next(-1)
+    {
+        if (m_indexed)
+        {
+            displayList.query(region, m_commands);
+        }
+        advance();
+    }
+
+    /// The next command, without visiting it, or -1 after the last one.
+    int peek() const
+    {
+        return m_next;
+    }
+
+    /// Visit the next command, or return -1 after the last one.
+    int next()
+    {
+        const int command = m_next;
+        advance();
+        return command;
+    }
+
+private:
+    void advance()
+    {
+        if (m_indexed)
+        {
+            m_next = (m_position < m_commands.size()) ? m_commands[m_position++] : -1;
+            return;
+        }
+
+        while ((m_position < m_displayList.size())
+               && !m_displayList.bounds(m_position).intersects(m_region))
+        {
+            m_position++;
+        }
+        m_next = (m_position < m_displayList.size()) ? m_position++ : -1;
+    }
+
+    const DisplayList& m_displayList;
+    const QRectF       m_region;
+    const bool         m_indexed;
+    QVector<int>       m_commands; ///< The results of the query, if m_indexed.
+    int                m_position;
+    int                m_next;
+};
+
+} // namespace
+
+/**
+ * @brief Get the vector format to use for a file, from its suffix.
+ *
+ * @return @c false if the file is not a supported vector format.
+ */
+bool VectorExporter::formatForFile(const QString& filename, Format& format)
+{
+    const QString suffix = QFileInfo(filename).suffix().toLower();
+
+    if (suffix == "svg")
+    {
+        format = Svg;
+        return true;
+    }
+    else if (suffix == "pdf")
+    {
+        format = Pdf;
+        return true;
+    }
+
+    return false;
+}
+
+VectorExporter::VectorExporter(Format format) :
+    m_format(format),
+    m_region(),
+    m_background(),
+    m_errorString()
+{
+
+}
+
+/**
+ * @brief Set the area to export.
+ *
+ * @param region The area, relative to the center of the canvas with the
+ *     Y axis pointing down (as in the DisplayList).
+ */
+void VectorExporter::setRegion(const QRectF& region)
+{
+    m_region = region;
+}
+
+/**
+ * @brief Set the background color.
+ *
+ * @param color The color, or an invalid color for a transparent background.
+ */
+void VectorExporter::setBackground(const QColor& color)
+{
+    m_background = color;
+}
+
+/**
+ * @brief Write the primitives of a display list to a file.
+ *
+ * @param filename The file to write.
+ * @param displayList The primitives.
+ * @param styles The styles of the primitives, by PenBrushTable handle.
+ * @return @c false if the file could not be written (see errorString()).
+ */
+bool VectorExporter::write(const QString& filename,
+                           const DisplayList& displayList,
+                           const QVector<DrawStyle>& styles)
+{
+    QFile file(filename);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        m_errorString = file.errorString();
+        return false;
+    }
+
+    QScopedPointer<VectorWriter> writer;
+    if (Svg == m_format)
+    {
+        writer.reset(new SvgWriter(file));
+    }
+    else
+    {
+        writer.reset(new PdfWriter(file));
+    }
+
+    QPointF basePosition;
+    const QImage base = baseImage(displayList.baseTiles(), m_region, basePosition);
+
+    writer->begin(m_region, m_background, base, basePosition);
+
+    RegionCommands commands(displayList, m_region);
+
+    PatternAtlas patterns;
+    bool ok = true;
+
+    for (int index = commands.next(); ok && (index >= 0); index = commands.next())
+    {
+        const DrawCommand& command = displayList.at(index);
+        const DrawStyle&   style   = styles.at(command.style());
+
+        switch (command.type())
+        {
+        case DrawCommand::Line:
+        {
+            QLineF line = command.line();
+            int points = 2;
+
+            writer->beginStroke(style);
+            writer->moveTo(line.p1());
+            writer->lineTo(line.p2());
+
+            // Merge the following lines while they carry on from this one.
+            while ((commands.peek() == index + 1)
+                   && (points < MAX_PATH_POINTS))
+            {
+                const DrawCommand& next = displayList.at(index + 1);
+
+                if ((next.type() != DrawCommand::Line)
+                    || (next.style() != command.style())
+                    || (next.line().p1() != line.p2()))
+                {
+                    break;
+                }
+
+                line = next.line();
+                writer->lineTo(line.p2());
+                points++;
+                index = commands.next();
+            }
+
+            writer->endPath();
+            break;
+        }
+
+        case DrawCommand::Arc:
+        {
+            const ArcShape arc = command.arc();
+
+            if (command.filled() && (style.brushStyle != Qt::NoBrush))
+            {
+                const quint32* pattern = nullptr;
+                int patternTile = -1;
+
+                if (style.brushStyle != Qt::SolidPattern)
+                {
+                    patternTile = patterns.tile(style.brushStyle, style.brushColor);
+                    pattern     = patterns.pixels(patternTile);
+                }
+
+                writer->beginFill(style, patternTile, pattern);
+                addArc(*writer, arc, true);
+                writer->endPath();
+            }
+
+            writer->beginStroke(style);
+            addArc(*writer, arc, false);
+            writer->endPath();
+            break;
+        }
+
+        case DrawCommand::Fill:
+        case DrawCommand::Stamp:
+        case DrawCommand::Glyph:
+        case DrawCommand::Image:
+            // Fills, stamps, text and images are part of the base tiles
+            // (see TurtleCanvasGraphicsItem::copyPrimitives()).
+            break;
+        }
+
+        ok = writer->flush(false);
+    }
+
+    if (ok)
+    {
+        writer->end();
+        ok = writer->flush(true);
+    }
+
+    if (!ok)
+    {
+        m_errorString = file.errorString();
+    }
+
+    return ok;
+}
+
+QString VectorExporter::errorString() const
+{
+    return m_errorString;
+}
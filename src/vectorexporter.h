@@ -0,0 +1,75 @@
+/************************************************************************
+ * Copyright (c) 2016 Daniel King
+ * Turtle graphics with Lua
+ *
+ * This file is part of Turtyl.
+ *
+ * Turtyl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***********************************************************************/
+#ifndef VECTOREXPORTER_H
+#define VECTOREXPORTER_H
+
+#include "displaylist.h"
+#include "penbrushtable.h"
+#include <QColor>
+#include <QRectF>
+#include <QString>
+#include <QVector>
+
+/**
+ * @brief Writes the primitives of a DisplayList to an SVG or PDF file.
+ *
+ * Only the primitives which touch the exported region are written. They
+ * are found via the list's spatial index when the region only holds a
+ * small part of the drawing, and otherwise by testing the bounds of each
+ * primitive in turn (see DisplayList::isSelective()). Consecutive lines
+ * which join end to end with the same style are merged into a single
+ * path, and arcs are converted to cubic Bézier curves.
+ *
+ * The file is written as the primitives are visited, through a small
+ * buffer. Apart from the results of the index for small regions, the
+ * memory used does not grow with the number of primitives.
+ * Any base tiles of the list (the drawing whose primitives were discarded)
+ * are embedded as an image under the primitives.
+ */
+class VectorExporter
+{
+public:
+    enum Format
+    {
+        Svg,
+        Pdf
+    };
+
+    static bool formatForFile(const QString& filename, Format& format);
+
+    explicit VectorExporter(Format format);
+
+    void setRegion(const QRectF& region);
+    void setBackground(const QColor& color);
+
+    bool write(const QString& filename,
+               const DisplayList& displayList,
+               const QVector<DrawStyle>& styles);
+
+    QString errorString() const;
+
+private:
+    Format  m_format;
+    QRectF  m_region;     ///< Relative to the center of the canvas, Y axis down.
+    QColor  m_background; ///< Invalid for a transparent background.
+    QString m_errorString;
+};
+
+#endif // VECTOREXPORTER_H
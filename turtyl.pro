@@ -24,7 +24,28 @@ SOURCES += src/main.cpp\
     src/scriptrunner.cpp \
     src/aboutdialog.cpp \
     src/canvassaveoptionsdialog.cpp \
-    src/settings.cpp
+    src/settings.cpp \
+    src/perfcounters.cpp \
+    src/performancehud.cpp \
+    src/tracer.cpp \
+    src/samplingprofiler.cpp \
+    src/functionprofiler.cpp \
+    src/luaallocator.cpp \
+    src/compositing.cpp \
+    src/rasterizer.cpp \
+    src/penbrushtable.cpp \
+    src/patternatlas.cpp \
+    src/spatialindex.cpp \
+    src/displaylist.cpp \
+    src/tilestore.cpp \
+    src/vectorexporter.cpp \
+    src/taskscheduler.cpp \
+    src/tilebinner.cpp \
+    src/floodfill.cpp \
+    src/layercompositor.cpp \
+    src/stampcache.cpp \
+    src/glyphatlas.cpp \
+    src/imagecache.cpp
 
 HEADERS  += src/mainwindow.h \
     src/preferencesdialog.h \
@@ -32,7 +53,30 @@ HEADERS  += src/mainwindow.h \
     src/scriptrunner.h \
     src/aboutdialog.h \
     src/canvassaveoptionsdialog.h \
-    src/settings.h
+    src/settings.h \
+    src/perfcounters.h \
+    src/performancehud.h \
+    src/tracer.h \
+    src/samplingprofiler.h \
+    src/functionprofiler.h \
+    src/luaallocator.h \
+    src/compositing.h \
+    src/rasterizer.h \
+    src/penbrushtable.h \
+    src/drawcommand.h \
+    src/patternatlas.h \
+    src/spatialindex.h \
+    src/displaylist.h \
+    src/tilestore.h \
+    src/vectorexporter.h \
+    src/triplebuffer.h \
+    src/taskscheduler.h \
+    src/tilebinner.h \
+    src/floodfill.h \
+    src/layercompositor.h \
+    src/stampcache.h \
+    src/glyphatlas.h \
+    src/imagecache.h
 
 FORMS    += forms/mainwindow.ui \
     forms/preferencesdialog.ui \